@@ -63,7 +63,7 @@ sub init
 
     # In the end we try to assume plain attribute or handler
     while (my($option, $val) = each %arg) {
-	if ($option =~ /^(\w+)_h$/) {
+	if ($option =~ /^(\w+(?::.+)?)_h$/) {
 	    $self->handler($1 => @$val);
 	}
         elsif ($option =~ /^(text|start|end|process|declaration|comment)$/) {
@@ -100,6 +100,24 @@ sub parse_file
 }
 
 
+sub thaw
+{
+    my($class, $frozen, @args) = @_;
+    my $self = $class->new(@args);
+    $self->_thaw($frozen);
+    return $self;
+}
+
+
+sub clone
+{
+    my $self = shift;
+    my $clone = bless { %$self }, ref($self);
+    $self->_clone($clone);
+    return $clone;
+}
+
+
 sub netscape_buggy_comment  # legacy
 {
     my $self = shift;
@@ -187,11 +205,11 @@ returns it.  Key/value argument pairs may be provided to assign event
 handlers or initialize parser options.  The handlers and parser
 options can also be set or modified later by the method calls described below.
 
-If a top level key is in the form "<event>_h" (e.g., "text_h") then it
-assigns a handler to that event, otherwise it initializes a parser
-option. The event handler specification value must be an array
-reference.  Multiple handlers may also be assigned with the 'handlers
-=> [%handlers]' option.  See examples below.
+If a top level key is in the form "<event>_h" (e.g., "text_h" or
+"start:a_h") then it assigns a handler to that event, otherwise it
+initializes a parser option. The event handler specification value
+must be an array reference.  Multiple handlers may also be assigned
+with the 'handlers => [%handlers]' option.  See examples below.
 
 If new() is called without any arguments, it will create a parser that
 uses callback methods compatible with version 2 of C<HTML::Parser>.
@@ -225,6 +243,28 @@ that receives the $p and the tokens array.
 This creates a new parser object that stores the event type and the
 original text in @array for text and comment events.
 
+=item $p = HTML::Parser->thaw( $frozen, %options_and_handlers )
+
+This class method creates a new C<HTML::Parser> object like new() and
+then gives it the state saved by $p->freeze, so that it can go on
+parsing the document with the next chunk.  The handlers are not part
+of the saved state and have to be passed again, but the options saved
+take precedence over the ones passed.
+
+=item $p2 = $p->clone
+
+Creates a new C<HTML::Parser> object with the same handlers and options
+as $p, but no document state, as if $p->eof had been called on it.
+The handlers, the argspecs compiled for them, the selector handlers
+and the filters and tag tables are shared with $p and only copied when
+one of the two changes them, so a clone is much cheaper to create and
+keep around than a parser made with new().  Changing an option or
+handler of the clone does not affect $p, nor the other way around.
+
+This makes it cheap to set up one prototype parser and clone it for
+each of many documents parsed at the same time.  Selector handlers are
+copied instead of shared when C<reuse_args> is enabled.
+
 =back
 
 The following methods feed the HTML document
@@ -263,6 +303,53 @@ The effect of this is the same as:
 
 But it is more efficient as this loop runs internally in XS code.
 
+=item $p->parse( $string, %budget )
+
+=item $p->parse( $code_ref, %budget )
+
+Parse as above, but stop once the budget is used up, so that a big
+chunk does not hold up an event loop.  The budget can be:
+
+=over
+
+=item max_events => $n
+
+Stop after $n events, whether or not a handler is called for them.
+
+=item max_bytes => $n
+
+Stop after the event that goes $n characters past where this call
+started.
+
+=back
+
+Parsing stops as if a handler had called $p->pause after the event
+that used up the budget.  The budget only applies to this call.
+
+=item $p->pause
+
+=item $p->resume
+
+=item $p->resume( %budget )
+
+A handler can call $p->pause to make $p->parse return as soon as the
+events of the token being parsed have been reported.  The rest of the
+chunk is kept, and $p->paused returns TRUE until it is parsed by
+$p->resume, which takes the same budget as $p->parse, or by the next
+$p->parse or $p->eof.  When parsing chunks from a code reference, no
+more chunks are asked for until the next call.  Calling $p->pause
+outside $p->parse and $p->resume has no effect.
+
+Unlike $p->eof, pausing does not change the events reported, except
+that text can be broken up differently, as it depends on where the
+chunks end, unless C<unbroken_text> is enabled.  The return value of
+$p->resume is as for $p->parse.
+
+=item $p->paused
+
+Returns TRUE if the last call to $p->parse or $p->resume stopped
+before the end of what it was given.
+
 =item $p->parse_file( $file )
 
 Parse text directly from a file.  The $file argument can be a
@@ -301,6 +388,71 @@ can be invoked to feed new documents with the parser object.
 
 The return value from eof() is a reference to the parser object.
 
+=item $p->reset
+
+Forgets the document being parsed without reporting anything more, not
+even the text held back or the C<end_document> event that $p->eof
+would report.  The handlers and options are kept, so the parser is
+ready for the next document.  This is the cheapest way to reuse a
+parser for documents that are given up on halfway.  The return value
+is a reference to the parser object.
+
+=item $p->replay( $stream )
+
+Reports the events recorded with C<event_output> to the handlers of
+$p, as if the documents they came from were parsed, but without
+tokenizing them again.  Each document in the stream ends as with
+$p->eof.  The handlers see the same C<text>, C<tokens>, C<offset>,
+C<line> and other argspecs, and tag filters, C<unbroken_text> and the
+output modes of $p apply as usual, so $p should be set up like the
+parser that recorded the stream.  C<element> events are never
+reported, as the stream has the start and end tags instead.
+
+The stream is read where it is, so it can be a string mapped from a
+file.  Like $p->parse, the return value is a reference to the parser
+object, or FALSE if a handler called $p->eof.
+
+=item $p->reparse( $doc, $offset, $old_length, $new_length )
+
+Reports the events that changed after an edit of the document parsed
+last, without parsing all of it again.  $doc is the complete edited
+document, where $old_length characters at $offset were replaced by
+$new_length new ones.  The C<checkpoint_interval> option must have
+been set for the last parse, which must have ended with $p->eof.
+
+Parsing starts again at the last checkpoint before the edit, and stops
+as soon as the parser is in the same state at a checkpoint of the old
+parse after the edit.  The return value is the range ($from, $to) of
+$doc that was parsed again.  The events reported are the ones of that
+range; the events of the old parse that started before $from, and
+those that started at $to or later (moved by $new_length -
+$old_length), still stand.  If the parse never lined up again it went
+on to the end of the document, and $to is the length of $doc and the
+C<end_document> event is reported too.  An empty list is returned if a
+handler called $p->eof.
+
+Since parsing starts in the middle of the document, the element stack
+behind C<depth>, C<path>, C<selectors> and C<element> events only
+holds the elements started after $from.  The output modes, like
+C<text_output>, only see the new events.  No checkpoints are taken
+inside marked sections, script and other literal elements, or with
+C<unbroken_text> text pending, so edits there reparse more.
+
+=item $p->freeze
+
+Returns the state of the parser between two calls to $p->parse as a
+compact string of bytes, that HTML::Parser->thaw turns into a parser
+that goes on where $p left off, possibly in another process.  The
+state covers the text not parsed yet, the position in the document,
+literal and marked section modes, text held back by C<unbroken_text>,
+the elements being ignored and the element stack, as well as the
+boolean options, C<boolean_attribute_value>, C<input_encoding> with
+the bytes it holds back, C<literal_tags> and the tag filters.
+Handlers are left out, as are the output modes like C<text_output>,
+C<checkpoint_interval> and the checkpoints it took.  Selector handlers
+need to be set up in the same order for the elements already open to
+match them.
+
 =back
 
 
@@ -344,6 +496,15 @@ argspecs.
 By default, tagnames and attribute names are down-cased.  Enabling this
 attribute leaves them as found in the HTML source document.
 
+=item $p->checkpoint_interval
+
+=item $p->checkpoint_interval( $chars )
+
+Makes the parser remember its state at an event boundary about every
+$chars characters of the document, so that $p->reparse can start from
+there after an edit.  A smaller interval makes reparsing do less work
+and takes more memory.  The default is 0, which takes no checkpoints.
+
 =item $p->closing_plaintext
 
 =item $p->closing_plaintext( $bool )
@@ -370,6 +531,154 @@ C<text> for the artificial end event will be empty and the C<tokenpos>
 array will be undefined even though the token array will have one
 element containing the tag name.
 
+=item $p->event_output
+
+=item $p->event_output( \$buffer )
+
+=item $p->event_output( $fh )
+
+Setting this makes the parser write the events it reports to the
+scalar referenced, or to the file handle given, in a compact binary
+form that $p->replay reads.  This is for handing parsed documents to
+other processes; handlers are called as usual.  Passing C<undef> turns
+this off again.  The return value is the old setting.  While this is
+set, C<element> events are not reported.
+
+Each document starts with the 5 bytes C<"HPev\x01">, and each event is
+a record of:
+
+   byte    event number: 0 declaration, 1 comment, 2 start, 3 end,
+           4 text, 5 process, 6 start_document, 7 end_document,
+           11 skipped text
+   byte    flags: 1 text is UTF-8, 2 is_cdata, 4 in an ignored
+           marked section
+   varint  number of extra bytes
+   varint  length of the text
+   varint  number of tokens
+   varint  1 + start, varint length   for each token
+   bytes   the extra bytes, then the text
+
+Varints have 7 bits in each byte, least significant first, and the
+high bit set in all bytes but the last.  Token starts count from the
+first extra byte.  A start of 0 is an attribute without a value.  The
+extra bytes hold the tokens that are not part of the text, like the
+tag name of an end tag made up for C<< <br/> >> with
+C<empty_element_tags>.  The C<offset>, C<line> and C<column> of an
+event are what the lengths of the texts before it add up to.
+
+   my $events = "";
+   HTML::Parser->new(api_version => 3, event_output => \$events)
+       ->parse_file($file);
+   # elsewhere
+   $p->replay($events);
+
+L<HTML::Parser::Cache> uses this to replay documents parsed before.
+
+=item $p->head_scan
+
+=item $p->head_scan( $bool )
+
+Enabling this attribute makes the parser collect the fields of the
+document head itself, as L<HTML::HeadParser> does, instead of invoking
+the C<start>, C<end> and C<text> handlers.  It picks up C<title>,
+C<base>, C<meta>, C<link> and C<isindex> elements and stops parsing at
+the first tag or text that belongs to the body, just like calling
+$p->eof from a handler.  The fields are fetched with $p->head_fields.
+
+=item $p->head_fields
+
+Returns the header fields collected in C<head_scan> mode as a list of
+name/value pairs, like ("Title", "Example", "X-Meta-Author", "me"),
+and forgets them.
+
+=item $p->input_encoding
+
+=item $p->input_encoding( $name )
+
+Setting this makes $p->parse take the document as bytes in the
+encoding $name and turn them into characters itself, a chunk at a
+time, so there is no need to decode the whole document first.  The
+encodings known are "UTF-8", "UTF-16LE", "UTF-16BE" and "windows-1252",
+and the usual other names for them.  As in HTML5, "ISO-8859-1",
+"US-ASCII" and their other names mean windows-1252.  Characters split
+between chunks are put together again, and bytes that can't be decoded
+become U+FFFD.  The C<offset> and C<length> argspecs count the
+decoded characters, not the bytes.  Pass C<undef> to turn it off
+again.
+
+With "auto" the encoding is found for each document the way HTML5
+does: by a byte order mark, or else by a C<< <meta charset> >> or
+C<< <meta http-equiv="Content-Type"> >> in the first 1024 bytes.
+Without either, the document is taken to be UTF-8 if those bytes look
+like it, or windows-1252 if not.  No events are reported until the
+encoding is known, so up to 1024 bytes are held back.  A byte order
+mark is obeyed even if another encoding is asked for.
+
+The characters are given to the handlers as Perl Unicode strings, or
+as UTF-8 bytes when C<utf8_mode> is enabled.  The method returns the
+name of the encoding asked for.  This option is only available with
+perl-5.8 or better.
+
+=item $p->document_encoding
+
+Returns the name of the encoding C<input_encoding> found for the
+document being parsed or the one parsed last, or C<undef> if it is not
+known yet.
+
+=item $p->link_base
+
+=item $p->link_base( $url )
+
+This method sets the base URL that the C<@links> argspec makes links
+absolute against, following the rules of RFC 3986.  Characters that
+can't be part of a URL are %-escaped in both the base and the links,
+as their UTF-8 bytes, so "\xE9" becomes "%C3%A9".  Links that already
+have a scheme are left as they are.  Passing C<undef> turns resolution
+off again.  The return value is the old base.
+
+=item $p->link_base_tag
+
+=item $p->link_base_tag( $bool )
+
+By default, C<< <base href> >> in the document has no effect on the
+C<@links> argspec.  Enabling this attribute makes the first one seen
+the base URL for the rest of the document.  Its own href is resolved
+against C<link_base> if that is set.
+
+=item $p->link_elements( \%elements )
+
+This method sets the table used by the C<@links> argspec.  The keys
+are tag names and the values the name of the attribute holding a link,
+or an array of such names.  This is the format of
+%HTML::Tagset::linkElements:
+
+   $p->link_elements(\%HTML::Tagset::linkElements);
+
+The table is copied, so later changes to the hash have no effect.
+Calling the method without an argument removes the table.
+
+=item $p->literal_tags( @tags )
+
+This method sets the elements whose content is not parsed for markup.
+By default these are C<script>, C<style>, C<xmp>, C<iframe>,
+C<plaintext>, C<title> and C<textarea>.  Everything following the
+start tag of one of these elements up to the corresponding end tag is
+reported as a single C<text> event.  This can be used to skip over
+large containers whose inner markup is of no interest:
+
+   $p->literal_tags(qw(script style template svg));
+
+The content of C<title> and C<textarea> is still reported with
+C<is_cdata> FALSE so that C<dtext> decodes entities, and the content
+of any other listed element with C<is_cdata> TRUE.  An element that is
+not closed at the end of the document is treated like C<script> unless
+it is one of the default elements.
+
+The tag names are matched case insensitively.  Calling the method
+without arguments restores the default set, and passing an empty
+array reference disables literal parsing altogether.  The elements
+are never parsed literally when C<xml_mode> is enabled.
+
 =item $p->marked_sections
 
 =item $p->marked_sections( $bool )
@@ -381,6 +690,212 @@ honoured.
 There are currently no events associated with the marked section
 markup, but the text can be returned as C<skipped_text>.
 
+=item $p->reuse_args
+
+=item $p->reuse_args( $bool )
+
+By default, the values passed to callback handlers are created for
+each event and freed when the handler returns.  When this attribute is
+enabled, the parser keeps the scalars, and the hashes and arrays
+referenced by C<attr>, C<attrseq>, C<tokens> and similar argspecs,
+from one invocation of a handler to the next, and only resets and
+refills them.  This saves a lot of memory allocation for documents
+with many small events.
+
+Handlers must copy anything they want to keep, i.e. C<my $attr = {
+%{$_[1]} }> rather than C<my $attr = $_[1]>.  The parser will not
+reuse a value that is still referenced after the handler returns, so
+keeping a reference is safe, but will cost an allocation for the
+following event.  Accumulator array handlers are not affected by this
+attribute.
+
+=item $p->rewrite_output
+
+=item $p->rewrite_output( \$buffer )
+
+=item $p->rewrite_output( $fh )
+
+Setting this makes the parser copy the document to the scalar
+referenced, or to the file handle given, as it is parsed.  Events that
+are not reported to any handler are copied byte for byte, so without
+handlers the output is the input.  Events that a handler is called for
+are not copied; the handler writes whatever should replace them with
+$p->rewrite_print.  Events whose handler is a false value, like
+C<< comment_h => [""] >>, are left out.  The filters only decide which
+tags reach the handlers; tags that C<report_tags> or C<ignore_tags>
+filter out are copied like any other unreported event.  Passing
+C<undef> turns this mode off again.  The return value is the old
+setting.
+
+This makes it cheap to change a few tags of a large document, as
+nothing but the tags a handler is registered for calls out to Perl:
+
+   my $out = "";
+   HTML::Parser->new(api_version => 3,
+                     rewrite_output => \$out,
+                     "start:a_h" => [sub {
+                         my($p, $text) = @_;
+                         $text =~ s/^<a /<a rel="nofollow" /i;
+                         $p->rewrite_print($text);
+                     }, "self, text"],
+                    )->parse_file($file);
+
+Edits that need no code are better made with $p->rewrite_tags.
+
+=item $p->rewrite_print( @text )
+
+Writes the text given to C<rewrite_output>.  This is how handlers put
+their version of the event in the output.
+
+=item $p->rewrite_tags( \%edits )
+
+This method sets edits that C<rewrite_output> applies to the start and
+end tags of the elements named, without calling any handler for them.
+The edits of each tag are a hash with these keys:
+
+=over
+
+=item rename => $name
+
+The tag name is replaced.
+
+=item drop_attr => \@names
+
+These attributes are removed, with the whitespace in front of them.
+
+=item set_attr => \%attr
+
+The values of these attributes are replaced, and the ones that are
+missing are added after the last attribute.  Values are written quoted
+with C<&>, C<< < >>, C<< > >> and C<"> escaped; C<undef> makes a
+boolean attribute.  Added attributes are sorted by name; pass an array
+of name/value pairs to control their order.
+
+=item drop => "tag"
+
+The tag is removed, but not the content of the element.
+
+=item drop => "element"
+
+The whole element is removed, its content included.
+
+=back
+
+A table entry named C<*> applies to the tags that have no entry of
+their own.  Everything outside of the edited tokens is copied as it
+is.  For example, this removes presentational markup:
+
+   $p->rewrite_tags({
+       font   => { drop => "tag" },
+       script => { drop => "element" },
+       "*"    => { drop_attr => [qw(bgcolor color style)] },
+   });
+
+Calling the method without an argument removes all edits.
+
+=item $p->sanitize( \%options )
+
+This method turns the C<rewrite_output> mode into an allowlist
+sanitizer.  Instead of being copied, the document is written out again
+with nothing but the allowed tags and attributes, without any calls
+to Perl.  Text and attribute values have their entities decoded and
+C<&>, C<< < >> and C<< > >> (plus C<"> in values) encoded again, and
+every attribute value is quoted.  End tags that don't match an open
+element are dropped, elements ended implicitly are ended explicitly,
+and the elements still open at $p->eof are ended then.  Comments,
+declarations and processing instructions are left out.  The options
+are:
+
+=over
+
+=item tags => \%tags
+
+The allowed tags and their allowed attributes, as a hash like
+%HTML::Tagset::linkElements.  The attributes of an entry named C<*>
+are allowed for all of the tags.  Tags that are not allowed are left
+out, but not their content.  This option is required.
+
+=item url_attrs => \@names
+
+Attributes holding URLs.  A value with a scheme not in C<url_schemes>
+makes the attribute be left out; relative URLs are fine.  The default
+is C<href>, C<src>, C<cite>, C<action>, C<background>, C<longdesc>,
+C<poster> and C<formaction>.
+
+=item url_schemes => \@schemes
+
+The URL schemes allowed.  The default is C<http>, C<https> and
+C<mailto>.
+
+=item drop_elements => \@tags
+
+Elements left out with their content.  The default is C<script> and
+C<style>.
+
+=back
+
+For example:
+
+   my $clean = "";
+   my $p = HTML::Parser->new(api_version => 3, rewrite_output => \$clean);
+   $p->sanitize({ tags => { a => [qw(href title)], p => [], b => [],
+                            i => [], br => [], ul => [], li => [] } });
+   $p->parse($html)->eof;
+
+Calling the method without an argument turns the sanitizer off again.
+
+=item $p->serialize( \%options )
+
+This method makes the C<rewrite_output> mode write the tags out again,
+normalized, instead of copying them.  It is meant for minifying
+documents and for making them easier to compare.  Nothing is called
+in Perl, and the options each turn on one change:
+
+=over
+
+=item lowercase_names => $bool
+
+Tag and attribute names are written in lower case.
+
+=item quote_attributes => $bool
+
+Attribute values are written inside double quotes, with C<"> in them
+encoded as C<&quot;>.  Attributes are separated by a single space.
+
+=item collapse_whitespace => $bool
+
+Runs of whitespace in text are written as a single space, except
+inside C<pre>, C<textarea>, C<script>, C<style>, C<xmp>, C<listing>
+and C<plaintext> elements.
+
+=item drop_comments => $bool
+
+Comments are left out.  Conditional comments for Internet Explorer,
+the ones starting with C<[if>, are kept.
+
+=item drop_optional_end_tags => $bool
+
+End tags that HTML allows to be omitted, like C<< </li> >>, C<< </p> >>
+and C<< </td> >>, are left out when what follows them ends the
+element anyway.  Whitespace between such an end tag and what ends the
+element is written in its place.  This option has no effect in
+C<xml_mode>.
+
+=back
+
+As with $p->sanitize(), the events are not reported to handlers while
+this is on, apart from C<start_document> and C<end_document>.  If
+$p->sanitize() is used as well, it decides what is written.  For
+example:
+
+   my $min = "";
+   my $p = HTML::Parser->new(api_version => 3, rewrite_output => \$min);
+   $p->serialize({ collapse_whitespace => 1, drop_comments => 1,
+                   drop_optional_end_tags => 1 });
+   $p->parse_file($file);
+
+Calling the method without an argument turns it off again.
+
 =item $p->strict_comment
 
 =item $p->strict_comment( $bool )
@@ -429,6 +944,51 @@ The official behaviour is enabled by enabling this attribute.  If
 enabled, it will cause the tag above to be reported as text
 since "LIST]" is not a legal attribute name.
 
+=item $p->text_collapse
+
+=item $p->text_collapse( $bool )
+
+By default, the C<text_output> mode writes whitespace as found in the
+document.  Enabling this attribute collapses each run of whitespace
+(including the breaks made by tags) into a single space, or a single
+newline if a block level tag is in it.  Whitespace at the start and end
+of the document is dropped.
+
+=item $p->text_output
+
+=item $p->text_output( \$buffer )
+
+=item $p->text_output( $fh )
+
+Setting this makes the parser write the text of the document itself,
+instead of invoking the C<start>, C<end> and C<text> handlers.  The
+text is appended to the scalar referenced, or written to the file
+handle given, with entities decoded.  The content of C<script> and
+C<style> elements is left out, and so are comments, which are never
+part of text anyway.  Block level tags like C<p>, C<div>, C<li> and
+C<br> become newlines, table cells spaces, and tags listed with
+$p->textify are replaced by the value of one of their attributes.
+Passing C<undef> turns this mode off again.  The return value is the
+old setting.
+
+   my $text = "";
+   HTML::Parser->new(api_version => 3, text_output => \$text)
+       ->parse_file($file);
+
+Text that is not UTF-8 flagged is written to file handles as the bytes
+it is.
+
+=item $p->textify( \%tags )
+
+This method sets the tags that the C<text_output> mode replaces by text.
+The hash maps tag names to the attribute holding the text, like the
+I<textify> attribute of L<HTML::TokeParser>.  If the attribute is
+missing the text is the upper case tag name in brackets, e.g.
+"[IMG]".  Calling the method without an argument restores the default,
+which is:
+
+   { img => "alt", applet => "alt" }
+
 =item $p->unbroken_text
 
 =item $p->unbroken_text( $bool )
@@ -512,7 +1072,8 @@ method is used to set up handlers for different events:
 This method assigns a subroutine, method, or array to handle an event.
 
 Event is one of C<text>, C<start>, C<end>, C<declaration>, C<comment>,
-C<process>, C<start_document>, C<end_document> or C<default>.
+C<process>, C<start_document>, C<end_document>, C<element> or
+C<default>.
 
 The C<\&subroutine> is a reference to a subroutine which is called to handle
 the event.
@@ -526,6 +1087,43 @@ sub-arrays.
 If the second argument is "", the event is ignored.
 If it is undef, the default handler is invoked for the event.
 
+For C<start>, C<end> and C<element> events a handler can be set up
+for a single tag by appending ":" and the tag name to the event name,
+as in C<< $p->handler("start:a" => \&link, "attr") >>.  The tag name is
+matched against the lower cased tag name unless C<xml_mode> or
+C<case_sensitive> is enabled.  Events for a tag that has its own
+handler are not passed to the handler for the event type.  Setting a
+tag handler to undef removes it; the event type handler (or the
+default handler) then takes over again.
+
+If the part after ":" is not a plain tag name, it is taken as a
+selector, as in C<< $p->handler("start:div.article a[href]" => \&link,
+"attrval(href)") >>.  Selectors are matched in C against the open
+elements (see C<depth>), so the handler is only called for the
+elements it is interested in.  The supported subset of CSS is:
+
+   *                any element
+   a                elements with that tag name
+   #main            id attribute equal to "main"
+   .nav             class attribute containing the word "nav"
+   [href]           elements having the attribute
+   [rel=nofollow]   attribute equal to the value
+   [href^="http:"]  attribute value starting with the value
+   div a            an "a" element inside a "div" element
+   ul > li          an "li" element whose parent is an "ul" element
+
+Values that are not plain names must be quoted.  Tag and attribute
+names are matched the same way as for single tag handlers; attribute
+values are matched after entity decoding and are case sensitive.
+Selector handlers can be set up for C<start> and C<end> events, and
+for C<text> events, where they are called for the text inside the
+matching elements.  A matching selector handler takes precedence over
+a handler for the tag; if several match, the one set up first is
+used.  Elements that were already open when a selector handler is
+set up or removed do not match selectors.  At most 32 compound
+selectors (the parts between the combinators) can be used by the
+selector handlers of a parser.
+
 The C<$argspec> is a string that describes the information to be reported
 for the event.  Any requested information that does not apply to a
 specific event is passed as C<undef>.  If argspec is omitted, then it
@@ -540,6 +1138,13 @@ invoking the $p->eof method.  A handler callback is not allowed to
 invoke the $p->parse() or $p->parse_file() method.  An exception will
 be raised if it tries.
 
+If a handler callback dies, the exception propagates out of the
+$p->parse() or $p->eof call that invoked it.  The rest of that chunk is
+not parsed, but the parser can still be used.
+
+The method for a C<$method_name> handler is looked up once and
+remembered until the class of $p or its inheritance changes.
+
 Examples:
 
     $p->handler(start =>  "start", 'self, attr, attrseq, text' );
@@ -577,6 +1182,11 @@ reported.  The main bottleneck during parsing is often the huge number
 of callbacks made from the parser.  Applying filters can improve
 performance significantly.
 
+Start tags are also parsed faster when the handler they are reported
+to does not ask for any of the C<attr>, C<@attr>, C<attrseq>,
+C<tokens> or C<tokenpos> argspecs, as the attributes are then skipped
+over without being split up.
+
 The following methods control filters:
 
 =over
@@ -606,6 +1216,14 @@ Any C<start> and C<end> events involving any of the tags I<not> given
 are suppressed.  To reset the filter (i.e. report all C<start> and
 C<end> events), call C<report_tags> without an argument.
 
+When only C<start>, C<end> and C<element> handlers (plus the document
+handlers) are active, nothing but the tags given can ever be reported.
+The parser then skips directly from one C<< < >> to the next and only
+looks at the name of each tag, so extracting a few tags from large
+documents becomes much cheaper.  The skipped parts show up as
+C<skipped_text> as usual.  Argspecs that need the open element stack
+(C<depth>, C<parent>, C<path>) turn this off.
+
 =back
 
 Internally, the system has two filter lists, one for C<report_tags>
@@ -636,7 +1254,7 @@ Boolean attributes' values are either the value set by
 $p->boolean_attribute_value, or the attribute name if no value has been
 set by $p->boolean_attribute_value.
 
-This passes undef except for C<start> events.
+This passes undef except for C<start> and C<element> events.
 
 Unless C<xml_mode> or C<case_sensitive> is enabled, the attribute
 names are forced to lower case.
@@ -658,7 +1276,31 @@ here:
 assuming $attr and $attrseq here are the hash and array passed as the
 result of C<attr> and C<attrseq> argspecs.
 
-This passes no values for events besides C<start>.
+This passes no values for events besides C<start> and C<element>.
+
+=item C<attr(>I<name>, ...C<)>
+
+Like C<attr>, but only the named attributes are included in the hash.
+The names are matched while the tag is scanned, and only the values
+of matching attributes are decoded.  Attributes that are not present
+in the tag are left out of the hash.
+
+The names are compared without regard to case unless C<xml_mode> or
+C<case_sensitive> is enabled.
+
+This passes undef except for C<start> and C<element> events.
+
+=item C<attrval(>I<name>, ...C<)>
+
+Attrval passes one argument for each name listed: the value of that
+attribute, or undef if the tag does not have it.  If an attribute is
+repeated the first value is used.  Values are decoded as for C<attr>.
+
+   $p->handler(start => sub { my($href, $title) = @_; ... },
+               "attrval(href, title)");
+
+This passes undef for each name except for C<start> and C<element>
+events.
 
 =item C<attrseq>
 
@@ -666,7 +1308,7 @@ Attrseq causes a reference to an array of attribute names to be
 passed.  This can be useful if you want to walk the C<attr> hash in
 the original sequence.
 
-This passes undef except for C<start> events.
+This passes undef except for C<start> and C<element> events.
 
 Unless C<xml_mode> or C<case_sensitive> is enabled, the attribute
 names are forced to lower case.
@@ -676,31 +1318,58 @@ names are forced to lower case.
 Column causes the column number of the start of the event to be passed.
 The first column on a line is 0.
 
+=item C<depth>
+
+Depth causes the number of currently open elements to be passed.  For
+C<start>, C<end> and C<element> events the element of the event is
+counted; for other events these are the elements that enclose it.
+
+The parser keeps track of the open elements only while some handler
+asks for C<depth>, C<parent>, C<path> or C<@path>.  End tags close any
+elements that are still open inside the element they end, and end tags
+without a matching start tag are ignored.  Unless C<xml_mode> is
+enabled, empty elements like C<br> and C<img> are never left open, and
+elements with optional end tags are closed by the start tags that
+imply their end, for instance C<< <li> >> closes an open C<li> and
+C<< <div> >> closes an open C<p>.  Both come from tables built into
+the parser that follow HTML5: its void elements, plus obsolete ones
+like C<basefont>, C<isindex> and C<spacer>, and its rules for
+optional end tags.  HTML::Tagset is not consulted.  This only looks at
+the current element; the parser does not try to repair the document
+the way a browser would.  The stack is cleared at the end of each
+document.
+
 =item C<dtext>
 
 Dtext causes the decoded text to be passed.  General entities are
 automatically decoded unless the event was inside a CDATA section or
 was between literal start and end tags (C<script>, C<style>,
-C<xmp>, C<iframe>, C<title>, C<textarea> and C<plaintext>).
+C<xmp>, C<iframe> and C<plaintext> by default; see C<literal_tags>).
 
 The Unicode character set is assumed for entity decoding.  With Perl
 version 5.6 or earlier only the Latin-1 range is supported, and
 entities for characters outside the range 0..255 are left unchanged.
 
-This passes undef except for C<text> events.
+For C<element> events this is the decoded text between the start and
+end tag.
+
+This passes undef except for C<text> and C<element> events.
 
 =item C<event>
 
 Event causes the event name to be passed.
 
 The event name is one of C<text>, C<start>, C<end>, C<declaration>,
-C<comment>, C<process>, C<start_document> or C<end_document>.
+C<comment>, C<process>, C<start_document>, C<end_document> or
+C<element>.
 
 =item C<is_cdata>
 
 Is_cdata causes a TRUE value to be passed if the event is inside a CDATA
 section or between literal start and end tags (C<script>,
-C<style>, C<xmp>, C<iframe>, C<title>, C<textarea> and C<plaintext>).
+C<style>, C<xmp>, C<iframe> and C<plaintext> by default; see
+C<literal_tags>).  For C<element> events it tells if the element is
+such a literal element.
 
 if the flag is FALSE for a text event, then you should normally
 either use C<dtext> or decode the entities yourself before the text is
@@ -717,6 +1386,19 @@ Line causes the line number of the start of the event to be passed.
 The first line in the document is 1.  Line counting doesn't start
 until at least one handler requests this value to be reported.
 
+=item C<@links>
+
+@links causes the link attributes of a start tag to be passed as
+separate name and URL arguments.  Which attributes hold links is set
+up with $p->link_elements.  The values are decoded like for C<attr>,
+trimmed of leading and trailing whitespace and made absolute if
+$p->link_base is set.  Handlers whose argspec contains @links are only
+invoked for start tags that have at least one link attribute; tags
+without one are treated as skipped text.  This is what
+L<HTML::LinkExtor> is built on:
+
+   $p->handler(start => \@links, "tagname, \@links");
+
 =item C<offset>
 
 Offset causes the byte position in the HTML document of the start of
@@ -727,6 +1409,25 @@ the event to be passed.  The first byte in the document has offset 0.
 Offset_end causes the byte position in the HTML document of the end of
 the event to be passed.  This is the same as C<offset> + C<length>.
 
+=item C<parent>
+
+Parent causes the tag name of the element enclosing the event to be
+passed.  For C<start>, C<end> and C<element> events this is the
+element enclosing the element of the event.  It is undef at the top
+level.  See C<depth> for how the open elements are tracked.
+
+=item C<path>
+
+Path causes the tag names of the open elements to be passed as a
+single string, joined by "/", starting with the outermost element,
+e.g. "html/body/div/p".  For C<start>, C<end> and C<element> events
+the last name is that of the element itself.
+
+=item C<@path>
+
+@path is like C<path>, but passes each tag name as a separate
+argument.
+
 =item C<self>
 
 Self causes the current object to be passed to the handler.  If the
@@ -755,7 +1456,8 @@ C<skipped_text>.
 
 Same as C<tagname>, but prefixed with "/" if it belongs to an C<end>
 event and "!" for a declaration.  The C<tag> does not have any prefix
-for C<start> events, and is in this case identical to C<tagname>.
+for C<start> and C<element> events, and is in this case identical to
+C<tagname>.
 
 =item C<tagname>
 
@@ -893,6 +1595,25 @@ This event is triggered for events that do not have a specific
 handler.  You can set up a handler for this event to catch stuff you
 did not want to catch explicitly.
 
+=item C<element>
+
+This event is only triggered if a handler for it has been set up,
+either for all elements or for some tags with C<"element:title">.  It
+replaces the C<start>, C<text> and C<end> events of an element whose
+start tag is followed by nothing but text and its end tag, all within
+the buffer being parsed.  The C<text> argspec reports the whole
+element and C<dtext> the text inside it.  Elements that do not meet
+these conditions, for instance because they contain other markup or
+their end tag has not been passed to $p->parse() yet, are reported
+with the usual separate events.
+
+Elements filtered out by C<ignore_tags> or C<report_tags> are never
+reported as C<element> events.
+
+Example:
+
+  <TITLE>Perl &amp; HTML</TITLE>
+
 =item C<end>
 
 This event is triggered when an end tag is recognized.
@@ -1141,6 +1862,121 @@ boolean attributes.
 reference, then name of a subroutine or method, or a reference to an
 array.
 
+=item %s must be given as a hash reference
+
+(F) The argument to $p->link_elements() or $p->textify() must be a
+reference to a hash like %HTML::Tagset::linkElements.  The same goes
+for $p->rewrite_tags(), $p->sanitize() and $p->serialize(), and the
+C<tags> option of $p->sanitize().
+
+=item Attribute lists must be plain scalars and arrays
+
+(F) The values of the hash passed to $p->link_elements() or
+$p->textify(), and the C<drop_attr> edits of $p->rewrite_tags(), must
+be attribute names or references to arrays of them.
+
+=item Bad attribute name '%s' in %s
+
+(F) An attribute name given to $p->link_elements(), $p->textify() or
+$p->rewrite_tags() was empty or longer than 255 characters.
+
+=item Edits for '%s' must be given as a hash reference
+
+(F) Each value of the hash passed to $p->rewrite_tags() must be a
+reference to a hash of edits.
+
+=item Bad rewrite edit '%s' for '%s'
+
+(F) The edits for a tag passed to $p->rewrite_tags() had a key other
+than C<rename>, C<drop_attr>, C<set_attr> and C<drop>, or a bad value
+for one of them.  C<drop> must be "tag" or "element".
+
+=item Bad sanitize option '%s'
+
+(F) $p->sanitize() was given an option it does not know, or no
+C<tags> option.
+
+=item Bad event stream at byte %d
+
+(F) The string passed to $p->replay() was not written by
+C<event_output>, or was cut off or changed after that.
+
+=item Can't write %s output
+
+(F) Writing to the file handle given to C<event_output>,
+C<rewrite_output> or C<text_output> failed.
+
+=item Bad serialize option '%s'
+
+(F) $p->serialize() was given an option it does not know.
+
+=item Bad parse option '%s'
+
+(F) $p->parse() or $p->resume() was given a budget other than
+C<max_events> and C<max_bytes>, or one without a value.
+
+=item Unknown input encoding '%s'
+
+(F) $p->input_encoding() was given the name of an encoding it can't
+decode.
+
+=item Bad frozen parser state at byte %d
+
+(F) The string passed to HTML::Parser->thaw() was not made by
+$p->freeze, or was cut off or changed after that.  It is also given
+when the open elements match more selector handlers than the new
+parser has.
+
+=item Can't freeze or thaw while parsing
+
+(F) A handler invoked $p->freeze, or the parser's state was replaced
+while it was parsing.
+
+=item Can't reset while parsing
+
+(F) A handler invoked $p->reset.  Use $p->eof to stop the parse from
+a handler.
+
+=item No complete parse to reparse
+
+(F) $p->reparse() was called without C<checkpoint_interval> set for
+the last parse, or before that parse ended with $p->eof.
+
+=item Edit is outside the document
+
+(F) The offset and lengths passed to $p->reparse() do not fit in the
+document given.
+
+=item Tag list must be plain scalars and arrays
+
+(F) The tag list given to $p->ignore_tags() and friends, or to the
+C<drop_elements> option of $p->sanitize(), was a reference to
+something other than an array.
+
+=item No rewrite_output to print to
+
+(F) $p->rewrite_print() was called without $p->rewrite_output() set.
+
+=item No tag specific handlers for %s events
+
+(F) Handlers for a single tag, like "start:a", can only be set up for
+C<start>, C<end> and C<element> events.
+
+=item No selector handlers for %s events
+
+(F) Selector handlers, like "start:div a", can only be set up for
+C<start>, C<end> and C<text> events.
+
+=item Bad selector (%s)
+
+(F) The selector given after the ":" of the event name uses syntax
+not supported by $p->handler, or is not complete.
+
+=item Too many compound selectors
+
+(F) The selector handlers of a parser can use at most 32 compound
+selectors between them.
+
 =item No handler for %s events
 
 (F) The first argument to $p->handler must be a valid event name; i.e. one
@@ -1170,6 +2006,26 @@ It is reserved to permit quoting inside a literal in a later version.
 (F) Only identifier names, literals, spaces and commas
 are allowed in argspecs.
 
+=item Missing attribute list for attrval in argspec
+
+(F) The C<attrval> argspec must be followed by a parenthesized list
+of attribute names.
+
+=item Unterminated attribute list in argspec
+
+(F) The closing ")" for an C<attr(...)> or C<attrval(...)> argspec
+was not found.
+
+=item Bad attribute name in argspec (%s)
+
+(F) The names in an attribute list must be separated by "," and can
+not be empty or longer than 255 characters.
+
+=item Too many attribute names in argspec
+
+(F) The current implementation limits attribute lists in an argspec to
+255 names.
+
 =item Missing comma separator in argspec
 
 (F) Identifiers in an argspec must be separated with ",".
@@ -1214,7 +2070,7 @@ the document.  The result of parsing will likely be garbage.
 =head1 SEE ALSO
 
 L<HTML::Entities>, L<HTML::PullParser>, L<HTML::TokeParser>, L<HTML::HeadParser>,
-L<HTML::LinkExtor>, L<HTML::Form>
+L<HTML::LinkExtor>, L<HTML::Parser::Cache>, L<HTML::Form>
 
 L<HTML::TreeBuilder> (part of the I<HTML-Tree> distribution)
 
@@ -73,12 +73,6 @@ newSVpvn(char *s, STRLEN len)
 #endif
 
 
-#if PATCHLEVEL > 6 || (PATCHLEVEL == 6 && SUBVERSION > 0)
-   #define RETHROW	   croak(Nullch)
-#else
-   #define RETHROW    { STRLEN my_na; croak("%s", SvPV(ERRSV, my_na)); }
-#endif
-
 #if PATCHLEVEL < 8
    /* No useable Unicode support */
    /* Make these harmless if present */
@@ -181,12 +175,73 @@ get_pstate_hv(pTHX_ SV* sv)                               /* used by XS typemap
 }
 
 
+static void
+parse_unwind(pTHX_ void* arg)
+{
+    PSTATE* p_state = (PSTATE*)arg;
+    if (p_state->parsing) {
+	/* a handler died; leave the parser usable */
+	pend_text_materialize(aTHX_ p_state);
+	if (p_state->pend_text_flushing) {
+	    p_state->pend_text_flushing = 0;
+	    if (p_state->pend_text)
+		SvOK_off(p_state->pend_text);
+	}
+	p_state->parsing = 0;
+	p_state->eof = 0;
+	p_state->pausable = 0;
+	p_state->paused = 0;
+	p_state->budget_events = p_state->budget_offset = 0;
+	if (p_state->reparse_old) {
+	    /* the checkpoints don't fit the document any more */
+	    Safefree(p_state->reparse_old);
+	    p_state->reparse_old = 0;
+	    p_state->reparse_done = 0;
+	    p_state->checkpoints_count = 0;
+	}
+    }
+}
+
+static void
+parse_budget(pTHX_ PSTATE* p_state, SV** args, int items)
+{
+    /* the max_events and max_bytes options of parse() and resume() */
+    int i;
+    for (i = 0; i < items; i += 2) {
+	char *key = SvPV_nolen(args[i]);
+	UV n;
+	if (i + 1 == items)
+	    croak("Bad parse option '%s'", key);
+	n = SvUV(args[i + 1]);
+	if (strEQ(key, "max_events"))
+	    p_state->budget_events = n;
+	else if (strEQ(key, "max_bytes"))
+	    p_state->budget_offset = n ? p_state->offset + n : 0;
+	else
+	    croak("Bad parse option '%s'", key);
+    }
+}
+
+static void
+parse_guard(pTHX_ PSTATE* p_state, SV* self)
+{
+    /* Handlers are called without G_EVAL.  This arranges for the
+     * parser state to be restored on scope exit if one of them dies,
+     * and keeps the parser object alive until then.  Call after ENTER.
+     */
+    SvREFCNT_inc(SvRV(self));
+    SAVEFREESV(SvRV(self));
+    SAVEDESTRUCTOR_X(parse_unwind, p_state);
+}
+
 static void
 free_pstate(pTHX_ PSTATE* pstate)
 {
     int i;
     SvREFCNT_dec(pstate->buf);
+    SvREFCNT_dec(pstate->in_pending);
     SvREFCNT_dec(pstate->pend_text);
+    Safefree(pstate->pend_spans);
     SvREFCNT_dec(pstate->skipped_text);
 #ifdef MARKED_SECTION
     SvREFCNT_dec(pstate->ms_stack);
@@ -195,12 +250,37 @@ free_pstate(pTHX_ PSTATE* pstate)
     for (i = 0; i < EVENT_COUNT; i++) {
 	SvREFCNT_dec(pstate->handlers[i].cb);
 	SvREFCNT_dec(pstate->handlers[i].argspec);
+	SvREFCNT_dec(pstate->handlers[i].args);
+	SvREFCNT_dec(pstate->handlers[i].method_cv);
+	tag_handlers_free(aTHX_ pstate->tag_handlers[i]);
     }
 
     SvREFCNT_dec(pstate->report_tags);
     SvREFCNT_dec(pstate->ignore_tags);
     SvREFCNT_dec(pstate->ignore_elements);
     SvREFCNT_dec(pstate->ignoring_element);
+    literal_set_free(pstate->literal_tags);
+    literal_set_free(pstate->prefilter_tags);
+    Safefree(pstate->stack);
+    SvREFCNT_dec(pstate->stack_names);
+    selectors_free(aTHX_ pstate->selectors);
+    SvREFCNT_dec(pstate->link_elements);
+    SvREFCNT_dec(pstate->link_base);
+    SvREFCNT_dec(pstate->link_doc_base);
+    SvREFCNT_dec(pstate->head_fields);
+    SvREFCNT_dec(pstate->head_text);
+    SvREFCNT_dec(pstate->text_output);
+    SvREFCNT_dec(pstate->textify);
+    SvREFCNT_dec(pstate->text_buf);
+    SvREFCNT_dec(pstate->rewrite_output);
+    SvREFCNT_dec(pstate->rewrite_tags);
+    SvREFCNT_dec(pstate->rewrite_dropping);
+    sanitize_free(aTHX_ pstate);
+    SvREFCNT_dec(pstate->serialize_end);
+    SvREFCNT_dec(pstate->serialize_ws);
+    SvREFCNT_dec(pstate->event_output);
+    SvREFCNT_dec(pstate->event_buf);
+    Safefree(pstate->checkpoints);
 
     SvREFCNT_dec(pstate->tmp);
 
@@ -219,6 +299,113 @@ magic_free_pstate(pTHX_ SV *sv, MAGIC *mg)
     return 0;
 }
 
+static PSTATE*
+new_pstate(pTHX)
+{
+    PSTATE* pstate;
+    Newz(56, pstate, 1, PSTATE);
+    pstate->signature = P_SIGNATURE;
+    pstate->entity2char = perl_get_hv("HTML::Entities::entity2char", TRUE);
+    pstate->tmp = NEWSV(0, 20);
+    return pstate;
+}
+
+static PSTATE*
+clone_pstate(pTHX_ PSTATE* pstate)
+{
+    /* A parser with the configuration of pstate and no document.  The
+     * compiled handlers, filters and tables are shared by reference
+     * count, as they are only ever replaced, never changed in place.
+     * Tag and selector handlers live in tables of their own, so those
+     * are copied.
+     */
+    PSTATE* pstate2 = new_pstate(aTHX);
+    int i;
+
+    pstate2->line = pstate->line ? 1 : 0;
+
+#ifdef MARKED_SECTION
+    pstate2->marked_sections = pstate->marked_sections;
+#endif
+    pstate2->strict_comment = pstate->strict_comment;
+    pstate2->strict_names = pstate->strict_names;
+    pstate2->strict_end = pstate->strict_end;
+    pstate2->xml_mode = pstate->xml_mode;
+    pstate2->unbroken_text = pstate->unbroken_text;
+    pstate2->attr_encoded = pstate->attr_encoded;
+    pstate2->case_sensitive = pstate->case_sensitive;
+    pstate2->closing_plaintext = pstate->closing_plaintext;
+    pstate2->utf8_mode = pstate->utf8_mode;
+    pstate2->empty_element_tags = pstate->empty_element_tags;
+    pstate2->xml_pic = pstate->xml_pic;
+    pstate2->backquote = pstate->backquote;
+    pstate2->reuse_args = pstate->reuse_args;
+
+    pstate2->bool_attr_val = SvREFCNT_inc(pstate->bool_attr_val);
+    for (i = 0; i < EVENT_COUNT; i++) {
+	pstate2->handlers[i].cb = SvREFCNT_inc(pstate->handlers[i].cb);
+	pstate2->handlers[i].argspec =
+	    SvREFCNT_inc(pstate->handlers[i].argspec);
+	if (pstate->tag_handlers[i]) {
+	    HV* hv = pstate->tag_handlers[i];
+	    HE* he;
+	    hv_iterinit(hv);
+	    while ((he = hv_iternext(hv))) {
+		struct p_handler *h = TAG_HANDLER(HeVAL(he));
+		struct p_handler *h2;
+		h2 = tag_handler_fetch(aTHX_ pstate2, i, hv_iterkeysv(he), 1);
+		h2->cb = SvREFCNT_inc(h->cb);
+		h2->argspec = SvREFCNT_inc(h->argspec);
+	    }
+	}
+    }
+    if (pstate->selectors) {
+	/* with reuse_args the handlers keep their arguments in the set */
+	if (pstate->reuse_args)
+	    pstate2->selectors = selectors_copy(aTHX_ pstate->selectors);
+	else {
+	    pstate2->selectors = pstate->selectors;
+	    pstate2->selectors->refcnt++;
+	}
+    }
+    pstate2->argspec_entity_decode = pstate->argspec_entity_decode;
+    pstate2->want_attr_tokens = pstate->want_attr_tokens;
+    pstate2->track_stack = pstate->track_stack;
+
+    pstate2->report_tags = (HV*)SvREFCNT_inc((SV*)pstate->report_tags);
+    pstate2->ignore_tags = (HV*)SvREFCNT_inc((SV*)pstate->ignore_tags);
+    pstate2->ignore_elements = (HV*)SvREFCNT_inc((SV*)pstate->ignore_elements);
+    if (pstate->literal_tags)
+	pstate2->literal_tags = literal_set_dup(aTHX_ pstate->literal_tags);
+    if (pstate->prefilter_tags)
+	pstate2->prefilter_tags = literal_set_dup(aTHX_ pstate->prefilter_tags);
+    pstate2->prefilter_handlers_ok = pstate->prefilter_handlers_ok;
+
+    pstate2->link_elements = (HV*)SvREFCNT_inc((SV*)pstate->link_elements);
+    pstate2->link_base = SvREFCNT_inc(pstate->link_base);
+    pstate2->link_base_tag = pstate->link_base_tag;
+    pstate2->head_scan = pstate->head_scan;
+
+    pstate2->text_output = SvREFCNT_inc(pstate->text_output);
+    pstate2->textify = (HV*)SvREFCNT_inc((SV*)pstate->textify);
+    pstate2->text_collapse = pstate->text_collapse;
+    pstate2->rewrite_output = SvREFCNT_inc(pstate->rewrite_output);
+    pstate2->rewrite_tags = (HV*)SvREFCNT_inc((SV*)pstate->rewrite_tags);
+    if (pstate->sanitize_tags) {
+	pstate2->sanitize_tags = (HV*)SvREFCNT_inc((SV*)pstate->sanitize_tags);
+	pstate2->sanitize_url_attrs = SvREFCNT_inc(pstate->sanitize_url_attrs);
+	pstate2->sanitize_schemes = SvREFCNT_inc(pstate->sanitize_schemes);
+	pstate2->sanitize_drop = (HV*)SvREFCNT_inc((SV*)pstate->sanitize_drop);
+	pstate2->sanitize_stack = newAV();
+    }
+    pstate2->serialize = pstate->serialize;
+    pstate2->event_output = SvREFCNT_inc(pstate->event_output);
+    pstate2->checkpoint_interval = pstate->checkpoint_interval;
+    pstate2->in_enc = pstate->in_enc;
+
+    return pstate2;
+}
+
 #if defined(USE_ITHREADS) && PATCHLEVEL >= 8
 
 static PSTATE *
@@ -237,11 +424,24 @@ dup_pstate(pTHX_ PSTATE *pstate, CLONE_PARAMS *params)
     pstate2->start_document = pstate->start_document;
     pstate2->parsing = pstate->parsing;
     pstate2->eof = pstate->eof;
-
-    pstate2->literal_mode = pstate->literal_mode;
+    pstate2->in_enc = pstate->in_enc;
+    pstate2->in_enc_doc = pstate->in_enc_doc;
+    pstate2->in_pending = SvREFCNT_inc(sv_dup(pstate->in_pending, params));
+
+    if (pstate->literal_tags)
+	pstate2->literal_tags = literal_set_dup(aTHX_ pstate->literal_tags);
+    if (pstate->literal_mode)
+	pstate2->literal_mode =
+	    literal_tag_lookup(LITERAL_SET(pstate2),
+			       pstate->literal_mode->str,
+			       pstate->literal_mode->len);
     pstate2->is_cdata = pstate->is_cdata;
     pstate2->no_dash_dash_comment_end = pstate->no_dash_dash_comment_end;
-    pstate2->pending_end_tag = pstate->pending_end_tag;
+    if (pstate->pending_end_tag)
+	pstate2->pending_end_tag =
+	    literal_tag_lookup(LITERAL_SET(pstate2),
+			       pstate->pending_end_tag->str,
+			       pstate->pending_end_tag->len);
 
     pstate2->pend_text = SvREFCNT_inc(sv_dup(pstate->pend_text, params));
     pstate2->pend_text_is_cdata = pstate->pend_text_is_cdata;
@@ -270,6 +470,7 @@ dup_pstate(pTHX_ PSTATE *pstate, CLONE_PARAMS *params)
     pstate2->empty_element_tags = pstate->empty_element_tags;
     pstate2->xml_pic = pstate->xml_pic;
     pstate2->backquote = pstate->backquote;
+    pstate2->reuse_args = pstate->reuse_args;
 
     pstate2->bool_attr_val =
 	SvREFCNT_inc(sv_dup(pstate->bool_attr_val, params));
@@ -278,8 +479,36 @@ dup_pstate(pTHX_ PSTATE *pstate, CLONE_PARAMS *params)
 	    SvREFCNT_inc(sv_dup(pstate->handlers[i].cb, params));
 	pstate2->handlers[i].argspec =
 	    SvREFCNT_inc(sv_dup(pstate->handlers[i].argspec, params));
+	if (pstate->tag_handlers[i]) {
+	    HV* hv = pstate->tag_handlers[i];
+	    HE* he;
+	    hv_iterinit(hv);
+	    while ((he = hv_iternext(hv))) {
+		struct p_handler *h = TAG_HANDLER(HeVAL(he));
+		struct p_handler *h2;
+		STRLEN klen;
+		char *key = HePV(he, klen);
+		SV* tagname = sv_2mortal(newSVpvn(key, klen));
+		if (HeKUTF8(he))
+		    SvUTF8_on(tagname);
+		h2 = tag_handler_fetch(aTHX_ pstate2, i, tagname, 1);
+		h2->cb = SvREFCNT_inc(sv_dup(h->cb, params));
+		h2->argspec = SvREFCNT_inc(sv_dup(h->argspec, params));
+	    }
+	}
+    }
+    if (pstate->selectors) {
+	struct selector_set *set = pstate->selectors;
+	for (i = 0; i < set->count; i++) {
+	    struct sel_handler *sh = &set->handlers[i];
+	    struct p_handler *h2 =
+		sel_handler_fetch(aTHX_ pstate2, sh->event, sh->source, 1);
+	    h2->cb = SvREFCNT_inc(sv_dup(sh->h.cb, params));
+	    h2->argspec = SvREFCNT_inc(sv_dup(sh->h.argspec, params));
+	}
     }
     pstate2->argspec_entity_decode = pstate->argspec_entity_decode;
+    pstate2->want_attr_tokens = pstate->want_attr_tokens;
 
     pstate2->report_tags =
 	(HV *)SvREFCNT_inc(sv_dup((SV *)pstate->report_tags, params));
@@ -288,10 +517,83 @@ dup_pstate(pTHX_ PSTATE *pstate, CLONE_PARAMS *params)
     pstate2->ignore_elements =
 	(HV *)SvREFCNT_inc(sv_dup((SV *)pstate->ignore_elements, params));
 
+    if (pstate->prefilter_tags)
+	pstate2->prefilter_tags = literal_set_dup(aTHX_ pstate->prefilter_tags);
+    pstate2->prefilter_handlers_ok = pstate->prefilter_handlers_ok;
+
     pstate2->ignoring_element =
 	SvREFCNT_inc(sv_dup(pstate->ignoring_element, params));
     pstate2->ignore_depth = pstate->ignore_depth;
 
+    pstate2->track_stack = pstate->track_stack;
+    pstate2->stack_names =
+	(HV *)SvREFCNT_inc(sv_dup((SV *)pstate->stack_names, params));
+    if (pstate->stack_depth) {
+	New(56, pstate2->stack, pstate->stack_depth, struct stack_elem);
+	pstate2->stack_max = pstate->stack_depth;
+	for (i = 0; i < pstate->stack_depth; i++) {
+	    pstate2->stack[i] = pstate->stack[i];
+	    pstate2->stack[i].name = sv_dup(pstate->stack[i].name, params);
+	}
+    }
+    pstate2->stack_depth = pstate->stack_depth;
+    pstate2->stack_self = pstate->stack_self;
+    pstate2->stack_pop_pending = pstate->stack_pop_pending;
+
+    pstate2->link_elements =
+	(HV *)SvREFCNT_inc(sv_dup((SV *)pstate->link_elements, params));
+    pstate2->link_base = SvREFCNT_inc(sv_dup(pstate->link_base, params));
+    pstate2->link_doc_base =
+	SvREFCNT_inc(sv_dup(pstate->link_doc_base, params));
+    pstate2->link_base_tag = pstate->link_base_tag;
+
+    pstate2->head_scan = pstate->head_scan;
+    pstate2->head_fields =
+	(AV *)SvREFCNT_inc(sv_dup((SV *)pstate->head_fields, params));
+    pstate2->head_text = SvREFCNT_inc(sv_dup(pstate->head_text, params));
+    pstate2->head_tag = pstate->head_tag;
+    pstate2->head_text_seen = pstate->head_text_seen;
+
+    pstate2->text_output = SvREFCNT_inc(sv_dup(pstate->text_output, params));
+    pstate2->textify =
+	(HV *)SvREFCNT_inc(sv_dup((SV *)pstate->textify, params));
+    pstate2->text_collapse = pstate->text_collapse;
+    pstate2->text_skip = pstate->text_skip;
+    pstate2->text_started = pstate->text_started;
+    pstate2->text_pending = pstate->text_pending;
+
+    pstate2->rewrite_output =
+	SvREFCNT_inc(sv_dup(pstate->rewrite_output, params));
+    pstate2->rewrite_tags =
+	(HV *)SvREFCNT_inc(sv_dup((SV *)pstate->rewrite_tags, params));
+    pstate2->rewrite_dropping =
+	SvREFCNT_inc(sv_dup(pstate->rewrite_dropping, params));
+    pstate2->rewrite_drop_depth = pstate->rewrite_drop_depth;
+    pstate2->sanitize_tags =
+	(HV *)SvREFCNT_inc(sv_dup((SV *)pstate->sanitize_tags, params));
+    pstate2->sanitize_url_attrs =
+	SvREFCNT_inc(sv_dup(pstate->sanitize_url_attrs, params));
+    pstate2->sanitize_schemes =
+	SvREFCNT_inc(sv_dup(pstate->sanitize_schemes, params));
+    pstate2->sanitize_drop =
+	(HV *)SvREFCNT_inc(sv_dup((SV *)pstate->sanitize_drop, params));
+    pstate2->sanitize_stack =
+	(AV *)SvREFCNT_inc(sv_dup((SV *)pstate->sanitize_stack, params));
+    pstate2->serialize = pstate->serialize;
+    pstate2->serialize_raw = pstate->serialize_raw;
+    pstate2->serialize_space = pstate->serialize_space;
+    pstate2->serialize_end =
+	SvREFCNT_inc(sv_dup(pstate->serialize_end, params));
+    pstate2->serialize_ws = SvREFCNT_inc(sv_dup(pstate->serialize_ws, params));
+    pstate2->event_output = SvREFCNT_inc(sv_dup(pstate->event_output, params));
+    pstate2->event_buf = 0;
+    pstate2->checkpoint_interval = pstate->checkpoint_interval;
+    pstate2->checkpoint_next = pstate->checkpoint_next;
+    pstate2->checkpoints = 0;  /* they would point into the old literal_tags */
+    pstate2->checkpoints_count = 0;
+    pstate2->checkpoints_max = 0;
+    pstate2->reparse_old = 0;
+
     if (params->flags & CLONEf_JOIN_IN) {
 	pstate2->entity2char =
 	    perl_get_hv("HTML::Entities::entity2char", TRUE);
@@ -326,6 +628,38 @@ const MGVTBL vtbl_pstate =
 };
 
 
+static void
+attach_pstate(pTHX_ SV* self, PSTATE* pstate)
+{
+    /* store pstate in the object hash, which frees it with the object */
+    SV* sv = SvRV(self);
+    HV* hv;
+    MAGIC* mg;
+
+    if (!sv || SvTYPE(sv) != SVt_PVHV) {
+	free_pstate(aTHX_ pstate);
+	croak("Not a reference to a hash");
+    }
+    hv = (HV*)sv;
+
+    sv = newSViv(PTR2IV(pstate));
+#if PATCHLEVEL < 8
+    sv_magic(sv, 0, '~', 0, 0);
+#else
+    sv_magic(sv, 0, '~', (char *)pstate, 0);
+#endif
+    mg = mg_find(sv, '~');
+    assert(mg);
+    mg->mg_virtual = (MGVTBL*)&vtbl_pstate;
+#if defined(USE_ITHREADS) && PATCHLEVEL >= 8
+    mg->mg_flags |= MGf_DUP;
+#endif
+    SvREADONLY_on(sv);
+
+    hv_store(hv, "_hparser_xs_state", 17, newRV_noinc(sv), 0);
+}
+
+
 /*
  *  XS interface definition.
  */
@@ -337,66 +671,53 @@ PROTOTYPES: DISABLE
 void
 _alloc_pstate(self)
 	SV* self;
-    PREINIT:
-	PSTATE* pstate;
-	SV* sv;
-	HV* hv;
-        MAGIC* mg;
-
     CODE:
-	sv = SvRV(self);
-        if (!sv || SvTYPE(sv) != SVt_PVHV)
-            croak("Not a reference to a hash");
-	hv = (HV*)sv;
-
-	Newz(56, pstate, 1, PSTATE);
-	pstate->signature = P_SIGNATURE;
-	pstate->entity2char = perl_get_hv("HTML::Entities::entity2char", TRUE);
-	pstate->tmp = NEWSV(0, 20);
-
-	sv = newSViv(PTR2IV(pstate));
-#if PATCHLEVEL < 8
-	sv_magic(sv, 0, '~', 0, 0);
-#else
-	sv_magic(sv, 0, '~', (char *)pstate, 0);
-#endif
-	mg = mg_find(sv, '~');
-        assert(mg);
-        mg->mg_virtual = (MGVTBL*)&vtbl_pstate;
-#if defined(USE_ITHREADS) && PATCHLEVEL >= 8
-        mg->mg_flags |= MGf_DUP;
-#endif
-	SvREADONLY_on(sv);
+	attach_pstate(aTHX_ self, new_pstate(aTHX));
 
-	hv_store(hv, "_hparser_xs_state", 17, newRV_noinc(sv), 0);
+void
+_clone(pstate, clone)
+	PSTATE* pstate
+	SV* clone
+    CODE:
+	attach_pstate(aTHX_ clone, clone_pstate(aTHX_ pstate));
 
 void
-parse(self, chunk)
+parse(self, ...)
 	SV* self;
-	SV* chunk
+    ALIAS:
+	HTML::Parser::resume = 1
     PREINIT:
 	PSTATE* p_state = get_pstate_hv(aTHX_ self);
+	SV* chunk;
+	int first = 2;
     PPCODE:
 	if (p_state->parsing)
     	    croak("Parse loop not allowed");
+	if (ix == 1) {
+	    /* no chunk; what a pause left is parsed on */
+	    chunk = sv_2mortal(newSVpvn("", 0));
+	    first = 1;
+	}
+	else if (items < 2)
+	    croak("Usage: HTML::Parser::parse(self, chunk, ...)");
+	else
+	    chunk = ST(1);
+	ENTER;
+	parse_guard(aTHX_ p_state, self);
+	parse_budget(aTHX_ p_state, &ST(first), items - first);
         p_state->parsing = 1;
+	PUTBACK;
 	if (SvROK(chunk) && SvTYPE(SvRV(chunk)) == SVt_PVCV) {
 	    SV* generator = chunk;
 	    STRLEN len;
 	    do {
                 int count;
 		PUSHMARK(SP);
-	        count = perl_call_sv(generator, G_SCALAR|G_EVAL);
+	        count = perl_call_sv(generator, G_SCALAR);
 		SPAGAIN;
 		chunk = count ? POPs : 0;
 	        PUTBACK;
 
-	        if (SvTRUE(ERRSV)) {
-		    p_state->parsing = 0;
-		    p_state->eof = 0;
-		    RETHROW;
-                }
-
 		if (chunk && SvOK(chunk)) {
 		    (void)SvPV(chunk, len);  /* get length */
 		}
@@ -406,13 +727,40 @@ parse(self, chunk)
 		parse(aTHX_ p_state, len ? chunk : 0, self);
 	        SPAGAIN;
 
-            } while (len && !p_state->eof);
+            } while (len && !p_state->eof && !p_state->paused);
         }
 	else {
 	    parse(aTHX_ p_state, chunk, self);
             SPAGAIN;
         }
         p_state->parsing = 0;
+	p_state->budget_events = p_state->budget_offset = 0;
+	LEAVE;
+	if (p_state->eof) {
+	    p_state->eof = 0;
+            PUSHs(sv_newmortal());
+        }
+	else {
+	    PUSHs(self);
+	}
+
+void
+replay(self, stream)
+	SV* self;
+	SV* stream
+    PREINIT:
+	PSTATE* p_state = get_pstate_hv(aTHX_ self);
+    PPCODE:
+	if (p_state->parsing)
+    	    croak("Parse loop not allowed");
+	ENTER;
+	parse_guard(aTHX_ p_state, self);
+        p_state->parsing = 1;
+	PUTBACK;
+	replay(aTHX_ p_state, stream, self);
+	SPAGAIN;
+        p_state->parsing = 0;
+	LEAVE;
 	if (p_state->eof) {
 	    p_state->eof = 0;
             PUSHs(sv_newmortal());
@@ -421,6 +769,92 @@ parse(self, chunk)
 	    PUSHs(self);
 	}
 
+void
+reparse(self, doc, offset, old_len, new_len)
+	SV* self;
+	SV* doc
+	UV offset
+	UV old_len
+	UV new_len
+    PREINIT:
+	PSTATE* p_state = get_pstate_hv(aTHX_ self);
+	STRLEN from, to;
+	bool done;
+    PPCODE:
+	if (p_state->parsing)
+    	    croak("Parse loop not allowed");
+	ENTER;
+	parse_guard(aTHX_ p_state, self);
+        p_state->parsing = 1;
+	PUTBACK;
+	done = reparse(aTHX_ p_state, doc, offset, old_len, new_len, self,
+		       &from, &to);
+	SPAGAIN;
+        p_state->parsing = 0;
+	LEAVE;
+	if (done) {
+	    EXTEND(SP, 2);
+	    mPUSHu(from);
+	    mPUSHu(to);
+	}
+
+SV*
+_event_key(pstate, doc)
+	PSTATE* pstate
+	SV* doc
+    CODE:
+	RETVAL = event_key(aTHX_ pstate, doc);
+    OUTPUT:
+	RETVAL
+
+void
+pause(self)
+	SV* self;
+    PREINIT:
+	PSTATE* p_state = get_pstate_hv(aTHX_ self);
+    PPCODE:
+	if (p_state->pausable)
+	    p_state->paused = 1;
+	PUSHs(self);
+
+SV*
+paused(pstate)
+	PSTATE* pstate
+    CODE:
+	RETVAL = boolSV(pstate->paused);
+    OUTPUT:
+	RETVAL
+
+void
+reset(self)
+	SV* self;
+    PREINIT:
+	PSTATE* p_state = get_pstate_hv(aTHX_ self);
+    PPCODE:
+	if (p_state->parsing)
+	    croak("Can't reset while parsing");
+	parse_discard(aTHX_ p_state);
+	PUSHs(self);
+
+SV*
+freeze(pstate)
+	PSTATE* pstate
+    CODE:
+	if (pstate->parsing)
+	    croak("Can't freeze or thaw while parsing");
+	RETVAL = state_freeze(aTHX_ pstate);
+    OUTPUT:
+	RETVAL
+
+void
+_thaw(pstate, frozen)
+	PSTATE* pstate
+	SV* frozen
+    CODE:
+	if (pstate->parsing)
+	    croak("Can't freeze or thaw while parsing");
+	state_thaw(aTHX_ pstate, frozen);
+
 void
 eof(self)
 	SV* self;
@@ -430,9 +864,12 @@ eof(self)
         if (p_state->parsing)
             p_state->eof = 1;
         else {
+	    ENTER;
+	    parse_guard(aTHX_ p_state, self);
 	    p_state->parsing = 1;
 	    parse(aTHX_ p_state, 0, self); /* flush */
 	    p_state->parsing = 0;
+	    LEAVE;
 	}
 	PUSHs(self);
 
@@ -453,6 +890,10 @@ strict_comment(pstate,...)
         HTML::Parser::empty_element_tags = 11
         HTML::Parser::xml_pic = 12
 	HTML::Parser::backquote = 13
+	HTML::Parser::reuse_args = 14
+	HTML::Parser::link_base_tag = 15
+	HTML::Parser::head_scan = 16
+	HTML::Parser::text_collapse = 17
     PREINIT:
 	bool *attr;
     CODE:
@@ -479,12 +920,21 @@ strict_comment(pstate,...)
 	case 11: attr = &pstate->empty_element_tags;   break;
         case 12: attr = &pstate->xml_pic;              break;
 	case 13: attr = &pstate->backquote;            break;
+	case 14: attr = &pstate->reuse_args;           break;
+	case 15: attr = &pstate->link_base_tag;        break;
+	case 16: attr = &pstate->head_scan;            break;
+	case 17: attr = &pstate->text_collapse;        break;
 	default:
 	    croak("Unknown boolean attribute (%d)", (int)ix);
         }
 	RETVAL = boolSV(*attr);
-	if (items > 1)
+	if (items > 1) {
 	    *attr = SvTRUE(ST(1));
+	    if (ix == 14 && *attr)
+		selectors_unshare(aTHX_ pstate);
+	    if (ix == 16)
+		check_handlers(pstate);
+	}
     OUTPUT:
 	RETVAL
 
@@ -524,10 +974,13 @@ ignore_tags(pstate,...)
 
 	items--;  /* pstate */
 	if (items) {
-	    if (*attr)
+	    if (*attr && SvREFCNT(*attr) == 1)
 		hv_clear(*attr);
-	    else
+	    else {
+		/* might be shared with clones */
+		SvREFCNT_dec(*attr);
 		*attr = newHV();
+	    }
 
 	    for (i = 0; i < items; i++) {
 		SV* sv = ST(i+1);
@@ -556,6 +1009,234 @@ ignore_tags(pstate,...)
 	    SvREFCNT_dec(*attr);
             *attr = 0;
 	}
+	if (ix != 2)
+	    prefilter_update(aTHX_ pstate);
+
+void
+head_fields(pstate)
+	PSTATE* pstate
+    PREINIT:
+	AV* av;
+	I32 i;
+    PPCODE:
+	av = pstate->head_fields;
+	if (av) {
+	    pstate->head_fields = 0;
+	    EXTEND(SP, av_len(av) + 1);
+	    for (i = 0; i <= av_len(av); i++)
+		PUSHs(sv_2mortal(SvREFCNT_inc(*av_fetch(av, i, 0))));
+	    SvREFCNT_dec(av);
+	}
+
+SV*
+text_output(pstate,...)
+	PSTATE* pstate
+    CODE:
+	RETVAL = pstate->text_output ? newSVsv(pstate->text_output)
+				     : &PL_sv_undef;
+	if (items > 1) {
+	    SV* out = ST(1);
+	    SvREFCNT_dec(pstate->text_output);
+	    pstate->text_output = 0;
+	    if (SvOK(out)) {
+		if (!(SvROK(out) && !SvOBJECT(SvRV(out)) &&
+		      SvTYPE(SvRV(out)) <= SVt_PVMG))
+		    (void)sv_2io(out);  /* croaks if not a file handle */
+		pstate->text_output = newSVsv(out);
+	    }
+	    check_handlers(pstate);
+	}
+    OUTPUT:
+	RETVAL
+
+SV*
+rewrite_output(pstate,...)
+	PSTATE* pstate
+    CODE:
+	RETVAL = pstate->rewrite_output ? newSVsv(pstate->rewrite_output)
+					: &PL_sv_undef;
+	if (items > 1) {
+	    SV* out = ST(1);
+	    SvREFCNT_dec(pstate->rewrite_output);
+	    pstate->rewrite_output = 0;
+	    if (SvOK(out)) {
+		if (!(SvROK(out) && !SvOBJECT(SvRV(out)) &&
+		      SvTYPE(SvRV(out)) <= SVt_PVMG))
+		    (void)sv_2io(out);  /* croaks if not a file handle */
+		pstate->rewrite_output = newSVsv(out);
+	    }
+	    check_handlers(pstate);
+	}
+    OUTPUT:
+	RETVAL
+
+UV
+checkpoint_interval(pstate,...)
+	PSTATE* pstate
+    CODE:
+	RETVAL = pstate->checkpoint_interval;
+	if (items > 1) {
+	    pstate->checkpoint_interval = SvUV(ST(1));
+	    if (!pstate->checkpoint_interval)
+		pstate->checkpoints_count = 0;
+	}
+    OUTPUT:
+	RETVAL
+
+SV*
+input_encoding(pstate,...)
+	PSTATE* pstate
+    CODE:
+	RETVAL = pstate->in_enc ? newSVpv(input_names[pstate->in_enc], 0)
+				: &PL_sv_undef;
+	if (items > 1) {
+#ifdef UNICODE_HTML_PARSER
+	    SV* name = ST(1);
+	    int enc = 0;
+	    if (SvOK(name)) {
+		STRLEN len;
+		char *s = SvPV(name, len);
+		if (len == 4 && strnEQ(s, "auto", 4))
+		    enc = INENC_AUTO;
+		else if (!(enc = input_encoding_find(s, len)))
+		    croak("Unknown input encoding '%s'", s);
+	    }
+	    pstate->in_enc = enc;
+#else
+	    croak("The input_encoding does not work with this perl; perl-5.8 or better required");
+#endif
+	}
+    OUTPUT:
+	RETVAL
+
+SV*
+document_encoding(pstate)
+	PSTATE* pstate
+    CODE:
+	RETVAL = pstate->in_enc_doc ? newSVpv(input_names[pstate->in_enc_doc], 0)
+				    : &PL_sv_undef;
+    OUTPUT:
+	RETVAL
+
+SV*
+event_output(pstate,...)
+	PSTATE* pstate
+    CODE:
+	RETVAL = pstate->event_output ? newSVsv(pstate->event_output)
+				      : &PL_sv_undef;
+	if (items > 1) {
+	    SV* out = ST(1);
+	    SvREFCNT_dec(pstate->event_output);
+	    pstate->event_output = 0;
+	    if (SvOK(out)) {
+		if (!(SvROK(out) && !SvOBJECT(SvRV(out)) &&
+		      SvTYPE(SvRV(out)) <= SVt_PVMG))
+		    (void)sv_2io(out);  /* croaks if not a file handle */
+		pstate->event_output = newSVsv(out);
+	    }
+	    check_handlers(pstate);
+	}
+    OUTPUT:
+	RETVAL
+
+void
+rewrite_tags(pstate,...)
+	PSTATE* pstate
+    CODE:
+	if (GIMME_V != G_VOID)
+	    croak("Can't report rewrite tags yet");
+	SvREFCNT_dec(pstate->rewrite_tags);
+	pstate->rewrite_tags = 0;
+	if (items > 1 && SvOK(ST(1)))
+	    pstate->rewrite_tags = rewrite_tags_compile(aTHX_ ST(1));
+	check_handlers(pstate);
+
+void
+rewrite_print(pstate,...)
+	PSTATE* pstate
+    PREINIT:
+	int i;
+    CODE:
+	if (!pstate->rewrite_output)
+	    croak("No rewrite_output to print to");
+	for (i = 1; i < items; i++) {
+	    if (SvOK(ST(i)))
+		rewrite_put_sv(aTHX_ pstate, ST(i));
+	}
+
+void
+sanitize(pstate,...)
+	PSTATE* pstate
+    CODE:
+	if (GIMME_V != G_VOID)
+	    croak("Can't report sanitize options yet");
+	if (items > 1 && SvOK(ST(1)))
+	    sanitize_compile(aTHX_ pstate, ST(1));
+	else
+	    sanitize_free(aTHX_ pstate);
+	check_handlers(pstate);
+
+void
+serialize(pstate,...)
+	PSTATE* pstate
+    CODE:
+	if (GIMME_V != G_VOID)
+	    croak("Can't report serialize options yet");
+	pstate->serialize = (items > 1 && SvOK(ST(1)))
+	    ? serialize_compile(aTHX_ ST(1)) : 0;
+	check_handlers(pstate);
+
+void
+textify(pstate,...)
+	PSTATE* pstate
+    CODE:
+	if (GIMME_V != G_VOID)
+	    croak("Can't report textify tags yet");
+	SvREFCNT_dec(pstate->textify);
+	pstate->textify = 0;
+	if (items > 1 && SvOK(ST(1)))
+	    pstate->textify = attr_table_compile(aTHX_ ST(1), "textify");
+
+void
+link_elements(pstate,...)
+	PSTATE* pstate
+    CODE:
+	if (GIMME_V != G_VOID)
+	    croak("Can't report link elements yet");
+	SvREFCNT_dec(pstate->link_elements);
+	pstate->link_elements = 0;
+	if (items > 1 && SvOK(ST(1)))
+	    pstate->link_elements = attr_table_compile(aTHX_ ST(1), "link_elements");
+
+SV*
+link_base(pstate,...)
+	PSTATE* pstate
+    CODE:
+	RETVAL = pstate->link_base ? newSVsv(pstate->link_base)
+				   : &PL_sv_undef;
+	if (items > 1) {
+	    SvREFCNT_dec(pstate->link_base);
+	    pstate->link_base = 0;
+	    if (SvOK(ST(1))) {
+		STRLEN len;
+		char *s = SvPV(ST(1), len);
+		pstate->link_base = newSVpvn("", 0);
+		uri_escape_cat(aTHX_ pstate->link_base, s, len, SvUTF8(ST(1)));
+	    }
+	}
+    OUTPUT:
+	RETVAL
+
+void
+literal_tags(pstate,...)
+	PSTATE* pstate
+    CODE:
+	if (GIMME_V != G_VOID)
+	    croak("Can't report tag lists yet");
+
+	literal_tags_replace(pstate, (items > 1)
+			     ? literal_set_compile(aTHX_ &ST(1), items - 1)
+			     : 0);
 
 void
 handler(pstate, eventname,...)
@@ -564,13 +1245,18 @@ handler(pstate, eventname,...)
     PREINIT:
 	STRLEN name_len;
 	char *name = SvPV(eventname, name_len);
+	char *tag = strchr(name, ':');
+	STRLEN event_len = tag ? (STRLEN)(tag - name) : name_len;
+	SV* tagname = 0;
+	SV* selector = 0;
         int event = -1;
         int i;
         struct p_handler *h;
     PPCODE:
 	/* map event name string to event_id */
 	for (i = 0; i < EVENT_COUNT; i++) {
-	    if (strEQ(name, event_id_str[i])) {
+	    if (strlen(event_id_str[i]) == event_len &&
+		strnEQ(name, event_id_str[i], event_len)) {
 	        event = i;
 	        break;
 	    }
@@ -578,10 +1264,39 @@ handler(pstate, eventname,...)
         if (event < 0)
 	    croak("No handler for %s events", name);
 
-	h = &pstate->handlers[event];
+	if (tag) {
+	    /* "start:a" or "start:div.article a[href]" */
+	    char *t;
+	    tagname = sv_2mortal(newSVpvn(tag + 1, name_len - event_len - 1));
+	    if (SvUTF8(eventname))
+		SvUTF8_on(tagname);
+	    for (t = tag + 1; t < name + name_len && isSEL_NAME(*t); t++)
+		;
+	    if (event == E_TEXT || t < name + name_len) {
+		if (event != E_START && event != E_END && event != E_TEXT)
+		    croak("No selector handlers for %s events",
+			  event_id_str[event]);
+		selector = tagname;
+		tagname = 0;
+		if (items > 2)
+		    selectors_unshare(aTHX_ pstate);
+		h = sel_handler_fetch(aTHX_ pstate, event, selector,
+				      items > 2 && SvOK(ST(2)));
+	    }
+	    else {
+		if (event != E_START && event != E_END && event != E_ELEMENT)
+		    croak("No tag specific handlers for %s events",
+			  event_id_str[event]);
+		h = tag_handler_fetch(aTHX_ pstate, event, tagname,
+				      items > 2 && SvOK(ST(2)));
+	    }
+	}
+	else {
+	    h = &pstate->handlers[event];
+	}
 
 	/* set up return value */
-	if (h->cb) {
+	if (h && h->cb) {
 	    PUSHs((SvTYPE(h->cb) == SVt_PVAV)
 	                 ? sv_2mortal(newRV_inc(h->cb))
 	                 : sv_2mortal(newSVsv(h->cb)));
@@ -590,6 +1305,9 @@ handler(pstate, eventname,...)
 	    PUSHs(&PL_sv_undef);
         }
 
+	if (!h)
+	    XSRETURN(1);  /* no handler for the tag, and none to set */
+
         /* update */
         if (items > 3) {
 	    SvREFCNT_dec(h->argspec);
@@ -601,6 +1319,18 @@ handler(pstate, eventname,...)
             h->cb = 0;
 	    h->cb = check_handler(aTHX_ ST(2));
 	}
+	if (items > 2) {
+	    /* the argument layout and method might have changed */
+	    SvREFCNT_dec(h->args);
+	    h->args = 0;
+	    SvREFCNT_dec(h->method_cv);
+	    h->method_cv = 0;
+	}
+	if (tagname && !h->cb)
+	    tag_handler_delete(aTHX_ pstate, event, tagname);
+	if (selector && !h->cb)
+	    sel_handler_delete(aTHX_ pstate, event, selector);
+	check_handlers(pstate);
 
 
 MODULE = HTML::Parser		PACKAGE = HTML::Entities
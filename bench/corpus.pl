@@ -0,0 +1,154 @@
+#!/usr/bin/perl -w
+
+# Generates the documents that bench/run parses.  The same kind and
+# size give the same document on every platform and perl, so results
+# can be compared between runs.
+#
+#   perl bench/corpus.pl [--size BYTES] DIR
+#
+# writes DIR/<kind>.html for each kind.
+
+package BenchCorpus;
+
+use strict;
+
+our @KINDS = qw(text attrs entities script nested comment mixed);
+
+my $seed;
+
+sub rnd
+{
+    # a linear congruential generator; perl's rand() differs by platform
+    my $n = shift;
+    $seed = ($seed * 69069 + 1) % 4294967296;
+    return int($seed / 65536) % $n;
+}
+
+sub pick { $_[rnd(scalar @_)] }
+
+my @words = qw(the of and to in is that it for was on are as with his they
+	       at be this from have or by one had not but what all were when
+	       we there can an your which their said if do will each about how
+	       up out them then she many some so these would other into has
+	       more her two like him see time could no make than first been
+	       its who now people my made over did down only way find use may
+	       water long little very after words called just where most know);
+push(@words, "caf\xe9", "na\xefve", "r\xe9sum\xe9", "fa\xe7ade");
+
+sub words
+{
+    my $n = shift;
+    return join(" ", map { $words[rnd(scalar @words)] } 1 .. $n);
+}
+
+my @entities = split(' ', "&amp; &lt; &gt; &quot; &nbsp; &eacute; &copy; &hellip;
+			  &#233; &#8364; &#x20AC; &#x3b1; &mdash; &amp &lt
+			  &unknown; &#; &#xZZ; &AMP; &rarr;");
+
+my %gen;
+
+$gen{text} = sub {
+    return "<p>" . words(50 + rnd(200)) . ".</p>\n" .
+	   (rnd(4) ? "" : "<h2>" . words(3 + rnd(5)) . "</h2>\n");
+};
+
+$gen{attrs} = sub {
+    my $n = rnd(100000);
+    return pick(qq(<div id="d$n" class="box item-$n" data-index="$n" ) .
+		qq(title='@{[words(3)]}' style="color: red; margin: 0">\n),
+		qq(<a href="/page/$n?x=1&amp;y=2" rel=nofollow target=_blank ) .
+		qq(onclick="return go($n)" TITLE=Link>@{[words(2)]}</a>\n),
+		qq(<img src="/img/$n.png" alt="@{[words(4)]}" width=100 ) .
+		qq(height=50 border=0 />\n),
+		qq(<input type="checkbox" name=opt$n value='v$n' checked ) .
+		qq(disabled data-a=1 data-b=2 data-c=3>\n),
+		qq(<span lang=en dir=ltr class=x>w</span><br/>\n),
+		qq(</div>\n));
+};
+
+$gen{entities} = sub {
+    my $s = "<p title='" . join("", map { pick(@entities) } 1 .. 3) . "'>";
+    for (1 .. 20 + rnd(40)) {
+	$s .= rnd(2) ? pick(@entities) : $words[rnd(scalar @words)] . " ";
+    }
+    return "$s</p>\n";
+};
+
+$gen{script} = sub {
+    my $n = rnd(1000);
+    return pick(qq(<script type="text/javascript">\n) .
+		qq(var a$n = [1, 2, 3]; for (var i = 0; i < a$n.length; i++) {\n) .
+		qq(  if (a${n}[i] < 2 && i > 0) document.write("<b>" + i + "</b>");\n) .
+		qq(}\n// <!-- not a comment -->\n</script>\n),
+		qq(<style>\n.c$n > p { margin: 0 } a:hover { color: #$n }\n</style>\n),
+		qq(<script>var s = '</scr' + 'ipt>'; x = y << 2;</script>\n),
+		"<p>" . words(10) . "</p>\n");
+};
+
+$gen{nested} = sub {
+    my $depth = 50 + rnd(150);
+    my @tags = map { pick(qw(div span ul li table tr td b i em section)) } 1 .. $depth;
+    return join("", map { "<$_>" } @tags) . words(3) .
+	   join("", map { "</$_>" } reverse @tags) . "\n";
+};
+
+$gen{comment} = sub {
+    my $s = "<!-- ";
+    $s .= words(20) . pick(" -- ", " <p>tag</p> ", " - ", "\n") for 1 .. 200 + rnd(2000);
+    return "$s -->\n<p>" . words(5) . "</p>\n";
+};
+
+$gen{mixed} = sub {
+    # a page with a little of everything
+    my $s = "<!DOCTYPE html>\n<html><head><title>" . words(4) . "</title>\n" .
+	    qq(<meta name=viewport content="width=device-width">\n) .
+	    qq(<link rel=stylesheet href="/s.css">\n) .
+	    $gen{script}->() . "</head>\n<body>\n";
+    for (1 .. 10) {
+	my $kind = pick(qw(text text attrs attrs entities script nested comment));
+	$s .= $kind eq "comment" ? "<!-- " . words(30) . " -->\n" : $gen{$kind}->();
+    }
+    return "$s</body></html>\n";
+};
+
+sub generate
+{
+    my($kind, $size) = @_;
+    die "Unknown corpus kind '$kind'" unless $gen{$kind};
+    $seed = 42;
+    $seed = ($seed * 31 + ord($_)) % 4294967296 for split //, $kind;
+    my $doc = "";
+    $doc .= $gen{$kind}->() while length($doc) < $size;
+    return $doc;
+}
+
+sub chunks
+{
+    # the document cut into pieces of 1 to 512 bytes, as from a socket
+    my $doc = shift;
+    my @chunks;
+    $seed = length($doc);
+    for (my $i = 0; $i < length($doc); ) {
+	my $n = 1 + rnd(512);
+	push(@chunks, substr($doc, $i, $n));
+	$i += $n;
+    }
+    return @chunks;
+}
+
+unless (caller) {
+    my $size = 1_000_000;
+    if (@ARGV && $ARGV[0] eq "--size") {
+	shift;
+	$size = shift;
+    }
+    my $dir = shift || die "Usage: $0 [--size BYTES] DIR\n";
+    for my $kind (@KINDS) {
+	open(my $fh, ">", "$dir/$kind.html") || die "Can't create $dir/$kind.html: $!";
+	binmode($fh);
+	print $fh generate($kind, $size);
+	close($fh) || die "Can't write $dir/$kind.html: $!";
+    }
+}
+
+1;
@@ -14,22 +14,25 @@
 #include "tokenpos.h"  /* dTOKEN; PUSH_TOKEN() */
 
 
-const static
-struct literal_tag {
-    int len;
-    char* str;
-    int is_cdata;
-}
+static struct literal_tag
 literal_mode_elem[] =
 {
-    {6, "script", 1},
-    {5, "style", 1},
-    {3, "xmp", 1},
-    {6, "iframe", 1},
-    {9, "plaintext", 1},
-    {5, "title", 0},
-    {8, "textarea", 0},
-    {0, 0, 0}
+    {6, "script",    1, LITERAL_EOF_EMPTY},
+    {5, "style",     1, LITERAL_EOF_EMPTY},
+    {3, "xmp",       1, LITERAL_EOF_TEXT},
+    {6, "iframe",    1, LITERAL_EOF_TEXT},
+    {9, "plaintext", 1, LITERAL_EOF_TEXT},
+    {5, "title",     0, LITERAL_EOF_PENDING},
+    {8, "textarea",  0, LITERAL_EOF_TEXT}
+};
+
+const static struct literal_set
+literal_mode_default =
+{
+    LITERAL_LEN_BIT(3) | LITERAL_LEN_BIT(5) | LITERAL_LEN_BIT(6) |
+    LITERAL_LEN_BIT(8) | LITERAL_LEN_BIT(9),
+    7,
+    literal_mode_elem
 };
 
 enum argcode {
@@ -53,8 +56,17 @@ enum argcode {
     ARG_COLUMN,
     ARG_EVENT,
     ARG_UNDEF,
+    ARG_ATTRVAL,
+    ARG_DEPTH,
+    ARG_PARENT,
+    ARG_PATH,
+    ARG_PATHARR,
+    ARG_LINKS,
     ARG_LITERAL, /* Always keep last */
 
+    /* "attr(...)"; attribute lists are encoded after these */
+    ARG_ATTR_SUBSET,
+
     /* extra flags always encoded first */
     ARG_FLAG_FLAT_ARRAY
 };
@@ -81,18 +93,48 @@ static const char * const argname[] = {
     "column",   /* ARG_COLUMN */
     "event",    /* ARG_EVENT */
     "undef",    /* ARG_UNDEF */
+    "attrval",  /* ARG_ATTRVAL */
+    "depth",    /* ARG_DEPTH */
+    "parent",   /* ARG_PARENT */
+    "path",     /* ARG_PATH */
+    "@path",    /* ARG_PATHARR */
+    "@links",   /* ARG_LINKS */
     /* ARG_LITERAL (not compared) */
     /* ARG_FLAG_FLAT_ARRAY */
 };
 
+/* argcodes that need the start tag attributes tokenized */
+static const char attr_argcodes[] = {
+    ARG_TOKENS, ARG_TOKENPOS, ARG_ATTR, ARG_ATTRARR, ARG_ATTRSEQ,
+    ARG_ATTR_SUBSET, ARG_ATTRVAL, ARG_LINKS, 0
+};
+
+/* argcodes that need the open element stack */
+static const char stack_argcodes[] = {
+    ARG_DEPTH, ARG_PARENT, ARG_PATH, ARG_PATHARR, 0
+};
+
+/* argcodes that restrict start events to tags with links */
+static const char link_argcodes[] = {
+    ARG_LINKS, 0
+};
+
 #define CASE_SENSITIVE(p_state) \
          ((p_state)->xml_mode || (p_state)->case_sensitive)
 #define STRICT_NAMES(p_state) \
          ((p_state)->xml_mode || (p_state)->strict_names)
 #define ALLOW_EMPTY_TAG(p_state) \
          ((p_state)->xml_mode || (p_state)->empty_element_tags)
+#define LITERAL_SET(p_state) \
+         ((p_state)->literal_tags ? (p_state)->literal_tags : &literal_mode_default)
 
 static void flush_pending_text(PSTATE* p_state, SV* self);
+static bool argspec_uses(SV* argspec, const char *codes);
+static void pend_text_materialize(pTHX_ PSTATE* p_state);
+
+#define PEND_TEXT_OK(p_state) \
+   ((p_state)->pend_spans_count || \
+    ((p_state)->pend_text && SvOK((p_state)->pend_text)))
 
 /*
  * Parser functions.
@@ -113,226 +155,2995 @@ static void flush_pending_text(PSTATE* p_state, SV* self);
  *                      has recongnized something.
  */
 
-static void
-report_event(PSTATE* p_state,
-	     event_id_t event,
-	     char *beg, char *end, U32 utf8,
-	     token_pos_t *tokens, int num_tokens,
-	     SV* self
-	    )
+static SV*
+attr_value(pTHX_ PSTATE* p_state, token_pos_t *name, token_pos_t *val, U32 utf8)
 {
-    struct p_handler *h;
-    dTHX;
-    dSP;
-    AV *array;
-    STRLEN my_na;
-    char *argspec;
-    char *s;
-    STRLEN offset;
-    STRLEN line;
-    STRLEN column;
-
+    /* make the value reported for an attribute; 'val' is the token
+     * following the attribute 'name' token
+     */
+    SV* attrval;
+
+    if (val->beg) {
+	char *beg = val->beg;
+	STRLEN len = val->end - beg;
+	if (*beg == '"' || *beg == '\'' || (*beg == '`' && p_state->backquote)) {
+	    assert(len >= 2 && *beg == beg[len-1]);
+	    beg++; len -= 2;
+	}
+	attrval = newSVpvn(beg, len);
+	if (utf8)
+	    SvUTF8_on(attrval);
+	if (!p_state->attr_encoded) {
 #ifdef UNICODE_HTML_PARSER
-    #define CHR_DIST(a,b) (utf8 ? utf8_distance((U8*)(a),(U8*)(b)) : (a) - (b))
-#else
-    #define CHR_DIST(a,b) ((a) - (b))
+	    if (p_state->utf8_mode) {
+		sv_utf8_decode(attrval);
+		sv_utf8_upgrade(attrval);
+	    }
 #endif
+	    decode_entities(aTHX_ attrval, p_state->entity2char, 0);
+	    if (p_state->utf8_mode)
+		SvUTF8_off(attrval);
+	}
+    }
+    else { /* boolean */
+	if (p_state->bool_attr_val)
+	    attrval = newSVsv(p_state->bool_attr_val);
+	else {
+	    attrval = newSVpvn(name->beg, name->end - name->beg);
+	    if (utf8)
+		SvUTF8_on(attrval);
+	}
+    }
+    return attrval;
+}
 
-    /* some events might still fire after a handler has signaled eof
-     * so suppress them here.
+static int
+attr_list_match(PSTATE* p_state, char *list, int n, token_pos_t *name)
+{
+    /* look for the attribute name in an "attr(...)" or "attrval(...)"
+     * list compiled by argspec_compile(); returns its index or -1
      */
-    if (p_state->eof)
-	return;
+    STRLEN len = name->end - name->beg;
+    int i;
+    for (i = 0; i < n; i++) {
+	STRLEN list_len = (unsigned char)*list++;
+	if (list_len == len &&
+	    strnEQx(name->beg, list, len, !CASE_SENSITIVE(p_state)))
+	{
+	    return i;
+	}
+	list += list_len;
+    }
+    return -1;
+}
 
-    /* capture offsets */
-    offset = p_state->offset;
-    line = p_state->line;
-    column = p_state->column;
+static SV*
+event_tagname(pTHX_ PSTATE* p_state, token_pos_t *tokens, U32 utf8)
+{
+    /* the tag name of a start or end event, as used for the tag
+     * filters and tag specific handlers.  Lives in p_state->tmp.
+     */
+    SV* tagname = p_state->tmp;
+    sv_setpvn(tagname, tokens[0].beg, tokens[0].end - tokens[0].beg);
+    if (utf8)
+	SvUTF8_on(tagname);
+    else
+	SvUTF8_off(tagname);
+    if (!CASE_SENSITIVE(p_state))
+	sv_lower(aTHX_ tagname);
+    return tagname;
+}
 
-#if 0
-    {  /* used for debugging at some point */
-	char *s = beg;
-	int i;
+/* The open element stack.  Tag names are interned in stack_names; the
+ * IV slot of each name holds the ELEM_* flags below, so knowing how a
+ * start tag affects the stack is a pointer comparison and a bit test.
+ */
+#define ELEM_CLOSES_MASK  0x7FFF        /* optional end elements it closes */
+#define ELEM_OPT_END(n)   ((IV)1 << ((n) + 15))
+#define ELEM_VOID         ((IV)1 << 30)
+
+/* the void elements of HTML5, and obsolete ones that were void */
+static const char * const void_elements[] = {
+    "area", "base", "basefont", "bgsound", "br", "col", "embed", "frame",
+    "hr", "img", "input", "isindex", "keygen", "link", "meta", "param",
+    "source", "spacer", "track", "wbr",
+    0
+};
 
-	/* print debug output */
-	switch(event) {
-	case E_DECLARATION: printf("DECLARATION"); break;
-	case E_COMMENT:     printf("COMMENT"); break;
-	case E_START:       printf("START"); break;
-	case E_END:         printf("END"); break;
-	case E_TEXT:        printf("TEXT"); break;
-	case E_PROCESS:     printf("PROCESS"); break;
-	case E_NONE:        printf("NONE"); break;
-	default:            printf("EVENT #%d", event); break;
-	}
+/* elements whose end tag can be left out, the start tags that
+ * implicitly end them when they are the current element, and the
+ * parents whose end tag may follow where theirs is left out
+ */
+static const struct {
+    const char *name;
+    const char *closed_by;
+    const char *parents;
+} optional_end_elements[] = {
+    { "p",        " address article aside blockquote details dialog div dl"
+                  " fieldset figcaption figure footer form h1 h2 h3 h4 h5"
+                  " h6 header hgroup hr main menu nav ol p pre section"
+                  " table ul ",                   "" },
+    { "li",       " li ",                         " ul ol menu " },
+    { "dt",       " dt dd ",                      "" },
+    { "dd",       " dt dd ",                      " dl " },
+    { "option",   " option optgroup ",            " select datalist optgroup " },
+    { "optgroup", " optgroup ",                   " select " },
+    { "tr",       " tr tbody thead tfoot ",       " table tbody thead tfoot " },
+    { "td",       " td th tr tbody thead tfoot ", " tr " },
+    { "th",       " td th tr tbody thead tfoot ", " tr " },
+    { "thead",    " tbody tfoot ",                "" },
+    { "tbody",    " tbody tfoot ",                " table " },
+    { "tfoot",    " tbody ",                      " table " },
+    { "rt",       " rt rp ",                      " ruby " },
+    { "rp",       " rt rp ",                      " ruby " },
+    { 0, 0, 0 }
+};
 
-	printf(" [");
-	while (s < end) {
-	    if (*s == '\n') {
-		putchar('\\'); putchar('n');
-	    }
-	    else
-		putchar(*s);
-	    s++;
+static IV
+elem_flags(const char *name, STRLEN len)
+{
+    char buf[16];
+    IV flags = 0;
+    int i;
+
+    if (len > sizeof(buf) - 3)
+	return 0;
+    for (i = 0; void_elements[i]; i++) {
+	if (strlen(void_elements[i]) == len &&
+	    strnEQ(void_elements[i], name, len))
+	{
+	    flags |= ELEM_VOID;
+	    break;
 	}
-	printf("] %d\n", end - beg);
-	for (i = 0; i < num_tokens; i++) {
-	    printf("  token %d: %d %d\n",
-		   i,
-		   tokens[i].beg - beg,
-		   tokens[i].end - tokens[i].beg);
+    }
+    buf[0] = ' ';
+    memcpy(buf + 1, name, len);
+    buf[len + 1] = ' ';
+    buf[len + 2] = '\0';
+    for (i = 0; optional_end_elements[i].name; i++) {
+	if (strlen(optional_end_elements[i].name) == len &&
+	    strnEQ(optional_end_elements[i].name, name, len))
+	{
+	    flags |= ELEM_OPT_END(i);
 	}
+	if (strstr(optional_end_elements[i].closed_by, buf))
+	    flags |= (IV)1 << i;
     }
-#endif
+    return flags;
+}
 
-    if (p_state->pending_end_tag && event != E_TEXT && event != E_COMMENT) {
-	token_pos_t t;
-	char dummy;
-	t.beg = p_state->pending_end_tag;
-	t.end = p_state->pending_end_tag + strlen(p_state->pending_end_tag);
-	p_state->pending_end_tag = 0;
-	report_event(p_state, E_END, &dummy, &dummy, 0, &t, 1, self);
-	SPAGAIN;
+static SV*
+stack_intern(pTHX_ PSTATE* p_state, SV* tagname)
+{
+    HE* he;
+    SV* name;
+
+    if (!p_state->stack_names)
+	p_state->stack_names = newHV();
+    he = hv_fetch_ent(p_state->stack_names, tagname, 1, 0);
+    name = HeVAL(he);
+    if (!SvOK(name)) {
+	sv_setsv(name, tagname);
+	(void)SvUPGRADE(name, SVt_PVIV);
+	SvIV_set(name, elem_flags(SvPVX(name), SvCUR(name)));
     }
+    return name;
+}
 
-    /* update offsets */
-    p_state->offset += CHR_DIST(end, beg);
-    if (line) {
-	char *s = beg;
-	char *nl = NULL;
-	while (s < end) {
-	    if (*s == '\n') {
-		p_state->line++;
-		nl = s;
-	    }
-	    s++;
-	}
-	if (nl)
-	    p_state->column = CHR_DIST(end, nl) - 1;
-	else
-	    p_state->column += CHR_DIST(end, beg);
-    }
+/*
+ * Selector handlers.
+ *
+ *   sel_compile()     - parses a selector into the shared part table
+ *   sel_part_match()  - does an element match a compound selector?
+ *   selector_match()  - finds the selector handlers a new element matches
+ */
 
-    if (event == E_NONE)
-	goto IGNORE_EVENT;
+#define isSEL_NAME(c) (isHNAME_CHAR(c) && (c) != '.')
 
-#ifdef MARKED_SECTION
-    if (p_state->ms == MS_IGNORE)
-	goto IGNORE_EVENT;
-#endif
+static bool
+sel_compile(pTHX_ struct selector_set *set, struct sel_handler *sh)
+{
+    /* returns FALSE if the selector can't be parsed */
+    STRLEN len;
+    char *s = SvPV(sh->source, len);
+    char *end = s + len;
+    int n = set->nparts;
+    bool child = 0;
 
-    /* tag filters */
-    if (p_state->ignore_tags || p_state->report_tags || p_state->ignore_elements) {
+    sh->first_part = n;
+    while (1) {
+	struct sel_part *part;
 
-	if (event == E_START || event == E_END) {
-	    SV* tagname = p_state->tmp;
+	while (s < end && isHSPACE(*s))
+	    s++;
+	if (s < end && *s == '>') {
+	    if (n == sh->first_part || child)
+		return 0;
+	    child = 1;
+	    s++;
+	    continue;
+	}
+	if (s == end)
+	    break;
 
-	    assert(num_tokens >= 1);
-	    sv_setpvn(tagname, tokens[0].beg, tokens[0].end - tokens[0].beg);
-	    if (utf8)
-		SvUTF8_on(tagname);
-	    else
-		SvUTF8_off(tagname);
-	    if (!CASE_SENSITIVE(p_state))
-		sv_lower(aTHX_ tagname);
+	if (n == SEL_MAX_PARTS)
+	    croak("Too many compound selectors");
+	part = &set->parts[n];
+	Zero(part, 1, struct sel_part);
+	part->child = child;
+	child = 0;
 
-	    if (p_state->ignoring_element) {
-		if (sv_eq(p_state->ignoring_element, tagname)) {
-		    if (event == E_START)
-			p_state->ignore_depth++;
-		    else if (--p_state->ignore_depth == 0) {
-			SvREFCNT_dec(p_state->ignoring_element);
-			p_state->ignoring_element = 0;
-		    }
-		}
-		goto IGNORE_EVENT;
-	    }
+	if (*s == '*') {
+	    s++;
+	}
+	else if (isHNAME_FIRST(*s)) {
+	    part->tag = s;
+	    while (s < end && isSEL_NAME(*s))
+		s++;
+	    part->tag_len = s - part->tag;
+	}
 
-	    if (p_state->ignore_elements &&
-		hv_fetch_ent(p_state->ignore_elements, tagname, 0, 0))
-	    {
-		if (event == E_START) {
-		    p_state->ignoring_element = newSVsv(tagname);
-		    p_state->ignore_depth = 1;
-		}
-		goto IGNORE_EVENT;
+	while (s < end && !isHSPACE(*s) && *s != '>') {
+	    struct sel_cond *cond;
+	    if (part->nconds == SEL_MAX_CONDS)
+		return 0;
+	    cond = &part->conds[part->nconds++];
+
+	    if (*s == '#' || *s == '.') {
+		cond->type = *s++;
+		cond->name = cond->type == '#' ? "id" : "class";
+		cond->name_len = strlen(cond->name);
+		cond->value = s;
+		while (s < end && isSEL_NAME(*s))
+		    s++;
+		cond->value_len = s - cond->value;
+		if (!cond->value_len)
+		    return 0;
 	    }
-
-	    if (p_state->ignore_tags &&
-		hv_fetch_ent(p_state->ignore_tags, tagname, 0, 0))
-	    {
-		goto IGNORE_EVENT;
+	    else if (*s == '[') {
+		s++;
+		while (s < end && isHSPACE(*s))
+		    s++;
+		cond->name = s;
+		while (s < end && isHNAME_CHAR(*s))
+		    s++;
+		cond->name_len = s - cond->name;
+		if (!cond->name_len)
+		    return 0;
+		while (s < end && isHSPACE(*s))
+		    s++;
+		if (s < end && *s == '^') {
+		    cond->type = '^';
+		    s++;
+		}
+		else {
+		    cond->type = '=';
+		}
+		if (s < end && *s == ']') {
+		    if (cond->type == '^')
+			return 0;
+		    cond->type = '[';
+		}
+		else {
+		    if (s == end || *s != '=')
+			return 0;
+		    s++;
+		    while (s < end && isHSPACE(*s))
+			s++;
+		    if (s < end && (*s == '"' || *s == '\'')) {
+			char quote = *s++;
+			cond->value = s;
+			while (s < end && *s != quote)
+			    s++;
+			if (s == end)
+			    return 0;
+			cond->value_len = s++ - cond->value;
+		    }
+		    else {
+			cond->value = s;
+			while (s < end && isHNAME_CHAR(*s))
+			    s++;
+			cond->value_len = s - cond->value;
+			if (!cond->value_len)
+			    return 0;
+		    }
+		    while (s < end && isHSPACE(*s))
+			s++;
+		}
+		if (s == end || *s != ']')
+		    return 0;
+		s++;
 	    }
-	    if (p_state->report_tags &&
-		!hv_fetch_ent(p_state->report_tags, tagname, 0, 0))
-	    {
-		goto IGNORE_EVENT;
+	    else {
+		return 0;
 	    }
 	}
-	else if (p_state->ignoring_element) {
-	    goto IGNORE_EVENT;
-	}
+	n++;
     }
+    if (n == sh->first_part || child)
+	return 0;
 
-    h = &p_state->handlers[event];
-    if (!h->cb) {
-	/* event = E_DEFAULT; */
-	h = &p_state->handlers[E_DEFAULT];
-	if (!h->cb)
-	    goto IGNORE_EVENT;
-    }
+    sh->last_part = n - 1;
+    set->nparts = n;
+    return 1;
+}
 
-    if (SvTYPE(h->cb) != SVt_PVAV && !SvTRUE(h->cb)) {
-	/* FALSE scalar ('' or 0) means IGNORE this event */
-	return;
+static bool
+sel_value_match(struct sel_cond *cond, char *v, STRLEN len)
+{
+    char *end = v + len;
+
+    switch (cond->type) {
+    case '^':
+	return len >= cond->value_len && memEQ(v, cond->value, cond->value_len);
+    case '.':
+	while (v < end) {
+	    char *w;
+	    while (v < end && isHSPACE(*v))
+		v++;
+	    w = v;
+	    while (v < end && !isHSPACE(*v))
+		v++;
+	    if (v - w == (int)cond->value_len && memEQ(w, cond->value, v - w))
+		return 1;
+	}
+	return 0;
+    default:
+	return len == cond->value_len && memEQ(v, cond->value, len);
     }
+}
 
-    if (p_state->unbroken_text && event == E_TEXT) {
-	/* should buffer text */
-	if (!p_state->pend_text)
-	    p_state->pend_text = newSV(256);
-	if (SvOK(p_state->pend_text)) {
-	    if (p_state->is_cdata != p_state->pend_text_is_cdata) {
-		flush_pending_text(p_state, self);
-		SPAGAIN;
-		goto INIT_PEND_TEXT;
-	    }
-	}
-	else {
-	INIT_PEND_TEXT:
-	    p_state->pend_text_offset = offset;
-	    p_state->pend_text_line = line;
-	    p_state->pend_text_column = column;
-	    p_state->pend_text_is_cdata = p_state->is_cdata;
-	    sv_setpvn(p_state->pend_text, "", 0);
-	    if (!utf8)
-		SvUTF8_off(p_state->pend_text);
+static bool
+sel_part_match(pTHX_ PSTATE* p_state, struct sel_part *part, SV* name,
+	       token_pos_t *tokens, int num_tokens, U32 utf8)
+{
+    bool icase = !CASE_SENSITIVE(p_state);
+    int i, j;
+
+    if (part->tag && !(part->tag_len == SvCUR(name) &&
+		       strnEQx(part->tag, SvPVX(name), part->tag_len, icase)))
+	return 0;
+
+    for (i = 0; i < part->nconds; i++) {
+	struct sel_cond *cond = &part->conds[i];
+	token_pos_t *val;
+	bool ok;
+
+	/* the first attribute with the name counts, like for "attr" */
+	for (j = 1; j < num_tokens; j += 2) {
+	    if (tokens[j].end - tokens[j].beg == (int)cond->name_len &&
+		strnEQx(tokens[j].beg, cond->name, cond->name_len, icase))
+		break;
 	}
-#ifdef UNICODE_HTML_PARSER
-	if (utf8 && !SvUTF8(p_state->pend_text))
-	    sv_utf8_upgrade(p_state->pend_text);
-	if (utf8 || !SvUTF8(p_state->pend_text)) {
-	    sv_catpvn(p_state->pend_text, beg, end - beg);
+	if (j >= num_tokens)
+	    return 0;
+	if (cond->type == '[')
+	    continue;
+
+	val = &tokens[j+1];
+	if (val->beg && (p_state->attr_encoded ||
+			 !memchr(val->beg, '&', val->end - val->beg)))
+	{
+	    char *beg = val->beg;
+	    STRLEN len = val->end - beg;
+	    if (*beg == '"' || *beg == '\'' ||
+		(*beg == '`' && p_state->backquote))
+	    {
+		beg++; len -= 2;
+	    }
+	    ok = sel_value_match(cond, beg, len);
 	}
 	else {
-	    SV *tmp = newSVpvn(beg, end - beg);
-	    sv_utf8_upgrade(tmp);
-	    sv_catsv(p_state->pend_text, tmp);
-	    SvREFCNT_dec(tmp);
+	    STRLEN len;
+	    SV* attrval = attr_value(aTHX_ p_state, &tokens[j], val, utf8);
+	    char *v = SvPV(attrval, len);
+	    ok = sel_value_match(cond, v, len);
+	    SvREFCNT_dec(attrval);
 	}
-#else
-	sv_catpvn(p_state->pend_text, beg, end - beg);
-#endif
-	return;
-    }
-    else if (p_state->pend_text && SvOK(p_state->pend_text)) {
-	flush_pending_text(p_state, self);
-	SPAGAIN;
+	if (!ok)
+	    return 0;
     }
+    return 1;
+}
 
-    /* At this point we have decided to generate an event callback */
+static void
+selector_match(pTHX_ PSTATE* p_state, token_pos_t *tokens, int num_tokens,
+	       U32 utf8)
+{
+    struct selector_set *set = p_state->selectors;
+    struct stack_elem *next = &p_state->stack_next;
+    struct stack_elem *parent;
+    int depth = p_state->stack_next_depth;
+    U32 parts = 0;
+    U32 first = 0, child = 0;
+    U32 match = 0;
+    int i;
+
+    for (i = 0; i < set->nparts; i++) {
+	if (sel_part_match(aTHX_ p_state, &set->parts[i], next->name,
+			   tokens, num_tokens, utf8))
+	    parts |= (U32)1 << i;
+	if (set->parts[i].child)
+	    child |= (U32)1 << i;
+    }
+    for (i = 0; i < set->count; i++)
+	first |= (U32)1 << set->handlers[i].first_part;
 
-    argspec = h->argspec ? SvPV(h->argspec, my_na) : "";
+    /* A part counts when the part before it counted for the parent,
+     * or for the parent or an ancestor after a descendant combinator.
+     * The masks of the parent say so without looking further up.
+     */
+    parent = depth ? &p_state->stack[depth - 1] : 0;
+    if (parent)
+	parts &= first | (child & ~first & parent->sel_parts << 1) |
+	    (~child & ~first & parent->sel_above << 1);
+    else
+	parts &= first;
+
+    for (i = 0; i < set->count; i++) {
+	if (parts & ((U32)1 << set->handlers[i].last_part))
+	    match |= (U32)1 << i;
+    }
+    next->sel_parts = parts;
+    next->sel_above = parts;
+    next->sel_match = match;
+    next->sel_inside = match;
+    if (parent) {
+	next->sel_above |= parent->sel_above;
+	next->sel_inside |= parent->sel_inside;
+    }
+}
+
+static struct p_handler*
+selector_handler(PSTATE* p_state, event_id_t event)
+{
+    /* the first selector handler for the event that matches */
+    struct selector_set *set = p_state->selectors;
+    U32 match;
+    int i;
+
+    if (!p_state->stack_next.name && event != E_TEXT)
+	return 0;
+    switch (event) {
+    case E_START:
+	match = p_state->stack_next.sel_match;
+	break;
+    case E_END:
+	if (p_state->stack_next_depth < 0)
+	    return 0;
+	match = p_state->stack[p_state->stack_next_depth].sel_match;
+	break;
+    case E_TEXT:
+	if (!p_state->stack_depth)
+	    return 0;
+	match = p_state->stack[p_state->stack_depth - 1].sel_inside;
+	break;
+    default:
+	return 0;
+    }
+
+    for (i = 0; match && i < set->count; i++) {
+	if ((match & ((U32)1 << i)) && set->handlers[i].event == event &&
+	    set->handlers[i].h.cb)
+	    return &set->handlers[i].h;
+    }
+    return 0;
+}
+
+static void
+stack_prepare(pTHX_ PSTATE* p_state, event_id_t event,
+	      token_pos_t *tokens, int num_tokens, U32 utf8)
+{
+    /* Work out how a start, end or element event changes the stack.
+     * The change is made by stack_update() right before the event is
+     * reported or ignored, so that the pending text flushed first
+     * still sees the stack as it was.
+     */
+    struct stack_elem *next = &p_state->stack_next;
+    SV* name;
+    IV flags;
+    int depth;
+
+    next->name = 0;
+    if (!p_state->track_stack)
+	return;
+    if (event != E_START && event != E_END && event != E_ELEMENT)
+	return;
+
+    name = stack_intern(aTHX_ p_state,
+			event_tagname(aTHX_ p_state, tokens, utf8));
+    next->name = name;
+
+    if (event == E_END) {
+	for (depth = p_state->stack_depth - 1; depth >= 0; depth--) {
+	    if (p_state->stack[depth].name == name)
+		break;
+	}
+	p_state->stack_next_depth = depth;
+	return;
+    }
+
+    /* start tags that imply the end of the current element */
+    depth = p_state->stack_depth;
+    flags = p_state->xml_mode ? 0 : SvIVX(name);
+    while (depth && (flags & ELEM_CLOSES_MASK)) {
+	IV top = SvIVX(p_state->stack[depth - 1].name);
+	if (!((top >> 15) & flags & ELEM_CLOSES_MASK))
+	    break;
+	depth--;
+    }
+    p_state->stack_next_depth = depth;
+
+    next->sel_parts = next->sel_above = next->sel_match = next->sel_inside = 0;
+    if (p_state->selectors)
+	selector_match(aTHX_ p_state, tokens, num_tokens, utf8);
+}
+
+static void
+stack_update(PSTATE* p_state, event_id_t event)
+{
+    struct stack_elem *next = &p_state->stack_next;
+    int depth = p_state->stack_next_depth;
+
+    if (!next->name ||
+	(event != E_START && event != E_END && event != E_ELEMENT))
+	return;
+
+    if (event == E_END) {
+	if (depth >= 0 && depth < p_state->stack_depth &&
+	    p_state->stack[depth].name == next->name)
+	{
+	    /* elements still open inside it are closed implicitly; the
+	     * element itself is popped at the next event
+	     */
+	    p_state->stack_depth = depth + 1;
+	    p_state->stack_self = 1;
+	    p_state->stack_pop_pending = 1;
+	}
+	next->name = 0;
+	return;
+    }
+
+    if (depth > p_state->stack_depth)
+	depth = p_state->stack_depth;
+    if (depth == p_state->stack_max) {
+	p_state->stack_max = p_state->stack_max * 2 + 16;
+	Renew(p_state->stack, p_state->stack_max, struct stack_elem);
+    }
+    p_state->stack[depth] = *next;
+    p_state->stack_depth = depth + 1;
+    p_state->stack_self = 1;
+    if (event == E_ELEMENT ||
+	(!p_state->xml_mode && (SvIVX(next->name) & ELEM_VOID)))
+	p_state->stack_pop_pending = 1;
+    next->name = 0;
+}
+
+static bool
+element_wanted(PSTATE* p_state, token_pos_t *tokens, U32 utf8)
+{
+    /* Is there a handler for element events of this tag?  Tags that
+     * ignore_tags or report_tags filter out are not fused, as the
+     * text inside them is still to be reported.
+     */
+    dTHX;
+    SV* tagname;
+
+    if (!p_state->handlers[E_ELEMENT].cb && !p_state->tag_handlers[E_ELEMENT])
+	return 0;
+    if (p_state->event_output)
+	return 0;  /* the stream has the start and end tags */
+    if (p_state->rewrite_output &&
+	(p_state->sanitize_tags || p_state->serialize))
+	return 0;
+    if (!p_state->ignore_tags && !p_state->report_tags &&
+	!p_state->tag_handlers[E_ELEMENT])
+	return 1;
+
+    tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+    if (p_state->ignore_tags &&
+	hv_exists_ent(p_state->ignore_tags, tagname, 0))
+	return 0;
+    if (p_state->report_tags &&
+	!hv_exists_ent(p_state->report_tags, tagname, 0))
+	return 0;
+    return p_state->handlers[E_ELEMENT].cb ||
+	(p_state->tag_handlers[E_ELEMENT] &&
+	 hv_exists_ent(p_state->tag_handlers[E_ELEMENT], tagname, 0));
+}
+
+/*
+ * Links.
+ *
+ *   attr_table_compile() - makes the tables for link_elements and textify
+ *   start_links()        - the link attributes of a start tag
+ */
+
+static SV*
+attr_list_compile(pTHX_ SV* val, const char *what)
+{
+    /* an attribute name or array of them as a length prefixed list,
+     * with their count in the IV slot
+     */
+    SV* list = sv_2mortal(newSVpvn("", 0));  /* in case we croak */
+    AV* av = 0;
+    I32 n = 1;
+    I32 i;
+
+    SvUPGRADE(list, SVt_PVIV);
+    SvIV_set(list, 0);
+    if (SvROK(val)) {
+	if (SvTYPE(SvRV(val)) != SVt_PVAV)
+	    croak("Attribute lists must be plain scalars and arrays");
+	av = (AV*)SvRV(val);
+	n = av_len(av) + 1;
+    }
+    for (i = 0; i < n; i++) {
+	SV** svp = av ? av_fetch(av, i, 0) : &val;
+	STRLEN len;
+	char *name;
+	char c;
+	if (!svp || !SvOK(*svp))
+	    continue;
+	name = SvPV(*svp, len);
+	if (!len || len > 255)
+	    croak("Bad attribute name '%s' in %s", name, what);
+	c = (char)len;
+	sv_catpvn(list, &c, 1);
+	sv_catpvn(list, name, len);
+	SvIV_set(list, SvIVX(list) + 1);
+    }
+    return SvREFCNT_inc(list);
+}
+
+EXTERN HV*
+attr_table_compile(pTHX_ SV* table, const char *what)
+{
+    /* tag name => attribute name or array of them, as in
+     * %HTML::Tagset::linkElements.  The names of each tag become a
+     * list made by attr_list_compile().
+     */
+    HV* src;
+    HV* hv;
+    HE* he;
+
+    if (!SvROK(table) || SvTYPE(SvRV(table)) != SVt_PVHV)
+	croak("%s must be given as a hash reference", what);
+    src = (HV*)SvRV(table);
+    hv = newHV();
+    sv_2mortal((SV*)hv);  /* in case we croak */
+
+    hv_iterinit(src);
+    while ((he = hv_iternext(src))) {
+	hv_store_ent(hv, hv_iterkeysv(he),
+		     attr_list_compile(aTHX_ HeVAL(he), what), 0);
+    }
+    return (HV*)SvREFCNT_inc(hv);
+}
+
+static int
+start_links(pTHX_ PSTATE* p_state, token_pos_t *tokens, int num_tokens,
+	    U32 utf8, AV* out)
+{
+    /* counts the attributes link_elements lists for the tag.  If out
+     * is given, (name, url) pairs are pushed on it as well; the url is
+     * trimmed and made absolute if there is a base.
+     */
+    HE* he;
+    SV* list;
+    SV* base;
+    char *s;
+    IV n;
+    int i;
+    int count = 0;
+    bool is_base;
+
+    if (!p_state->link_elements)
+	return 0;
+    he = hv_fetch_ent(p_state->link_elements,
+		      event_tagname(aTHX_ p_state, tokens, utf8), 0, 0);
+    if (!he)
+	return 0;
+    list = HeVAL(he);
+
+    base = p_state->link_doc_base ? p_state->link_doc_base
+				  : p_state->link_base;
+    is_base = out && p_state->link_base_tag && !p_state->link_doc_base &&
+	tokens[0].end - tokens[0].beg == 4 &&
+	strnEQx(tokens[0].beg, "base", 4, !CASE_SENSITIVE(p_state));
+
+    for (s = SvPVX(list), n = SvIVX(list); n--; s += (unsigned char)*s + 1) {
+	STRLEN len = (unsigned char)*s;
+	SV* val;
+	SV* url;
+	char *beg, *end;
+	STRLEN val_len;
+
+	for (i = 1; i < num_tokens; i += 2) {
+	    if ((STRLEN)(tokens[i].end - tokens[i].beg) == len &&
+		strnEQx(tokens[i].beg, s + 1, len, !CASE_SENSITIVE(p_state)))
+		break;
+	}
+	if (i >= num_tokens)
+	    continue;
+	count++;
+	if (!out)
+	    continue;
+
+	val = attr_value(aTHX_ p_state, &tokens[i], &tokens[i+1], utf8);
+	beg = SvPV(val, val_len);
+	end = beg + val_len;
+	while (beg < end && isSPACE(*beg))
+	    beg++;
+	while (end > beg && isSPACE(end[-1]))
+	    end--;
+
+	if (base) {
+	    SV* esc = newSVpvn("", 0);
+	    uri_escape_cat(aTHX_ esc, beg, end - beg, SvUTF8(val));
+	    url = newSVpvn("", 0);
+	    uri_resolve(aTHX_ url, SvPVX(esc), SvCUR(esc),
+			SvPVX(base), SvCUR(base));
+	    SvREFCNT_dec(esc);
+	}
+	else {
+	    url = newSVpvn(beg, end - beg);
+	    if (SvUTF8(val))
+		SvUTF8_on(url);
+	}
+	SvREFCNT_dec(val);
+
+	if (is_base && len == 4 && strnEQ(s + 1, "href", 4)) {
+	    /* the first <base href> applies to the rest of the document */
+	    p_state->link_doc_base = newSVpvn("", 0);
+	    if (base)
+		sv_setsv(p_state->link_doc_base, url);
+	    else
+		uri_escape_cat(aTHX_ p_state->link_doc_base,
+			       SvPVX(url), SvCUR(url), SvUTF8(url));
+	    is_base = 0;
+	}
+
+	av_push(out, newSVpvn(s + 1, len));
+	av_push(out, url);
+    }
+    return count;
+}
+
+/*
+ * The head_scan mode does what HTML::HeadParser does with its start,
+ * end and text handlers, without calling out to Perl.
+ *
+ *   head_event() - looks at a start tag, end tag or text
+ *   head_flush() - the <title> is done
+ */
+
+#define HEAD_TITLE 1
+#define HEAD_OTHER 2
+
+static STRLEN
+head_space(pTHX_ const char *s, const char *e, bool utf8)
+{
+    /* the length of the \s char at s, or 0 */
+    if (isSPACE(*s))
+	return 1;
+#ifdef isSPACE_utf8_safe
+    if (utf8 && !UTF8_IS_INVARIANT(*s) && isSPACE_utf8_safe((U8*)s, (U8*)e))
+	return UTF8SKIP(s);
+#endif
+    return 0;
+}
+
+static void
+head_squash(pTHX_ SV* sv, bool collapse)
+{
+    /* s/^\s+//; s/\s+$//; and with collapse also s/\s+/ /g */
+    STRLEN len;
+    char *start = SvPV_force(sv, len);
+    char *s = start;
+    char *e = s + len;
+    char *d = s;
+    bool utf8 = SvUTF8(sv) != 0;
+
+    while (s < e) {
+	char *run = s;
+	STRLEN n;
+	while (s < e && (n = head_space(aTHX_ s, e, utf8)))
+	    s += n;
+	if (s == e)
+	    break;
+	if (run != s && d != start) {
+	    if (collapse)
+		*d++ = ' ';
+	    else {
+		Move(run, d, s - run, char);
+		d += s - run;
+	    }
+	}
+	n = utf8 ? UTF8SKIP(s) : 1;
+	if (n > (STRLEN)(e - s))
+	    n = e - s;
+	Move(s, d, n, char);
+	d += n;
+	s += n;
+    }
+    *d = '\0';
+    SvCUR_set(sv, d - start);
+}
+
+static void
+head_push(pTHX_ PSTATE* p_state, SV* name, SV* value)
+{
+    if (!p_state->head_fields)
+	p_state->head_fields = newAV();
+    av_push(p_state->head_fields, name);
+    av_push(p_state->head_fields, value ? value : newSV(0));
+}
+
+static SV*
+head_attr(pTHX_ PSTATE* p_state, token_pos_t *tokens, int num_tokens,
+	  U32 utf8, const char *name)
+{
+    /* like $attr->{$name}, 0 if it does not exist */
+    STRLEN len = strlen(name);
+    int i;
+    for (i = 1; i < num_tokens; i += 2) {
+	if ((STRLEN)(tokens[i].end - tokens[i].beg) == len &&
+	    strnEQx(tokens[i].beg, name, len, !CASE_SENSITIVE(p_state)))
+	    return attr_value(aTHX_ p_state, &tokens[i], &tokens[i+1], utf8);
+    }
+    return 0;
+}
+
+static void
+head_flush(pTHX_ PSTATE* p_state)
+{
+    if (p_state->head_tag == HEAD_TITLE) {
+	SV* text = newSVsv(p_state->head_text);
+	bool decoded = 0;
+	head_squash(aTHX_ text, 1);
+#ifdef UNICODE_HTML_PARSER
+	if (p_state->utf8_mode)
+	    decoded = sv_utf8_decode(text);
+#endif
+	decode_entities(aTHX_ text, p_state->entity2char, 0);
+#ifdef UNICODE_HTML_PARSER
+	if (decoded)
+	    sv_utf8_encode(text);
+#endif
+	head_push(aTHX_ p_state, newSVpvs("Title"), text);
+    }
+    p_state->head_tag = 0;
+    sv_setpvn(p_state->head_text, "", 0);
+}
+
+static void
+head_event(pTHX_ PSTATE* p_state, event_id_t event, char *beg, char *end,
+	   U32 utf8, token_pos_t *tokens, int num_tokens)
+{
+    SV* tagname;
+    char *name;
+    STRLEN len;
+
+    if (!p_state->head_text)
+	p_state->head_text = newSVpvn("", 0);
+
+    if (event == E_TEXT) {
+	char *s;
+	if (!p_state->head_text_seen) {
+	    /* drop Unicode BOM if found */
+	    if ((utf8 || p_state->utf8_mode) && end - beg >= 3 &&
+		strnEQ(beg, "\xEF\xBB\xBF", 3))
+		beg += 3;
+	    p_state->head_text_seen = 1;
+	}
+	if (!p_state->head_tag) {
+	    /* normal text means start of body */
+	    for (s = beg; s < end; ) {
+		STRLEN n = head_space(aTHX_ s, end, utf8);
+		if (!n) {
+		    p_state->eof = 1;
+		    break;
+		}
+		s += n;
+	    }
+	    return;
+	}
+	if (p_state->head_tag != HEAD_TITLE)
+	    return;
+#ifdef UNICODE_HTML_PARSER
+	if (utf8 && !SvUTF8(p_state->head_text))
+	    sv_utf8_upgrade(p_state->head_text);
+	if (!utf8 && SvUTF8(p_state->head_text)) {
+	    SV *tmp = sv_2mortal(newSVpvn(beg, end - beg));
+	    sv_utf8_upgrade(tmp);
+	    sv_catsv(p_state->head_text, tmp);
+	    return;
+	}
+#endif
+	sv_catpvn(p_state->head_text, beg, end - beg);
+	return;
+    }
+
+    if (p_state->head_tag)
+	head_flush(aTHX_ p_state);
+
+    tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+    name = SvPV(tagname, len);
+#define TAG_IS(str) (len == sizeof(str) - 1 && strnEQ(name, str, len))
+
+    if (event == E_END) {
+	if (TAG_IS("head"))
+	    p_state->eof = 1;
+	return;
+    }
+
+    if (TAG_IS("meta")) {
+	SV* key = head_attr(aTHX_ p_state, tokens, num_tokens, utf8,
+			    "http-equiv");
+	char *s;
+	STRLEN key_len, i;
+	if (!key || !SvCUR(key)) {
+	    SV* val = head_attr(aTHX_ p_state, tokens, num_tokens, utf8, "name");
+	    SvREFCNT_dec(key);
+	    key = 0;
+	    if (val && SvTRUE(val))
+		key = newSVpvs("X-Meta-");
+	    else {
+		/* Open Graph and RDFa <meta property="..."> */
+		SvREFCNT_dec(val);
+		val = head_attr(aTHX_ p_state, tokens, num_tokens, utf8,
+				"property");
+		if (val && SvTRUE(val))
+		    key = newSVpvs("X-Meta-Property-");
+	    }
+	    if (key) {
+		STRLEN prefix_len = SvCUR(key);
+		sv_catsv(key, val);
+		SvREFCNT_dec(val);
+		/* \u */
+		s = SvPVX(key) + prefix_len;
+		if (UTF8_IS_INVARIANT(*s))
+		    *s = toUPPER(*s);
+#ifdef toTITLE_utf8_safe
+		else if (SvUTF8(key)) {
+		    U8 buf[UTF8_MAXBYTES_CASE + 1];
+		    STRLEN buf_len;
+		    toTITLE_utf8_safe((U8*)s, (U8*)SvEND(key), buf, &buf_len);
+		    sv_insert(key, prefix_len, UTF8SKIP(s), (char*)buf, buf_len);
+		}
+#endif
+	    }
+	    else {
+		SvREFCNT_dec(val);
+		val = head_attr(aTHX_ p_state, tokens, num_tokens, utf8,
+				"charset");
+		if (val && SvTRUE(val))  /* HTML 5 <meta charset="..."> */
+		    head_push(aTHX_ p_state, newSVpvs("X-Meta-Charset"), val);
+		else
+		    SvREFCNT_dec(val);
+		return;
+	    }
+	}
+	s = SvPV_force(key, key_len);
+	for (i = 0; i < key_len; i++) {
+	    if (s[i] == ':')
+		s[i] = '-';
+	}
+	head_push(aTHX_ p_state, key,
+		  head_attr(aTHX_ p_state, tokens, num_tokens, utf8, "content"));
+    }
+    else if (TAG_IS("base")) {
+	SV* href = head_attr(aTHX_ p_state, tokens, num_tokens, utf8, "href");
+	if (href) {
+	    head_squash(aTHX_ href, 0);
+	    head_push(aTHX_ p_state, newSVpvs("Content-Base"), href);
+	}
+    }
+    else if (TAG_IS("isindex")) {
+	SV* prompt = head_attr(aTHX_ p_state, tokens, num_tokens, utf8,
+			       "prompt");
+	if (!prompt || !SvTRUE(prompt)) {
+	    SvREFCNT_dec(prompt);
+	    prompt = newSVpvs("?");
+	}
+	head_push(aTHX_ p_state, newSVpvs("Isindex"), prompt);
+    }
+    else if (TAG_IS("title")) {
+	p_state->head_tag = HEAD_TITLE;
+    }
+    else if (TAG_IS("noscript") || TAG_IS("object") || TAG_IS("command")) {
+	p_state->head_tag = HEAD_OTHER;
+    }
+    else if (TAG_IS("link")) {
+	/* <link href="http:..." rel="xxx" rev="xxx" title="xxx"> */
+	HV* attr;
+	AV* names;
+	SV* href;
+	SV* val;
+	HE* he;
+	int i;
+
+	attr = (HV*)sv_2mortal((SV*)newHV());
+	for (i = 1; i < num_tokens; i += 2) {
+	    SV* attrname = sv_2mortal(newSVpvn(tokens[i].beg,
+					       tokens[i].end - tokens[i].beg));
+	    if (utf8)
+		SvUTF8_on(attrname);
+	    if (!CASE_SENSITIVE(p_state))
+		sv_lower(aTHX_ attrname);
+	    if (!hv_exists_ent(attr, attrname, 0))
+		hv_store_ent(attr, attrname,
+			     attr_value(aTHX_ p_state, &tokens[i],
+					&tokens[i+1], utf8), 0);
+	}
+	href = hv_delete(attr, "href", 4, 0);
+	if (!href)
+	    return;
+	val = newSVpvs("<");
+	href = sv_mortalcopy(href);
+	head_squash(aTHX_ href, 0);
+	sv_catsv(val, href);
+	sv_catpvs(val, ">");
+
+	names = (AV*)sv_2mortal((SV*)newAV());
+	hv_iterinit(attr);
+	while ((he = hv_iternext(attr))) {
+	    SV* key = hv_iterkeysv(he);
+	    if (SvCUR(key) == 1 && *SvPVX(key) == '/')
+		continue;  /* XHTML junk */
+	    av_push(names, SvREFCNT_inc(key));
+	}
+	if (av_len(names) > 0)
+	    sortsv(AvARRAY(names), av_len(names) + 1, Perl_sv_cmp);
+	for (i = 0; i <= av_len(names); i++) {
+	    SV* key = AvARRAY(names)[i];
+	    sv_catpvs(val, "; ");
+	    sv_catsv(val, key);
+	    sv_catpvs(val, "=\"");
+	    sv_catsv(val, HeVAL(hv_fetch_ent(attr, key, 0, 0)));
+	    sv_catpvs(val, "\"");
+	}
+	head_push(aTHX_ p_state, newSVpvs("Link"), val);
+    }
+    else if (!TAG_IS("head") && !TAG_IS("html")) {
+	/* stop parsing */
+	p_state->eof = 1;
+    }
+#undef TAG_IS
+}
+
+/*
+ * The text_output mode writes the text of the document to a buffer or
+ * file handle, without calling out to Perl.
+ *
+ *   text_event() - looks at a start tag, end tag or text
+ *   text_emit()  - writes text, collapsing whitespace if asked to
+ */
+
+#define TEXT_SPACE    1
+#define TEXT_NEWLINE  2
+
+/* tags that break the text; sorted for bsearch */
+static const struct text_tag {
+    const char *name;
+    int brk;
+} text_tags[] = {
+    {"address",    TEXT_NEWLINE},
+    {"article",    TEXT_NEWLINE},
+    {"aside",      TEXT_NEWLINE},
+    {"blockquote", TEXT_NEWLINE},
+    {"body",       TEXT_NEWLINE},
+    {"br",         TEXT_NEWLINE},
+    {"caption",    TEXT_NEWLINE},
+    {"center",     TEXT_NEWLINE},
+    {"dd",         TEXT_NEWLINE},
+    {"details",    TEXT_NEWLINE},
+    {"dialog",     TEXT_NEWLINE},
+    {"dir",        TEXT_NEWLINE},
+    {"div",        TEXT_NEWLINE},
+    {"dl",         TEXT_NEWLINE},
+    {"dt",         TEXT_NEWLINE},
+    {"fieldset",   TEXT_NEWLINE},
+    {"figcaption", TEXT_NEWLINE},
+    {"figure",     TEXT_NEWLINE},
+    {"footer",     TEXT_NEWLINE},
+    {"form",       TEXT_NEWLINE},
+    {"frameset",   TEXT_NEWLINE},
+    {"h1",         TEXT_NEWLINE},
+    {"h2",         TEXT_NEWLINE},
+    {"h3",         TEXT_NEWLINE},
+    {"h4",         TEXT_NEWLINE},
+    {"h5",         TEXT_NEWLINE},
+    {"h6",         TEXT_NEWLINE},
+    {"header",     TEXT_NEWLINE},
+    {"hgroup",     TEXT_NEWLINE},
+    {"hr",         TEXT_NEWLINE},
+    {"html",       TEXT_NEWLINE},
+    {"li",         TEXT_NEWLINE},
+    {"main",       TEXT_NEWLINE},
+    {"menu",       TEXT_NEWLINE},
+    {"nav",        TEXT_NEWLINE},
+    {"ol",         TEXT_NEWLINE},
+    {"p",          TEXT_NEWLINE},
+    {"pre",        TEXT_NEWLINE},
+    {"section",    TEXT_NEWLINE},
+    {"summary",    TEXT_NEWLINE},
+    {"table",      TEXT_NEWLINE},
+    {"tbody",      TEXT_NEWLINE},
+    {"td",         TEXT_SPACE},
+    {"tfoot",      TEXT_NEWLINE},
+    {"th",         TEXT_SPACE},
+    {"thead",      TEXT_NEWLINE},
+    {"title",      TEXT_NEWLINE},
+    {"tr",         TEXT_NEWLINE},
+    {"ul",         TEXT_NEWLINE},
+};
+
+static int
+text_tag_cmp(const void *key, const void *elem)
+{
+    return strcmp((const char*)key, ((const struct text_tag*)elem)->name);
+}
+
+static void
+output_put(pTHX_ SV* out, const char *what, const char *s, STRLEN len,
+	   bool utf8)
+{
+    /* appends to the scalar referenced by 'out' or prints to the file
+     * handle it is
+     */
+    if (!len)
+	return;
+    if (SvROK(out) && !SvOBJECT(SvRV(out)) && SvTYPE(SvRV(out)) <= SVt_PVMG) {
+	out = SvRV(out);
+	if (!SvOK(out))
+	    sv_setpvn(out, "", 0);
+	sv_catpvn_flags(out, s, len, utf8 ? SV_CATUTF8 : SV_CATBYTES);
+    }
+    else {
+	IO* io = sv_2io(out);
+	if (!IoOFP(io) || PerlIO_write(IoOFP(io), s, len) != (SSize_t)len)
+	    croak("Can't write %s output", what);
+    }
+}
+
+static void
+text_put(pTHX_ PSTATE* p_state, const char *s, STRLEN len, bool utf8)
+{
+    output_put(aTHX_ p_state->text_output, "text", s, len, utf8);
+}
+
+static void
+text_emit(pTHX_ PSTATE* p_state, const char *s, STRLEN len, bool utf8)
+{
+    const char *end = s + len;
+
+    if (!p_state->text_collapse) {
+	text_put(aTHX_ p_state, s, len, utf8);
+	return;
+    }
+    while (s < end) {
+	const char *word = s;
+	STRLEN n;
+	while (s < end && (n = head_space(aTHX_ s, end, utf8)))
+	    s += n;
+	if (s > word && !p_state->text_pending)
+	    p_state->text_pending = TEXT_SPACE;
+	if (s == end)
+	    break;
+	word = s;
+	while (s < end && !head_space(aTHX_ s, end, utf8))
+	    s += utf8 ? UTF8SKIP(s) : 1;
+	if (s > end)
+	    s = end;
+	if (p_state->text_pending && p_state->text_started)
+	    text_put(aTHX_ p_state,
+		     p_state->text_pending == TEXT_NEWLINE ? "\n" : " ", 1, 0);
+	p_state->text_pending = 0;
+	text_put(aTHX_ p_state, word, s - word, utf8);
+	p_state->text_started = 1;
+    }
+}
+
+static void
+text_break(pTHX_ PSTATE* p_state, int brk)
+{
+    if (!p_state->text_collapse)
+	text_put(aTHX_ p_state, brk == TEXT_NEWLINE ? "\n" : " ", 1, 0);
+    else if (brk > p_state->text_pending)
+	p_state->text_pending = brk;
+}
+
+static SV*
+text_decoded(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8)
+{
+    /* the text with entities decoded, as dtext has it; lives in
+     * p_state->text_buf
+     */
+    SV* text;
+    if (!p_state->text_buf)
+	p_state->text_buf = newSVpvn("", 0);
+    text = p_state->text_buf;
+    sv_setpvn(text, beg, end - beg);
+    if (utf8)
+	SvUTF8_on(text);
+    else
+	SvUTF8_off(text);
+#ifdef UNICODE_HTML_PARSER
+    if (p_state->utf8_mode) {
+	sv_utf8_decode(text);
+	sv_utf8_upgrade(text);
+    }
+#endif
+    decode_entities(aTHX_ text, p_state->entity2char, 1);
+    if (p_state->utf8_mode)
+	SvUTF8_off(text);
+    return text;
+}
+
+static void
+text_event(pTHX_ PSTATE* p_state, event_id_t event, char *beg, char *end,
+	   U32 utf8, token_pos_t *tokens, int num_tokens)
+{
+    SV* tagname;
+    char *name;
+    STRLEN len;
+    const struct text_tag *tt;
+
+    if (event == E_TEXT) {
+	SV* text;
+	if (p_state->text_skip)
+	    return;
+	if (p_state->is_cdata) {
+	    text_emit(aTHX_ p_state, beg, end - beg, utf8);
+	    return;
+	}
+	text = text_decoded(aTHX_ p_state, beg, end, utf8);
+	text_emit(aTHX_ p_state, SvPVX(text), SvCUR(text), SvUTF8(text));
+	return;
+    }
+
+    tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+    name = SvPV(tagname, len);
+
+    if ((len == 6 && strEQ(name, "script")) ||
+	(len == 5 && strEQ(name, "style")))
+    {
+	p_state->text_skip = (event == E_START);
+	return;
+    }
+    if (p_state->text_skip)
+	return;
+
+    tt = (const struct text_tag*)
+	bsearch(name, text_tags, sizeof(text_tags) / sizeof(text_tags[0]),
+		sizeof(text_tags[0]), text_tag_cmp);
+    if (tt)
+	text_break(aTHX_ p_state, tt->brk);
+
+    if (event == E_START) {
+	/* img alt and the like */
+	HE* he = 0;
+	const char *attr = "alt";
+	STRLEN attr_len = 3;
+	int i;
+
+	if (p_state->textify) {
+	    he = hv_fetch_ent(p_state->textify, tagname, 0, 0);
+	    if (!he || !SvIVX(HeVAL(he)))
+		return;
+	    attr = SvPVX(HeVAL(he)) + 1;
+	    attr_len = (unsigned char)SvPVX(HeVAL(he))[0];
+	}
+	else if (!(len == 3 && strEQ(name, "img")) &&
+		 !(len == 6 && strEQ(name, "applet")))
+	{
+	    return;
+	}
+
+	for (i = 1; i < num_tokens; i += 2) {
+	    if ((STRLEN)(tokens[i].end - tokens[i].beg) == attr_len &&
+		strnEQx(tokens[i].beg, attr, attr_len, !CASE_SENSITIVE(p_state)))
+	    {
+		SV* val = attr_value(aTHX_ p_state, &tokens[i], &tokens[i+1],
+				     utf8);
+		STRLEN val_len;
+		char *v = SvPV(val, val_len);
+		text_emit(aTHX_ p_state, v, val_len, SvUTF8(val));
+		SvREFCNT_dec(val);
+		return;
+	    }
+	}
+	/* "[IMG]" if there is no such attribute */
+	{
+	    SV* label = newSVpvs("[");
+	    char *s;
+	    sv_catsv(label, tagname);
+	    sv_catpvs(label, "]");
+	    for (s = SvPVX(label); *s; s++)
+		*s = toUPPER(*s);
+	    text_emit(aTHX_ p_state, SvPVX(label), SvCUR(label), SvUTF8(label));
+	    SvREFCNT_dec(label);
+	}
+    }
+}
+
+/*
+ * The rewrite_output mode copies the document to a buffer or file
+ * handle while it is parsed.  Events given to a handler are left for
+ * it to write with $p->rewrite_print; the tags in rewrite_tags are
+ * edited on the way through.
+ *
+ *   rewrite_tags_compile() - checks and compiles the rewrite_tags table
+ *   rewrite_event()        - looks at an event before the tag filters
+ *   rewrite_tag()          - writes a start or end tag with its edits
+ */
+
+/* slots of the array the compiled edits of a tag are kept in */
+#define REWRITE_RENAME     0  /* new tag name */
+#define REWRITE_DROP       1  /* REWRITE_DROP_TAG or REWRITE_DROP_ELEMENT */
+#define REWRITE_DROP_ATTR  2  /* names of attributes to leave out */
+#define REWRITE_SET_ATTR   3  /* name, '="value"' pairs; values escaped */
+
+#define REWRITE_DROP_TAG      1
+#define REWRITE_DROP_ELEMENT  2
+
+static SV*
+rewrite_name(pTHX_ SV* name)
+{
+    /* a copy of an attribute name, checked */
+    STRLEN len = 0;
+    char *s = SvOK(name) ? SvPV(name, len) : "";
+    if (!len || len > 255)
+	croak("Bad attribute name '%s' in %s", s, "rewrite_tags");
+    return newSVsv(name);
+}
+
+static AV*
+rewrite_names(pTHX_ SV* val)
+{
+    AV* names = newAV();
+    AV* av = 0;
+    I32 n = 1;
+    I32 i;
+
+    sv_2mortal((SV*)names);
+    if (SvROK(val)) {
+	if (SvTYPE(SvRV(val)) != SVt_PVAV)
+	    croak("Attribute lists must be plain scalars and arrays");
+	av = (AV*)SvRV(val);
+	n = av_len(av) + 1;
+    }
+    for (i = 0; i < n; i++) {
+	SV** svp = av ? av_fetch(av, i, 0) : &val;
+	if (svp && SvOK(*svp))
+	    av_push(names, rewrite_name(aTHX_ *svp));
+    }
+    return (AV*)SvREFCNT_inc(names);
+}
+
+static SV*
+rewrite_value(pTHX_ SV* val)
+{
+    /* the text following the attribute name; nothing for undef */
+    SV* text = newSVpvs("=\"");
+    STRLEN len;
+    char *s;
+    char *end;
+
+    if (!SvOK(val)) {
+	sv_setpvn(text, "", 0);
+	return text;
+    }
+    s = SvPV(val, len);
+    end = s + len;
+    if (SvUTF8(val))
+	SvUTF8_on(text);
+    while (s < end) {
+	char *t = s;
+	while (t < end && *t != '&' && *t != '"' && *t != '<' && *t != '>')
+	    t++;
+	sv_catpvn(text, s, t - s);
+	if (t == end)
+	    break;
+	switch (*t) {
+	case '&': sv_catpvs(text, "&amp;");  break;
+	case '"': sv_catpvs(text, "&quot;"); break;
+	case '<': sv_catpvs(text, "&lt;");   break;
+	case '>': sv_catpvs(text, "&gt;");   break;
+	}
+	s = t + 1;
+    }
+    sv_catpvs(text, "\"");
+    return text;
+}
+
+EXTERN HV*
+rewrite_tags_compile(pTHX_ SV* table)
+{
+    /* tag name => { rename => $name, drop => "tag" or "element",
+     *               drop_attr => [...], set_attr => {...} }
+     */
+    HV* src;
+    HV* hv;
+    HE* he;
+
+    if (!SvROK(table) || SvTYPE(SvRV(table)) != SVt_PVHV)
+	croak("%s must be given as a hash reference", "rewrite_tags");
+    src = (HV*)SvRV(table);
+    hv = newHV();
+    sv_2mortal((SV*)hv);  /* in case we croak */
+
+    hv_iterinit(src);
+    while ((he = hv_iternext(src))) {
+	STRLEN tag_len;
+	char *tag = HePV(he, tag_len);
+	SV* val = HeVAL(he);
+	AV* edits;
+	HV* spec;
+	HE* e;
+
+	if (!SvROK(val) || SvTYPE(SvRV(val)) != SVt_PVHV)
+	    croak("Edits for '%s' must be given as a hash reference", tag);
+	spec = (HV*)SvRV(val);
+	edits = newAV();
+	hv_store_ent(hv, hv_iterkeysv(he), newRV_noinc((SV*)edits), 0);
+
+	hv_iterinit(spec);
+	while ((e = hv_iternext(spec))) {
+	    STRLEN len;
+	    char *key = HePV(e, len);
+	    val = HeVAL(e);
+
+	    if (strEQ(key, "rename")) {
+		char *name = SvOK(val) ? SvPV_nolen(val) : "";
+		if (!*name)
+		    croak("Bad rewrite edit '%s' for '%s'", key, tag);
+		av_store(edits, REWRITE_RENAME, newSVsv(val));
+	    }
+	    else if (strEQ(key, "drop")) {
+		char *how = SvOK(val) ? SvPV_nolen(val) : "";
+		IV drop;
+		if (strEQ(how, "tag"))
+		    drop = REWRITE_DROP_TAG;
+		else if (strEQ(how, "element"))
+		    drop = REWRITE_DROP_ELEMENT;
+		else
+		    croak("Bad rewrite edit '%s' for '%s'", key, tag);
+		av_store(edits, REWRITE_DROP, newSViv(drop));
+	    }
+	    else if (strEQ(key, "drop_attr")) {
+		av_store(edits, REWRITE_DROP_ATTR,
+			 newRV_noinc((SV*)rewrite_names(aTHX_ val)));
+	    }
+	    else if (strEQ(key, "set_attr")) {
+		/* a hash is done in name order; an array of pairs in the
+		 * order given
+		 */
+		AV* pairs = newAV();
+		AV* src_pairs;
+		I32 i;
+		av_store(edits, REWRITE_SET_ATTR, newRV_noinc((SV*)pairs));
+		if (SvROK(val) && SvTYPE(SvRV(val)) == SVt_PVHV) {
+		    HV* attr = (HV*)SvRV(val);
+		    HE* a;
+		    src_pairs = (AV*)sv_2mortal((SV*)newAV());
+		    hv_iterinit(attr);
+		    while ((a = hv_iternext(attr)))
+			av_push(src_pairs, newSVsv(hv_iterkeysv(a)));
+		    sortsv(AvARRAY(src_pairs), av_len(src_pairs) + 1,
+			   Perl_sv_cmp);
+		    for (i = 0; i <= av_len(src_pairs); i++) {
+			SV* name = *av_fetch(src_pairs, i, 0);
+			HE* v = hv_fetch_ent(attr, name, 0, 0);
+			av_push(pairs, rewrite_name(aTHX_ name));
+			av_push(pairs, rewrite_value(aTHX_ HeVAL(v)));
+		    }
+		}
+		else if (SvROK(val) && SvTYPE(SvRV(val)) == SVt_PVAV) {
+		    src_pairs = (AV*)SvRV(val);
+		    for (i = 0; i <= av_len(src_pairs); i += 2) {
+			SV** name = av_fetch(src_pairs, i, 0);
+			SV** v = av_fetch(src_pairs, i + 1, 0);
+			av_push(pairs,
+				rewrite_name(aTHX_ name ? *name : &PL_sv_undef));
+			av_push(pairs, rewrite_value(aTHX_ v ? *v : &PL_sv_undef));
+		    }
+		}
+		else
+		    croak("Bad rewrite edit '%s' for '%s'", key, tag);
+	    }
+	    else
+		croak("Bad rewrite edit '%s' for '%s'", key, tag);
+	}
+    }
+    return (HV*)SvREFCNT_inc(hv);
+}
+
+static void
+rewrite_put(pTHX_ PSTATE* p_state, const char *s, STRLEN len, bool utf8)
+{
+    output_put(aTHX_ p_state->rewrite_output, "rewrite", s, len, utf8);
+}
+
+static void
+rewrite_put_sv(pTHX_ PSTATE* p_state, SV* sv)
+{
+    STRLEN len;
+    char *s = SvPV(sv, len);
+    rewrite_put(aTHX_ p_state, s, len, SvUTF8(sv));
+}
+
+static SV**
+rewrite_slot(pTHX_ AV* edits, int slot)
+{
+    SV** svp = av_fetch(edits, slot, 0);
+    return (svp && SvOK(*svp)) ? svp : 0;
+}
+
+static int
+rewrite_attr_find(pTHX_ PSTATE* p_state, AV* list, int step,
+		  token_pos_t *name)
+{
+    /* index of the attribute 'name' in every step'th entry of list */
+    STRLEN len = name->end - name->beg;
+    I32 i;
+    for (i = 0; i <= av_len(list); i += step) {
+	SV* sv = *av_fetch(list, i, 0);
+	if (SvCUR(sv) == len &&
+	    strnEQx(name->beg, SvPVX(sv), len, !CASE_SENSITIVE(p_state)))
+	    return i;
+    }
+    return -1;
+}
+
+static void
+rewrite_tag(pTHX_ PSTATE* p_state, AV* edits, char *beg, char *end,
+	    U32 utf8, token_pos_t *tokens, int num_tokens)
+{
+    /* The tag is written in pieces; the text between the tokens that
+     * are edited is copied as is.
+     */
+    SV** rename = rewrite_slot(aTHX_ edits, REWRITE_RENAME);
+    SV** drop = rewrite_slot(aTHX_ edits, REWRITE_DROP_ATTR);
+    SV** set = rewrite_slot(aTHX_ edits, REWRITE_SET_ATTR);
+    AV* drop_attr = drop ? (AV*)SvRV(*drop) : 0;
+    AV* set_attr = set ? (AV*)SvRV(*set) : 0;
+    char *pos = beg;
+    char *prev_end;
+    char done_buf[32];
+    char *done = done_buf;
+    int n_set = set_attr ? (av_len(set_attr) + 1) / 2 : 0;
+    int i;
+
+    if (beg == end)
+	return;  /* implied end tag */
+
+    if (rename) {
+	rewrite_put(aTHX_ p_state, pos, tokens[0].beg - pos, utf8);
+	rewrite_put_sv(aTHX_ p_state, *rename);
+	pos = tokens[0].end;
+    }
+    prev_end = tokens[0].end;
+
+    /* which of set_attr have been written */
+    if (n_set > (int)sizeof(done_buf))
+	New(56, done, n_set, char);
+    if (n_set)
+	Zero(done, n_set, char);
+
+    for (i = 1; i + 1 < num_tokens; i += 2) {
+	token_pos_t *name = &tokens[i];
+	char *attr_end = tokens[i+1].beg ? tokens[i+1].end : name->end;
+	int j;
+
+	if (drop_attr && rewrite_attr_find(aTHX_ p_state, drop_attr, 1, name) >= 0) {
+	    /* the space in front of it goes too */
+	    rewrite_put(aTHX_ p_state, pos, prev_end - pos, utf8);
+	    pos = attr_end;
+	}
+	else if (set_attr &&
+		 (j = rewrite_attr_find(aTHX_ p_state, set_attr, 2, name)) >= 0)
+	{
+	    if (done[j / 2]) {
+		/* repeated attribute */
+		rewrite_put(aTHX_ p_state, pos, prev_end - pos, utf8);
+	    }
+	    else {
+		rewrite_put(aTHX_ p_state, pos, name->end - pos, utf8);
+		rewrite_put_sv(aTHX_ p_state, *av_fetch(set_attr, j + 1, 0));
+		done[j / 2] = 1;
+	    }
+	    pos = attr_end;
+	}
+	prev_end = attr_end;
+    }
+
+    if (set_attr) {
+	/* add the ones not there */
+	rewrite_put(aTHX_ p_state, pos, prev_end - pos, utf8);
+	pos = prev_end;
+	for (i = 0; i <= av_len(set_attr); i += 2) {
+	    if (done[i / 2])
+		continue;
+	    rewrite_put(aTHX_ p_state, " ", 1, 0);
+	    rewrite_put_sv(aTHX_ p_state, *av_fetch(set_attr, i, 0));
+	    rewrite_put_sv(aTHX_ p_state, *av_fetch(set_attr, i + 1, 0));
+	}
+    }
+    rewrite_put(aTHX_ p_state, pos, end - pos, utf8);
+    if (done != done_buf)
+	Safefree(done);
+}
+
+static void
+rewrite_drop_track(pTHX_ PSTATE* p_state, event_id_t event,
+		   token_pos_t *tokens, U32 utf8)
+{
+    /* follows the nesting of the element being dropped */
+    SV* tagname;
+    if (event != E_START && event != E_END && event != E_ELEMENT)
+	return;
+    tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+    if (!sv_eq(p_state->rewrite_dropping, tagname))
+	return;
+    if (event == E_START)
+	p_state->rewrite_drop_depth++;
+    else if (event == E_END && --p_state->rewrite_drop_depth == 0) {
+	SvREFCNT_dec(p_state->rewrite_dropping);
+	p_state->rewrite_dropping = 0;
+    }
+}
+
+static bool
+rewrite_drop_start(pTHX_ PSTATE* p_state, SV* tagname)
+{
+    /* starts dropping the element, unless it is void */
+    STRLEN len;
+    char *name = SvPV(tagname, len);
+    if (!p_state->xml_mode && (elem_flags(name, len) & ELEM_VOID))
+	return 0;
+    p_state->rewrite_dropping = newSVsv(tagname);
+    p_state->rewrite_drop_depth = 1;
+    return 1;
+}
+
+static bool
+rewrite_event(pTHX_ PSTATE* p_state, event_id_t event, char *beg, char *end,
+	      U32 utf8, token_pos_t *tokens, int num_tokens, SV* self)
+{
+    /* Deals with events inside a dropped element and with the tags
+     * that have edits.  Returns FALSE for the events that are to be
+     * reported or copied as usual.
+     */
+    SV* tagname;
+    HE* he;
+    SV** svp;
+    AV* edits;
+    SV** drop;
+
+    if (p_state->rewrite_dropping) {
+	rewrite_drop_track(aTHX_ p_state, event, tokens, utf8);
+	return 1;
+    }
+
+    if (!p_state->rewrite_tags ||
+	(event != E_START && event != E_END && event != E_ELEMENT))
+	return 0;
+
+    tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+    he = hv_fetch_ent(p_state->rewrite_tags, tagname, 0, 0);
+    if (he)
+	svp = &HeVAL(he);
+    else if (!(svp = hv_fetch(p_state->rewrite_tags, "*", 1, 0)))
+	return 0;
+    edits = (AV*)SvRV(*svp);
+    drop = rewrite_slot(aTHX_ edits, REWRITE_DROP);
+    if (event == E_ELEMENT && !(drop && SvIV(*drop) == REWRITE_DROP_ELEMENT))
+	return 0;  /* the element handler writes it */
+
+    if (drop && SvIV(*drop) == REWRITE_DROP_ELEMENT && event == E_START)
+	rewrite_drop_start(aTHX_ p_state, tagname);
+
+    if (PEND_TEXT_OK(p_state))
+	flush_pending_text(p_state, self);
+    if (!drop)
+	rewrite_tag(aTHX_ p_state, edits, beg, end, utf8, tokens, num_tokens);
+    return 1;
+}
+
+/*
+ * The sanitize mode is rewrite_output with allowlists.  Instead of
+ * being copied the document is written out again, with nothing but
+ * the allowed tags and attributes, entities encoded and the elements
+ * balanced.
+ *
+ *   sanitize_compile() - sets up the allowlists from the options
+ *   sanitize_event()   - writes the sanitized version of an event
+ *   sanitize_close()   - writes end tags for the open elements
+ */
+
+static const char * const sanitize_default_url_attrs[] = {
+    "href", "src", "cite", "action", "background", "longdesc", "poster",
+    "formaction", 0
+};
+static const char * const sanitize_default_schemes[] = {
+    "http", "https", "mailto", 0
+};
+static const char * const sanitize_default_drop[] = {
+    "script", "style", 0
+};
+
+static SV*
+sanitize_option(pTHX_ HV* opt, const char *key,
+		const char * const *defaults)
+{
+    /* the value of an option, or an array of the defaults */
+    SV** svp = hv_fetch(opt, key, strlen(key), 0);
+    AV* av;
+    int i;
+    if (svp && SvOK(*svp))
+	return *svp;
+    av = (AV*)sv_2mortal((SV*)newAV());
+    for (i = 0; defaults[i]; i++)
+	av_push(av, newSVpv(defaults[i], 0));
+    return sv_2mortal(newRV_inc((SV*)av));
+}
+
+EXTERN void
+sanitize_free(pTHX_ PSTATE* p_state)
+{
+    SvREFCNT_dec(p_state->sanitize_tags);
+    SvREFCNT_dec(p_state->sanitize_url_attrs);
+    SvREFCNT_dec(p_state->sanitize_schemes);
+    SvREFCNT_dec(p_state->sanitize_drop);
+    SvREFCNT_dec(p_state->sanitize_stack);
+    p_state->sanitize_tags = 0;
+    p_state->sanitize_url_attrs = 0;
+    p_state->sanitize_schemes = 0;
+    p_state->sanitize_drop = 0;
+    p_state->sanitize_stack = 0;
+}
+
+EXTERN void
+sanitize_compile(pTHX_ PSTATE* p_state, SV* options)
+{
+    HV* opt;
+    HE* he;
+    SV* drop;
+    HV* tags;
+    SV* url_attrs;
+    SV* schemes;
+    HV* drop_hv;
+    I32 i;
+
+    if (!SvROK(options) || SvTYPE(SvRV(options)) != SVt_PVHV)
+	croak("%s must be given as a hash reference", "sanitize");
+    opt = (HV*)SvRV(options);
+    hv_iterinit(opt);
+    while ((he = hv_iternext(opt))) {
+	char *key = HePV(he, PL_na);
+	if (strNE(key, "tags") && strNE(key, "url_attrs") &&
+	    strNE(key, "url_schemes") && strNE(key, "drop_elements"))
+	    croak("Bad sanitize option '%s'", key);
+    }
+    if (!hv_exists(opt, "tags", 4))
+	croak("Bad sanitize option '%s'", "tags");
+
+    tags = attr_table_compile(aTHX_ *hv_fetch(opt, "tags", 4, 0), "tags");
+    sv_2mortal((SV*)tags);
+    url_attrs = attr_list_compile(aTHX_
+	sanitize_option(aTHX_ opt, "url_attrs", sanitize_default_url_attrs),
+	"url_attrs");
+    sv_2mortal(url_attrs);
+    schemes = attr_list_compile(aTHX_
+	sanitize_option(aTHX_ opt, "url_schemes", sanitize_default_schemes),
+	"url_schemes");
+    sv_2mortal(schemes);
+
+    drop = sanitize_option(aTHX_ opt, "drop_elements", sanitize_default_drop);
+    if (!SvROK(drop) || SvTYPE(SvRV(drop)) != SVt_PVAV)
+	croak("Tag list must be plain scalars and arrays");
+    drop_hv = (HV*)sv_2mortal((SV*)newHV());
+    for (i = 0; i <= av_len((AV*)SvRV(drop)); i++) {
+	SV** svp = av_fetch((AV*)SvRV(drop), i, 0);
+	if (svp && SvOK(*svp))
+	    hv_store_ent(drop_hv, *svp, newSViv(0), 0);
+    }
+
+    sanitize_free(aTHX_ p_state);
+    p_state->sanitize_tags = (HV*)SvREFCNT_inc(tags);
+    p_state->sanitize_url_attrs = SvREFCNT_inc(url_attrs);
+    p_state->sanitize_schemes = SvREFCNT_inc(schemes);
+    p_state->sanitize_drop = (HV*)SvREFCNT_inc(drop_hv);
+    p_state->sanitize_stack = newAV();
+}
+
+static void
+sanitize_put(pTHX_ PSTATE* p_state, const char *s, STRLEN len, bool utf8,
+	     bool quote)
+{
+    /* writes text with '&', '<' and '>' encoded, and '"' too in
+     * attribute values
+     */
+    const char *end = s + len;
+    while (s < end) {
+	const char *t = s;
+	while (t < end && *t != '&' && *t != '<' && *t != '>' &&
+	       !(quote && *t == '"'))
+	    t++;
+	rewrite_put(aTHX_ p_state, s, t - s, utf8);
+	if (t == end)
+	    break;
+	switch (*t) {
+	case '&': rewrite_put(aTHX_ p_state, "&amp;", 5, 0);  break;
+	case '<': rewrite_put(aTHX_ p_state, "&lt;", 4, 0);   break;
+	case '>': rewrite_put(aTHX_ p_state, "&gt;", 4, 0);   break;
+	case '"': rewrite_put(aTHX_ p_state, "&quot;", 6, 0); break;
+	}
+	s = t + 1;
+    }
+}
+
+static bool
+sanitize_url_ok(pTHX_ PSTATE* p_state, SV* url)
+{
+    /* Relative URLs are fine; the scheme of the others must be in the
+     * list.  Browsers skip control characters and whitespace in the
+     * scheme, so "java\tscript:" is javascript too.
+     */
+    STRLEN len;
+    char *s = SvPV(url, len);
+    char *end = s + len;
+    char *list = SvPVX(p_state->sanitize_schemes);
+    IV n = SvIVX(p_state->sanitize_schemes);
+    char scheme[32];
+    STRLEN scheme_len = 0;
+
+    for (; s < end && *s != ':'; s++) {
+	unsigned char c = (unsigned char)*s;
+	if (c <= ' ')
+	    continue;
+	if (!(isALPHA(c) ||
+	      (scheme_len && (isDIGIT(c) || c == '+' || c == '-' || c == '.'))))
+	    return 1;  /* no scheme */
+	if (scheme_len == sizeof(scheme))
+	    return 0;
+	scheme[scheme_len++] = toLOWER(c);
+    }
+    if (s == end || !scheme_len)
+	return 1;
+
+    while (n--) {
+	STRLEN list_len = (unsigned char)*list++;
+	if (list_len == scheme_len && strnEQx(list, scheme, scheme_len, 1))
+	    return 1;
+	list += list_len;
+    }
+    return 0;
+}
+
+static void
+sanitize_end_tag(pTHX_ PSTATE* p_state, SV* name)
+{
+    rewrite_put(aTHX_ p_state, "</", 2, 0);
+    rewrite_put_sv(aTHX_ p_state, name);
+    rewrite_put(aTHX_ p_state, ">", 1, 0);
+}
+
+static void
+sanitize_start(pTHX_ PSTATE* p_state, SV* name, SV* attrs,
+	       token_pos_t *tokens, int num_tokens, U32 utf8)
+{
+    AV* stack = p_state->sanitize_stack;
+    IV flags = p_state->xml_mode ? 0 : SvIVX(name);
+    SV** any = hv_fetchs(p_state->sanitize_tags, "*", 0);
+    int i;
+
+    /* start tags that imply the end of the current element */
+    while (av_len(stack) >= 0 && (flags & ELEM_CLOSES_MASK)) {
+	SV* top = *av_fetch(stack, av_len(stack), 0);
+	if (!((SvIVX(top) >> 15) & flags & ELEM_CLOSES_MASK))
+	    break;
+	sanitize_end_tag(aTHX_ p_state, top);
+	SvREFCNT_dec(av_pop(stack));
+    }
+
+    rewrite_put(aTHX_ p_state, "<", 1, 0);
+    rewrite_put_sv(aTHX_ p_state, name);
+    for (i = 1; i + 1 < num_tokens; i += 2) {
+	token_pos_t *attr = &tokens[i];
+	SV* attrname;
+	int j;
+
+	if (attr_list_match(p_state, SvPVX(attrs), SvIVX(attrs), attr) < 0 &&
+	    !(any && attr_list_match(p_state, SvPVX(*any), SvIVX(*any),
+				     attr) >= 0))
+	    continue;
+
+	/* only the first of repeated attributes counts */
+	for (j = 1; j < i; j += 2) {
+	    if (tokens[j].end - tokens[j].beg == attr->end - attr->beg &&
+		strnEQx(tokens[j].beg, attr->beg, attr->end - attr->beg,
+			!CASE_SENSITIVE(p_state)))
+		break;
+	}
+	if (j < i)
+	    continue;
+
+	attrname = event_tagname(aTHX_ p_state, attr, utf8);  /* lower cased */
+	if (tokens[i+1].beg) {
+	    SV* val = attr_value(aTHX_ p_state, attr, &tokens[i+1], utf8);
+	    STRLEN len;
+	    char *v;
+	    if (attr_list_match(p_state, SvPVX(p_state->sanitize_url_attrs),
+				SvIVX(p_state->sanitize_url_attrs), attr) >= 0 &&
+		!sanitize_url_ok(aTHX_ p_state, val))
+	    {
+		SvREFCNT_dec(val);
+		continue;
+	    }
+	    v = SvPV(val, len);
+	    rewrite_put(aTHX_ p_state, " ", 1, 0);
+	    rewrite_put_sv(aTHX_ p_state, attrname);
+	    rewrite_put(aTHX_ p_state, "=\"", 2, 0);
+	    sanitize_put(aTHX_ p_state, v, len, SvUTF8(val), 1);
+	    rewrite_put(aTHX_ p_state, "\"", 1, 0);
+	    SvREFCNT_dec(val);
+	}
+	else {
+	    rewrite_put(aTHX_ p_state, " ", 1, 0);
+	    rewrite_put_sv(aTHX_ p_state, attrname);
+	}
+    }
+    rewrite_put(aTHX_ p_state, ">", 1, 0);
+
+    if (!(flags & ELEM_VOID))
+	av_push(stack, SvREFCNT_inc(name));
+}
+
+static void
+sanitize_close(pTHX_ PSTATE* p_state, I32 depth)
+{
+    /* ends the open elements from the top down to 'depth' */
+    AV* stack = p_state->sanitize_stack;
+    while (av_len(stack) >= depth) {
+	SV* top = av_pop(stack);
+	sanitize_end_tag(aTHX_ p_state, top);
+	SvREFCNT_dec(top);
+    }
+}
+
+static void
+sanitize_end(pTHX_ PSTATE* p_state, SV* name)
+{
+    /* end tags of elements that are not open are dropped; the ones
+     * still open inside it are ended first
+     */
+    AV* stack = p_state->sanitize_stack;
+    I32 depth;
+
+    for (depth = av_len(stack); depth >= 0; depth--) {
+	if (*av_fetch(stack, depth, 0) == name) {
+	    sanitize_close(aTHX_ p_state, depth);
+	    break;
+	}
+    }
+}
+
+static void
+sanitize_event(pTHX_ PSTATE* p_state, event_id_t event, char *beg, char *end,
+	       U32 utf8, token_pos_t *tokens, int num_tokens)
+{
+    SV* tagname;
+    HE* he;
+
+    if (p_state->rewrite_dropping) {
+	rewrite_drop_track(aTHX_ p_state, event, tokens, utf8);
+	return;
+    }
+
+    if (event == E_TEXT) {
+	if (p_state->is_cdata) {
+	    sanitize_put(aTHX_ p_state, beg, end - beg, utf8, 0);
+	}
+	else {
+	    SV* text = text_decoded(aTHX_ p_state, beg, end, utf8);
+	    sanitize_put(aTHX_ p_state, SvPVX(text), SvCUR(text),
+			 SvUTF8(text), 0);
+	}
+	return;
+    }
+    if (event != E_START && event != E_END)
+	return;  /* comments, declarations and processing instructions */
+
+    tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+    if (event == E_START &&
+	hv_exists_ent(p_state->sanitize_drop, tagname, 0))
+    {
+	rewrite_drop_start(aTHX_ p_state, tagname);
+	return;
+    }
+    he = hv_fetch_ent(p_state->sanitize_tags, tagname, 0, 0);
+    if (!he)
+	return;  /* the content is kept */
+
+    if (event == E_START)
+	sanitize_start(aTHX_ p_state, stack_intern(aTHX_ p_state, tagname),
+		       HeVAL(he), tokens, num_tokens, utf8);
+    else
+	sanitize_end(aTHX_ p_state, stack_intern(aTHX_ p_state, tagname));
+}
+
+/*
+ * The serialize mode is rewrite_output writing every tag out again from
+ * its tokens, with the normalizations asked for.
+ *
+ *   serialize_compile() - turns the options into SERIALIZE_* flags
+ *   serialize_event()   - writes an event
+ *   serialize_held()    - writes or drops an optional end tag held back
+ */
+
+#define SERIALIZE_ON           0x01
+#define SERIALIZE_LOWERCASE    0x02  /* lowercase_names */
+#define SERIALIZE_QUOTE        0x04  /* quote_attributes */
+#define SERIALIZE_COLLAPSE     0x08  /* collapse_whitespace */
+#define SERIALIZE_NO_COMMENTS  0x10  /* drop_comments */
+#define SERIALIZE_NO_OPT_END   0x20  /* drop_optional_end_tags */
+
+static const struct {
+    const char *name;
+    int flag;
+} serialize_options[] = {
+    { "lowercase_names",        SERIALIZE_LOWERCASE },
+    { "quote_attributes",       SERIALIZE_QUOTE },
+    { "collapse_whitespace",    SERIALIZE_COLLAPSE },
+    { "drop_comments",          SERIALIZE_NO_COMMENTS },
+    { "drop_optional_end_tags", SERIALIZE_NO_OPT_END },
+    { 0, 0 }
+};
+
+EXTERN int
+serialize_compile(pTHX_ SV* options)
+{
+    /* the SERIALIZE_* flags for a hash of options */
+    int flags = SERIALIZE_ON;
+    HV* opt;
+    HE* he;
+
+    if (!SvROK(options) || SvTYPE(SvRV(options)) != SVt_PVHV)
+	croak("%s must be given as a hash reference", "serialize");
+    opt = (HV*)SvRV(options);
+    hv_iterinit(opt);
+    while ((he = hv_iternext(opt))) {
+	STRLEN len;
+	char *key = HePV(he, len);
+	int i;
+	for (i = 0; serialize_options[i].name; i++) {
+	    if (strEQ(key, serialize_options[i].name))
+		break;
+	}
+	if (!serialize_options[i].name)
+	    croak("Bad serialize option '%s'", key);
+	if (SvTRUE(HeVAL(he)))
+	    flags |= serialize_options[i].flag;
+    }
+    return flags;
+}
+
+/* elements whitespace is kept in */
+static const char serialize_raw_elements[] =
+    " pre textarea script style xmp listing plaintext ";
+
+static bool
+serialize_in_list(const char *list, const char *name, STRLEN len)
+{
+    /* is 'name' one of the words of a " a b c " list? */
+    char buf[16];
+    if (len > sizeof(buf) - 3)
+	return 0;
+    buf[0] = ' ';
+    memcpy(buf + 1, name, len);
+    buf[len + 1] = ' ';
+    buf[len + 2] = '\0';
+    return strstr(list, buf) != 0;
+}
+
+static bool
+serialize_keep_comment(const char *beg, const char *end)
+{
+    /* conditional comments of old IE are kept */
+    STRLEN len = end - beg;
+    return (len >= 7 && strnEQ(beg, "<!--[if", 7)) ||
+	(len >= 12 && strnEQ(end - 12, "<![endif]-->", 12));
+}
+
+static void
+serialize_text(pTHX_ PSTATE* p_state, const char *s, STRLEN len, U32 utf8)
+{
+    /* writes text, with runs of whitespace made a single space if
+     * collapse_whitespace is on and we are not inside <pre> or the like
+     */
+    const char *end = s + len;
+
+    if (!(p_state->serialize & SERIALIZE_COLLAPSE) || p_state->serialize_raw) {
+	rewrite_put(aTHX_ p_state, s, len, utf8);
+	p_state->serialize_space = 0;
+	return;
+    }
+    while (s < end) {
+	const char *t = s;
+	while (t < end && !isHSPACE(*t))
+	    t++;
+	if (t > s) {
+	    rewrite_put(aTHX_ p_state, s, t - s, utf8);
+	    p_state->serialize_space = 0;
+	}
+	if (t == end)
+	    break;
+	s = t;
+	while (s < end && isHSPACE(*s))
+	    s++;
+	if (!p_state->serialize_space) {
+	    rewrite_put(aTHX_ p_state, " ", 1, 0);
+	    p_state->serialize_space = 1;
+	}
+    }
+}
+
+static void
+serialize_name(pTHX_ PSTATE* p_state, token_pos_t *t, U32 utf8)
+{
+    STRLEN len = t->end - t->beg;
+    if (p_state->serialize & SERIALIZE_LOWERCASE) {
+	SV* name = p_state->tmp;
+	sv_setpvn(name, t->beg, len);
+	if (utf8)
+	    SvUTF8_on(name);
+	else
+	    SvUTF8_off(name);
+	sv_lower(aTHX_ name);
+	rewrite_put_sv(aTHX_ p_state, name);
+    }
+    else
+	rewrite_put(aTHX_ p_state, t->beg, len, utf8);
+}
+
+EXTERN void
+serialize_held(pTHX_ PSTATE* p_state, bool write)
+{
+    /* the optional end tag held back is written if what follows it
+     * needs it, and then the whitespace held back after it
+     */
+    SV* held = p_state->serialize_end;
+    SV* ws = p_state->serialize_ws;
+    if (!held)
+	return;
+    p_state->serialize_end = 0;
+    if (write) {
+	rewrite_put_sv(aTHX_ p_state, held);
+	p_state->serialize_space = 0;
+    }
+    SvREFCNT_dec(held);
+    if (ws && SvCUR(ws)) {
+	serialize_text(aTHX_ p_state, SvPVX(ws), SvCUR(ws), SvUTF8(ws));
+	SvCUR_set(ws, 0);
+    }
+}
+
+static void
+serialize_start(pTHX_ PSTATE* p_state, char *end, U32 utf8,
+		token_pos_t *tokens, int num_tokens)
+{
+    char *last = tokens[0].end;
+    char *s;
+    int i;
+
+    rewrite_put(aTHX_ p_state, "<", 1, 0);
+    serialize_name(aTHX_ p_state, &tokens[0], utf8);
+    for (i = 1; i + 1 < num_tokens; i += 2) {
+	token_pos_t *val = &tokens[i+1];
+	rewrite_put(aTHX_ p_state, " ", 1, 0);
+	serialize_name(aTHX_ p_state, &tokens[i], utf8);
+	last = tokens[i].end;
+	if (!val->beg)
+	    continue;  /* boolean */
+	last = val->end;
+	if (p_state->serialize & SERIALIZE_QUOTE) {
+	    char *v = val->beg;
+	    char *v_end = val->end;
+	    if (*v == '"' || *v == '\'' || (*v == '`' && p_state->backquote)) {
+		v++;
+		v_end--;
+	    }
+	    rewrite_put(aTHX_ p_state, "=\"", 2, 0);
+	    while (v < v_end) {
+		char *q = v;
+		while (q < v_end && *q != '"')
+		    q++;
+		rewrite_put(aTHX_ p_state, v, q - v, utf8);
+		if (q == v_end)
+		    break;
+		rewrite_put(aTHX_ p_state, "&quot;", 6, 0);
+		v = q + 1;
+	    }
+	    rewrite_put(aTHX_ p_state, "\"", 1, 0);
+	}
+	else {
+	    rewrite_put(aTHX_ p_state, "=", 1, 0);
+	    rewrite_put(aTHX_ p_state, val->beg, val->end - val->beg, utf8);
+	}
+    }
+    /* <br/> */
+    for (s = last; s < end - 1; s++) {
+	if (*s == '/') {
+	    rewrite_put(aTHX_ p_state, "/", 1, 0);
+	    break;
+	}
+    }
+    rewrite_put(aTHX_ p_state, ">", 1, 0);
+}
+
+static void
+serialize_event(pTHX_ PSTATE* p_state, event_id_t event, char *beg, char *end,
+		U32 utf8, token_pos_t *tokens, int num_tokens)
+{
+    SV* name = 0;
+    IV flags = 0;
+    bool raw = 0;
+
+    if (event == E_TEXT) {
+	if (p_state->serialize_end) {
+	    char *s = beg;
+	    while (s < end && isHSPACE(*s))
+		s++;
+	    if (s == end) {
+		/* goes out after the end tag, if that is written */
+		if (!p_state->serialize_ws)
+		    p_state->serialize_ws = newSVpvn("", 0);
+		if (utf8 && !SvUTF8(p_state->serialize_ws))
+		    sv_utf8_upgrade(p_state->serialize_ws);
+		sv_catpvn(p_state->serialize_ws, beg, end - beg);
+		return;
+	    }
+	    serialize_held(aTHX_ p_state, 1);
+	}
+	serialize_text(aTHX_ p_state, beg, end - beg, utf8);
+	return;
+    }
+
+    if (event == E_COMMENT && (p_state->serialize & SERIALIZE_NO_COMMENTS) &&
+	!serialize_keep_comment(beg, end))
+	return;
+
+    if (event == E_START || event == E_END) {
+	SV* tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+	raw = serialize_in_list(serialize_raw_elements,
+				SvPVX(tagname), SvCUR(tagname));
+	if (!p_state->xml_mode) {
+	    name = stack_intern(aTHX_ p_state, tagname);
+	    flags = SvIVX(name);
+	}
+    }
+
+    if (p_state->serialize_end) {
+	/* does this event end the element of the held end tag? */
+	IV held = SvIVX(p_state->serialize_end);
+	bool drop = 0;
+	if (event == E_START)
+	    drop = ((held >> 15) & flags & ELEM_CLOSES_MASK) != 0;
+	else if (event == E_END && name) {
+	    int i;
+	    for (i = 0; !(held & ELEM_OPT_END(i)); i++)
+		;
+	    drop = serialize_in_list(optional_end_elements[i].parents,
+				     SvPVX(name), SvCUR(name));
+	}
+	serialize_held(aTHX_ p_state, !drop);
+    }
+
+    switch (event) {
+    case E_START:
+	serialize_start(aTHX_ p_state, end, utf8, tokens, num_tokens);
+	if (raw && end[-2] != '/')
+	    p_state->serialize_raw++;
+	break;
+    case E_END:
+	if (beg == end)
+	    break;  /* implied by <tag/> */
+	if (raw && p_state->serialize_raw)
+	    p_state->serialize_raw--;
+	if ((p_state->serialize & SERIALIZE_NO_OPT_END) &&
+	    (flags & (ELEM_CLOSES_MASK << 15)))
+	{
+	    /* held back until we know what follows; the flags of the
+	     * element go in the IV slot
+	     */
+	    SV* held = newSVpvs("</");
+	    SvUPGRADE(held, SVt_PVIV);
+	    SvIV_set(held, flags);
+	    sv_catpvn(held, tokens[0].beg, tokens[0].end - tokens[0].beg);
+	    sv_catpvs(held, ">");
+	    if (utf8)
+		SvUTF8_on(held);
+	    if (p_state->serialize & SERIALIZE_LOWERCASE)
+		sv_lower(aTHX_ held);
+	    p_state->serialize_end = held;
+	    return;  /* nothing written yet */
+	}
+	rewrite_put(aTHX_ p_state, "</", 2, 0);
+	serialize_name(aTHX_ p_state, &tokens[0], utf8);
+	rewrite_put(aTHX_ p_state, ">", 1, 0);
+	break;
+    default:
+	/* comments, declarations and processing instructions */
+	rewrite_put(aTHX_ p_state, beg, end - beg, utf8);
+	break;
+    }
+    p_state->serialize_space = 0;
+}
+
+/*
+ * The event stream is what report_event() is called with, written out
+ * so that another parser can replay it without tokenizing the document
+ * again.  Each document starts with EVENT_MAGIC, and each event is a
+ * record of
+ *
+ *   byte    event id (enum event_id)
+ *   byte    EVENT_* flags
+ *   varint  number of extra bytes before the text
+ *   varint  length of the text of the event
+ *   varint  number of tokens
+ *   varint  1 + start, varint length  for each token
+ *   bytes   the extra bytes, then the text
+ *
+ * Varints are 7 bits a byte, least significant first, with the high
+ * bit set on all bytes but the last.  Token starts count from the
+ * first extra byte, and 0 is the missing value of a boolean attribute.
+ * Tokens outside the text of the event, like the tag name of an end
+ * tag the parser makes up, are copied to the extra bytes.
+ *
+ *   event_record() - writes the record for an event
+ *   replay()       - reports the events of a stream again
+ */
+
+#define EVENT_MAGIC      "HPev\001"
+#define EVENT_MAGIC_LEN  5
+
+#define EVENT_UTF8       0x01
+#define EVENT_CDATA      0x02  /* p_state->is_cdata */
+#define EVENT_MS_IGNORE  0x04  /* inside <![IGNORE[ ... ]]> */
+
+#define EVENT_OUTSIDE(t, beg, end) \
+	((t).beg && ((t).beg < (beg) || (t).end > (end)))
+
+static void
+event_varint(pTHX_ SV* buf, STRLEN n)
+{
+    U8 b[(sizeof(STRLEN) * 8 + 6) / 7];
+    int i = 0;
+    while (n >= 0x80) {
+	b[i++] = (U8)(n | 0x80);
+	n >>= 7;
+    }
+    b[i++] = (U8)n;
+    sv_catpvn(buf, (char*)b, i);
+}
+
+static void
+event_record(pTHX_ PSTATE* p_state, event_id_t event, char *beg, char *end,
+	     U32 utf8, token_pos_t *tokens, int num_tokens)
+{
+    SV* buf = p_state->event_buf;
+    STRLEN extra = 0;
+    U8 head[2];
+    int i;
+
+    if (!buf)
+	buf = p_state->event_buf = newSVpvn("", 0);
+    if (event == E_START_DOCUMENT)
+	sv_setpvn(buf, EVENT_MAGIC, EVENT_MAGIC_LEN);
+    else
+	SvCUR_set(buf, 0);
+
+    head[0] = (U8)event;
+    head[1] = utf8 ? EVENT_UTF8 : 0;
+    if (p_state->is_cdata)
+	head[1] |= EVENT_CDATA;
+#ifdef MARKED_SECTION
+    if (p_state->ms == MS_IGNORE)
+	head[1] |= EVENT_MS_IGNORE;
+#endif
+    sv_catpvn(buf, (char*)head, 2);
+
+    for (i = 0; i < num_tokens; i++) {
+	if (EVENT_OUTSIDE(tokens[i], beg, end))
+	    extra += tokens[i].end - tokens[i].beg;
+    }
+    event_varint(aTHX_ buf, extra);
+    event_varint(aTHX_ buf, end - beg);
+    event_varint(aTHX_ buf, num_tokens);
+    {
+	STRLEN pos = 0;
+	for (i = 0; i < num_tokens; i++) {
+	    STRLEN len = tokens[i].end - tokens[i].beg;
+	    if (!tokens[i].beg) {
+		event_varint(aTHX_ buf, 0);
+		len = 0;
+	    }
+	    else if (EVENT_OUTSIDE(tokens[i], beg, end)) {
+		event_varint(aTHX_ buf, 1 + pos);
+		pos += len;
+	    }
+	    else
+		event_varint(aTHX_ buf, 1 + extra + (tokens[i].beg - beg));
+	    event_varint(aTHX_ buf, len);
+	}
+    }
+    for (i = 0; i < num_tokens; i++) {
+	if (EVENT_OUTSIDE(tokens[i], beg, end))
+	    sv_catpvn(buf, tokens[i].beg, tokens[i].end - tokens[i].beg);
+    }
+    sv_catpvn(buf, beg, end - beg);
+
+    output_put(aTHX_ p_state->event_output, "event",
+	       SvPVX(buf), SvCUR(buf), 0);
+}
+
+/* multiplying hash for event_key(), 8 bytes at a time */
+
+#define EVENT_HASH_MUL  UINT64_C(0xff51afd7ed558ccd)
+
+static U64
+event_hash(U64 h, const char *s, STRLEN len)
+{
+    const char *end = s + len;
+    U64 w;
+    while (end - s >= 8) {
+	memcpy(&w, s, 8);
+	h = (h ^ w) * EVENT_HASH_MUL;
+	h ^= h >> 32;
+	s += 8;
+    }
+    w = 0;
+    memcpy(&w, s, end - s);
+    h = (h ^ w ^ ((U64)len << 56)) * EVENT_HASH_MUL;
+    h ^= h >> 33;
+    h *= UINT64_C(0xc4ceb9fe1a85ec53);
+    h ^= h >> 33;
+    return h;
+}
+
+EXTERN SV*
+event_key(pTHX_ PSTATE* p_state, SV* doc)
+{
+    /* a hash of the document and of the options that change what
+     * event_output writes for it
+     */
+    char opts[12];
+    STRLEN len;
+    const char *s = SvPV(doc, len);
+    U64 h = UINT64_C(0x9e3779b97f4a7c15);
+
+    opts[0]  = (char)p_state->strict_comment;
+    opts[1]  = (char)p_state->strict_names;
+    opts[2]  = (char)p_state->strict_end;
+    opts[3]  = (char)p_state->xml_mode;
+    opts[4]  = (char)p_state->marked_sections;
+    opts[5]  = (char)p_state->closing_plaintext;
+    opts[6]  = (char)(p_state->utf8_mode | p_state->in_enc << 1);
+    opts[7]  = (char)p_state->empty_element_tags;
+    opts[8]  = (char)p_state->xml_pic;
+    opts[9]  = (char)p_state->backquote;
+    opts[10] = SvUTF8(doc) ? 1 : 0;
+    opts[11] = EVENT_MAGIC[EVENT_MAGIC_LEN - 1];  /* format version */
+    h = event_hash(h, opts, sizeof(opts));
+    if (p_state->literal_tags) {
+	struct literal_set *set = p_state->literal_tags;
+	int i;
+	for (i = 0; i < set->count; i++) {
+	    struct literal_tag *lt = &set->tags[i];
+	    char how[2];
+	    how[0] = (char)lt->is_cdata;
+	    how[1] = (char)lt->eof_action;
+	    h = event_hash(h, lt->str, lt->len);
+	    h = event_hash(h, how, 2);
+	}
+    }
+    h = event_hash(h, s, len);
+    return newSVpvf("%08lx%08lx-%" UVuf,
+		    (unsigned long)(h >> 32), (unsigned long)(h & 0xffffffff),
+		    (UV)len);
+}
+
+/*
+ * Checkpoints are the tokenizer state at event boundaries, taken about
+ * every checkpoint_interval characters.  reparse() starts from one of
+ * them and stops where the state lines up with a checkpoint of the old
+ * parse again.
+ *
+ *   checkpoint_take() - takes one or stops reparse() at an event
+ */
+
+static void
+checkpoint_state(PSTATE* p_state, struct checkpoint *cp)
+{
+    cp->offset = p_state->offset;
+    cp->line = p_state->line;
+    cp->column = p_state->column;
+    cp->literal_mode = p_state->literal_mode;
+    cp->pending_end_tag = p_state->pending_end_tag;
+    cp->is_cdata = p_state->is_cdata;
+    cp->no_dash_dash_comment_end = p_state->no_dash_dash_comment_end;
+}
+
+static bool
+checkpoint_same(struct checkpoint *a, struct checkpoint *b)
+{
+    return a->literal_mode == b->literal_mode &&
+	a->pending_end_tag == b->pending_end_tag &&
+	a->is_cdata == b->is_cdata &&
+	a->no_dash_dash_comment_end == b->no_dash_dash_comment_end;
+}
+
+static void
+checkpoint_push(PSTATE* p_state, struct checkpoint *cp)
+{
+    if (p_state->checkpoints_count == p_state->checkpoints_max) {
+	p_state->checkpoints_max = p_state->checkpoints_max * 2 + 16;
+	Renew(p_state->checkpoints, p_state->checkpoints_max,
+	      struct checkpoint);
+    }
+    p_state->checkpoints[p_state->checkpoints_count++] = *cp;
+}
+
+static bool
+checkpoint_take(pTHX_ PSTATE* p_state, char *beg, char *end)
+{
+    /* returns TRUE if reparse() is done */
+    struct checkpoint cp;
+
+    if (beg == end || p_state->pend_text_flushing || PEND_TEXT_OK(p_state))
+	return 0;  /* not where the tokenizer can start again */
+    if (p_state->literal_mode || p_state->pending_end_tag)
+	return 0;  /* literal text is only reported once its end is seen */
+#ifdef MARKED_SECTION
+    if (p_state->ms_stack && av_len(p_state->ms_stack) >= 0)
+	return 0;
+#endif
+    checkpoint_state(p_state, &cp);
+
+    if (p_state->reparse_old && cp.offset >= p_state->reparse_after) {
+	/* has it lined up with the old parse again? */
+	struct checkpoint *old = p_state->reparse_old;
+	int i = p_state->reparse_idx;
+	while (i < p_state->reparse_old_count &&
+	       (IV)old[i].offset + p_state->reparse_delta < (IV)cp.offset)
+	    i++;
+	p_state->reparse_idx = i;
+	if (i < p_state->reparse_old_count &&
+	    (IV)old[i].offset + p_state->reparse_delta == (IV)cp.offset &&
+	    checkpoint_same(&old[i], &cp))
+	{
+	    p_state->reparse_done = 1;
+	    p_state->eof = 1;  /* the rest is as it was */
+	    return 1;
+	}
+    }
+
+    if (cp.offset >= p_state->checkpoint_next) {
+	checkpoint_push(p_state, &cp);
+	p_state->checkpoint_next = cp.offset + p_state->checkpoint_interval;
+    }
+    return 0;
+}
+
+static SV*
+new_arg(pTHX_ AV* args, int slot, svtype type)
+{
+    /* Return an empty value for an argument; a reference to a new
+     * hash or array if 'type' is SVt_PVHV or SVt_PVAV.  With reuse_args
+     * the value kept in 'slot' of 'args' is cleared and returned
+     * instead, unless the previous handler held on to it.
+     */
+    SV* sv;
+
+    if (!args) {
+	if (type == SVt_PVHV)
+	    sv = newRV_noinc((SV*)newHV());
+	else if (type == SVt_PVAV)
+	    sv = newRV_noinc((SV*)newAV());
+	else
+	    sv = newSV(0);
+	return sv_2mortal(sv);
+    }
+
+    if (slot <= av_len(args) && (sv = AvARRAY(args)[slot]) &&
+	SvREFCNT(sv) == 1 && !SvMAGICAL(sv) && !SvREADONLY(sv))
+    {
+	if (type == SVt_NULL)
+	    return sv;
+	if (SvROK(sv)) {
+	    SV* c = SvRV(sv);
+	    if (SvTYPE(c) == type && SvREFCNT(c) == 1 &&
+		!SvOBJECT(c) && !SvMAGICAL(c))
+	    {
+		if (type == SVt_PVHV)
+		    hv_clear((HV*)c);
+		else
+		    av_clear((AV*)c);
+		return sv;
+	    }
+	}
+    }
+
+    if (type == SVt_PVHV)
+	sv = newRV_noinc((SV*)newHV());
+    else if (type == SVt_PVAV)
+	sv = newRV_noinc((SV*)newAV());
+    else
+	sv = newSV(0);
+    av_store(args, slot, sv);
+    return sv;
+}
+
+static CV*
+handler_method_cv(pTHX_ struct p_handler *h, SV* self)
+{
+    /* Look up the method named by a handler in the class of self.  The
+     * CV found is remembered until the object is reblessed or perl's
+     * method caches are invalidated, e.g. by redefining a sub or
+     * changing @ISA.  Returns 0 if perl_call_method() should be used.
+     */
+    HV* stash;
+    GV* gv;
+    U32 gen;
+    STRLEN len;
+    char *method;
+
+    if (!SvROK(self) || !SvOBJECT(SvRV(self)))
+	return 0;
+    stash = SvSTASH(SvRV(self));
+#ifdef HvMROMETA
+    gen = PL_sub_generation + HvMROMETA(stash)->cache_gen +
+	  HvMROMETA(stash)->pkg_gen;
+#else
+    gen = PL_sub_generation;
+#endif
+    if (h->method_cv && h->method_stash == stash && h->method_gen == gen)
+	return h->method_cv;
+
+    SvREFCNT_dec(h->method_cv);
+    h->method_cv = 0;
+
+    method = SvPV(h->cb, len);
+    if (strchr(method, ':') || strchr(method, '\''))
+	return 0;  /* qualified names are left to perl */
+    gv = gv_fetchmethod_autoload(stash, method, FALSE);
+    if (!gv || !isGV(gv) || !GvCV(gv))
+	return 0;  /* AUTOLOAD or error; let perl deal with it */
+
+    h->method_cv = (CV*)SvREFCNT_inc((SV*)GvCV(gv));
+    h->method_stash = stash;
+    h->method_gen = gen;
+    return h->method_cv;
+}
+
+static void
+report_event(PSTATE* p_state,
+	     event_id_t event,
+	     char *beg, char *end, U32 utf8,
+	     token_pos_t *tokens, int num_tokens,
+	     SV* self
+	    )
+{
+    struct p_handler *h;
+    dTHX;
+    dSP;
+    AV *array;
+    AV *args = 0;
+    SV *tagname = 0;
+    int slot;
+    STRLEN my_na;
+    char *argspec;
+    char *s;
+    STRLEN offset;
+    STRLEN line;
+    STRLEN column;
+
+#ifdef UNICODE_HTML_PARSER
+    #define CHR_DIST(a,b) (utf8 ? utf8_distance((U8*)(a),(U8*)(b)) : (a) - (b))
+#else
+    #define CHR_DIST(a,b) ((a) - (b))
+#endif
+
+    /* some events might still fire after a handler has signaled eof
+     * so suppress them here.
+     */
+    if (p_state->eof)
+	return;
+
+    /* capture offsets */
+    offset = p_state->offset;
+    line = p_state->line;
+    column = p_state->column;
+
+#if 0
+    {  /* used for debugging at some point */
+	char *s = beg;
+	int i;
+
+	/* print debug output */
+	switch(event) {
+	case E_DECLARATION: printf("DECLARATION"); break;
+	case E_COMMENT:     printf("COMMENT"); break;
+	case E_START:       printf("START"); break;
+	case E_END:         printf("END"); break;
+	case E_TEXT:        printf("TEXT"); break;
+	case E_PROCESS:     printf("PROCESS"); break;
+	case E_NONE:        printf("NONE"); break;
+	default:            printf("EVENT #%d", event); break;
+	}
+
+	printf(" [");
+	while (s < end) {
+	    if (*s == '\n') {
+		putchar('\\'); putchar('n');
+	    }
+	    else
+		putchar(*s);
+	    s++;
+	}
+	printf("] %d\n", end - beg);
+	for (i = 0; i < num_tokens; i++) {
+	    printf("  token %d: %d %d\n",
+		   i,
+		   tokens[i].beg - beg,
+		   tokens[i].end - tokens[i].beg);
+	}
+    }
+#endif
+
+    if ((p_state->checkpoint_interval || p_state->reparse_old) &&
+	checkpoint_take(aTHX_ p_state, beg, end))
+	return;
+
+    if (p_state->pending_end_tag && event != E_TEXT && event != E_COMMENT) {
+	token_pos_t t;
+	char dummy;
+	t.beg = p_state->pending_end_tag->str;
+	t.end = p_state->pending_end_tag->str + p_state->pending_end_tag->len;
+	p_state->pending_end_tag = 0;
+	report_event(p_state, E_END, &dummy, &dummy, 0, &t, 1, self);
+	SPAGAIN;
+    }
+
+    if (p_state->event_output && !p_state->pend_text_flushing)
+	event_record(aTHX_ p_state, event, beg, end, utf8, tokens, num_tokens);
+
+    if (p_state->track_stack && !p_state->pend_text_flushing) {
+	/* the element of the previous event might be done with */
+	if (p_state->stack_pop_pending) {
+	    p_state->stack_depth--;
+	    p_state->stack_pop_pending = 0;
+	}
+	p_state->stack_self = 0;
+	p_state->stack_next.name = 0;
+    }
+
+    /* update offsets */
+    p_state->offset += CHR_DIST(end, beg);
+    if (line) {
+	char *s = beg;
+	char *nl = NULL;
+	while (s < end) {
+	    if (*s == '\n') {
+		p_state->line++;
+		nl = s;
+	    }
+	    s++;
+	}
+	if (nl)
+	    p_state->column = CHR_DIST(end, nl) - 1;
+	else
+	    p_state->column += CHR_DIST(end, beg);
+    }
+
+    if (p_state->pausable && !p_state->pend_text_flushing &&
+	((event != E_NONE && p_state->budget_events &&
+	  !--p_state->budget_events) ||
+	 (p_state->budget_offset && p_state->offset >= p_state->budget_offset)))
+	p_state->paused = 1;  /* parse_buf() stops after this token */
+
+    if (event == E_NONE)
+	goto IGNORE_EVENT;
+
+#ifdef MARKED_SECTION
+    if (p_state->ms == MS_IGNORE)
+	goto IGNORE_EVENT;
+#endif
+
+    if (p_state->track_stack && !p_state->pend_text_flushing)
+	stack_prepare(aTHX_ p_state, event, tokens, num_tokens, utf8);
+
+    if (p_state->rewrite_output && p_state->sanitize_tags &&
+	event != E_START_DOCUMENT && event != E_END_DOCUMENT)
+    {
+	/* no handlers are called for these */
+	sanitize_event(aTHX_ p_state, event, beg, end, utf8,
+		       tokens, num_tokens);
+	stack_update(p_state, event);
+	return;
+    }
+    if (p_state->rewrite_output && p_state->serialize &&
+	event != E_START_DOCUMENT && event != E_END_DOCUMENT)
+    {
+	serialize_event(aTHX_ p_state, event, beg, end, utf8,
+			tokens, num_tokens);
+	stack_update(p_state, event);
+	return;
+    }
+    if (p_state->rewrite_output && !p_state->pend_text_flushing &&
+	rewrite_event(aTHX_ p_state, event, beg, end, utf8,
+		      tokens, num_tokens, self))
+    {
+	SPAGAIN;
+	stack_update(p_state, event);
+	return;
+    }
+
+    /* tag filters */
+    if (p_state->ignore_tags || p_state->report_tags || p_state->ignore_elements) {
+
+	if (event == E_START || event == E_END || event == E_ELEMENT) {
+	    assert(num_tokens >= 1);
+	    tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+
+	    if (p_state->ignoring_element) {
+		if (sv_eq(p_state->ignoring_element, tagname)) {
+		    if (event == E_START)
+			p_state->ignore_depth++;
+		    else if (event == E_END && --p_state->ignore_depth == 0) {
+			SvREFCNT_dec(p_state->ignoring_element);
+			p_state->ignoring_element = 0;
+		    }
+		}
+		goto IGNORE_EVENT;
+	    }
+
+	    if (p_state->ignore_elements &&
+		hv_fetch_ent(p_state->ignore_elements, tagname, 0, 0))
+	    {
+		if (event == E_START) {
+		    p_state->ignoring_element = newSVsv(tagname);
+		    p_state->ignore_depth = 1;
+		}
+		goto IGNORE_EVENT;
+	    }
+
+	    if (p_state->ignore_tags &&
+		hv_fetch_ent(p_state->ignore_tags, tagname, 0, 0))
+	    {
+		goto IGNORE_EVENT;
+	    }
+	    if (p_state->report_tags &&
+		!hv_fetch_ent(p_state->report_tags, tagname, 0, 0))
+	    {
+		goto IGNORE_EVENT;
+	    }
+	}
+	else if (p_state->ignoring_element) {
+	    goto IGNORE_EVENT;
+	}
+    }
+
+    if (p_state->head_scan &&
+	(event == E_START || event == E_END || event == E_TEXT))
+    {
+	/* no handlers are called for these */
+	head_event(aTHX_ p_state, event, beg, end, utf8, tokens, num_tokens);
+	stack_update(p_state, event);
+	return;
+    }
+    if (p_state->text_output &&
+	(event == E_START || event == E_END || event == E_TEXT))
+    {
+	text_event(aTHX_ p_state, event, beg, end, utf8, tokens, num_tokens);
+	stack_update(p_state, event);
+	return;
+    }
+
+    h = 0;
+    if (p_state->selectors)
+	h = selector_handler(p_state, event);
+    if (!h && p_state->tag_handlers[event]) {
+	/* look for a handler for this tag first */
+	HE* he;
+	assert(num_tokens >= 1);
+	if (!tagname)
+	    tagname = event_tagname(aTHX_ p_state, tokens, utf8);
+	he = hv_fetch_ent(p_state->tag_handlers[event], tagname, 0, 0);
+	if (he)
+	    h = TAG_HANDLER(HeVAL(he));
+    }
+    if (!h)
+	h = &p_state->handlers[event];
+    if (!h->cb) {
+	/* event = E_DEFAULT; */
+	h = &p_state->handlers[E_DEFAULT];
+	if (!h->cb)
+	    goto IGNORE_EVENT;
+    }
+
+    if (SvTYPE(h->cb) != SVt_PVAV && !SvTRUE(h->cb)) {
+	/* FALSE scalar ('' or 0) means IGNORE this event; it is not
+	 * written to rewrite_output either
+	 */
+	stack_update(p_state, event);
+	return;
+    }
+
+    if ((event == E_START || event == E_ELEMENT) &&
+	argspec_uses(h->argspec, link_argcodes) &&
+	!start_links(aTHX_ p_state, tokens, num_tokens, utf8, 0))
+    {
+	/* handlers asking for @links only hear about tags with links */
+	goto IGNORE_EVENT;
+    }
+
+    if (p_state->pend_text_flushing) {
+	/* this is the pending text being reported by flush_pending_text() */
+	assert(event == E_TEXT);
+    }
+    else if (p_state->unbroken_text && event == E_TEXT) {
+	/* should buffer text */
+	struct text_span *span;
+	if (PEND_TEXT_OK(p_state)) {
+	    if (p_state->is_cdata != p_state->pend_text_is_cdata) {
+		flush_pending_text(p_state, self);
+		SPAGAIN;
+		goto INIT_PEND_TEXT;
+	    }
+	}
+	else {
+	INIT_PEND_TEXT:
+	    p_state->pend_text_offset = offset;
+	    p_state->pend_text_line = line;
+	    p_state->pend_text_column = column;
+	    p_state->pend_text_is_cdata = p_state->is_cdata;
+	}
+
+	/* just remember where the text is; it is copied once the
+	 * current buffer is about to go away
+	 */
+	if (p_state->pend_spans_count) {
+	    span = &p_state->pend_spans[p_state->pend_spans_count - 1];
+	    if (span->end == beg && span->utf8 == (utf8 != 0)) {
+		span->end = end;
+		return;
+	    }
+	}
+	if (p_state->pend_spans_count == p_state->pend_spans_max) {
+	    p_state->pend_spans_max = p_state->pend_spans_max * 2 + 8;
+	    Renew(p_state->pend_spans, p_state->pend_spans_max,
+		  struct text_span);
+	}
+	span = &p_state->pend_spans[p_state->pend_spans_count++];
+	span->beg = beg;
+	span->end = end;
+	span->utf8 = (utf8 != 0);
+	return;
+    }
+    else if (PEND_TEXT_OK(p_state)) {
+	flush_pending_text(p_state, self);
+	SPAGAIN;
+    }
+    stack_update(p_state, event);
+
+    /* At this point we have decided to generate an event callback */
+
+    argspec = h->argspec ? SvPV(h->argspec, my_na) : "";
 
     if (SvTYPE(h->cb) == SVt_PVAV) {
 
@@ -354,9 +3165,17 @@ report_event(PSTATE* p_state,
 	ENTER;
 	SAVETMPS;
 	PUSHMARK(SP);
+
+	if (p_state->reuse_args) {
+	    if (!h->args)
+		h->args = newAV();
+	    /* the handler might replace itself while it runs */
+	    args = (AV*)SvREFCNT_inc(h->args);
+	    SAVEFREESV(args);
+	}
     }
 
-    for (s = argspec; *s; s++) {
+    for (s = argspec, slot = 0; *s; s++, slot++) {
 	SV* arg = 0;
 	int push_arg = 1;
 	enum argcode argcode = (enum argcode)*s;
@@ -364,14 +3183,17 @@ report_event(PSTATE* p_state,
 	switch( argcode ) {
 
 	case ARG_SELF:
-	    arg = sv_mortalcopy(self);
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setsv(arg, self);
 	    break;
 
 	case ARG_TOKENS:
 	    if (num_tokens >= 1) {
-		AV* av = newAV();
+		AV* av;
 		SV* prev_token = &PL_sv_undef;
 		int i;
+		arg = new_arg(aTHX_ args, slot, SVt_PVAV);
+		av = (AV*)SvRV(arg);
 		av_extend(av, num_tokens);
 		for (i = 0; i < num_tokens; i++) {
 		    if (tokens[i].beg) {
@@ -386,14 +3208,15 @@ report_event(PSTATE* p_state,
 				: newSVsv(prev_token));
 		    }
 		}
-		arg = sv_2mortal(newRV_noinc((SV*)av));
 	    }
 	    break;
 
 	case ARG_TOKENPOS:
 	    if (num_tokens >= 1 && tokens[0].beg >= beg) {
-		AV* av = newAV();
+		AV* av;
 		int i;
+		arg = new_arg(aTHX_ args, slot, SVt_PVAV);
+		av = (AV*)SvRV(arg);
 		av_extend(av, num_tokens*2);
 		for (i = 0; i < num_tokens; i++) {
 		    if (tokens[i].beg) {
@@ -405,7 +3228,6 @@ report_event(PSTATE* p_state,
 			av_push(av, newSViv(0));
 		    }
 		}
-		arg = sv_2mortal(newRV_noinc((SV*)av));
 	    }
 	    break;
 
@@ -415,13 +3237,15 @@ report_event(PSTATE* p_state,
 
 	case ARG_TAG:
 	    if (num_tokens >= 1) {
-		arg = sv_2mortal(newSVpvn(tokens[0].beg,
-					  tokens[0].end - tokens[0].beg));
+		arg = new_arg(aTHX_ args, slot, SVt_NULL);
+		sv_setpvn(arg, tokens[0].beg, tokens[0].end - tokens[0].beg);
 		if (utf8)
 		    SvUTF8_on(arg);
+		else
+		    SvUTF8_off(arg);
 		if (!CASE_SENSITIVE(p_state) && argcode != ARG_TOKEN0)
 		    sv_lower(aTHX_ arg);
-		if (argcode == ARG_TAG && event != E_START) {
+		if (argcode == ARG_TAG && event != E_START && event != E_ELEMENT) {
 		    char *e_type = "!##/#?#";
 		    sv_insert(arg, 0, 0, &e_type[event], 1);
 		}
@@ -430,12 +3254,12 @@ report_event(PSTATE* p_state,
 
 	case ARG_ATTR:
 	case ARG_ATTRARR:
-	    if (event == E_START) {
+	    if (event == E_START || event == E_ELEMENT) {
 		HV* hv;
 		int i;
 		if (argcode == ARG_ATTR) {
-		    hv = newHV();
-		    arg = sv_2mortal(newRV_noinc((SV*)hv));
+		    arg = new_arg(aTHX_ args, slot, SVt_PVHV);
+		    hv = (HV*)SvRV(arg);
 		}
 		else {
 #ifdef __GNUC__
@@ -448,39 +3272,11 @@ report_event(PSTATE* p_state,
 		for (i = 1; i < num_tokens; i += 2) {
 		    SV* attrname = newSVpvn(tokens[i].beg,
 					    tokens[i].end-tokens[i].beg);
-		    SV* attrval;
+		    SV* attrval = attr_value(aTHX_ p_state,
+					     &tokens[i], &tokens[i+1], utf8);
 
 		    if (utf8)
 			SvUTF8_on(attrname);
-		    if (tokens[i+1].beg) {
-			char *beg = tokens[i+1].beg;
-			STRLEN len = tokens[i+1].end - beg;
-			if (*beg == '"' || *beg == '\'' || (*beg == '`' && p_state->backquote)) {
-			    assert(len >= 2 && *beg == beg[len-1]);
-			    beg++; len -= 2;
-			}
-			attrval = newSVpvn(beg, len);
-			if (utf8)
-			    SvUTF8_on(attrval);
-			if (!p_state->attr_encoded) {
-#ifdef UNICODE_HTML_PARSER
-			    if (p_state->utf8_mode) {
-				sv_utf8_decode(attrval);
-                                sv_utf8_upgrade(attrval);
-                            }
-#endif
-			    decode_entities(aTHX_ attrval, p_state->entity2char, 0);
-			    if (p_state->utf8_mode)
-				SvUTF8_off(attrval);
-			}
-		    }
-		    else { /* boolean */
-			if (p_state->bool_attr_val)
-			    attrval = newSVsv(p_state->bool_attr_val);
-			else
-			    attrval = newSVsv(attrname);
-		    }
-
 		    if (!CASE_SENSITIVE(p_state))
 			sv_lower(aTHX_ attrname);
 
@@ -508,10 +3304,74 @@ report_event(PSTATE* p_state,
 	    }
 	    break;
 
+	case ARG_ATTR_SUBSET:
+	case ARG_ATTRVAL:
+	{
+	    int n = (unsigned char)s[1];
+	    char *list = s + 2;
+	    int i, j;
+
+	    if (argcode == ARG_ATTR_SUBSET) {
+		if (event == E_START || event == E_ELEMENT) {
+		    HV* hv;
+		    arg = new_arg(aTHX_ args, slot, SVt_PVHV);
+		    hv = (HV*)SvRV(arg);
+		    for (i = 1; i < num_tokens; i += 2) {
+			SV* attrname;
+			if (attr_list_match(p_state, list, n, &tokens[i]) < 0)
+			    continue;
+			attrname = newSVpvn(tokens[i].beg,
+					    tokens[i].end - tokens[i].beg);
+			if (utf8)
+			    SvUTF8_on(attrname);
+			if (!CASE_SENSITIVE(p_state))
+			    sv_lower(aTHX_ attrname);
+			if (!hv_exists_ent(hv, attrname, 0)) {
+			    SV* attrval = attr_value(aTHX_ p_state, &tokens[i],
+						     &tokens[i+1], utf8);
+			    if (!hv_store_ent(hv, attrname, attrval, 0))
+				SvREFCNT_dec(attrval);
+			}
+			SvREFCNT_dec(attrname);
+		    }
+		}
+	    }
+	    else {
+		/* one argument for each name in the list */
+		push_arg = 0;
+		for (j = 0; j < n; j++) {
+		    SV* attrval = 0;
+		    if (event == E_START || event == E_ELEMENT) {
+			for (i = 1; i < num_tokens; i += 2) {
+			    if (attr_list_match(p_state, list, n, &tokens[i]) == j) {
+				attrval = sv_2mortal(attr_value(aTHX_ p_state,
+						     &tokens[i], &tokens[i+1], utf8));
+				break;
+			    }
+			}
+		    }
+		    if (!attrval)
+			attrval = sv_mortalcopy(&PL_sv_undef);
+		    if (array)
+			av_push(array, SvREFCNT_inc(attrval));
+		    else
+			XPUSHs(attrval);
+		}
+	    }
+
+	    /* skip past the list */
+	    for (j = 0; j < n; j++)
+		list += (unsigned char)*list + 1;
+	    s = list - 1;
+	}
+	break;
+
 	case ARG_ATTRSEQ:       /* (v2 compatibility stuff) */
-	    if (event == E_START) {
-		AV* av = newAV();
+	    if (event == E_START || event == E_ELEMENT) {
+		AV* av;
 		int i;
+		arg = new_arg(aTHX_ args, slot, SVt_PVAV);
+		av = (AV*)SvRV(arg);
 		for (i = 1; i < num_tokens; i += 2) {
 		    SV* attrname = newSVpvn(tokens[i].beg,
 					    tokens[i].end-tokens[i].beg);
@@ -521,21 +3381,30 @@ report_event(PSTATE* p_state,
 			sv_lower(aTHX_ attrname);
 		    av_push(av, attrname);
 		}
-		arg = sv_2mortal(newRV_noinc((SV*)av));
 	    }
 	    break;
 
 	case ARG_TEXT:
-	    arg = sv_2mortal(newSVpvn(beg, end - beg));
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setpvn(arg, beg, end - beg);
 	    if (utf8)
 		SvUTF8_on(arg);
+	    else
+		SvUTF8_off(arg);
 	    break;
 
 	case ARG_DTEXT:
-	    if (event == E_TEXT) {
-		arg = sv_2mortal(newSVpvn(beg, end - beg));
+	    if (event == E_TEXT || event == E_ELEMENT) {
+		arg = new_arg(aTHX_ args, slot, SVt_NULL);
+		if (event == E_ELEMENT)
+		    sv_setpvn(arg, p_state->element_text_beg,
+			      p_state->element_text_end - p_state->element_text_beg);
+		else
+		    sv_setpvn(arg, beg, end - beg);
 		if (utf8)
 		    SvUTF8_on(arg);
+		else
+		    SvUTF8_off(arg);
 		if (!p_state->is_cdata) {
 #ifdef UNICODE_HTML_PARSER
 		    if (p_state->utf8_mode) {
@@ -551,7 +3420,7 @@ report_event(PSTATE* p_state,
 	    break;
 
 	case ARG_IS_CDATA:
-	    if (event == E_TEXT) {
+	    if (event == E_TEXT || event == E_ELEMENT) {
 		arg = boolSV(p_state->is_cdata);
 	    }
 	    break;
@@ -562,36 +3431,45 @@ report_event(PSTATE* p_state,
             break;
 
 	case ARG_OFFSET:
-	    arg = sv_2mortal(newSViv(offset));
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setiv(arg, offset);
 	    break;
 
 	case ARG_OFFSET_END:
-	    arg = sv_2mortal(newSViv(offset + CHR_DIST(end, beg)));
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setiv(arg, offset + CHR_DIST(end, beg));
 	    break;
 
 	case ARG_LENGTH:
-	    arg = sv_2mortal(newSViv(CHR_DIST(end, beg)));
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setiv(arg, CHR_DIST(end, beg));
 	    break;
 
 	case ARG_LINE:
-	    arg = sv_2mortal(newSViv(line));
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setiv(arg, line);
 	    break;
 
 	case ARG_COLUMN:
-	    arg = sv_2mortal(newSViv(column));
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setiv(arg, column);
 	    break;
 
 	case ARG_EVENT:
 	    assert(event >= 0 && event < EVENT_COUNT);
-	    arg = sv_2mortal(newSVpv(event_id_str[event], 0));
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setpv(arg, event_id_str[event]);
 	    break;
 
 	case ARG_LITERAL:
 	{
 	    int len = (unsigned char)s[1];
-	    arg = sv_2mortal(newSVpvn(s+2, len));
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setpvn(arg, s+2, len);
 	    if (SvUTF8(h->argspec))
 		SvUTF8_on(arg);
+	    else
+		SvUTF8_off(arg);
 	    s += len + 1;
 	}
 	break;
@@ -600,6 +3478,62 @@ report_event(PSTATE* p_state,
 	    arg = sv_mortalcopy(&PL_sv_undef);
 	    break;
 
+	case ARG_DEPTH:
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setiv(arg, p_state->stack_depth);
+	    break;
+
+	case ARG_PARENT:
+	{
+	    int i = p_state->stack_depth - 1 - p_state->stack_self;
+	    if (i >= 0) {
+		arg = new_arg(aTHX_ args, slot, SVt_NULL);
+		sv_setsv(arg, p_state->stack[i].name);
+	    }
+	}
+	break;
+
+	case ARG_PATH:
+	{
+	    int i;
+	    arg = new_arg(aTHX_ args, slot, SVt_NULL);
+	    sv_setpvn(arg, "", 0);
+	    SvUTF8_off(arg);
+	    for (i = 0; i < p_state->stack_depth; i++) {
+		if (i)
+		    sv_catpvn(arg, "/", 1);
+		sv_catsv(arg, p_state->stack[i].name);
+	    }
+	}
+	break;
+
+	case ARG_PATHARR:
+	{
+	    int i;
+	    push_arg = 0;
+	    for (i = 0; i < p_state->stack_depth; i++) {
+		SV* name = newSVsv(p_state->stack[i].name);
+		if (array)
+		    av_push(array, name);
+		else
+		    XPUSHs(sv_2mortal(name));
+	    }
+	}
+	break;
+
+	case ARG_LINKS:
+	    push_arg = 0;
+	    if (event == E_START || event == E_ELEMENT) {
+		AV* links = array ? array : (AV*)sv_2mortal((SV*)newAV());
+		start_links(aTHX_ p_state, tokens, num_tokens, utf8, links);
+		if (!array) {
+		    int i;
+		    for (i = 0; i <= av_len(links); i++)
+			XPUSHs(*av_fetch(links, i, 0));
+		}
+	    }
+	    break;
+
 	default:
 	    arg = sv_2mortal(newSVpvf("Bad argspec %d", *s));
 	    break;
@@ -628,16 +3562,20 @@ report_event(PSTATE* p_state,
     else {
 	PUTBACK;
 
+	/* No G_EVAL here; the parse and eof methods use parse_guard()
+	 * to restore the parser state if the handler dies.
+	 */
 	if ((enum argcode)*argspec == ARG_SELF && !SvROK(h->cb)) {
-	    char *method = SvPV(h->cb, my_na);
-	    perl_call_method(method, G_DISCARD | G_EVAL | G_VOID);
+	    CV* cv = handler_method_cv(aTHX_ h, self);
+	    if (cv)
+		perl_call_sv((SV*)cv, G_DISCARD | G_VOID);
+	    else {
+		char *method = SvPV(h->cb, my_na);
+		perl_call_method(method, G_DISCARD | G_VOID);
+	    }
 	}
 	else {
-	    perl_call_sv(h->cb, G_DISCARD | G_EVAL | G_VOID);
-	}
-
-	if (SvTRUE(ERRSV)) {
-	    RETHROW;
+	    perl_call_sv(h->cb, G_DISCARD | G_VOID);
 	}
 
 	FREETMPS;
@@ -648,8 +3586,19 @@ report_event(PSTATE* p_state,
     return;
 
 IGNORE_EVENT:
+    if (p_state->rewrite_output && !p_state->rewrite_dropping &&
+	!p_state->sanitize_tags)
+    {
+	/* not reported, so copied as it is */
+	if (PEND_TEXT_OK(p_state) && !p_state->pend_text_flushing) {
+	    flush_pending_text(p_state, self);
+	    SPAGAIN;
+	}
+	serialize_held(aTHX_ p_state, 1);
+	rewrite_put(aTHX_ p_state, beg, end - beg, utf8);
+    }
     if (p_state->skipped_text) {
-	if (event != E_TEXT && p_state->pend_text && SvOK(p_state->pend_text))
+	if (event != E_TEXT && PEND_TEXT_OK(p_state))
 	    flush_pending_text(p_state, self);
 #ifdef UNICODE_HTML_PARSER
 	if (utf8 && !SvUTF8(p_state->skipped_text))
@@ -667,6 +3616,7 @@ IGNORE_EVENT:
 	}
 #endif
     }
+    stack_update(p_state, event);
 #undef CHR_DIST
     return;
 }
@@ -719,7 +3669,58 @@ argspec_compile(SV* src, PSTATE* p_state)
 	    }
 	    if (a < ARG_LITERAL) {
 		char c = (unsigned char) a;
-		sv_catpvn(argspec, &c, 1);
+		char *list = s;
+
+		while (isHSPACE(*list))
+		    list++;
+		if (*list == '(' && (a == ARG_ATTR || a == ARG_ATTRVAL)) {
+		    /* attribute name list */
+		    unsigned char n = 0;
+		    STRLEN n_pos;
+		    if (a == ARG_ATTR) {
+			a = ARG_ATTR_SUBSET;
+			c = (unsigned char) a;
+		    }
+		    sv_catpvn(argspec, &c, 1);
+		    n_pos = SvCUR(argspec);
+		    sv_catpvn(argspec, "", 1);  /* count, filled in below */
+		    s = list + 1;
+		    while (1) {
+			char *attr_name;
+			unsigned char len;
+			while (isHSPACE(*s))
+			    s++;
+			attr_name = s;
+			while (s < end && *s != ',' && *s != ')' && !isHSPACE(*s))
+			    s++;
+			if (s == attr_name || s - attr_name > 255)
+			    croak("Bad attribute name in argspec (%s)", attr_name);
+			if (n == 255)
+			    croak("Too many attribute names in argspec");
+			len = s - attr_name;
+			sv_catpvn(argspec, (char*)&len, 1);
+			sv_catpvn(argspec, attr_name, len);
+			n++;
+			while (isHSPACE(*s))
+			    s++;
+			if (*s == ',') {
+			    s++;
+			    continue;
+			}
+			if (*s == ')') {
+			    s++;
+			    break;
+			}
+			croak("Unterminated attribute list in argspec");
+		    }
+		    SvPVX(argspec)[n_pos] = (char)n;
+		}
+		else if (a == ARG_ATTRVAL) {
+		    croak("Missing attribute list for attrval in argspec");
+		}
+		else {
+		    sv_catpvn(argspec, &c, 1);
+		}
 
 		if (a == ARG_LINE || a == ARG_COLUMN) {
 		    if (!p_state->line)
@@ -730,7 +3731,9 @@ argspec_compile(SV* src, PSTATE* p_state)
 			p_state->skipped_text = newSVpvn("", 0);
                     }
                 }
-		if (a == ARG_ATTR || a == ARG_ATTRARR) {
+		if (a == ARG_ATTR || a == ARG_ATTRARR ||
+		    a == ARG_ATTR_SUBSET || a == ARG_ATTRVAL || a == ARG_LINKS)
+		{
 		    if (p_state->argspec_entity_decode != ARG_DTEXT)
 			p_state->argspec_entity_decode = ARG_ATTR;
 		}
@@ -794,40 +3797,585 @@ argspec_compile(SV* src, PSTATE* p_state)
     return argspec;
 }
 
-
+
+static bool
+argspec_uses(SV* argspec, const char *codes)
+{
+    char *s;
+    char *end;
+
+    if (!argspec)
+	return 0;
+    s = SvPVX(argspec);
+    end = s + SvCUR(argspec);
+    if (s < end && *s == ARG_FLAG_FLAT_ARRAY)
+	s++;
+    for (; s < end; s++) {
+	if (*s && strchr(codes, *s))
+	    return 1;
+	switch ((enum argcode)*s) {
+	case ARG_LITERAL:
+	    s += (unsigned char)s[1] + 1;
+	    break;
+	case ARG_ATTR_SUBSET:
+	case ARG_ATTRVAL:
+	{
+	    int n = (unsigned char)*++s;
+	    while (n--)
+		s += (unsigned char)s[1] + 1;
+	}
+	break;
+	default:
+	    break;
+	}
+    }
+    return 0;
+}
+
+/*
+ * Tag specific handlers.
+ *
+ *   tag_handler_fetch()  - finds (or creates) the handler for a tag
+ *   tag_handler_delete() - removes it again
+ *   tag_handlers_free()  - releases the hash of an event
+ */
+
+EXTERN void
+p_handler_clear(pTHX_ struct p_handler *h)
+{
+    SvREFCNT_dec(h->cb);
+    SvREFCNT_dec(h->argspec);
+    SvREFCNT_dec(h->args);
+    SvREFCNT_dec(h->method_cv);
+    Zero(h, 1, struct p_handler);
+}
+
+EXTERN struct p_handler*
+tag_handler_fetch(pTHX_ PSTATE* p_state, int event, SV* tagname, bool create)
+{
+    HV* hv = p_state->tag_handlers[event];
+    HE* he;
+    SV* sv;
+
+    if (!hv) {
+	if (!create)
+	    return 0;
+	hv = p_state->tag_handlers[event] = newHV();
+    }
+    he = hv_fetch_ent(hv, tagname, create, 0);
+    if (!he)
+	return 0;
+    sv = HeVAL(he);
+    if (!SvPOK(sv)) {
+	/* new entry */
+	SvUPGRADE(sv, SVt_PV);
+	SvGROW(sv, sizeof(struct p_handler) + 1);
+	Zero(SvPVX(sv), sizeof(struct p_handler), char);
+	SvCUR_set(sv, sizeof(struct p_handler));
+	SvPOK_only(sv);
+    }
+    return TAG_HANDLER(sv);
+}
+
+EXTERN void
+tag_handler_delete(pTHX_ PSTATE* p_state, int event, SV* tagname)
+{
+    HV* hv = p_state->tag_handlers[event];
+    struct p_handler *h = tag_handler_fetch(aTHX_ p_state, event, tagname, 0);
+    if (!h)
+	return;
+    p_handler_clear(aTHX_ h);
+    hv_delete_ent(hv, tagname, G_DISCARD, 0);
+    if (!HvKEYS(hv)) {
+	/* makes report_event() skip the lookup again */
+	SvREFCNT_dec(hv);
+	p_state->tag_handlers[event] = 0;
+    }
+}
+
+EXTERN void
+tag_handlers_free(pTHX_ HV* hv)
+{
+    HE* he;
+    if (!hv)
+	return;
+    hv_iterinit(hv);
+    while ((he = hv_iternext(hv)))
+	p_handler_clear(aTHX_ TAG_HANDLER(HeVAL(he)));
+    SvREFCNT_dec(hv);
+}
+
+/*
+ *   sel_handler_fetch()  - finds (or creates) the handler for a selector
+ *   sel_handler_delete() - removes it again
+ *   selectors_free()     - releases all selector handlers
+ */
+
+EXTERN struct p_handler*
+sel_handler_fetch(pTHX_ PSTATE* p_state, event_id_t event, SV* source, bool create)
+{
+    struct selector_set *set = p_state->selectors;
+    struct sel_handler *sh;
+    int i;
+
+    if (set) {
+	for (i = 0; i < set->count; i++) {
+	    sh = &set->handlers[i];
+	    if (sh->event == event && sv_eq(sh->source, source))
+		return &sh->h;
+	}
+    }
+    if (!create)
+	return 0;
+
+    if (!set) {
+	Newz(56, set, 1, struct selector_set);
+	set->refcnt = 1;
+	p_state->selectors = set;
+    }
+    /* each handler needs at least one part */
+    if (set->count >= SEL_MAX_PARTS)
+	croak("Too many compound selectors");
+    sh = &set->handlers[set->count];
+    Zero(sh, 1, struct sel_handler);
+    sh->source = sv_2mortal(newSVsv(source));
+    sh->event = event;
+    if (!sel_compile(aTHX_ set, sh))
+	croak("Bad selector (%s)", SvPV_nolen(source));
+    SvREFCNT_inc(sh->source);
+    set->count++;
+    return &sh->h;
+}
+
+EXTERN void
+sel_handler_delete(pTHX_ PSTATE* p_state, event_id_t event, SV* source)
+{
+    struct selector_set *set = p_state->selectors;
+    int i;
+
+    if (!set)
+	return;
+    for (i = 0; i < set->count; i++) {
+	if (set->handlers[i].event == event &&
+	    sv_eq(set->handlers[i].source, source))
+	    break;
+    }
+    if (i == set->count)
+	return;
+
+    p_handler_clear(aTHX_ &set->handlers[i].h);
+    SvREFCNT_dec(set->handlers[i].source);
+    set->count--;
+    Move(&set->handlers[i + 1], &set->handlers[i], set->count - i,
+	 struct sel_handler);
+
+    /* renumber the parts; the open elements lose their matches */
+    set->nparts = 0;
+    for (i = 0; i < set->count; i++)
+	sel_compile(aTHX_ set, &set->handlers[i]);
+    for (i = 0; i < p_state->stack_depth; i++) {
+	p_state->stack[i].sel_parts = 0;
+	p_state->stack[i].sel_above = 0;
+	p_state->stack[i].sel_match = 0;
+	p_state->stack[i].sel_inside = 0;
+    }
+    if (!set->count) {
+	Safefree(set);
+	p_state->selectors = 0;
+    }
+}
+
+EXTERN void
+selectors_free(pTHX_ struct selector_set *set)
+{
+    int i;
+    if (!set || --set->refcnt > 0)
+	return;
+    for (i = 0; i < set->count; i++) {
+	p_handler_clear(aTHX_ &set->handlers[i].h);
+	SvREFCNT_dec(set->handlers[i].source);
+    }
+    Safefree(set);
+}
+
+EXTERN struct selector_set*
+selectors_copy(pTHX_ const struct selector_set *set)
+{
+    /* the parts point into the sources, which the copy shares */
+    struct selector_set *set2;
+    int i;
+
+    New(56, set2, 1, struct selector_set);
+    Copy(set, set2, 1, struct selector_set);
+    set2->refcnt = 1;
+    for (i = 0; i < set2->count; i++) {
+	struct sel_handler *sh = &set2->handlers[i];
+	SvREFCNT_inc(sh->source);
+	SvREFCNT_inc(sh->h.cb);
+	SvREFCNT_inc(sh->h.argspec);
+	sh->h.args = 0;
+	sh->h.method_cv = 0;
+	sh->h.method_stash = 0;
+	sh->h.method_gen = 0;
+    }
+    return set2;
+}
+
+EXTERN void
+selectors_unshare(pTHX_ PSTATE* p_state)
+{
+    /* make the selector handlers of p_state its own before a change */
+    struct selector_set *set = p_state->selectors;
+    if (set && set->refcnt > 1) {
+	p_state->selectors = selectors_copy(aTHX_ set);
+	set->refcnt--;
+    }
+}
+
+static bool
+handler_uses(pTHX_ struct p_handler *h, const char *codes)
+{
+    return h->cb && (SvTYPE(h->cb) == SVt_PVAV || SvTRUE(h->cb)) &&
+	argspec_uses(h->argspec, codes);
+}
+
+static bool
+tag_handlers_use(pTHX_ HV* hv, const char *codes)
+{
+    HE* he;
+    if (!hv)
+	return 0;
+    hv_iterinit(hv);
+    while ((he = hv_iternext(hv))) {
+	if (handler_uses(aTHX_ TAG_HANDLER(HeVAL(he)), codes))
+	    return 1;
+    }
+    return 0;
+}
+
+EXTERN void
+check_handlers(PSTATE* p_state)
+{
+    /* find out if the handlers that start tags are reported to will
+     * look at the attributes.  If not, parse_start() can skip
+     * tokenizing them.  The element stack is only maintained if some
+     * handler asks for it.
+     */
+    struct p_handler *h = &p_state->handlers[E_START];
+    int i;
+    dTHX;
+
+    if (!h->cb)
+	h = &p_state->handlers[E_DEFAULT];
+    p_state->want_attr_tokens =
+	handler_uses(aTHX_ h, attr_argcodes) ||
+	handler_uses(aTHX_ &p_state->handlers[E_ELEMENT], attr_argcodes) ||
+	tag_handlers_use(aTHX_ p_state->tag_handlers[E_START], attr_argcodes) ||
+	tag_handlers_use(aTHX_ p_state->tag_handlers[E_ELEMENT], attr_argcodes) ||
+	p_state->head_scan || p_state->text_output || p_state->event_output ||
+	(p_state->rewrite_output &&
+	 (p_state->rewrite_tags || p_state->sanitize_tags ||
+	  p_state->serialize));
+
+    p_state->track_stack = 0;
+    if (p_state->selectors) {
+	struct selector_set *set = p_state->selectors;
+	for (i = 0; i < set->nparts; i++) {
+	    if (set->parts[i].nconds)
+		p_state->want_attr_tokens = 1;
+	}
+	for (i = 0; i < set->count; i++) {
+	    if (set->handlers[i].event == E_START &&
+		handler_uses(aTHX_ &set->handlers[i].h, attr_argcodes))
+		p_state->want_attr_tokens = 1;
+	}
+	p_state->track_stack = 1;
+    }
+    for (i = 0; !p_state->track_stack && i < EVENT_COUNT; i++) {
+	if (handler_uses(aTHX_ &p_state->handlers[i], stack_argcodes) ||
+	    tag_handlers_use(aTHX_ p_state->tag_handlers[i], stack_argcodes))
+	{
+	    p_state->track_stack = 1;
+	    break;
+	}
+    }
+    if (!p_state->track_stack) {
+	p_state->stack_depth = 0;
+	p_state->stack_pop_pending = 0;
+    }
+
+    /* only start and end tags can be filtered by report_tags */
+    p_state->prefilter_handlers_ok = 1;
+    for (i = 0; i < EVENT_COUNT; i++) {
+	struct p_handler *h = &p_state->handlers[i];
+	if (i == E_START || i == E_END || i == E_ELEMENT ||
+	    i == E_START_DOCUMENT || i == E_END_DOCUMENT)
+	    continue;
+	if (h->cb && (SvTYPE(h->cb) == SVt_PVAV || SvTRUE(h->cb) ||
+		      p_state->rewrite_output))
+	    p_state->prefilter_handlers_ok = 0;
+    }
+    /* the prefilter would copy the tags that have edits unchanged */
+    if (p_state->rewrite_output &&
+	(p_state->rewrite_tags || p_state->sanitize_tags ||
+	 p_state->serialize))
+	p_state->prefilter_handlers_ok = 0;
+    /* the event stream has all of the events, and the text and head
+     * of the document are made from more than the reported tags
+     */
+    if (p_state->event_output || p_state->text_output || p_state->head_scan)
+	p_state->prefilter_handlers_ok = 0;
+}
+
+
+static void
+pend_text_materialize(pTHX_ PSTATE* p_state)
+{
+    /* copy the pending text spans into pend_text */
+    SV* pend_text;
+    STRLEN len;
+    int i;
+
+    if (!p_state->pend_spans_count)
+	return;
+
+    if (!p_state->pend_text)
+	p_state->pend_text = newSV(256);
+    pend_text = p_state->pend_text;
+    if (!SvOK(pend_text)) {
+	sv_setpvn(pend_text, "", 0);
+	SvUTF8_off(pend_text);
+    }
+
+    len = SvCUR(pend_text);
+    for (i = 0; i < p_state->pend_spans_count; i++) {
+	struct text_span *span = &p_state->pend_spans[i];
+	len += span->end - span->beg;
+#ifdef UNICODE_HTML_PARSER
+	if (span->utf8 && !SvUTF8(pend_text))
+	    sv_utf8_upgrade(pend_text);
+#endif
+    }
+    SvGROW(pend_text, len + 1);
+
+    for (i = 0; i < p_state->pend_spans_count; i++) {
+	struct text_span *span = &p_state->pend_spans[i];
+#ifdef UNICODE_HTML_PARSER
+	if (span->utf8 || !SvUTF8(pend_text)) {
+	    sv_catpvn(pend_text, span->beg, span->end - span->beg);
+	}
+	else {
+#ifdef SV_CATBYTES
+	    sv_catpvn_flags(pend_text, span->beg, span->end - span->beg,
+			    SV_CATBYTES);
+#else
+	    SV *tmp = newSVpvn(span->beg, span->end - span->beg);
+	    sv_utf8_upgrade(tmp);
+	    sv_catsv(pend_text, tmp);
+	    SvREFCNT_dec(tmp);
+#endif
+	}
+#else
+	sv_catpvn(pend_text, span->beg, span->end - span->beg);
+#endif
+    }
+    p_state->pend_spans_count = 0;
+}
+
 static void
 flush_pending_text(PSTATE* p_state, SV* self)
 {
     dTHX;
-    bool   old_unbroken_text = p_state->unbroken_text;
-    SV*    old_pend_text     = p_state->pend_text;
+    SV*    pend_text         = p_state->pend_text;
     bool   old_is_cdata      = p_state->is_cdata;
     STRLEN old_offset        = p_state->offset;
     STRLEN old_line          = p_state->line;
     STRLEN old_column        = p_state->column;
 
-    assert(p_state->pend_text && SvOK(p_state->pend_text));
+    assert(PEND_TEXT_OK(p_state));
 
-    p_state->unbroken_text = 0;
-    p_state->pend_text     = 0;
+    /* The state is switched back in parse_unwind() if the handler
+     * dies, so pend_text and unbroken_text must stay in place.
+     */
+    p_state->pend_text_flushing = 1;
     p_state->is_cdata      = p_state->pend_text_is_cdata;
     p_state->offset        = p_state->pend_text_offset;
     p_state->line          = p_state->pend_text_line;
     p_state->column        = p_state->pend_text_column;
 
-    report_event(p_state, E_TEXT,
-		 SvPVX(old_pend_text), SvEND(old_pend_text),
-		 SvUTF8(old_pend_text), 0, 0, self);
-    SvOK_off(old_pend_text);
+    if (p_state->pend_spans_count == 1 && !(pend_text && SvOK(pend_text))) {
+	/* report it directly from the buffer */
+	struct text_span span = p_state->pend_spans[0];
+	p_state->pend_spans_count = 0;
+	report_event(p_state, E_TEXT, span.beg, span.end, span.utf8,
+		     0, 0, self);
+    }
+    else {
+	pend_text_materialize(aTHX_ p_state);
+	pend_text = p_state->pend_text;
+	report_event(p_state, E_TEXT,
+		     SvPVX(pend_text), SvEND(pend_text),
+		     SvUTF8(pend_text), 0, 0, self);
+	SvOK_off(pend_text);
+    }
 
-    p_state->unbroken_text = old_unbroken_text;
-    p_state->pend_text     = old_pend_text;
+    p_state->pend_text_flushing = 0;
     p_state->is_cdata      = old_is_cdata;
     p_state->offset        = old_offset;
     p_state->line          = old_line;
     p_state->column        = old_column;
 }
 
+/*
+ * Literal mode elements.
+ *
+ *   literal_set_compile()  - builds a set from a list of tag names
+ *   literal_tag_lookup()   - finds the set entry for a tag name
+ *   literal_tags_replace() - installs a new set for the parser
+ */
+
+static const struct literal_tag*
+literal_tag_lookup(const struct literal_set *set, const char *name, STRLEN len)
+{
+    int i;
+    if (!(set->len_mask & LITERAL_LEN_BIT(len)))
+	return 0;
+    for (i = 0; i < set->count; i++) {
+	const struct literal_tag *lt = &set->tags[i];
+	if ((STRLEN)lt->len == len && strnEQx(name, lt->str, len, 1))
+	    return lt;
+    }
+    return 0;
+}
+
+static void
+literal_set_add(pTHX_ struct literal_set *set, const char *name, STRLEN len)
+{
+    struct literal_tag *lt;
+    const struct literal_tag *builtin;
+    STRLEN i;
+
+    if (!len || literal_tag_lookup(set, name, len))
+	return;
+
+    lt = &set->tags[set->count++];
+    builtin = literal_tag_lookup(&literal_mode_default, name, len);
+    if (builtin) {
+	*lt = *builtin;
+	lt->str = savepvn(builtin->str, len);
+    }
+    else {
+	/* unknown elements behave like <script> */
+	lt->len = len;
+	lt->str = savepvn(name, len);
+	for (i = 0; i < len; i++)
+	    lt->str[i] = toLOWER(lt->str[i]);
+	lt->is_cdata = 1;
+	lt->eof_action = LITERAL_EOF_EMPTY;
+    }
+    set->len_mask |= LITERAL_LEN_BIT(len);
+}
+
+EXTERN struct literal_set*
+literal_set_compile(pTHX_ SV** names, int items)
+{
+    struct literal_set *set;
+    int max = 0;
+    int i;
+
+    for (i = 0; i < items; i++) {
+	SV* sv = names[i];
+	if (SvROK(sv)) {
+	    if (SvTYPE(SvRV(sv)) != SVt_PVAV)
+		croak("Tag list must be plain scalars and arrays");
+	    max += av_len((AV*)SvRV(sv)) + 1;
+	}
+	else {
+	    max++;
+	}
+    }
+
+    Newz(56, set, 1, struct literal_set);
+    Newz(56, set->tags, max ? max : 1, struct literal_tag);
+
+    for (i = 0; i < items; i++) {
+	SV* sv = names[i];
+	STRLEN len;
+	char *name;
+	if (SvROK(sv)) {
+	    AV* av = (AV*)SvRV(sv);
+	    STRLEN j;
+	    STRLEN av_items = av_len(av) + 1;
+	    for (j = 0; j < av_items; j++) {
+		SV**svp = av_fetch(av, j, 0);
+		if (svp) {
+		    name = SvPV(*svp, len);
+		    literal_set_add(aTHX_ set, name, len);
+		}
+	    }
+	}
+	else {
+	    name = SvPV(sv, len);
+	    literal_set_add(aTHX_ set, name, len);
+	}
+    }
+    return set;
+}
+
+EXTERN struct literal_set*
+literal_set_dup(pTHX_ const struct literal_set *set)
+{
+    struct literal_set *set2;
+    int i;
+
+    Newz(56, set2, 1, struct literal_set);
+    Newz(56, set2->tags, set->count ? set->count : 1, struct literal_tag);
+    set2->len_mask = set->len_mask;
+    set2->count = set->count;
+    for (i = 0; i < set->count; i++) {
+	set2->tags[i] = set->tags[i];
+	set2->tags[i].str = savepvn(set->tags[i].str, set->tags[i].len);
+    }
+    return set2;
+}
+
+EXTERN void
+literal_set_free(struct literal_set *set)
+{
+    int i;
+    if (!set)
+	return;
+    for (i = 0; i < set->count; i++)
+	Safefree(set->tags[i].str);
+    Safefree(set->tags);
+    Safefree(set);
+}
+
+EXTERN void
+literal_tags_replace(PSTATE* p_state, struct literal_set *set)
+{
+    struct literal_set *old_set = p_state->literal_tags;
+    p_state->literal_tags = set;
+    p_state->checkpoints_count = 0;  /* they point into the old set */
+
+    /* keep pointing at a live entry (or leave literal_mode if the
+     * element is no longer a literal one)
+     */
+    if (p_state->literal_mode) {
+	const struct literal_tag *lt = p_state->literal_mode;
+	p_state->literal_mode = literal_tag_lookup(LITERAL_SET(p_state),
+						   lt->str, lt->len);
+	if (!p_state->literal_mode)
+	    p_state->is_cdata = 0;
+    }
+    if (p_state->pending_end_tag) {
+	const struct literal_tag *lt = p_state->pending_end_tag;
+	p_state->pending_end_tag = literal_tag_lookup(LITERAL_SET(p_state),
+						      lt->str, lt->len);
+    }
+    literal_set_free(old_set);
+}
+
 static char*
 skip_until_gt(char *beg, char *end)
 {
@@ -1264,6 +4812,105 @@ DECL_FAIL:
 }
 
 
+static char*
+skip_attrs(PSTATE* p_state, char *s, char *end,
+	   hctype_t attr_name_first, hctype_t attr_name_char)
+{
+    /* Walks the attributes of a start tag with the same rules as the
+     * attribute loop of parse_start(), but without recording any
+     * tokens.  Returns where that loop would have stopped, or 0 if
+     * the tag is not complete yet.
+     */
+    bool allow_empty = ALLOW_EMPTY_TAG(p_state);
+
+    while (isHCTYPE(*s, attr_name_first)) {
+	if (*s == '/' && allow_empty) {
+	    if ((s + 1) == end)
+		return 0;
+	    if (*(s + 1) == '>')
+		break;
+	}
+	s++;
+	while (s < end && isHCTYPE(*s, attr_name_char)) {
+	    if (*s == '/' && allow_empty) {
+		if ((s + 1) == end)
+		    return 0;
+		if (*(s + 1) == '>')
+		    break;
+	    }
+	    s++;
+	}
+
+	while (isHSPACE(*s))
+	    s++;
+	if (s == end)
+	    return 0;
+
+	if (*s == '=') {
+	    s++;
+	    while (isHSPACE(*s))
+		s++;
+	    if (s == end)
+		return 0;
+	    if (*s == '>')
+		break;
+	    if (*s == '"' || *s == '\'' || (*s == '`' && p_state->backquote)) {
+		char *str_end = (char*)memchr(s + 1, *s, end - s - 1);
+		if (!str_end)
+		    return 0;
+		s = str_end + 1;
+	    }
+	    else {
+		while (s < end && isHNOT_SPACE_GT(*s)) {
+		    if (*s == '/' && allow_empty) {
+			if ((s + 1) == end)
+			    return 0;
+			if (*(s + 1) == '>')
+			    break;
+		    }
+		    s++;
+		}
+		if (s == end)
+		    return 0;
+	    }
+	    while (isHSPACE(*s))
+		s++;
+	    if (s == end)
+		return 0;
+	}
+    }
+    return s;
+}
+
+static char*
+element_end(PSTATE* p_state, char *s, char *end, token_pos_t *tag,
+	    const struct literal_tag *lt, char **text_end)
+{
+    /* Look for the end tag of the element whose start tag ends at 's',
+     * with nothing but text in between.  Returns the position after
+     * the end tag, or 0 if the element can't be reported as a whole
+     * from this buffer.
+     */
+    STRLEN len = tag->end - tag->beg;
+    while ((s = (char*)memchr(s, '<', end - s))) {
+	if ((STRLEN)(end - s) > len + 2 && s[1] == '/' &&
+	    strnEQx(s + 2, tag->beg, len, !CASE_SENSITIVE(p_state)))
+	{
+	    char *t = s + 2 + len;
+	    while (t < end && isHSPACE(*t))
+		t++;
+	    if (t < end && *t == '>') {
+		*text_end = s;
+		return t + 1;
+	    }
+	}
+	if (!lt)
+	    return 0;  /* markup inside the element */
+	s++;
+    }
+    return 0;
+}
+
 static char*
 parse_start(PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 {
@@ -1302,18 +4949,18 @@ parse_start(PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
     if (s == end)
 	goto PREMATURE;
 
-    while (isHCTYPE(*s, attr_name_first)) {
-	/* attribute */
-	char *attr_name_beg = s;
-	char *attr_name_end;
-	if (*s == '/' && ALLOW_EMPTY_TAG(p_state)) {
-	    if ((s + 1) == end)
-		goto PREMATURE;
-	    if (*(s + 1) == '>')
-		break;
-	}
-	s++;
-	while (s < end && isHCTYPE(*s, attr_name_char)) {
+    if (!p_state->want_attr_tokens) {
+	/* nobody looks at the attributes, so just find the end of the tag */
+	char *tmp = skip_attrs(p_state, s, end, attr_name_first, attr_name_char);
+	if (!tmp)
+	    goto PREMATURE;
+	s = tmp;
+    }
+    else {
+	while (isHCTYPE(*s, attr_name_first)) {
+	    /* attribute */
+	    char *attr_name_beg = s;
+	    char *attr_name_end;
 	    if (*s == '/' && ALLOW_EMPTY_TAG(p_state)) {
 		if ((s + 1) == end)
 		    goto PREMATURE;
@@ -1321,62 +4968,71 @@ parse_start(PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 		    break;
 	    }
 	    s++;
-	}
-	if (s == end)
-	    goto PREMATURE;
-
-	attr_name_end = s;
-	PUSH_TOKEN(attr_name_beg, attr_name_end); /* attr name */
+	    while (s < end && isHCTYPE(*s, attr_name_char)) {
+		if (*s == '/' && ALLOW_EMPTY_TAG(p_state)) {
+		    if ((s + 1) == end)
+			goto PREMATURE;
+		    if (*(s + 1) == '>')
+			break;
+		}
+		s++;
+	    }
+	    if (s == end)
+		goto PREMATURE;
 
-	while (isHSPACE(*s))
-	    s++;
-	if (s == end)
-	    goto PREMATURE;
+	    attr_name_end = s;
+	    PUSH_TOKEN(attr_name_beg, attr_name_end); /* attr name */
 
-	if (*s == '=') {
-	    /* with a value */
-	    s++;
 	    while (isHSPACE(*s))
 		s++;
 	    if (s == end)
 		goto PREMATURE;
-	    if (*s == '>') {
-		/* parse it similar to ="" */
-		PUSH_TOKEN(s, s);
-		break;
-	    }
-	    if (*s == '"' || *s == '\'' || (*s == '`' && p_state->backquote)) {
-		char *str_beg = s;
+
+	    if (*s == '=') {
+		/* with a value */
 		s++;
-		while (s < end && *s != *str_beg)
+		while (isHSPACE(*s))
 		    s++;
 		if (s == end)
 		    goto PREMATURE;
-		s++;
-		PUSH_TOKEN(str_beg, s);
-	    }
-	    else {
-		char *word_start = s;
-		while (s < end && isHNOT_SPACE_GT(*s)) {
-		    if (*s == '/' && ALLOW_EMPTY_TAG(p_state)) {
-			if ((s + 1) == end)
-			    goto PREMATURE;
-			if (*(s + 1) == '>')
-			    break;
-		    }
+		if (*s == '>') {
+		    /* parse it similar to ="" */
+		    PUSH_TOKEN(s, s);
+		    break;
+		}
+		if (*s == '"' || *s == '\'' || (*s == '`' && p_state->backquote)) {
+		    char *str_beg = s;
+		    s++;
+		    while (s < end && *s != *str_beg)
+			s++;
+		    if (s == end)
+			goto PREMATURE;
 		    s++;
+		    PUSH_TOKEN(str_beg, s);
+		}
+		else {
+		    char *word_start = s;
+		    while (s < end && isHNOT_SPACE_GT(*s)) {
+			if (*s == '/' && ALLOW_EMPTY_TAG(p_state)) {
+			    if ((s + 1) == end)
+				goto PREMATURE;
+			    if (*(s + 1) == '>')
+				break;
+			}
+			s++;
+		    }
+		    if (s == end)
+			goto PREMATURE;
+		    PUSH_TOKEN(word_start, s);
 		}
+		while (isHSPACE(*s))
+		    s++;
 		if (s == end)
 		    goto PREMATURE;
-		PUSH_TOKEN(word_start, s);
 	    }
-	    while (isHSPACE(*s))
-		s++;
-	    if (s == end)
-		goto PREMATURE;
-	}
-	else {
-	    PUSH_TOKEN(0, 0); /* boolean attr value */
+	    else {
+		PUSH_TOKEN(0, 0); /* boolean attr value */
+	    }
 	}
     }
 
@@ -1388,8 +5044,32 @@ parse_start(PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
     }
 
     if (*s == '>') {
+	const struct literal_tag *lt = 0;
 	s++;
 	/* done */
+	if (!empty_tag && element_wanted(p_state, tokens, utf8)) {
+	    /* report the whole element if it is all here */
+	    char *text_end;
+	    char *elem_end;
+	    if (!p_state->xml_mode)
+		lt = literal_tag_lookup(LITERAL_SET(p_state), tokens[0].beg,
+					tokens[0].end - tokens[0].beg);
+	    if (lt && strEQ(lt->str, "plaintext") && !p_state->closing_plaintext)
+		elem_end = 0;  /* never ends */
+	    else
+		elem_end = element_end(p_state, s, end, tokens, lt, &text_end);
+	    if (elem_end) {
+		p_state->element_text_beg = s;
+		p_state->element_text_end = text_end;
+		p_state->is_cdata = lt && lt->is_cdata;
+		report_event(p_state, E_ELEMENT, beg, elem_end, utf8,
+			     tokens, num_tokens, self);
+		p_state->is_cdata = 0;
+		FREE_TOKENS;
+		return elem_end;
+	    }
+	}
+
 	report_event(p_state, E_START, beg, s, utf8, tokens, num_tokens, self);
 	if (empty_tag) {
 	    report_event(p_state, E_END, s, s, utf8, tokens, 1, self);
@@ -1397,32 +5077,12 @@ parse_start(PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 	else if (!p_state->xml_mode) {
 	    /* find out if this start tag should put us into literal_mode
 	     */
-	    int i;
-	    int tag_len = tokens[0].end - tokens[0].beg;
-
-	    for (i = 0; literal_mode_elem[i].len; i++) {
-		if (tag_len == literal_mode_elem[i].len) {
-		    /* try to match it */
-		    char *s = beg + 1;
-		    char *t = literal_mode_elem[i].str;
-		    int len = tag_len;
-		    while (len) {
-			if (toLOWER(*s) != *t)
-			    break;
-			s++;
-			t++;
-			if (!--len) {
-			    /* found it */
-			    p_state->literal_mode = literal_mode_elem[i].str;
-			    p_state->is_cdata = literal_mode_elem[i].is_cdata;
-			    /* printf("Found %s\n", p_state->literal_mode); */
-			    goto END_OF_LITERAL_SEARCH;
-			}
-		    }
-		}
+	    lt = literal_tag_lookup(LITERAL_SET(p_state),
+				    tokens[0].beg, tokens[0].end - tokens[0].beg);
+	    if (lt) {
+		p_state->literal_mode = lt;
+		p_state->is_cdata = lt->is_cdata;
 	    }
-	END_OF_LITERAL_SEARCH:
-	    ;
 	}
 
 	FREE_TOKENS;
@@ -1540,6 +5200,131 @@ parse_null(PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 #include "pfunc.h"                   /* declares the parsefunc[] */
 #endif /* USE_PFUNC */
 
+EXTERN void
+prefilter_update(pTHX_ PSTATE* p_state)
+{
+    /* compile the names the prefilter has to stop at */
+    HV* lists[2];
+    AV* names;
+    SV* ref;
+    int i;
+
+    literal_set_free(p_state->prefilter_tags);
+    p_state->prefilter_tags = 0;
+    if (!p_state->report_tags)
+	return;
+
+    names = (AV*)sv_2mortal((SV*)newAV());
+    lists[0] = p_state->report_tags;
+    lists[1] = p_state->ignore_elements;
+    for (i = 0; i < 2; i++) {
+	HE* he;
+	if (!lists[i])
+	    continue;
+	hv_iterinit(lists[i]);
+	while ((he = hv_iternext(lists[i]))) {
+	    STRLEN len;
+	    char *key = HePV(he, len);
+	    av_push(names, newSVpvn(key, len));
+	}
+    }
+    ref = sv_2mortal(newRV_inc((SV*)names));
+    p_state->prefilter_tags = literal_set_compile(aTHX_ &ref, 1);
+}
+
+static char*
+prefilter_skip(PSTATE* p_state, char *s, char *end)
+{
+    /* Skips text and tags that can't give any reported event.  Stops
+     * at the '<' of a tag named in report_tags or ignore_elements, of
+     * a literal element, or of a comment, declaration or processing
+     * instruction, or at anything that is not complete yet.  Tags are
+     * walked with the same rules as parse_start() and parse_end(), so
+     * a '<' inside an attribute value is not mistaken for a tag.
+     */
+    hctype_t name_first, name_char, attr_name_first, attr_name_char;
+    bool allow_empty = ALLOW_EMPTY_TAG(p_state);
+
+    if (STRICT_NAMES(p_state)) {
+	name_first = attr_name_first = HCTYPE_NAME_FIRST;
+	name_char  = attr_name_char  = HCTYPE_NAME_CHAR;
+    }
+    else {
+	name_first = name_char = HCTYPE_NOT_SPACE_GT;
+	attr_name_first = HCTYPE_NOT_SPACE_GT;
+	attr_name_char  = HCTYPE_NOT_SPACE_EQ_GT;
+    }
+
+    while (s < end) {
+	char *tag = (char*)memchr(s, '<', end - s);
+	char *name;
+	bool is_end;
+
+	if (!tag)
+	    return end;
+	s = tag + 1;
+	if (s == end)
+	    return tag;
+
+	is_end = (*s == '/');
+	if (is_end) {
+	    s++;
+	    if (s == end || !isHCTYPE(*s, name_first))
+		return tag;
+	}
+	else if (!isHNAME_FIRST(*s)) {
+	    if (*s == '!' || *s == '?')
+		return tag;
+	    continue;  /* just text */
+	}
+
+	name = s;
+	while (s < end && isHCTYPE(*s, name_char)) {
+	    if (!is_end && *s == '/' && allow_empty) {
+		if ((s + 1) == end)
+		    return tag;
+		if (*(s + 1) == '>')
+		    break;
+	    }
+	    s++;
+	}
+	if (s == end ||
+	    literal_tag_lookup(p_state->prefilter_tags, name, s - name) ||
+	    (!is_end && !p_state->xml_mode &&
+	     literal_tag_lookup(LITERAL_SET(p_state), name, s - name)))
+	    return tag;
+
+	if (is_end) {
+	    if (p_state->strict_end)
+		return tag;
+	    s = skip_until_gt(s, end);
+	    if (s == end)
+		return tag;
+	    s++;
+	}
+	else {
+	    while (isHSPACE(*s))
+		s++;
+	    if (s == end)
+		return tag;
+	    s = skip_attrs(p_state, s, end, attr_name_first, attr_name_char);
+	    if (!s)
+		return tag;
+	    if (allow_empty && *s == '/') {
+		s++;
+		if (s == end)
+		    return tag;
+	    }
+	    if (*s != '>') {
+		s = tag + 1;  /* not a tag after all */
+		continue;
+	    }
+	    s++;
+	}
+    }
+    return s;
+}
+
 static char*
 parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 {
@@ -1547,7 +5332,7 @@ parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
     char *t = beg;
     char *new_pos;
 
-    while (!p_state->eof) {
+    while (!p_state->eof && !p_state->paused) {
 	/*
 	 * At the start of this loop we will always be ready for eating text
 	 * or a new tag.  We will never be inside some tag.  The 't' points
@@ -1555,14 +5340,11 @@ parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 	 */
 
 	while (p_state->literal_mode) {
-	    char *l = p_state->literal_mode;
+	    const char *l = p_state->literal_mode->str;
 	    char *end_text;
 
-	    while (s < end && *s != '<') {
-		s++;
-	    }
-
-	    if (s == end) {
+	    s = (char*)memchr(s, '<', end - s);
+	    if (!s) {
 		s = t;
 		goto DONE;
 	    }
@@ -1578,7 +5360,7 @@ parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 		    l++;
 		}
 
-		if (!*l && (strNE(p_state->literal_mode, "plaintext") || p_state->closing_plaintext)) {
+		if (!*l && (strNE(p_state->literal_mode->str, "plaintext") || p_state->closing_plaintext)) {
 		    /* matched it all */
 		    token_pos_t end_token;
 		    end_token.beg = end_text + 2;
@@ -1618,6 +5400,8 @@ parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 		    t = s;
 		    SvREFCNT_dec(av_pop(p_state->ms_stack));
 		    marked_section_update(p_state);
+		    if (p_state->paused)
+			break;
 		    continue;
 		}
 	    }
@@ -1628,11 +5412,46 @@ parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 	}
 #endif
 
+	if (p_state->paused) {
+	    s = t;
+	    break;
+	}
+
+	if (s == t && p_state->prefilter_tags &&
+	    p_state->prefilter_handlers_ok &&
+	    !p_state->track_stack && !p_state->pending_end_tag
+#ifdef MARKED_SECTION
+	    && !p_state->ms
+#endif
+	   )
+	{
+	    /* nothing but tags from report_tags can be reported */
+	    char *skip_end = prefilter_skip(p_state, t, end);
+	    if (skip_end != t) {
+		report_event(p_state, E_NONE, t, skip_end, utf8, 0, 0, self);
+		t = s = skip_end;
+		continue;
+	    }
+	}
+
 	/* first we try to match as much text as possible */
+#ifdef MARKED_SECTION
+	if (!p_state->ms)
+#endif
+	{
+	    s = (char*)memchr(s, '<', end - s);
+	    if (!s)
+		s = end;
+	}
 	while (s < end && *s != '<') {
 #ifdef MARKED_SECTION
 	    if (p_state->ms && *s == ']') {
 		char *end_text = s;
+		if (end - s < 3) {
+		    /* might be a chopped up "]]>", wait for more */
+		    if (s + 1 == end || s[1] == ']')
+			break;
+		}
 		s++;
 		if (*s == ']') {
 		    s++;
@@ -1645,6 +5464,8 @@ parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 			t = s;
 			SvREFCNT_dec(av_pop(p_state->ms_stack));
 			marked_section_update(p_state);
+			if (p_state->paused)
+			    break;
 			continue;
 		    }
 		}
@@ -1678,6 +5499,11 @@ parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 	    }
 	}
 
+	if (p_state->paused) {
+	    s = t;
+	    break;
+	}
+
 	if (end - s < 3)
 	    break;
 
@@ -1707,30 +5533,690 @@ parse_buf(pTHX_ PSTATE* p_state, char *beg, char *end, U32 utf8, SV* self)
 	    }
 	    t = s = new_pos;
 	}
-
-	/* if we get out here then this was not a conforming tag, so
-	 * treat it is plain text at the top of the loop again (we
-	 * have already skipped past the "<").
-	 */
+
+	/* if we get out here then this was not a conforming tag, so
+	 * treat it is plain text at the top of the loop again (we
+	 * have already skipped past the "<").
+	 */
+    }
+
+DONE:
+    return s;
+
+}
+
+/*
+ * With the input_encoding option parse() takes bytes and turns them
+ * into characters a chunk at a time, before parse_buf() sees them.
+ *
+ *   input_encoding_find() - looks up an encoding label
+ *   input_sniff()         - finds the encoding of a document
+ *   input_transcode()     - turns bytes into UTF-8
+ *   input_decode()        - turns a chunk into characters
+ */
+
+#define INENC_AUTO      1
+#define INENC_UTF8      2
+#define INENC_UTF16LE   3
+#define INENC_UTF16BE   4
+#define INENC_CP1252    5
+
+#define INPUT_PRESCAN   1024  /* bytes looked at for <meta charset> */
+
+/* the names input_encoding() and document_encoding() return */
+static const char * const input_names[] = {
+    0, "auto", "UTF-8", "UTF-16LE", "UTF-16BE", "windows-1252"
+};
+
+#ifdef UNICODE_HTML_PARSER
+
+static const struct {
+    const char *label;
+    int enc;
+} input_labels[] = {
+    { "utf-8",             INENC_UTF8 },
+    { "utf8",              INENC_UTF8 },
+    { "unicode-1-1-utf-8", INENC_UTF8 },
+    { "utf-16le",          INENC_UTF16LE },
+    { "utf-16",            INENC_UTF16LE },
+    { "utf-16be",          INENC_UTF16BE },
+    /* HTML5 takes ASCII and ISO-8859-1 to mean windows-1252 */
+    { "windows-1252",      INENC_CP1252 },
+    { "cp1252",            INENC_CP1252 },
+    { "x-cp1252",          INENC_CP1252 },
+    { "iso-8859-1",        INENC_CP1252 },
+    { "iso8859-1",         INENC_CP1252 },
+    { "iso88591",          INENC_CP1252 },
+    { "iso_8859-1",        INENC_CP1252 },
+    { "iso_8859-1:1987",   INENC_CP1252 },
+    { "iso-ir-100",        INENC_CP1252 },
+    { "latin1",            INENC_CP1252 },
+    { "l1",                INENC_CP1252 },
+    { "csisolatin1",       INENC_CP1252 },
+    { "cp819",             INENC_CP1252 },
+    { "ibm819",            INENC_CP1252 },
+    { "us-ascii",          INENC_CP1252 },
+    { "ascii",             INENC_CP1252 },
+    { "ansi_x3.4-1968",    INENC_CP1252 },
+    { 0, 0 }
+};
+
+/* windows-1252 0x80 to 0x9F, the rest is ISO-8859-1 */
+static const U16 input_cp1252[32] = {
+    0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021,
+    0x02C6, 0x2030, 0x0160, 0x2039, 0x0152, 0x008D, 0x017D, 0x008F,
+    0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022, 0x2013, 0x2014,
+    0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178
+};
+
+#define INPUT_SPACE(c) \
+	((c) == ' ' || (c) == '\t' || (c) == '\n' || (c) == '\f' || (c) == '\r')
+
+static int
+input_encoding_find(const char *s, STRLEN len)
+{
+    /* returns the INENC_* of an encoding label, or 0 */
+    int i;
+    while (len && INPUT_SPACE(*s)) {
+	s++;
+	len--;
+    }
+    while (len && INPUT_SPACE(s[len - 1]))
+	len--;
+    for (i = 0; input_labels[i].label; i++) {
+	const char *l = input_labels[i].label;
+	STRLEN j;
+	if (strlen(l) != len)
+	    continue;
+	for (j = 0; j < len && toLOWER(s[j]) == l[j]; j++)
+	    ;
+	if (j == len)
+	    return input_labels[i].enc;
+    }
+    return 0;
+}
+
+static bool
+input_attr(const U8 **sp, const U8 *end,
+	   char *name, STRLEN name_max, char *val, STRLEN val_max)
+{
+    /* reads the next attribute of a tag the way the prescan does,
+     * lowercased and cut to fit.  Returns FALSE at the end of the tag.
+     */
+    const U8 *s = *sp;
+    STRLEN n = 0, v = 0;
+
+    while (s < end && (INPUT_SPACE(*s) || *s == '/'))
+	s++;
+    if (s == end || *s == '>') {
+	*sp = s;
+	return 0;
+    }
+    do {
+	if (*s == '=' && n)
+	    break;
+	if (INPUT_SPACE(*s)) {
+	    while (s < end && INPUT_SPACE(*s))
+		s++;
+	    if (s == end || *s != '=')
+		goto DONE;
+	    break;
+	}
+	if (*s == '/' || *s == '>')
+	    goto DONE;
+	if (n < name_max)
+	    name[n++] = toLOWER(*s);
+	s++;
+    } while (s < end);
+    if (s == end)
+	goto DONE;
+
+    s++;  /* the '=' */
+    while (s < end && INPUT_SPACE(*s))
+	s++;
+    if (s < end && (*s == '"' || *s == '\'')) {
+	U8 quote = *s++;
+	while (s < end && *s != quote) {
+	    if (v < val_max)
+		val[v++] = toLOWER(*s);
+	    s++;
+	}
+	if (s < end)
+	    s++;
+    }
+    else {
+	while (s < end && !INPUT_SPACE(*s) && *s != '>') {
+	    if (v < val_max)
+		val[v++] = toLOWER(*s);
+	    s++;
+	}
+    }
+
+  DONE:
+    name[n] = '\0';
+    val[v] = '\0';
+    *sp = s;
+    return 1;
+}
+
+static int
+input_content_charset(const char *s)
+{
+    /* the charset of a <meta content="text/html; charset=..."> */
+    const char *e;
+    while ((s = strstr(s, "charset"))) {
+	s += 7;
+	while (INPUT_SPACE(*s))
+	    s++;
+	if (*s != '=')
+	    continue;
+	s++;
+	while (INPUT_SPACE(*s))
+	    s++;
+	if (*s == '"' || *s == '\'') {
+	    if (!(e = strchr(s + 1, *s)))
+		return 0;
+	    s++;
+	}
+	else
+	    for (e = s; *e && !INPUT_SPACE(*e) && *e != ';'; e++)
+		;
+	return input_encoding_find(s, e - s);
+    }
+    return 0;
+}
+
+static int
+input_prescan(const U8 *s, const U8 *end)
+{
+    /* the <meta> prescan of HTML5; returns 0 if nothing was found */
+    char name[16], val[128];
+
+    while (s < end) {
+	if (*s != '<') {
+	    s++;
+	    continue;
+	}
+	if (end - s >= 4 && memEQ(s, "<!--", 4)) {
+	    for (s += 2; s + 3 <= end && !memEQ(s, "-->", 3); s++)
+		;
+	    if (s + 3 > end)
+		return 0;
+	    s += 3;
+	}
+	else if (end - s >= 6 && toLOWER(s[1]) == 'm' && toLOWER(s[2]) == 'e' &&
+		 toLOWER(s[3]) == 't' && toLOWER(s[4]) == 'a' &&
+		 (INPUT_SPACE(s[5]) || s[5] == '/'))
+	{
+	    bool got_pragma = 0, seen_content = 0, seen_charset = 0;
+	    int need_pragma = -1;  /* not known */
+	    int enc = 0;
+
+	    s += 5;
+	    while (input_attr(&s, end, name, sizeof(name) - 1,
+			      val, sizeof(val) - 1))
+	    {
+		if (strEQ(name, "http-equiv")) {
+		    if (strEQ(val, "content-type"))
+			got_pragma = 1;
+		}
+		else if (strEQ(name, "content")) {
+		    if (!seen_content && need_pragma < 0 &&
+			(enc = input_content_charset(val)))
+			need_pragma = 1;
+		    seen_content = 1;
+		}
+		else if (strEQ(name, "charset") && !seen_charset) {
+		    enc = input_encoding_find(val, strlen(val));
+		    need_pragma = 0;
+		    seen_charset = 1;
+		}
+	    }
+	    if (s == end)
+		return 0;  /* the value might go on */
+	    if (enc && (need_pragma == 0 || got_pragma)) {
+		/* a document that can say so isn't UTF-16 */
+		if (enc == INENC_UTF16LE || enc == INENC_UTF16BE)
+		    enc = INENC_UTF8;
+		return enc;
+	    }
+	    s++;
+	}
+	else if (end - s >= 3 && (isALPHA(s[1]) || (s[1] == '/' && isALPHA(s[2])))) {
+	    for (s += 2; s < end && !INPUT_SPACE(*s) && *s != '>'; s++)
+		;
+	    while (input_attr(&s, end, name, sizeof(name) - 1,
+			      val, sizeof(val) - 1))
+		;
+	    s++;
+	}
+	else if (end - s >= 2 && (s[1] == '!' || s[1] == '/' || s[1] == '?')) {
+	    for (s += 2; s < end && *s != '>'; s++)
+		;
+	    s++;
+	}
+	else
+	    s++;
+    }
+    return 0;
+}
+
+static int
+input_sniff(pTHX_ int enc, const U8 *s, STRLEN len, bool eof, STRLEN *bom)
+{
+    /* returns the encoding of the document starting with s, or 0 if
+     * that takes more of it
+     */
+    if (len >= 3 && s[0] == 0xEF && s[1] == 0xBB && s[2] == 0xBF) {
+	*bom = 3;
+	return INENC_UTF8;
+    }
+    if (len >= 2 && s[0] == 0xFE && s[1] == 0xFF) {
+	*bom = 2;
+	return INENC_UTF16BE;
+    }
+    if (len >= 2 && s[0] == 0xFF && s[1] == 0xFE) {
+	*bom = 2;
+	return INENC_UTF16LE;
+    }
+    if (len < 3 && !eof)
+	return 0;
+    if (enc != INENC_AUTO)
+	return enc;
+
+    if (len > INPUT_PRESCAN)
+	len = INPUT_PRESCAN;
+    if ((enc = input_prescan(s, s + len)))
+	return enc;
+    if (len < INPUT_PRESCAN && !eof)
+	return 0;
+
+    /* no label, so guess */
+    if (probably_utf8_chunk(aTHX_ (char*)s, len))
+	return INENC_UTF8;
+    return INENC_CP1252;
+}
+
+static U8*
+input_put(U8 *d, UV u)
+{
+    if (u < 0x80)
+	*d++ = (U8)u;
+    else if (u < 0x800) {
+	*d++ = (U8)(0xC0 | (u >> 6));
+	*d++ = (U8)(0x80 | (u & 0x3F));
+    }
+    else if (u < 0x10000) {
+	*d++ = (U8)(0xE0 | (u >> 12));
+	*d++ = (U8)(0x80 | ((u >> 6) & 0x3F));
+	*d++ = (U8)(0x80 | (u & 0x3F));
+    }
+    else {
+	*d++ = (U8)(0xF0 | (u >> 18));
+	*d++ = (U8)(0x80 | ((u >> 12) & 0x3F));
+	*d++ = (U8)(0x80 | ((u >> 6) & 0x3F));
+	*d++ = (U8)(0x80 | (u & 0x3F));
+    }
+    return d;
+}
+
+static STRLEN
+input_transcode(pTHX_ int enc, const U8 *beg, const U8 *end, SV* out, bool eof)
+{
+    /* appends the characters of beg..end to out as UTF-8 and returns
+     * how many bytes it used; the rest starts a character that the
+     * next chunk finishes.  What can't be decoded becomes U+FFFD.
+     */
+    const U8 *s = beg;
+    U8 *d;
+
+    /* each byte gives at most three */
+    SvGROW(out, SvCUR(out) + 3 * (end - beg) + 1);
+    d = (U8*)SvEND(out);
+
+    switch (enc) {
+    case INENC_CP1252:
+	while (s < end) {
+	    U8 c = *s++;
+	    if (c < 0x80)
+		*d++ = c;
+	    else if (c < 0xA0)
+		d = input_put(d, input_cp1252[c - 0x80]);
+	    else {
+		*d++ = (U8)(0xC0 | (c >> 6));
+		*d++ = (U8)(0x80 | (c & 0x3F));
+	    }
+	}
+	break;
+
+    case INENC_UTF8:
+	while (s < end) {
+	    U8 c = *s;
+	    U8 lo = 0x80, hi = 0xBF;
+	    int n, i;
+	    if (c < 0x80) {
+		*d++ = c;
+		s++;
+		continue;
+	    }
+	    if (c < 0xC2 || c > 0xF4) {
+		d = input_put(d, 0xFFFD);
+		s++;
+		continue;
+	    }
+	    n = c < 0xE0 ? 2 : c < 0xF0 ? 3 : 4;
+	    if (c == 0xE0)
+		lo = 0xA0;
+	    else if (c == 0xED)
+		hi = 0x9F;
+	    else if (c == 0xF0)
+		lo = 0x90;
+	    else if (c == 0xF4)
+		hi = 0x8F;
+	    for (i = 1; i < n && s + i < end && s[i] >= lo && s[i] <= hi; i++)
+		lo = 0x80, hi = 0xBF;
+	    if (i == n) {
+		Copy(s, d, n, U8);
+		d += n;
+		s += n;
+	    }
+	    else if (s + i == end && !eof)
+		break;
+	    else {
+		d = input_put(d, 0xFFFD);
+		s += i;
+	    }
+	}
+	break;
+
+    case INENC_UTF16LE:
+    case INENC_UTF16BE:
+	{
+	    int hi = enc == INENC_UTF16BE ? 0 : 1;
+	    while (end - s >= 2) {
+		UV u = s[hi] << 8 | s[!hi];
+		if (u >= 0xD800 && u <= 0xDBFF) {
+		    UV u2;
+		    if (end - s < 4) {
+			if (!eof)
+			    break;
+			u = 0xFFFD;
+			s += 2;
+		    }
+		    else if ((u2 = s[2 + hi] << 8 | s[2 + !hi]) >= 0xDC00 &&
+			     u2 <= 0xDFFF)
+		    {
+			u = 0x10000 + ((u - 0xD800) << 10) + (u2 - 0xDC00);
+			s += 4;
+		    }
+		    else {
+			u = 0xFFFD;
+			s += 2;
+		    }
+		}
+		else {
+		    if (u >= 0xDC00 && u <= 0xDFFF)
+			u = 0xFFFD;
+		    s += 2;
+		}
+		d = input_put(d, u);
+	    }
+	    if (eof && s < end) {
+		d = input_put(d, 0xFFFD);
+		s = end;
+	    }
+	}
+	break;
+    }
+
+    *d = '\0';
+    SvCUR_set(out, (char*)d - SvPVX(out));
+    return s - beg;
+}
+
+static SV*
+input_decode(pTHX_ PSTATE* p_state, SV* chunk)
+{
+    /* returns the characters of chunk, or of the bytes held back at
+     * eof (chunk is 0), or 0 while the encoding is still to be found
+     */
+    SV* pend = p_state->in_pending;
+    const U8 *s = 0;
+    STRLEN len = 0, used;
+    SV* out;
+
+    if (chunk)
+	s = (U8*)SvPVbyte(chunk, len);
+    if (pend && SvCUR(pend)) {
+	if (len)
+	    sv_catpvn(pend, (char*)s, len);
+	s = (U8*)SvPV(pend, len);
+    }
+    if (!len && !p_state->in_enc_doc)
+	return 0;
+
+    if (!p_state->in_enc_doc) {
+	STRLEN bom = 0;
+	int enc = input_sniff(aTHX_ p_state->in_enc, s, len, !chunk, &bom);
+	if (!enc) {
+	    /* hold on to it all until there is enough to tell */
+	    if (!pend)
+		pend = p_state->in_pending = newSVpvn("", 0);
+	    if (s != (U8*)SvPVX(pend))
+		sv_setpvn(pend, (char*)s, len);
+	    return 0;
+	}
+	p_state->in_enc_doc = enc;
+	s += bom;
+	len -= bom;
+    }
+
+    out = sv_2mortal(newSVpvn("", 0));
+    used = input_transcode(aTHX_ p_state->in_enc_doc, s, s + len, out, !chunk);
+    if (used < len) {
+	/* a character split between chunks, at most 3 bytes */
+	char rest[4];
+	Copy(s + used, rest, len - used, char);
+	if (!pend)
+	    pend = p_state->in_pending = newSVpvn("", 0);
+	sv_setpvn(pend, rest, len - used);
+    }
+    else if (pend)
+	SvCUR_set(pend, 0);
+    if (!p_state->utf8_mode)
+	SvUTF8_on(out);
+    return out;
+}
+
+#endif /* UNICODE_HTML_PARSER */
+
+static void
+parse_reset(pTHX_ PSTATE* p_state)
+{
+    /* the state of the parser between documents */
+    p_state->offset = 0;
+    if (p_state->line)
+	p_state->line = 1;
+    p_state->column = 0;
+    p_state->start_document = 0;
+    p_state->literal_mode = 0;
+    p_state->is_cdata = 0;
+    p_state->no_dash_dash_comment_end = 0;
+#ifdef MARKED_SECTION
+    /* a marked section left open */
+    if (p_state->ms_stack)
+	av_clear(p_state->ms_stack);
+    marked_section_update(p_state);
+#endif
+    p_state->stack_depth = 0;
+    p_state->stack_pop_pending = 0;
+    if (p_state->link_doc_base) {
+	SvREFCNT_dec(p_state->link_doc_base);
+	p_state->link_doc_base = 0;
+    }
+    p_state->head_tag = 0;
+    p_state->head_text_seen = 0;
+    if (p_state->head_text)
+	sv_setpvn(p_state->head_text, "", 0);
+    p_state->text_skip = 0;
+    p_state->text_started = 0;
+    p_state->text_pending = 0;
+    if (p_state->rewrite_dropping) {
+	SvREFCNT_dec(p_state->rewrite_dropping);
+	p_state->rewrite_dropping = 0;
+    }
+    if (p_state->sanitize_stack)
+	av_clear(p_state->sanitize_stack);
+    if (p_state->serialize_end) {
+	SvREFCNT_dec(p_state->serialize_end);
+	p_state->serialize_end = 0;
+    }
+    p_state->serialize_raw = 0;
+    p_state->serialize_space = 0;
+}
+
+EXTERN void
+parse_discard(pTHX_ PSTATE* p_state)
+{
+    /* drop the document being parsed, without reporting its end */
+    if (p_state->buf) {
+	SvREFCNT_dec(p_state->buf);
+	p_state->buf = 0;
+    }
+    p_state->pend_spans_count = 0;
+    if (p_state->pend_text)
+	SvOK_off(p_state->pend_text);
+    if (p_state->in_pending)
+	SvCUR_set(p_state->in_pending, 0);
+    p_state->in_enc_doc = 0;
+    if (p_state->skipped_text)
+	SvCUR_set(p_state->skipped_text, 0);
+    if (p_state->ignoring_element) {
+	SvREFCNT_dec(p_state->ignoring_element);
+	p_state->ignoring_element = 0;
+    }
+    p_state->pending_end_tag = 0;
+    if (p_state->head_fields)
+	av_clear(p_state->head_fields);
+    p_state->eof = 0;
+    p_state->paused = 0;
+    p_state->checkpoints_count = 0;
+    parse_reset(aTHX_ p_state);
+}
+
+static void
+parse_chunk(pTHX_ PSTATE* p_state, SV* chunk, SV* self)
+{
+    char *s, *beg, *end;
+    U32 utf8 = 0;
+    STRLEN len;
+
+    p_state->paused = 0;
+
+#ifdef UNICODE_HTML_PARSER
+    if (p_state->utf8_mode)
+	sv_utf8_downgrade(chunk, 0);
+#endif
+
+    if (p_state->buf && SvOK(p_state->buf)) {
+	sv_catsv(p_state->buf, chunk);
+	beg = SvPV(p_state->buf, len);
+	utf8 = SvUTF8(p_state->buf);
+    }
+    else {
+	beg = SvPV(chunk, len);
+	utf8 = SvUTF8(chunk);
+	if (p_state->offset == 0 && DOWARN && !p_state->in_enc) {
+	    /* Print warnings if we find unexpected Unicode BOM forms */
+#ifdef UNICODE_HTML_PARSER
+	    if (p_state->argspec_entity_decode &&
+		!(p_state->attr_encoded && p_state->argspec_entity_decode == ARG_ATTR) &&
+		!p_state->utf8_mode && (
+                 (!utf8 && len >= 3 && strnEQ(beg, "\xEF\xBB\xBF", 3)) ||
+		 (utf8 && len >= 6 && strnEQ(beg, "\xC3\xAF\xC2\xBB\xC2\xBF", 6)) ||
+		 (!utf8 && probably_utf8_chunk(aTHX_ beg, len))
+		)
+	       )
+	    {
+		warn("Parsing of undecoded UTF-8 will give garbage when decoding entities");
+	    }
+	    if (utf8 && len >= 2 && strnEQ(beg, "\xFF\xFE", 2)) {
+		warn("Parsing string decoded with wrong endianness");
+	    }
+#endif
+	    if (!utf8 && len >= 4 &&
+		(strnEQ(beg, "\x00\x00\xFE\xFF", 4) ||
+		 strnEQ(beg, "\xFE\xFF\x00\x00", 4))
+		)
+	    {
+		warn("Parsing of undecoded UTF-32");
+	    }
+	    else if (!utf8 && len >= 2 &&
+		     (strnEQ(beg, "\xFE\xFF", 2) || strnEQ(beg, "\xFF\xFE", 2))
+		)
+	    {
+		warn("Parsing of undecoded UTF-16");
+	    }
+	}
     }
 
-DONE:
-    return s;
+    if (!len)
+	return; /* nothing to do */
+
+    end = beg + len;
+    p_state->pausable = 1;
+    s = parse_buf(aTHX_ p_state, beg, end, utf8, self);
+    p_state->pausable = 0;
 
+    /* the buffer is about to change, so pending text must be copied */
+    pend_text_materialize(aTHX_ p_state);
+
+    if (s == end || p_state->eof) {
+	p_state->paused = 0;
+	if (p_state->buf) {
+	    SvOK_off(p_state->buf);
+	}
+    }
+    else {
+	/* need to keep rest in buffer */
+	if (p_state->buf) {
+	    /* chop off some chars at the beginning */
+	    if (SvOK(p_state->buf)) {
+		sv_chop(p_state->buf, s);
+	    }
+	    else {
+		sv_setpvn(p_state->buf, s, end - s);
+		if (utf8)
+		    SvUTF8_on(p_state->buf);
+		else
+		    SvUTF8_off(p_state->buf);
+	    }
+	}
+	else {
+	    p_state->buf = newSVpv(s, end - s);
+	    if (utf8)
+		SvUTF8_on(p_state->buf);
+	}
+    }
+    return;
 }
 
+
 EXTERN void
 parse(pTHX_
       PSTATE* p_state,
       SV* chunk,
       SV* self)
 {
-    char *s, *beg, *end;
+    char *s, *end;
     U32 utf8 = 0;
     STRLEN len;
 
     if (!p_state->start_document) {
 	char dummy[1];
+	p_state->checkpoints_count = 0;
+	p_state->checkpoint_next = 0;
+	p_state->in_enc_doc = 0;
 	report_event(p_state, E_START_DOCUMENT, dummy, dummy, 0, 0, 0, self);
 	p_state->start_document = 1;
     }
@@ -1738,6 +6224,23 @@ parse(pTHX_
     if (!chunk) {
 	/* eof */
 	char empty[1];
+#ifdef UNICODE_HTML_PARSER
+	if (p_state->in_enc && p_state->in_pending &&
+	    SvCUR(p_state->in_pending))
+	{
+	    /* the bytes held back, now that there are no more */
+	    SV* rest = input_decode(aTHX_ p_state, 0);
+	    if (rest)
+		parse_chunk(aTHX_ p_state, rest, self);
+	}
+#endif
+	if (p_state->paused) {
+	    /* what a pause left comes first, all of it */
+	    SV* none = sv_2mortal(newSVpvn("", 0));
+	    p_state->budget_events = p_state->budget_offset = 0;
+	    while (p_state->paused && !p_state->eof)
+		parse_chunk(aTHX_ p_state, none, self);
+	}
 	if (p_state->buf && SvOK(p_state->buf)) {
 	    /* flush it */
 	    s = SvPV(p_state->buf, len);
@@ -1745,24 +6248,24 @@ parse(pTHX_
 	    utf8 = SvUTF8(p_state->buf);
 	    assert(len);
 
+	    /* what follows depends on there being nothing more */
+	    p_state->checkpoint_next = (STRLEN)-1;
+
 	    while (s < end) {
 		if (p_state->literal_mode) {
-		    if (strEQ(p_state->literal_mode, "plaintext") ||
-			strEQ(p_state->literal_mode, "xmp") ||
-			strEQ(p_state->literal_mode, "iframe") ||
-			strEQ(p_state->literal_mode, "textarea"))
-		    {
-			/* rest is considered text */
+		    const struct literal_tag *lt = p_state->literal_mode;
+		    if (lt->eof_action == LITERAL_EOF_TEXT ||
+			p_state->rewrite_dropping) {
+			/* rest is considered text, dropped with the
+			 * element it is in if that is being dropped */
 			break;
                     }
-		    if (strEQ(p_state->literal_mode, "script") ||
-			strEQ(p_state->literal_mode, "style"))
-		    {
+		    if (lt->eof_action == LITERAL_EOF_EMPTY) {
 			/* effectively make it an empty element */
 			token_pos_t t;
 			char dummy;
-			t.beg = p_state->literal_mode;
-			t.end = p_state->literal_mode + strlen(p_state->literal_mode);
+			t.beg = lt->str;
+			t.end = lt->str + lt->len;
 			report_event(p_state, E_END, &dummy, &dummy, 0, &t, 1, self);
 		    }
 		    else {
@@ -1799,108 +6302,737 @@ parse(pTHX_
 		report_event(p_state, E_TEXT, s, end, utf8, 0, 0, self);
 	    }
 
+	    /* pending text might still point into the buffer */
+	    if (PEND_TEXT_OK(p_state))
+		flush_pending_text(p_state, self);
+
 	    SvREFCNT_dec(p_state->buf);
 	    p_state->buf = 0;
 	}
-	if (p_state->pend_text && SvOK(p_state->pend_text))
+	if (PEND_TEXT_OK(p_state))
 	    flush_pending_text(p_state, self);
 
+	if (p_state->rewrite_output && p_state->sanitize_tags)
+	    sanitize_close(aTHX_ p_state, 0);
+	if (p_state->rewrite_output)
+	    serialize_held(aTHX_ p_state, 0);  /* the end of the document */
 	if (p_state->ignoring_element) {
 	    /* document not balanced */
 	    SvREFCNT_dec(p_state->ignoring_element);
 	    p_state->ignoring_element = 0;
 	}
 	report_event(p_state, E_END_DOCUMENT, empty, empty, 0, 0, 0, self);
-
-	/* reset state */
-	p_state->offset = 0;
-	if (p_state->line)
-	    p_state->line = 1;
-	p_state->column = 0;
-	p_state->start_document = 0;
-	p_state->literal_mode = 0;
-	p_state->is_cdata = 0;
+	parse_reset(aTHX_ p_state);
 	return;
     }
 
 #ifdef UNICODE_HTML_PARSER
-    if (p_state->utf8_mode)
-	sv_utf8_downgrade(chunk, 0);
+    if (p_state->in_enc && !(chunk = input_decode(aTHX_ p_state, chunk)))
+	return;  /* not sure of the encoding yet */
 #endif
+    parse_chunk(aTHX_ p_state, chunk, self);
+}
 
-    if (p_state->buf && SvOK(p_state->buf)) {
-	sv_catsv(p_state->buf, chunk);
-	beg = SvPV(p_state->buf, len);
-	utf8 = SvUTF8(p_state->buf);
+/* replay() reads what event_record() wrote */
+
+static U8*
+event_read_varint(U8 *s, U8 *end, STRLEN *n)
+{
+    /* returns 0 if the stream ends inside the varint */
+    STRLEN v = 0;
+    int shift = 0;
+    while (s < end && shift < (int)sizeof(STRLEN) * 8) {
+	v |= (STRLEN)(*s & 0x7F) << shift;
+	if (!(*s++ & 0x80)) {
+	    *n = v;
+	    return s;
+	}
+	shift += 7;
     }
-    else {
-	beg = SvPV(chunk, len);
-	utf8 = SvUTF8(chunk);
-	if (p_state->offset == 0 && DOWARN) {
-	    /* Print warnings if we find unexpected Unicode BOM forms */
-#ifdef UNICODE_HTML_PARSER
-	    if (p_state->argspec_entity_decode &&
-		!(p_state->attr_encoded && p_state->argspec_entity_decode == ARG_ATTR) &&
-		!p_state->utf8_mode && (
-                 (!utf8 && len >= 3 && strnEQ(beg, "\xEF\xBB\xBF", 3)) ||
-		 (utf8 && len >= 6 && strnEQ(beg, "\xC3\xAF\xC2\xBB\xC2\xBF", 6)) ||
-		 (!utf8 && probably_utf8_chunk(aTHX_ beg, len))
-		)
-	       )
-	    {
-		warn("Parsing of undecoded UTF-8 will give garbage when decoding entities");
-	    }
-	    if (utf8 && len >= 2 && strnEQ(beg, "\xFF\xFE", 2)) {
-		warn("Parsing string decoded with wrong endianness");
-	    }
-#endif
-	    if (!utf8 && len >= 4 &&
-		(strnEQ(beg, "\x00\x00\xFE\xFF", 4) ||
-		 strnEQ(beg, "\xFE\xFF\x00\x00", 4))
-		)
-	    {
-		warn("Parsing of undecoded UTF-32");
+    return 0;
+}
+
+static bool
+event_tokens_ok(event_id_t event, int num_tokens)
+{
+    /* as many tokens as the parser reports the event with */
+    switch (event) {
+    case E_START:
+	return num_tokens % 2 == 1;  /* the tag name and attribute pairs */
+    case E_END:
+    case E_COMMENT:
+	return num_tokens >= 1;
+    case E_PROCESS:
+	return num_tokens == 1;
+    case E_DECLARATION:
+	return 1;
+    default:
+	return num_tokens == 0;
+    }
+}
+
+#define EVENT_BAD()  croak("Bad event stream at byte %" UVuf, (UV)(rec - beg))
+
+EXTERN void
+replay(pTHX_ PSTATE* p_state, SV* stream, SV* self)
+{
+    token_pos_t token_buf[32];
+    token_pos_t *tokens = token_buf;
+    STRLEN len;
+    U8 *beg = (U8*)SvPV(stream, len);
+    U8 *end = beg + len;
+    U8 *s = beg;
+    bool in_doc = p_state->start_document;
+
+    while (s < end && !p_state->eof) {
+	U8 *rec = s;
+	U8 *table;
+	STRLEN extra_len, text_len, n, tbeg = 0, tlen = 0;
+	int num_tokens, i;
+	event_id_t event;
+	int flags;
+	char *bytes, *text;
+	bool old_is_cdata;
+
+	if (!in_doc) {
+	    if (end - s < EVENT_MAGIC_LEN ||
+		memNE(s, EVENT_MAGIC, EVENT_MAGIC_LEN))
+		EVENT_BAD();
+	    s += EVENT_MAGIC_LEN;
+	    in_doc = 1;
+	    continue;
+	}
+
+	if (end - s < 2)
+	    EVENT_BAD();
+	event = (event_id_t)s[0];
+	flags = s[1];
+	s += 2;
+	if (!(s = event_read_varint(s, end, &extra_len)) ||
+	    !(s = event_read_varint(s, end, &text_len)) ||
+	    !(s = event_read_varint(s, end, &n)) ||
+	    n > (STRLEN)(end - s) ||
+	    (event >= E_ELEMENT && event != E_NONE))
+	    EVENT_BAD();
+	num_tokens = (int)n;
+	if (!event_tokens_ok(event, num_tokens))
+	    EVENT_BAD();
+
+	/* the token table comes before the bytes it points into */
+	table = s;
+	for (i = 0; i < num_tokens; i++) {
+	    if (!(s = event_read_varint(s, end, &tbeg)) ||
+		!(s = event_read_varint(s, end, &tlen)) ||
+		tbeg > extra_len + text_len + 1 ||
+		(tbeg && tlen > extra_len + text_len + 1 - tbeg) ||
+		(!tbeg && !(event == E_START && i && i % 2 == 0)))
+		EVENT_BAD();  /* only attribute values can be missing */
+	}
+	if (extra_len > (STRLEN)(end - s) ||
+	    text_len > (STRLEN)(end - s) - extra_len)
+	    EVENT_BAD();
+	bytes = (char*)s;
+	text = bytes + extra_len;
+	s += extra_len + text_len;
+
+	if (num_tokens > (int)(sizeof(token_buf) / sizeof(token_buf[0]))) {
+	    SV* buf = sv_2mortal(newSV(num_tokens * sizeof(token_pos_t)));
+	    tokens = (token_pos_t*)SvPVX(buf);
+	}
+	else
+	    tokens = token_buf;
+	for (i = 0; i < num_tokens; i++) {
+	    table = event_read_varint(table, end, &tbeg);
+	    table = event_read_varint(table, end, &tlen);
+	    if (tbeg) {
+		tokens[i].beg = bytes + tbeg - 1;
+		tokens[i].end = tokens[i].beg + tlen;
 	    }
-	    else if (!utf8 && len >= 2 &&
-		     (strnEQ(beg, "\xFE\xFF", 2) || strnEQ(beg, "\xFF\xFE", 2))
-		)
-	    {
-		warn("Parsing of undecoded UTF-16");
+	    else
+		tokens[i].beg = tokens[i].end = 0;  /* boolean attr value */
+	}
+
+	if (event == E_START_DOCUMENT) {
+	    if (!p_state->start_document) {
+		report_event(p_state, E_START_DOCUMENT, text, text, 0,
+			     0, 0, self);
+		p_state->start_document = 1;
 	    }
+	    continue;
 	}
+	if (event == E_END_DOCUMENT) {
+	    parse(aTHX_ p_state, 0, self);  /* eof */
+	    in_doc = 0;
+	    continue;
+	}
+
+	old_is_cdata = p_state->is_cdata;
+	p_state->is_cdata = (flags & EVENT_CDATA) != 0;
+#ifdef MARKED_SECTION
+	p_state->ms = (flags & EVENT_MS_IGNORE) ? MS_IGNORE : MS_NONE;
+#endif
+	report_event(p_state, event, text, text + text_len,
+		     (flags & EVENT_UTF8) ? 1 : 0, tokens, num_tokens, self);
+	p_state->is_cdata = old_is_cdata;
+#ifdef MARKED_SECTION
+	p_state->ms = MS_NONE;
+#endif
     }
 
-    if (!len)
-	return; /* nothing to do */
+    /* the stream might not be around for the next call */
+    pend_text_materialize(aTHX_ p_state);
+}
 
-    end = beg + len;
-    s = parse_buf(aTHX_ p_state, beg, end, utf8, self);
 
-    if (s == end || p_state->eof) {
-	if (p_state->buf) {
-	    SvOK_off(p_state->buf);
+/* reparse() starts the tokenizer again from a checkpoint */
+
+EXTERN bool
+reparse(pTHX_ PSTATE* p_state, SV* doc, STRLEN edit_beg, STRLEN old_len,
+	STRLEN new_len, SV* self, STRLEN *from, STRLEN *to)
+{
+    /* reports the events of the edited part of the document and
+     * returns FALSE if a handler stopped it
+     */
+    struct checkpoint *old = p_state->checkpoints;
+    int count = p_state->checkpoints_count;
+    struct checkpoint cp;
+    STRLEN len, doc_len;
+    char *beg = SvPV(doc, len);
+    char *end = beg + len;
+    char *s;
+    U32 utf8 = SvUTF8(doc);
+    bool done;
+    int k, i;
+
+    if (!count || p_state->start_document)
+	croak("No complete parse to reparse");
+    doc_len = utf8 ? utf8_length((U8*)beg, (U8*)end) : len;
+    if (edit_beg > doc_len || new_len > doc_len - edit_beg)
+	croak("Edit is outside the document");
+
+    /* the last checkpoint before the edit; the token ending where the
+     * edit starts might go on into it now
+     */
+    for (k = count - 1; k > 0 && old[k].offset >= edit_beg; k--)
+	;
+    cp = old[k];
+    *from = cp.offset;
+    s = utf8 ? (char*)utf8_hop((U8*)beg, cp.offset) : beg + cp.offset;
+
+    p_state->checkpoints = 0;
+    p_state->checkpoints_count = 0;
+    p_state->checkpoints_max = 0;
+    for (i = 0; i < k; i++)
+	checkpoint_push(p_state, &old[i]);
+    p_state->checkpoint_next = cp.offset;
+    p_state->reparse_old = old;
+    p_state->reparse_old_count = count;
+    p_state->reparse_idx = k + 1;
+    p_state->reparse_after = edit_beg + new_len;
+    p_state->reparse_delta = (IV)new_len - (IV)old_len;
+    p_state->reparse_done = 0;
+
+    p_state->offset = cp.offset;
+    p_state->line = cp.line;
+    p_state->column = cp.column;
+    p_state->literal_mode = cp.literal_mode;
+    p_state->pending_end_tag = cp.pending_end_tag;
+    p_state->is_cdata = cp.is_cdata;
+    p_state->no_dash_dash_comment_end = cp.no_dash_dash_comment_end;
+    p_state->start_document = 1;
+
+    s = parse_buf(aTHX_ p_state, s, end, utf8, self);
+    done = !p_state->eof || p_state->reparse_done;
+
+    if (p_state->reparse_done) {
+	/* the checkpoints after it move along with the text */
+	struct checkpoint *conv = &old[p_state->reparse_idx];
+	IV line_delta = (IV)p_state->line - (IV)conv->line;
+	IV column_delta = (IV)p_state->column - (IV)conv->column;
+	STRLEN conv_line = conv->line;
+	*to = p_state->offset;
+	for (i = p_state->reparse_idx; i < count; i++) {
+	    cp = old[i];
+	    if (cp.line == conv_line)
+		cp.column += column_delta;
+	    cp.offset += p_state->reparse_delta;
+	    cp.line += line_delta;
+	    checkpoint_push(p_state, &cp);
+	}
+	p_state->eof = 0;
+	parse_reset(aTHX_ p_state);
+    }
+    else if (!p_state->eof) {
+	/* it never lined up again, so the rest is new too */
+	if (s < end) {
+	    p_state->buf = newSVpvn(s, end - s);
+	    if (utf8)
+		SvUTF8_on(p_state->buf);
 	}
+	p_state->reparse_old = 0;
+	parse(aTHX_ p_state, 0, self);
+	*to = doc_len;
     }
     else {
-	/* need to keep rest in buffer */
-	if (p_state->buf) {
-	    /* chop off some chars at the beginning */
-	    if (SvOK(p_state->buf)) {
-		sv_chop(p_state->buf, s);
-	    }
-	    else {
-		sv_setpvn(p_state->buf, s, end - s);
-		if (utf8)
-		    SvUTF8_on(p_state->buf);
-		else
-		    SvUTF8_off(p_state->buf);
+	/* a handler called eof */
+	p_state->eof = 0;
+	p_state->checkpoints_count = 0;
+	parse_reset(aTHX_ p_state);
+    }
+    p_state->reparse_old = 0;
+    p_state->reparse_done = 0;
+    Safefree(old);
+    return done;
+}
+
+
+/*
+ * state_freeze() writes the state of the parser between two chunks of a
+ * document, and the options that change how they are tokenized, as a
+ * string state_thaw() reads back into another parser.  Handlers and
+ * output modes are left out.  The string is made of:
+ *
+ *   "HPst\001"
+ *   varint option bits, see state_options()
+ *   sv boolean_attribute_value
+ *   list literal_tags, list report_tags, ignore_tags, ignore_elements
+ *   varint flags (STATE_*)
+ *   varint offset, line, column
+ *   sv literal_mode, pending_end_tag, buf
+ *   sv pend_text, varint its offset, line, column
+ *   sv skipped_text, ignoring_element, varint ignore_depth
+ *   varint 1 + number of marked sections (0 for none), each a list
+ *   varint stack depth, each entry sv name and varint selector bits
+ *   sv link_doc_base
+ *
+ * where an sv is varint 0 for undef or 1 + (length << 1 | utf8) followed
+ * by the bytes, and a list is varint 0 for none or 1 + count followed by
+ * that many svs.
+ */
+
+#define STATE_MAGIC      "HPst\001"
+#define STATE_MAGIC_LEN  5
+
+#define STATE_START_DOCUMENT   0x01
+#define STATE_CDATA            0x02
+#define STATE_NO_DASH_DASH     0x04
+#define STATE_PEND_CDATA       0x08
+#define STATE_STACK_SELF       0x10
+#define STATE_STACK_POP        0x20
+#define STATE_PAUSED           0x40
+#define STATE_INPUT            0x80
+
+#define STATE_OPTIONS 15
+
+static void
+state_options(PSTATE* p_state, bool **opts)
+{
+    /* the boolean options kept, in the order of their bits */
+#ifndef MARKED_SECTION
+    static bool no_option;
+#endif
+    opts[0]  = &p_state->strict_comment;
+    opts[1]  = &p_state->strict_names;
+    opts[2]  = &p_state->xml_mode;
+    opts[3]  = &p_state->unbroken_text;
+#ifdef MARKED_SECTION
+    opts[4]  = &p_state->marked_sections;
+#else
+    opts[4]  = &no_option;
+#endif
+    opts[5]  = &p_state->attr_encoded;
+    opts[6]  = &p_state->case_sensitive;
+    opts[7]  = &p_state->strict_end;
+    opts[8]  = &p_state->closing_plaintext;
+    opts[9]  = &p_state->utf8_mode;
+    opts[10] = &p_state->empty_element_tags;
+    opts[11] = &p_state->xml_pic;
+    opts[12] = &p_state->backquote;
+    opts[13] = &p_state->reuse_args;
+    opts[14] = &p_state->link_base_tag;
+}
+
+static void
+freeze_pvn(pTHX_ SV* buf, const char *s, STRLEN len, bool utf8)
+{
+    event_varint(aTHX_ buf, 1 + (len << 1 | (utf8 ? 1 : 0)));
+    sv_catpvn(buf, s, len);
+}
+
+static void
+freeze_sv(pTHX_ SV* buf, SV* sv)
+{
+    STRLEN len;
+    char *s;
+    if (!sv || !SvOK(sv)) {
+	event_varint(aTHX_ buf, 0);
+	return;
+    }
+    s = SvPV(sv, len);
+    freeze_pvn(aTHX_ buf, s, len, SvUTF8(sv));
+}
+
+static void
+freeze_tag(pTHX_ SV* buf, const struct literal_tag *lt)
+{
+    if (lt)
+	freeze_pvn(aTHX_ buf, lt->str, lt->len, 0);
+    else
+	event_varint(aTHX_ buf, 0);
+}
+
+static void
+freeze_hv(pTHX_ SV* buf, HV* hv)
+{
+    HE* he;
+    if (!hv) {
+	event_varint(aTHX_ buf, 0);
+	return;
+    }
+    event_varint(aTHX_ buf, 1 + HvKEYS(hv));
+    hv_iterinit(hv);
+    while ((he = hv_iternext(hv))) {
+	STRLEN len;
+	char *key = HePV(he, len);
+	freeze_pvn(aTHX_ buf, key, len, HeUTF8(he));
+    }
+}
+
+EXTERN SV*
+state_freeze(pTHX_ PSTATE* p_state)
+{
+    SV* buf = newSVpvn(STATE_MAGIC, STATE_MAGIC_LEN);
+    bool *opts[STATE_OPTIONS];
+    STRLEN bits = 0;
+    int flags = 0;
+    int i;
+
+    state_options(p_state, opts);
+    for (i = 0; i < STATE_OPTIONS; i++) {
+	if (*opts[i])
+	    bits |= (STRLEN)1 << i;
+    }
+    event_varint(aTHX_ buf, bits);
+    freeze_sv(aTHX_ buf, p_state->bool_attr_val);
+
+    if (p_state->literal_tags) {
+	struct literal_set *set = p_state->literal_tags;
+	event_varint(aTHX_ buf, 1 + set->count);
+	for (i = 0; i < set->count; i++)
+	    freeze_tag(aTHX_ buf, &set->tags[i]);
+    }
+    else
+	event_varint(aTHX_ buf, 0);
+    freeze_hv(aTHX_ buf, p_state->report_tags);
+    freeze_hv(aTHX_ buf, p_state->ignore_tags);
+    freeze_hv(aTHX_ buf, p_state->ignore_elements);
+
+    if (p_state->start_document)
+	flags |= STATE_START_DOCUMENT;
+    if (p_state->is_cdata)
+	flags |= STATE_CDATA;
+    if (p_state->no_dash_dash_comment_end)
+	flags |= STATE_NO_DASH_DASH;
+    if (p_state->pend_text_is_cdata)
+	flags |= STATE_PEND_CDATA;
+    if (p_state->stack_self)
+	flags |= STATE_STACK_SELF;
+    if (p_state->stack_pop_pending)
+	flags |= STATE_STACK_POP;
+    if (p_state->paused)
+	flags |= STATE_PAUSED;
+    if (p_state->in_enc)
+	flags |= STATE_INPUT;
+    event_varint(aTHX_ buf, flags);
+    event_varint(aTHX_ buf, p_state->offset);
+    event_varint(aTHX_ buf, p_state->line);
+    event_varint(aTHX_ buf, p_state->column);
+    freeze_tag(aTHX_ buf, p_state->literal_mode);
+    freeze_tag(aTHX_ buf, p_state->pending_end_tag);
+    freeze_sv(aTHX_ buf, p_state->buf);
+    freeze_sv(aTHX_ buf, p_state->pend_text);
+    event_varint(aTHX_ buf, p_state->pend_text_offset);
+    event_varint(aTHX_ buf, p_state->pend_text_line);
+    event_varint(aTHX_ buf, p_state->pend_text_column);
+    freeze_sv(aTHX_ buf, p_state->skipped_text);
+    freeze_sv(aTHX_ buf, p_state->ignoring_element);
+    event_varint(aTHX_ buf, p_state->ignoring_element ?
+		 p_state->ignore_depth : 0);
+
+#ifdef MARKED_SECTION
+    if (p_state->ms_stack) {
+	AV* ms_stack = p_state->ms_stack;
+	int count = av_len(ms_stack) + 1;
+	event_varint(aTHX_ buf, 1 + count);
+	for (i = 0; i < count; i++) {
+	    SV** svp = av_fetch(ms_stack, i, 0);
+	    AV* tokens = (AV*)SvRV(*svp);
+	    int n = av_len(tokens) + 1;
+	    int j;
+	    event_varint(aTHX_ buf, 1 + n);
+	    for (j = 0; j < n; j++) {
+		SV** tp = av_fetch(tokens, j, 0);
+		freeze_sv(aTHX_ buf, tp ? *tp : 0);
 	    }
 	}
-	else {
-	    p_state->buf = newSVpv(s, end - s);
-	    if (utf8)
-		SvUTF8_on(p_state->buf);
+    }
+    else
+#endif
+	event_varint(aTHX_ buf, 0);
+
+    event_varint(aTHX_ buf, p_state->stack_depth);
+    for (i = 0; i < p_state->stack_depth; i++) {
+	struct stack_elem *elem = &p_state->stack[i];
+	freeze_sv(aTHX_ buf, elem->name);
+	event_varint(aTHX_ buf, elem->sel_parts);
+	event_varint(aTHX_ buf, elem->sel_match);
+	event_varint(aTHX_ buf, elem->sel_inside);
+    }
+    freeze_sv(aTHX_ buf, p_state->link_doc_base);
+    if (p_state->in_enc) {
+	event_varint(aTHX_ buf, p_state->in_enc);
+	event_varint(aTHX_ buf, p_state->in_enc_doc);
+	freeze_sv(aTHX_ buf, p_state->in_pending);
+    }
+    return buf;
+}
+
+/* state_thaw() reads what state_freeze() wrote */
+
+struct thaw_input {
+    U8 *beg;
+    U8 *s;
+    U8 *end;
+};
+
+#define STATE_BAD(in) \
+	croak("Bad frozen parser state at byte %" UVuf, (UV)((in)->s - (in)->beg))
+
+static STRLEN
+thaw_varint(pTHX_ struct thaw_input *in)
+{
+    STRLEN n;
+    U8 *s = event_read_varint(in->s, in->end, &n);
+    if (!s)
+	STATE_BAD(in);
+    in->s = s;
+    return n;
+}
+
+static SV*
+thaw_sv(pTHX_ struct thaw_input *in)
+{
+    /* returns a new SV, or 0 for undef */
+    STRLEN n = thaw_varint(aTHX_ in);
+    STRLEN len;
+    SV* sv;
+    if (!n)
+	return 0;
+    len = (n - 1) >> 1;
+    if (len > (STRLEN)(in->end - in->s))
+	STATE_BAD(in);
+    sv = newSVpvn((char*)in->s, len);
+    if ((n - 1) & 1)
+	SvUTF8_on(sv);
+    in->s += len;
+    return sv;
+}
+
+static SV*
+thaw_sv_ok(pTHX_ struct thaw_input *in)
+{
+    /* as thaw_sv(), where undef is not allowed */
+    SV* sv = thaw_sv(aTHX_ in);
+    if (!sv)
+	STATE_BAD(in);
+    return sv;
+}
+
+static const struct literal_tag*
+thaw_tag(pTHX_ struct thaw_input *in, PSTATE* p_state)
+{
+    SV* name = thaw_sv(aTHX_ in);
+    const struct literal_tag *lt;
+    if (!name)
+	return 0;
+    lt = literal_tag_lookup(LITERAL_SET(p_state), SvPVX(name), SvCUR(name));
+    SvREFCNT_dec(name);
+    if (!lt)
+	STATE_BAD(in);
+    return lt;
+}
+
+static HV*
+thaw_hv(pTHX_ struct thaw_input *in)
+{
+    STRLEN n = thaw_varint(aTHX_ in);
+    HV* hv;
+    if (!n)
+	return 0;
+    if (n - 1 > (STRLEN)(in->end - in->s))
+	STATE_BAD(in);
+    hv = (HV*)sv_2mortal((SV*)newHV());
+    while (--n) {
+	SV* key = sv_2mortal(thaw_sv_ok(aTHX_ in));
+	hv_store_ent(hv, key, newSViv(0), 0);
+    }
+    return (HV*)SvREFCNT_inc((SV*)hv);
+}
+
+static U32
+thaw_mask(pTHX_ struct thaw_input *in, int bits)
+{
+    /* a mask of selector parts or handlers, of which there are bits */
+    STRLEN n = thaw_varint(aTHX_ in);
+    if (n > (U32)~0 || (bits < 32 && n >> bits))
+	STATE_BAD(in);
+    return (U32)n;
+}
+
+static void
+thaw_replace(pTHX_ SV** slot, SV* sv)
+{
+    SvREFCNT_dec(*slot);
+    *slot = sv;
+}
+
+EXTERN void
+state_thaw(pTHX_ PSTATE* p_state, SV* frozen)
+{
+    struct thaw_input in;
+    bool *opts[STATE_OPTIONS];
+    STRLEN len, n, bits;
+    int flags, i;
+    int nparts = p_state->selectors ? p_state->selectors->nparts : 0;
+    int nsel = p_state->selectors ? p_state->selectors->count : 0;
+    SV* sv;
+
+    in.beg = in.s = (U8*)SvPV(frozen, len);
+    in.end = in.beg + len;
+    if (len < STATE_MAGIC_LEN || memNE(in.s, STATE_MAGIC, STATE_MAGIC_LEN))
+	STATE_BAD(&in);
+    in.s += STATE_MAGIC_LEN;
+
+    /* the options first, as the state is looked up in them */
+    bits = thaw_varint(aTHX_ &in);
+    if (bits >> STATE_OPTIONS)
+	STATE_BAD(&in);
+    state_options(p_state, opts);
+    for (i = 0; i < STATE_OPTIONS; i++)
+	*opts[i] = (bits >> i) & 1;
+    sv = thaw_sv(aTHX_ &in);
+    thaw_replace(aTHX_ &p_state->bool_attr_val, sv);
+
+    n = thaw_varint(aTHX_ &in);
+    if (n > (STRLEN)(in.end - in.s) + 1)
+	STATE_BAD(&in);
+    if (n) {
+	AV* names = (AV*)sv_2mortal((SV*)newAV());
+	SV* ref = sv_2mortal(newRV_inc((SV*)names));
+	while (--n)
+	    av_push(names, thaw_sv_ok(aTHX_ &in));
+	literal_tags_replace(p_state, literal_set_compile(aTHX_ &ref, 1));
+    }
+    else
+	literal_tags_replace(p_state, 0);
+    thaw_replace(aTHX_ (SV**)&p_state->report_tags, (SV*)thaw_hv(aTHX_ &in));
+    thaw_replace(aTHX_ (SV**)&p_state->ignore_tags, (SV*)thaw_hv(aTHX_ &in));
+    thaw_replace(aTHX_ (SV**)&p_state->ignore_elements, (SV*)thaw_hv(aTHX_ &in));
+    prefilter_update(aTHX_ p_state);
+
+    flags = (int)thaw_varint(aTHX_ &in);
+    p_state->start_document = (flags & STATE_START_DOCUMENT) ? 1 : 0;
+    p_state->is_cdata = (flags & STATE_CDATA) ? 1 : 0;
+    p_state->no_dash_dash_comment_end = (flags & STATE_NO_DASH_DASH) ? 1 : 0;
+    p_state->pend_text_is_cdata = (flags & STATE_PEND_CDATA) ? 1 : 0;
+    p_state->stack_self = (flags & STATE_STACK_SELF) ? 1 : 0;
+    p_state->stack_pop_pending = (flags & STATE_STACK_POP) ? 1 : 0;
+    p_state->paused = (flags & STATE_PAUSED) ? 1 : 0;
+    p_state->offset = thaw_varint(aTHX_ &in);
+    n = thaw_varint(aTHX_ &in);
+    if (n || !p_state->line)
+	p_state->line = n;  /* still counted if the handlers want it now */
+    p_state->column = thaw_varint(aTHX_ &in);
+    p_state->literal_mode = thaw_tag(aTHX_ &in, p_state);
+    p_state->pending_end_tag = thaw_tag(aTHX_ &in, p_state);
+    thaw_replace(aTHX_ &p_state->buf, thaw_sv(aTHX_ &in));
+    thaw_replace(aTHX_ &p_state->pend_text, thaw_sv(aTHX_ &in));
+    p_state->pend_text_offset = thaw_varint(aTHX_ &in);
+    p_state->pend_text_line = thaw_varint(aTHX_ &in);
+    p_state->pend_text_column = thaw_varint(aTHX_ &in);
+    p_state->pend_spans_count = 0;
+    thaw_replace(aTHX_ &p_state->skipped_text, thaw_sv(aTHX_ &in));
+    thaw_replace(aTHX_ &p_state->ignoring_element, thaw_sv(aTHX_ &in));
+    n = thaw_varint(aTHX_ &in);
+    if (!p_state->ignoring_element != !n || n > I32_MAX)
+	STATE_BAD(&in);
+    p_state->ignore_depth = (int)n;
+
+    n = thaw_varint(aTHX_ &in);
+#ifdef MARKED_SECTION
+    if (p_state->ms_stack) {
+	SvREFCNT_dec(p_state->ms_stack);
+	p_state->ms_stack = 0;
+    }
+    if (n) {
+	if (n - 1 > (STRLEN)(in.end - in.s))
+	    STATE_BAD(&in);
+	p_state->ms_stack = newAV();
+	while (--n) {
+	    AV* tokens = newAV();
+	    STRLEN count = thaw_varint(aTHX_ &in);
+	    av_push(p_state->ms_stack, newRV_noinc((SV*)tokens));
+	    if (!count || count - 1 > (STRLEN)(in.end - in.s))
+		STATE_BAD(&in);
+	    while (--count) {
+		sv = thaw_sv(aTHX_ &in);
+		av_push(tokens, sv ? sv : newSV(0));
+	    }
 	}
     }
-    return;
+    marked_section_update(p_state);
+    p_state->is_cdata = (flags & STATE_CDATA) ? 1 : 0;  /* as it was */
+#else
+    if (n > 1)
+	croak("marked sections not supported");
+#endif
+
+    n = thaw_varint(aTHX_ &in);
+    if (n > (STRLEN)(in.end - in.s))
+	STATE_BAD(&in);
+    /* the element of the last event is on the stack */
+    if (!n && (p_state->stack_self || p_state->stack_pop_pending))
+	STATE_BAD(&in);
+    if ((int)n > p_state->stack_max) {
+	p_state->stack_max = (int)n;
+	Renew(p_state->stack, p_state->stack_max, struct stack_elem);
+    }
+    p_state->stack_depth = 0;
+    for (i = 0; i < (int)n; i++) {
+	struct stack_elem *elem = &p_state->stack[i];
+	sv = sv_2mortal(thaw_sv_ok(aTHX_ &in));
+	elem->name = stack_intern(aTHX_ p_state, sv);
+	elem->sel_parts = thaw_mask(aTHX_ &in, nparts);
+	elem->sel_match = thaw_mask(aTHX_ &in, nsel);
+	elem->sel_inside = thaw_mask(aTHX_ &in, nsel);
+	elem->sel_above = elem->sel_parts;
+	if (i)
+	    elem->sel_above |= elem[-1].sel_above;
+	p_state->stack_depth = i + 1;
+    }
+    thaw_replace(aTHX_ &p_state->link_doc_base, thaw_sv(aTHX_ &in));
+    p_state->in_enc = p_state->in_enc_doc = 0;
+    if (flags & STATE_INPUT) {
+	STRLEN enc = thaw_varint(aTHX_ &in);
+	STRLEN enc_doc = thaw_varint(aTHX_ &in);
+	if (!enc || enc > INENC_CP1252 || enc_doc > INENC_CP1252 ||
+	    enc_doc == INENC_AUTO)
+	    STATE_BAD(&in);
+	p_state->in_enc = (int)enc;
+	p_state->in_enc_doc = (int)enc_doc;
+	thaw_replace(aTHX_ &p_state->in_pending, thaw_sv(aTHX_ &in));
+    }
+
+    if (in.s != in.end)
+	STATE_BAD(&in);
 }
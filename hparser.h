@@ -36,6 +36,7 @@ enum event_id {
     E_PROCESS,
     E_START_DOCUMENT,
     E_END_DOCUMENT,
+    E_ELEMENT,
     E_DEFAULT,
     /**/
     EVENT_COUNT,
@@ -53,12 +54,115 @@ static char* event_id_str[] = {
     "process",
     "start_document",
     "end_document",
+    "element",
     "default",
 };
 
 struct p_handler {
     SV* cb;
     SV* argspec;
+    AV* args;   /* argument values kept for reuse_args */
+
+    /* resolved method for method name handlers */
+    CV* method_cv;
+    HV* method_stash;
+    U32 method_gen;
+};
+
+/* handlers for a single tag ("start:a") are kept in the PV buffer of
+ * the values of PSTATE's tag_handlers hashes
+ */
+#define TAG_HANDLER(sv) ((struct p_handler*)SvPVX(sv))
+
+/* Selector handlers ("start:div.article a[href]").  The compound
+ * selectors of all handlers share one table so that the ones an element
+ * matches fit in a bit mask kept on the element stack.
+ */
+#define SEL_MAX_PARTS 32
+#define SEL_MAX_CONDS 8
+
+struct sel_cond {
+    char type;          /* '#', '.', '[' (present), '=' or '^' (prefix) */
+    char *name;         /* attribute name, points into the source */
+    STRLEN name_len;
+    char *value;
+    STRLEN value_len;
+};
+
+struct sel_part {
+    char *tag;          /* 0 matches any element */
+    STRLEN tag_len;
+    bool child;         /* combinator before this part is '>' */
+    int nconds;
+    struct sel_cond conds[SEL_MAX_CONDS];
+};
+
+struct sel_handler {
+    SV* source;         /* the selector text */
+    event_id_t event;
+    int first_part;     /* parts of the selector, outermost first */
+    int last_part;
+    struct p_handler h;
+};
+
+struct selector_set {
+    int nparts;
+    struct sel_part parts[SEL_MAX_PARTS];
+    int count;
+    struct sel_handler handlers[SEL_MAX_PARTS];
+    bool want_attr;     /* some part looks at attributes */
+    int refcnt;         /* parsers sharing it, see clone_pstate() */
+};
+
+/* an open element */
+struct stack_elem {
+    SV* name;           /* interned in stack_names */
+    U32 sel_parts;      /* selector parts matched with the ones before
+			 * them matching its ancestors */
+    U32 sel_above;      /* ... by it or one of its ancestors */
+    U32 sel_match;      /* selector handlers that match it */
+    U32 sel_inside;     /* ... that match it or one of its ancestors */
+};
+
+/* a piece of pending text still in the buffer being parsed */
+struct text_span {
+    char *beg;
+    char *end;
+    bool utf8;
+};
+
+/* how to deal with a literal element that is still open at eof */
+enum literal_eof_t {
+    LITERAL_EOF_TEXT = 0,   /* rest of the document is its text */
+    LITERAL_EOF_EMPTY,      /* make it an empty element and reparse the rest */
+    LITERAL_EOF_PENDING     /* reparse the rest and end it at the next markup */
+};
+
+struct literal_tag {
+    int len;
+    char* str;
+    int is_cdata;
+    enum literal_eof_t eof_action;
+};
+
+/* compiled set of elements that put the parser into literal_mode */
+struct literal_set {
+    U32 len_mask;   /* bit n is set if some tag is n chars long */
+    int count;
+    struct literal_tag *tags;
+};
+
+#define LITERAL_LEN_BIT(len) ((U32)1 << ((len) < 31 ? (len) : 31))
+
+/* the tokenizer state at an event boundary */
+struct checkpoint {
+    STRLEN offset;
+    STRLEN line;
+    STRLEN column;
+    const struct literal_tag *literal_mode;
+    const struct literal_tag *pending_end_tag;
+    bool is_cdata;
+    bool no_dash_dash_comment_end;
 };
 
 struct p_state {
@@ -73,14 +177,36 @@ struct p_state {
     bool parsing;
     bool eof;
 
+    /* pause() and the budgets of parse() make parse_buf() stop early */
+    bool   pausable;       /* in parse_buf() for parse() or resume() */
+    bool   paused;         /* stopped early; the rest is in buf */
+    STRLEN budget_events;  /* events left, 0 for no limit */
+    STRLEN budget_offset;  /* offset to stop at, 0 for no limit */
+
+    /* input_encoding makes parse() decode the bytes it is given */
+    int in_enc;            /* INENC_* asked for, 0 when off */
+    int in_enc_doc;        /* INENC_* of this document, 0 until known */
+    SV* in_pending;        /* bytes held back to sniff or to finish a char */
+
     /* special parsing modes */
-    char* literal_mode;
+    const struct literal_tag *literal_mode;
     bool  is_cdata;
     bool  no_dash_dash_comment_end;
-    char *pending_end_tag;
+    const struct literal_tag *pending_end_tag;
 
-    /* unbroken_text option needs a buffer of pending text */
+    /* unbroken_text option needs a buffer of pending text.  Text is
+     * kept as spans of the current buffer and only copied to pend_text
+     * when parse() returns.
+     */
     SV*    pend_text;
+    struct text_span *pend_spans;
+    int    pend_spans_count;
+    int    pend_spans_max;
+    bool   pend_text_flushing;
+
+    /* content of the element reported by an element event */
+    char*  element_text_beg;
+    char*  element_text_end;
     bool   pend_text_is_cdata;
     STRLEN pend_text_offset;
     STRLEN pend_text_line;
@@ -109,21 +235,107 @@ struct p_state {
     bool empty_element_tags;
     bool xml_pic;
     bool backquote;
+    bool reuse_args;
 
     /* other configuration stuff */
     SV* bool_attr_val;
     struct p_handler handlers[EVENT_COUNT];
+    HV* tag_handlers[EVENT_COUNT];
     int argspec_entity_decode;
+    bool want_attr_tokens;  /* start tag attributes need to be tokenized */
 
     /* filters */
     HV* report_tags;
     HV* ignore_tags;
     HV* ignore_elements;
 
+    /* elements parsed in literal_mode; 0 means the default set */
+    struct literal_set *literal_tags;
+
+    /* names of report_tags and ignore_elements; text and tags that
+     * can't be reported are skipped in one go if the handlers allow it
+     */
+    struct literal_set *prefilter_tags;
+    bool prefilter_handlers_ok;
+
     /* these are set when we are currently inside an element we want to ignore */
     SV* ignoring_element;
     int ignore_depth;
 
+    /* open elements; only tracked when some argspec asks for them */
+    bool track_stack;
+    struct stack_elem *stack;
+    int  stack_depth;
+    int  stack_max;
+    bool stack_self;        /* top entry is the element of the event */
+    bool stack_pop_pending; /* pop the top entry at the next event */
+    HV*  stack_names;
+
+    /* how the stack changes for the event being reported */
+    struct stack_elem stack_next;
+    int  stack_next_depth;  /* depth below it, -1 for a stray end tag */
+
+    struct selector_set *selectors;
+
+    /* link attributes reported by the @links argspec */
+    HV*  link_elements;  /* tag name => list of attribute names */
+    SV*  link_base;      /* links are made absolute against this */
+    SV*  link_doc_base;  /* <base href> of the current document */
+    bool link_base_tag;  /* look for <base href> */
+
+    /* head_scan mode collects what HTML::HeadParser wants itself */
+    bool head_scan;
+    AV*  head_fields;     /* (name, value) pairs not fetched yet */
+    SV*  head_text;       /* content of <title> so far */
+    int  head_tag;        /* HEAD_TITLE or HEAD_OTHER inside such elements */
+    bool head_text_seen;
+
+    /* text_output mode writes the text of the document itself */
+    SV*  text_output;     /* reference to a scalar, or a file handle */
+    HV*  textify;         /* tag => attribute giving its text; 0 for default */
+    SV*  text_buf;
+    bool text_collapse;
+    bool text_skip;       /* inside <script> or <style> */
+    bool text_started;    /* something has been written */
+    int  text_pending;    /* TEXT_SPACE or TEXT_NEWLINE to write before more */
+
+    /* rewrite_output mode copies the document, with edits */
+    SV*  rewrite_output;  /* reference to a scalar, or a file handle */
+    HV*  rewrite_tags;    /* tag => array of edits, see hparser.c */
+    SV*  rewrite_dropping; /* name of the element being left out */
+    int  rewrite_drop_depth;
+
+    /* sanitize mode writes what its allowlists let through instead */
+    HV*  sanitize_tags;      /* tag => allowed attributes */
+    SV*  sanitize_url_attrs; /* attributes holding URLs */
+    SV*  sanitize_schemes;   /* URL schemes allowed in them */
+    HV*  sanitize_drop;      /* elements left out with their content */
+    AV*  sanitize_stack;     /* elements written and not ended yet */
+
+    /* serialize mode writes tags out again, normalized */
+    int  serialize;          /* SERIALIZE_* flags, 0 when off */
+    int  serialize_raw;      /* inside <pre> and the like */
+    bool serialize_space;    /* whitespace was written last */
+    SV*  serialize_end;      /* optional end tag held back */
+    SV*  serialize_ws;       /* whitespace following it */
+
+    /* the events are written as a stream replay() reads */
+    SV*  event_output;
+    SV*  event_buf;
+
+    /* checkpoints for reparse(), and the old ones while it runs */
+    STRLEN checkpoint_interval;    /* 0 when not taken */
+    STRLEN checkpoint_next;        /* offset to take the next one at */
+    struct checkpoint *checkpoints;
+    int    checkpoints_count;
+    int    checkpoints_max;
+    struct checkpoint *reparse_old;
+    int    reparse_old_count;
+    int    reparse_idx;            /* first old one not passed yet */
+    STRLEN reparse_after;          /* end of the edit */
+    IV     reparse_delta;          /* change in length */
+    bool   reparse_done;           /* lined up with reparse_old */
+
     /* cache */
     HV* entity2char;            /* %HTML::Entities::entity2char */
     SV* tmp;
@@ -29,7 +29,9 @@ HTML::Filter - Filter HTML text through the parser
 
 B<This module is deprecated.> The C<HTML::Parser> now provides the
 functionally of C<HTML::Filter> much more efficiently with the
-C<default> handler.
+C<default> handler, or with the C<rewrite_output> mode which copies
+everything but the events given to handlers without calling out to
+Perl.
 
 =head1 SYNOPSIS
 
@@ -59,6 +59,10 @@ headers using the prefix C<X-Meta-> appended with the value of the
 C<name> attribute as the name of the header, and the value of the
 C<content> attribute as the pushed header value.
 
+E<lt>meta> elements containing a C<property> attribute instead, as
+used by Open Graph, result in headers using the prefix
+C<X-Meta-Property-> in the same way.
+
 E<lt>meta> elements containing a C<http-equiv> attribute will result
 in headers as in above, but without the C<X-Meta-> prefix in the
 header name.
@@ -105,6 +109,11 @@ of some class that is a or delegates to the C<HTTP::Headers> class.
 If no $header is given C<HTML::HeadParser> will create an
 C<HTTP::Headers> object by itself (initially empty).
 
+Unless a subclass overrides the start(), end(), text() or flush_text()
+methods, the head is scanned by the C<head_scan> mode of
+C<HTML::Parser> and no Perl code runs per tag.  The header object is
+then updated when parse() or eof() returns.
+
 =cut
 
 sub new
@@ -124,9 +133,41 @@ sub new
     $self->{'header'} = $header;
     $self->{'tag'} = '';   # name of active element that takes textual content
     $self->{'text'} = '';  # the accumulated text associated with the element
+
+    # the parser can do what the methods below do unless they are overridden
+    $self->head_scan(1)
+	if !$DEBUG &&
+	   $self->can("start") == \&start && $self->can("end") == \&end &&
+	   $self->can("text") == \&text &&
+	   $self->can("flush_text") == \&flush_text;
     $self;
 }
 
+sub parse
+{
+    my $self = shift;
+    my $ret = $self->SUPER::parse(@_);
+    $self->_push_fields;
+    $ret;
+}
+
+sub eof
+{
+    my $self = shift;
+    my $ret = $self->SUPER::eof(@_);
+    $self->_push_fields;
+    $ret;
+}
+
+sub _push_fields
+{
+    my $self = shift;
+    my @fields = $self->head_fields;
+    while (@fields) {
+	$self->{'header'}->push_header(splice(@fields, 0, 2));
+    }
+}
+
 =item $hp->header;
 
 Returns a reference to the header object.
@@ -200,6 +241,8 @@ sub start
 	if (!defined($key) || !length($key)) {
 	    if ($attr->{name}) {
 		$key = "X-Meta-\u$attr->{name}";
+	    } elsif ($attr->{property}) { # Open Graph, RDFa
+		$key = "X-Meta-Property-\u$attr->{property}";
 	    } elsif ($attr->{charset}) { # HTML 5 <meta charset="...">
 		$key = "X-Meta-Charset";
 		$self->{header}->push_header($key => $attr->{charset});
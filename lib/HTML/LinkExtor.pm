@@ -50,6 +50,16 @@ and can be retrieved by calling the $p->links() method.
 The $base argument is an optional base URL used to absolutize all URLs found.
 You need to have the I<URI> module installed if you provide $base.
 
+Links are extracted by the parser itself as directed by
+%HTML::Tagset::linkElements (see the C<@links> argspec in
+L<HTML::Parser>), so no Perl code runs for tags without links.  The
+table is read when the object is constructed.
+
+A C<< <base href> >> in the document is ignored unless
+C<< $p->link_base_tag(1) >> is called.  With it the first one seen
+overrides $base for the rest of the document.  If it is absolute,
+links are then resolved even if no $base was given.
+
 The callback is called with the lowercase tag name as first argument,
 and then all link attributes as separate key/value pairs.  All
 non-link attributes are removed.
@@ -60,7 +70,6 @@ sub new
 {
     my($class, $cb, $base) = @_;
     my $self = $class->SUPER::new(
-                    start_h => ["_start_tag", "self,tagname,attr"],
 		    report_tags => [keys %HTML::Tagset::linkElements],
 	       );
     $self->{extractlink_cb} = $cb;
@@ -68,6 +77,16 @@ sub new
 	require URI;
 	$self->{extractlink_base} = URI->new($base);
     }
+    if ($self->can("_start_tag") == \&_start_tag) {
+	# let the parser pick out and resolve the links
+	$self->link_elements(\%HTML::Tagset::linkElements);
+	$self->link_base("$self->{extractlink_base}") if $base;
+	$self->handler(start => ($base ? "_found_abs_link" : "_found_link"),
+		       "self,tagname,\@links");
+    }
+    else {
+	$self->handler(start => "_start_tag", "self,tagname,attr");
+    }
     $self;
 }
 
@@ -90,6 +109,15 @@ sub _start_tag
     $self->_found_link($tag, @links);
 }
 
+sub _found_abs_link
+{
+    my($self, $tag, @links) = @_;
+    for (my $i = 1; $i < @links; $i += 2) {
+	$links[$i] = URI->new($links[$i]);
+    }
+    $self->_found_link($tag, @links);
+}
+
 sub _found_link
 {
     my $self = shift;
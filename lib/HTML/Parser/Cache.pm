@@ -0,0 +1,262 @@
+package HTML::Parser::Cache;
+
+require HTML::Parser;
+$VERSION = "3.72";
+
+use strict;
+use Carp ();
+use Time::HiRes ();
+
+sub new
+{
+    my($class, %cnf) = @_;
+    my $self = bless {
+	max_size => delete $cnf{max_size},
+	dir      => delete $cnf{dir},
+	entries  => {},   # key => [stream, parse time, tick]
+	queue    => [],   # [key, tick], least recently used first
+	tick     => 0,
+	size     => 0,
+	hits     => 0,
+	misses   => 0,
+	saved    => 0,
+    }, $class;
+    Carp::croak("Unknown cache option '$_'") for sort keys %cnf;
+    $self->{max_size} = 32 * 1024 * 1024 unless defined $self->{max_size};
+    if (defined(my $dir = $self->{dir})) {
+	Carp::croak("Cache directory '$dir' does not exist") unless -d $dir;
+    }
+    $self;
+}
+
+
+sub parse
+{
+    my($self, $p, $doc) = @_;
+    my $key = $p->_event_key($doc);
+
+    my $t = Time::HiRes::time();
+    my $entry = $self->{entries}{$key} || $self->_load($key);
+    if ($entry) {
+	$self->_touch($key, $entry);
+	my $ok = $p->replay($entry->[0]);
+	$self->{hits}++;
+	$self->{saved} += $entry->[1] - (Time::HiRes::time() - $t);
+	return $ok;
+    }
+
+    my $stream = "";
+    my $old = $p->event_output(\$stream);
+    my $ok = eval { $p->parse($doc) && $p->eof };
+    my $err = $@;
+    $p->event_output($old);
+    die $err if $err;
+    $self->{misses}++;
+    return $ok unless $ok;  # cut short by a handler
+
+    $entry = [$stream, Time::HiRes::time() - $t];
+    $self->_store($key, $entry);
+    $self->_save($key, $entry) if defined $self->{dir};
+    return $ok;
+}
+
+
+sub stats
+{
+    my $self = shift;
+    my $lookups = $self->{hits} + $self->{misses};
+    return {
+	hits     => $self->{hits},
+	misses   => $self->{misses},
+	hit_rate => $lookups ? $self->{hits} / $lookups : 0,
+	saved    => $self->{saved},
+	entries  => scalar(keys %{$self->{entries}}),
+	size     => $self->{size},
+    };
+}
+
+
+sub clear
+{
+    my $self = shift;
+    %{$self->{entries}} = ();
+    @{$self->{queue}} = ();
+    $self->{size} = 0;
+    $self->{$_} = 0 for qw(hits misses saved);
+    $self;
+}
+
+
+sub _touch
+{
+    my($self, $key, $entry) = @_;
+    my $tick = ++$self->{tick};
+    $entry->[2] = $tick;
+    push(@{$self->{queue}}, [$key, $tick]);
+
+    # drop the stale queue entries once they are most of it
+    my $queue = $self->{queue};
+    if (@$queue > 2 * keys(%{$self->{entries}}) + 64) {
+	my $entries = $self->{entries};
+	@$queue = grep { my $e = $entries->{$_->[0]}; $e && $e->[2] == $_->[1] }
+	          @$queue;
+    }
+}
+
+
+sub _store
+{
+    my($self, $key, $entry) = @_;
+    my $len = length($entry->[0]);
+    return if $len > $self->{max_size};
+    $self->{entries}{$key} = $entry;
+    $self->{size} += $len;
+    $self->_touch($key, $entry);
+
+    my $entries = $self->{entries};
+    my $queue = $self->{queue};
+    while ($self->{size} > $self->{max_size} && @$queue) {
+	my($k, $tick) = @{shift @$queue};
+	my $e = $entries->{$k};
+	next unless $e && $e->[2] == $tick;  # used again later
+	delete $entries->{$k};
+	$self->{size} -= length($e->[0]);
+    }
+}
+
+
+sub _path
+{
+    my($self, $key) = @_;
+    return "$self->{dir}/" . substr($key, 0, 2) . "/$key";
+}
+
+
+sub _load
+{
+    my($self, $key) = @_;
+    return undef unless defined $self->{dir};
+    open(my $fh, "<", $self->_path($key)) || return undef;
+    binmode($fh);
+    local $/;
+    my $data = <$fh>;
+    close($fh);
+    return undef unless defined($data) && $data =~ s/^([\d.e-]+)\n//;
+    my $entry = [$data, $1];
+    $self->_store($key, $entry);
+    return $entry;
+}
+
+
+sub _save
+{
+    my($self, $key, $entry) = @_;
+    my $path = $self->_path($key);
+    (my $dir = $path) =~ s,/[^/]+\z,,;
+    mkdir($dir) unless -d $dir;
+
+    # written to a temporary file first so readers never see half of it
+    my $tmp = "$path.$$.tmp";
+    open(my $fh, ">", $tmp) || return;
+    binmode($fh);
+    my $ok = print $fh "$entry->[1]\n", $entry->[0];
+    $ok = close($fh) && $ok;
+    if ($ok) {
+	rename($tmp, $path) || unlink($tmp);
+    }
+    else {
+	unlink($tmp);
+    }
+}
+
+1;
+
+
+__END__
+
+=head1 NAME
+
+HTML::Parser::Cache - Replay the events of documents parsed before
+
+=head1 SYNOPSIS
+
+ require HTML::Parser::Cache;
+ my $cache = HTML::Parser::Cache->new(max_size => 64 * 1024 * 1024);
+ my $p = HTML::Parser->new(api_version => 3, start_h => [...]);
+ for my $html (@pages) {
+     $cache->parse($p, $html);
+ }
+ printf "%.0f%% hits, %.2fs saved\n",
+     100 * $cache->stats->{hit_rate}, $cache->stats->{saved};
+
+=head1 DESCRIPTION
+
+C<HTML::Parser::Cache> keeps the events of the documents parsed through
+it, as written by the C<event_output> option of C<HTML::Parser>, and
+replays them with $p->replay when the same document is parsed again.
+Documents are looked up by a fast non-cryptographic hash of their
+content together with the parser options that change how they are
+tokenized, like C<xml_mode>, C<strict_comment>, C<marked_sections>
+and C<literal_tags>.  The same cache can be shared by parsers with
+different options and handlers.
+
+The following methods are provided:
+
+=over 4
+
+=item $cache = HTML::Parser::Cache->new( %options )
+
+Creates a cache.  The options are:
+
+=over
+
+=item max_size => $bytes
+
+The most event stream bytes to keep in memory.  The documents used
+least recently are let go first.  The default is 32 MB.
+
+=item dir => $directory
+
+A directory to keep the event streams in as well, to share them
+between processes and runs.  Nothing is ever removed from it.  The
+directory must exist.
+
+=back
+
+=item $cache->parse( $p, $html )
+
+Reports the events of the complete document $html to the handlers of
+the parser $p, like $p->parse($html) followed by $p->eof.  If the
+document was parsed before with the same options, the events are
+replayed without tokenizing it again.  Like $p->eof, the return value
+is a reference to the parser object, or FALSE if a handler stopped the
+parse with $p->eof.  The events of documents stopped that way are not
+kept.
+
+As with C<event_output>, C<element> events are not reported.
+
+=item $cache->stats
+
+Returns a hash reference with the number of C<hits> and C<misses>
+so far, the C<hit_rate> (0 to 1), the time C<saved> in seconds, and
+the number of C<entries> and bytes (C<size>) kept in memory.  The time
+saved by a hit is the time the first parse of the document took less
+the time the replay took.  As the first parse also wrote the events,
+and both include the time spent in handlers, this is only an estimate.
+
+=item $cache->clear
+
+Forgets the documents kept in memory and resets the statistics.
+
+=back
+
+=head1 SEE ALSO
+
+L<HTML::Parser>
+
+=head1 COPYRIGHT
+
+This library is free software; you can redistribute it and/or
+modify it under the same terms as Perl itself.
+
+=cut
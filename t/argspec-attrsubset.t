@@ -0,0 +1,66 @@
+use strict;
+use Test::More tests => 12;
+
+use HTML::Parser;
+
+my @a;
+my $p = HTML::Parser->new(api_version => 3,
+			  start_h => [\@a, "tagname, attr(href, src)"]);
+
+$p->parse(qq(<a title="x" HREF="a&amp;b" src=s.gif id=1>))->eof;
+is($a[0][0], "a");
+is(join(",", map "$_=$a[0][1]{$_}", sort keys %{$a[0][1]}),
+   "href=a&b,src=s.gif", "only the listed attributes");
+
+@a = ();
+$p->handler(start => \@a, "attrval(src,href,alt)");
+$p->parse(qq(<img src="x.png" alt>))->eof;
+is_deeply(\@a, [["x.png", undef, "alt"]], "positional values");
+
+@a = ();
+$p->handler(start => \@a, '@{tagname, attrval(href)}');
+$p->parse(qq(<a href=1 href=2><b>))->eof;
+is_deeply(\@a, ["a", 1, "b", undef], "flat array, first value wins");
+
+@a = ();
+$p->handler(start => undef);
+$p->handler(end => \@a, "attrval(href), attr(href)");
+$p->parse(qq(<a href=1></a>))->eof;
+is_deeply(\@a, [[undef, undef]], "undef for other events");
+
+# case_sensitive
+@a = ();
+$p->handler(end => undef);
+$p->handler(start => \@a, "attr(Href), attrval(href)");
+$p->case_sensitive(1);
+$p->parse(qq(<a Href=1 href=2 HREF=3>))->eof;
+is_deeply(\@a, [[{Href => 1}, 2]], "case_sensitive");
+
+# attr_encoded and boolean_attribute_value
+@a = ();
+$p->case_sensitive(0);
+$p->attr_encoded(1);
+$p->boolean_attribute_value("yes");
+$p->parse(qq(<a HREF="a&amp;b" Checked>))->eof;
+$p->handler(start => \@a, "attr(checked)");
+$p->parse(qq(<input checked>))->eof;
+is_deeply(\@a, [[{href => "a&amp;b"}, "a&amp;b"], [{checked => "yes"}]],
+	  "attr_encoded and boolean_attribute_value");
+
+# attribute names with punctuation
+@a = ();
+$p->handler(start => \@a, "attrval(data-x, xml:lang)");
+$p->parse(qq(<p xml:lang=en data-x='1'>))->eof;
+is_deeply(\@a, [[1, "en"]], "names with punctuation");
+
+# bad argspecs
+for (["attrval",      qr/^Missing attribute list for attrval in argspec/],
+     ["attr(href",    qr/^Unterminated attribute list in argspec/],
+     ["attr(a,,b)",   qr/^Bad attribute name in argspec/],
+     ["attr()",       qr/^Bad attribute name in argspec/],
+    )
+{
+    my($argspec, $re) = @$_;
+    eval { $p->handler(start => \@a, $argspec) };
+    like($@, $re, $argspec);
+}
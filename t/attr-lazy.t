@@ -0,0 +1,73 @@
+use strict;
+use Test::More tests => 11;
+
+use HTML::Parser;
+use lib "t/lib";
+use RandomDoc;
+
+# Start tags are not tokenized when no handler looks at the attributes.
+# The events produced must be the same either way.
+
+sub events {
+    my($chunks, $argspec, $opt) = @_;
+    my @ev;
+    my $p = HTML::Parser->new(api_version => 3,
+			      %$opt,
+			      start_h   => [\@ev, $argspec],
+			      default_h => [\@ev, "event,text,offset"],
+			     );
+    # in random sized chunks to exercise the incomplete tag paths
+    $p->parse($_) for @$chunks;
+    $p->eof;
+    # not the attr hash itself
+    return event_string(map [@$_[0 .. 2]], @ev);
+}
+
+srand(42);
+for my $opt ({}, {strict_names => 1}, {empty_element_tags => 1},
+	     {backquote => 1}, {xml_mode => 1})
+{
+    ok(same_events(200, attr => 20, sub {
+	my @chunks = random_chunks(shift, 7);
+	return (lazy => events(\@chunks, "'S',text,offset", $opt),
+		full => events(\@chunks, "'S',text,offset,attr", $opt));
+    }), "same events with " . join(",", %$opt));
+}
+
+# the handler decides which path is used
+my @a;
+my $p = HTML::Parser->new(api_version => 3,
+			  start_h => [\@a, "tagname,offset_end"]);
+$p->parse("<a href='x>y' title=\"<b>\">");
+$p->parse("<br/>")->eof;
+is(join(",", map @$_, @a), "a,26,br/,31", "tagname only");
+
+@a = ();
+$p->handler(start => \@a, "tagname,attr");
+$p->parse("<a href='x>y'>")->eof;
+is($a[0][1]{href}, "x>y", "attr wanted");
+
+@a = ();
+$p->handler(start => undef);
+$p->handler(default => \@a, "event,tokens");
+$p->parse("<a href=1>")->eof;
+is(join(",", @{$a[1][1]}), "a,href,1", "default handler with tokens");
+
+@a = ();
+$p->handler(default => \@a, "event,tagname");
+$p->handler(start => "");
+$p->parse("<a href=1><b c=\">\">")->eof;
+is(join(",", map $_->[0], @a), "start_document,end_document", "ignored start events");
+
+@a = ();
+$p->handler(default => undef);
+$p->handler(start => \@a, '@{tagname, "attr"}');
+$p->parse("<a 'attr'=x>")->eof;
+is("@a", "a attr", "literal argspec is not an attribute request");
+
+@a = ();
+$p->handler(start => \@a, 'tagname');
+$p->handler(end => \@a, 'tagname');
+$p->empty_element_tags(1);
+$p->parse("<br foo=bar/>")->eof;
+is(join(",", map @$_, @a), "br,br", "empty element tag");
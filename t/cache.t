@@ -0,0 +1,52 @@
+use strict;
+use Test::More tests => 12;
+
+use HTML::Parser;
+use HTML::Parser::Cache;
+use File::Temp qw(tempdir);
+
+my $doc = qq(<html><title>T</title><body><p class=x>Hello <b>world</b>\n<br/>);
+my @a;
+my $p = HTML::Parser->new(api_version => 3,
+			  default_h => [\@a, "event,tagname,attr,text,offset,line"],
+			 );
+sub dump_events { join("\n", map { join("|", map { ref($_) ? join(",", %$_) : defined($_) ? $_ : "-" } @$_) } @_) }
+
+$p->parse($doc)->eof;
+my $fresh = dump_events(@a);
+
+my $cache = HTML::Parser::Cache->new;
+for (1 .. 3) {
+    @a = ();
+    ok($cache->parse($p, $doc), "parse $_");
+    is(dump_events(@a), $fresh, "events $_") if $_ != 2;
+}
+my $stats = $cache->stats;
+is("$stats->{hits}/$stats->{misses}", "2/1", "hits and misses");
+is(sprintf("%.2f", $stats->{hit_rate}), "0.67", "hit rate");
+
+# options that change tokenizing are part of the key
+$p->xml_mode(1);
+$cache->parse($p, $doc);
+$p->xml_mode(0);
+$p->empty_element_tags(1);
+$cache->parse($p, $doc);
+is($cache->stats->{misses}, 3, "xml_mode and empty_element_tags miss");
+$p->empty_element_tags(0);
+
+# the least recently used go first
+$cache = HTML::Parser::Cache->new(max_size => 300);
+$cache->parse($p, "<p>$_" . ("x" x 50)) for 1 .. 10;
+ok($cache->stats->{size} <= 300, "size bounded");
+$cache->parse($p, "<p>10" . ("x" x 50));
+is($cache->stats->{hits}, 1, "recent kept");
+$cache->parse($p, "<p>1" . ("x" x 50));
+is($cache->stats->{misses}, 11, "old dropped");
+
+# on disk
+my $dir = tempdir(CLEANUP => 1);
+HTML::Parser::Cache->new(dir => $dir)->parse($p, $doc);
+$cache = HTML::Parser::Cache->new(dir => $dir);
+@a = ();
+$cache->parse($p, $doc);
+is(dump_events(@a) . "|" . $cache->stats->{hits}, "$fresh|1", "from disk");
@@ -0,0 +1,69 @@
+use strict;
+use Test::More tests => 12;
+
+use HTML::Parser;
+
+my @ev;
+my $proto = HTML::Parser->new(api_version => 3,
+			      start_h => [\@ev, "tagname,attr"],
+			      text_h  => [\@ev, "dtext"],
+			      unbroken_text => 1);
+$proto->ignore_tags(qw(i));
+$proto->ignore_elements(qw(script));
+
+# reset forgets the half parsed document
+$proto->parse("<a href='x'>foo<script>bar");
+$proto->reset;
+@ev = ();
+$proto->parse("<b>&amp;<i><script>x</script>y")->eof;
+is(join(",", map { ref($_) ? join("=", %$_) : $_ } map @$_, @ev), "b,,&y", "reset");
+
+my $events = sub {
+    my $p = shift;
+    @ev = ();
+    $p->parse("<p class=c>one <i>two</i> <script>no</script>three")->eof;
+    return join(",", map { ref($_) ? join("=", %$_) : $_ } map @$_, @ev);
+};
+my $expect = $events->($proto);
+is($events->($proto->clone), $expect, "clone reports the same events");
+
+# changing a clone leaves the prototype alone
+my $clone = $proto->clone;
+isa_ok($clone, "HTML::Parser");
+$clone->ignore_tags(qw(p));
+$clone->unbroken_text(0);
+$clone->handler(end => sub { push(@ev, ["/$_[0]"]) }, "tagname");
+isnt($events->($clone), $expect, "the clone changed");
+is($events->($proto), $expect, "the prototype did not");
+ok($proto->unbroken_text, "unbroken_text kept");
+
+# selector handlers
+my @sel;
+$proto->handler("start:p.c" => \@sel, "tagname");
+$clone = $proto->clone;
+$clone->handler("start:p.c" => sub { push(@sel, "clone") }, "");
+$events->($clone);
+$events->($proto);
+is("@{[map { ref($_) ? @$_ : $_ } @sel]}", "clone p", "selector handlers");
+undef($clone);
+@sel = ();
+$events->($proto);
+is(scalar(@sel), 1, "still there after the clone is gone");
+
+# clones live on without the prototype
+$expect = $events->($proto);
+$clone = $proto->clone;
+undef($proto);
+is($events->($clone), $expect, "prototype gone");
+
+# many clones
+my @p = map { $clone->clone } 1 .. 100;
+$_->parse("<q>") for @p;
+@ev = ();
+$_->eof for @p;
+is(scalar(@ev), 0, "nothing pending");
+is($events->($p[-1]), $expect, "last clone");
+
+$clone->handler(start => sub { $_[0]->reset }, "self");
+eval { $clone->parse("<p>") };
+like($@, qr/^Can't reset while parsing/, "reset while parsing");
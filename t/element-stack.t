@@ -0,0 +1,79 @@
+use strict;
+use Test::More tests => 12;
+
+use HTML::Parser;
+
+my @a;
+my $p = HTML::Parser->new(api_version => 3,
+			  start_h => [\@a, '"S", tagname, depth, parent, path'],
+			  end_h   => [\@a, '"E", tagname, depth, parent, path'],
+			  text_h  => [\@a, '"T", text, depth, parent, path'],
+			 );
+
+sub doc {
+    my $doc = join("|", map { join(",", map { defined($_) ? $_ : "-" } @$_) } @a);
+    @a = ();
+    return $doc;
+}
+
+$p->parse("<html><body><div>x<b>y</b></div></body></html>")->eof;
+is(doc(), "S,html,1,-,html|S,body,2,html,html/body|S,div,3,body,html/body/div|T,x,3,div,html/body/div|S,b,4,div,html/body/div/b|T,y,4,b,html/body/div/b|E,b,4,div,html/body/div/b|E,div,3,body,html/body/div|E,body,2,html,html/body|E,html,1,-,html", "nested elements");
+
+$p->parse("<div><br>a<img src=x>b</div>")->eof;
+is(doc(), "S,div,1,-,div|S,br,2,div,div/br|T,a,1,div,div|S,img,2,div,div/img|T,b,1,div,div|E,div,1,-,div", "void elements are not kept open");
+
+$p->parse("<ul><li>a<li>b</ul><p>c<p>d<div>e</div>")->eof;
+is(doc(), "S,ul,1,-,ul|S,li,2,ul,ul/li|T,a,2,li,ul/li|S,li,2,ul,ul/li|T,b,2,li,ul/li|E,ul,1,-,ul|S,p,1,-,p|T,c,1,p,p|S,p,1,-,p|T,d,1,p,p|S,div,1,-,div|T,e,1,div,div|E,div,1,-,div", "optional end tags");
+
+$p->parse("<table><tr><td>1<td>2<tr><th>3</table>")->eof;
+is(doc(), "S,table,1,-,table|S,tr,2,table,table/tr|S,td,3,tr,table/tr/td|T,1,3,td,table/tr/td|S,td,3,tr,table/tr/td|T,2,3,td,table/tr/td|S,tr,2,table,table/tr|S,th,3,tr,table/tr/th|T,3,3,th,table/tr/th|E,table,1,-,table", "table cells");
+
+$p->parse("<a><b>x</a>y</b>z")->eof;
+is(doc(), "S,a,1,-,a|S,b,2,a,a/b|T,x,2,b,a/b|E,a,1,-,a|T,y,0,-,|E,b,0,-,|T,z,0,-,", "unbalanced end tags");
+
+$p->parse("<DIV><Span>x</SPAN></div>")->eof;
+is(doc(), "S,div,1,-,div|S,span,2,div,div/span|T,x,2,span,div/span|E,span,2,div,div/span|E,div,1,-,div", "case insensitive");
+
+# in xml_mode names are case sensitive and nothing is implied
+$p->xml_mode(1);
+$p->parse("<p><br><X>a</x></X><p/></br></p>")->eof;
+is(doc(), "S,p,1,-,p|S,br,2,p,p/br|S,X,3,br,p/br/X|T,a,3,X,p/br/X|E,x,3,X,p/br/X|E,X,3,br,p/br/X|S,p,3,br,p/br/p|E,p,3,br,p/br/p|E,br,2,p,p/br|E,p,1,-,p", "xml_mode");
+$p->xml_mode(0);
+
+# text is reported with the stack in effect where it was
+$p->unbroken_text(1);
+$p->parse("<p>a");
+$p->parse("b</p>c<p>d<p>e");
+$p->eof;
+is(doc(), "S,p,1,-,p|T,ab,1,p,p|E,p,1,-,p|T,c,0,-,|S,p,1,-,p|T,d,1,p,p|S,p,1,-,p|T,e,1,p,p", "unbroken_text");
+$p->unbroken_text(0);
+
+# the stack is maintained for events that are not reported
+$p->handler(start => "");
+$p->ignore_tags("i");
+$p->parse("<div><i>x</i><span>y</div>")->eof;
+is(doc(), "T,x,2,i,div/i|T,y,2,span,div/span|E,div,1,-,div", "ignored events");
+$p->ignore_tags();
+
+$p = HTML::Parser->new(api_version => 3,
+		       start_h => [\@a, '@{tagname, @path}'],
+		       element_h => [\@a, '@{tagname, depth, path}'],
+		      );
+$p->parse("<body><h1>Title</h1><p><b>x</b></p>")->eof;
+is("@a", "body body h1 2 body/h1 p body p b 3 body/p/b", "\@path and element events");
+@a = ();
+
+# no stack handlers, no stack
+$p->handler(element => undef);
+$p->handler(start => \@a, 'tagname');
+$p->parse("<a><b>");
+$p->handler(start => \@a, 'tagname, path');
+$p->parse("<c>")->eof;
+is(join(",", map @$_, @a), "a,b,c,c", "tracking starts with the handler");
+@a = ();
+
+$p->handler(start => \@a, 'path');
+$p->parse("<a><b>");
+$p->eof;
+$p->parse("<c>")->eof;
+is(join(",", map @$_, @a), "a,a/b,c", "reset at eof");
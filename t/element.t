@@ -0,0 +1,67 @@
+use strict;
+use Test::More tests => 11;
+
+use HTML::Parser;
+
+my @a;
+my $p = HTML::Parser->new(api_version => 3,
+			  element_h => [\@a, "event,tag,attr,dtext,is_cdata,offset,offset_end"],
+			  default_h => [\@a, "event,text"],
+			 );
+
+sub ev {
+    my $res = join("|", map { join(",", map { ref($_) eq "HASH" ? join("=", %$_) :
+					          defined($_) ? $_ : "" } @$_) } @a);
+    @a = ();
+    return $res;
+}
+
+$p->parse(qq(<title>a &amp; b</title><a href="x">label</a>))->eof;
+is(ev(), "start_document,|element,title,,a & b,,0,24|element,a,href=x,label,,24,45|end_document,", "leaf elements");
+
+$p->parse("<p>a<b>c</b> </P>")->eof;
+is(ev(), "start_document,|start,<p>|text,a|element,b,,c,,4,12|text, |end,</P>|end_document,", "nested");
+
+$p->parse("<script>if (a<b) x='</p>'</script >")->eof;
+is(ev(), "start_document,|element,script,,if (a<b) x='</p>',1,0,35|end_document,", "script");
+
+$p->parse("<b></b>");
+$p->parse("<i>x");
+$p->parse("</i>")->eof;
+is(ev(), "start_document,|element,b,,,,0,7|start,<i>|text,x|end,</i>|end_document,", "split across chunks");
+
+$p->parse("<plaintext>foo</plaintext>")->eof;
+is(ev(), "start_document,|start,<plaintext>|text,foo</plaintext>|end_document,", "plaintext");
+
+$p->ignore_tags("b");
+$p->parse("<b>x</b><i>y</i>")->eof;
+is(ev(), "start_document,|text,x|element,i,,y,,8,16|end_document,", "ignored tags are not fused");
+$p->ignore_tags();
+
+$p->ignore_elements("b");
+$p->parse("<b>x</b><i>y</i>")->eof;
+is(ev(), "start_document,|element,i,,y,,8,16|end_document,", "ignored elements");
+$p->ignore_elements();
+
+$p->xml_mode(1);
+$p->parse("<a/><a></A><A></A>")->eof;
+is(ev(), "start_document,|start,<a/>|end,|start,<a>|end,</A>|element,A,,,,11,18|end_document,", "xml_mode");
+$p->xml_mode(0);
+
+# tag specific element handler
+$p = HTML::Parser->new(api_version => 3,
+		       "element:title_h" => [\@a, "tagname,dtext"],
+		       start_h => [\@a, "tagname"],
+		       text_h => [\@a, "text"],
+		      );
+$p->parse("<title>T</title><h1>H</h1>")->eof;
+is(ev(), "title,T|h1|H", "element:title");
+
+$p->handler("start:h1" => \@a, '"h1!"');
+$p->handler("element:h1" => \@a, '"H1", attrval(id)');
+$p->parse("<h1 id=x>H</h1>")->eof;
+is(ev(), "H1,x", "element handler wins over start");
+
+$p->handler("element:h1" => undef);
+$p->parse("<h1>H</h1>")->eof;
+is(ev(), "h1!|H", "removed");
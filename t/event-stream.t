@@ -0,0 +1,143 @@
+use strict;
+use Test::More tests => 20;
+
+use HTML::Parser;
+
+my $doc = <<'EOT';
+<!DOCTYPE html>
+<html><head><title>A &amp; B</title>
+<script>if (a < b) document.write("<b>")</script></head>
+<body class=x id='y' hidden><!-- note --><p>One
+<a href="/x?a=1&amp;b=2" title=t>two</a><br/>
+<?php echo 1 ?><textarea>&lt;x</textarea>
+<pre>  keep  </pre>
+EOT
+
+my $argspec = "event,tagname,attr,attrseq,text,dtext,is_cdata,tokens,token0," .
+              "tokenpos,offset,offset_end,line,column,depth,path";
+
+sub events {
+    my($feed, %opt) = @_;
+    my @ev;
+    my $p = HTML::Parser->new(api_version => 3, %opt,
+			      default_h => [\@ev, $argspec]);
+    $feed->($p);
+    return join("\n", map { join("|", map flat($_), @$_) } @ev);
+}
+
+sub flat {
+    my $v = shift;
+    return "-" unless defined $v;
+    return join(",", map "$_=$v->{$_}", sort keys %$v) if ref($v) eq "HASH";
+    return "[@$v]" if ref($v);
+    return $v;
+}
+
+my $stream = "";
+my $direct = events(sub {
+    my $p = shift;
+    $p->event_output(\$stream);
+    $p->parse($_) for $doc =~ /(.{1,7})/sg;
+    $p->eof;
+});
+ok(length($stream), "stream written");
+like($stream, qr/^HPev\x01/, "magic");
+
+my $replayed = events(sub { shift->replay($stream) });
+is($replayed, $direct, "same events");
+
+# the replaying parser has its own options
+my @a;
+my $p = HTML::Parser->new(api_version => 3,
+			  start_h => [\@a, '@{tagname, offset}'],
+			  report_tags => [qw(a title)],
+			 );
+$p->replay($stream);
+is(join(",", @a), "title,28,a,158", "report_tags");
+@a = ();
+$p = HTML::Parser->new(api_version => 3,
+		       text_h => [\@a, '@{dtext}'],
+		       unbroken_text => 1,
+		      );
+$p->replay($stream);
+my $joined = join("|", @a);
+@a = ();
+$p->parse($doc)->eof;
+is($joined, join("|", @a), "unbroken_text");
+
+# the stream covers the document
+my $copy = "";
+$p = HTML::Parser->new(api_version => 3, rewrite_output => \$copy);
+$p->replay($stream);
+is($copy, $doc, "rewrite_output copies it");
+
+# made up end tags and marked sections
+$stream = "";
+$p = HTML::Parser->new(api_version => 3, marked_sections => 1,
+		       event_output => \$stream,
+		      );
+$p->parse("<title>x<![IGNORE[ <p> ]]><![CDATA[<b>]]>")->eof;
+my $fresh = events(sub { shift->parse("<title>x<![IGNORE[ <p> ]]><![CDATA[<b>]]>")->eof },
+		   marked_sections => 1);
+is(events(sub { shift->replay($stream) }, marked_sections => 1), $fresh,
+   "end tag at eof, marked sections");
+
+$stream = "";
+$p = HTML::Parser->new(api_version => 3, empty_element_tags => 1,
+		       event_output => \$stream,
+		      );
+$p->parse($doc)->eof;
+is(events(sub { shift->replay($stream) }, empty_element_tags => 1),
+   events(sub { shift->parse($doc)->eof }, empty_element_tags => 1),
+   "empty element tags");
+
+# several documents in one stream, to a file handle
+$stream = "";
+open(my $fh, ">", \$stream) || die;
+$p = HTML::Parser->new(api_version => 3, event_output => $fh);
+$p->parse("<a>1</a>")->eof;
+$p->parse("<b>2")->eof;
+close($fh);
+@a = ();
+$p = HTML::Parser->new(api_version => 3,
+		       start_document_h => [\@a, '@{"S"}'],
+		       end_document_h => [\@a, '@{"E"}'],
+		       start_h => [\@a, '@{tagname, offset}'],
+		      );
+$p->replay($stream);
+is("@a", "S a 0 E S b 0 E", "two documents");
+
+# a handler stops it
+@a = ();
+$p->handler($_ => undef) for qw(start_document end_document);
+$p->handler(start => sub { push(@a, shift); $_[0]->eof if @a == 1 }, "tagname,self");
+ok(!defined($p->replay($stream)), "eof from a handler");
+is("@a", "a", "stopped");
+
+eval { HTML::Parser->new->replay("HPev\x01\x02\x00\x05") };
+like($@, qr/^Bad event stream at byte 5/, "truncated");
+eval { HTML::Parser->new->replay("<html>") };
+like($@, qr/^Bad event stream at byte 0/, "not a stream");
+
+# records with the wrong number of tokens for the event
+sub record {
+    my($event, $text, @tokens) = @_;  # (beg, len) pairs, beg 1-based
+    return "HPev\x01" . pack("CCCCC", $event, 0, 0, length($text),
+			      @tokens / 2) . pack("C*", @tokens) . $text;
+}
+@a = ();
+$p = HTML::Parser->new(api_version => 3,
+		       start_h => [\@a, 'tagname, attr']);
+$p->replay(record(2, "<a b>", 2, 1, 4, 1, 0, 0));
+is_deeply(\@a, [["a", {b => "b"}]], "boolean attribute value");
+for my $bad ([2, "<a b>", 2, 1, 4, 1],   # start, no attribute value
+	     [2, "<a>"],                   # start, no tag name
+	     [2, "<a b>", 0, 0, 4, 1, 4, 1],
+	     [3, "</a>"],                  # end, no tag name
+	     [4, "a", 1, 1],               # text with a token
+	     [5, "<?x?>", 3, 1, 3, 1],     # process, two tokens
+	     )
+{
+    eval { $p->replay(record(@$bad)) };
+    like($@, qr/^Bad event stream at byte 5/, "bad token count for event $bad->[0]");
+}
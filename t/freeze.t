@@ -0,0 +1,105 @@
+use strict;
+use Test::More tests => 19;
+
+use HTML::Parser;
+use lib "t/lib";
+use RandomDoc;
+
+# A document parsed in chunks, with the parser frozen and thawed into a
+# new one between them, must give the same events as one parser.
+
+my @ev;
+my $argspec = "event,text,offset,line,column,is_cdata,depth,skipped_text";
+my @handlers = (api_version => 3,
+		default_h => [\@ev, $argspec],
+		start_document_h => [\@ev, $argspec]);
+
+sub events {
+    my($doc, $opt, $freeze) = @_;
+    @ev = ();
+    my $p = HTML::Parser->new(@handlers, %$opt);
+    $p->ignore_elements("title");
+    my @chunks = $doc =~ /(.{1,7})/gs;
+    for (@chunks) {
+	$p->parse($_);
+	$p = HTML::Parser->thaw($p->freeze, @handlers) if $freeze;
+    }
+    $p->eof;
+    return event_string(@ev);
+}
+
+srand(11);
+for my $opt ({}, {unbroken_text => 1}, {marked_sections => 1},
+	     {xml_mode => 1, empty_element_tags => 1}, {strict_comment => 1})
+{
+    ok(same_events(100, elements => 40, sub {
+	my $doc = shift;
+	return (full => events($doc, $opt), thawed => events($doc, $opt, 1));
+    }), "same events with " . join(",", %$opt));
+}
+
+# the options and filters go along
+my @a;
+my @h = (api_version => 3,
+	 start_h => [\@a, "tagname,attr"],
+	 text_h => [\@a, "text"]);
+my $p = HTML::Parser->new(@h, case_sensitive => 1,
+			  literal_tags => [qw(code)],
+			  boolean_attribute_value => "yes");
+$p->report_tags(qw(code x));
+$p->parse("<x a><y><code><y>");
+$p = HTML::Parser->thaw($p->freeze, @h);
+ok($p->case_sensitive, "case_sensitive");
+$p->parse("</y></code><x b><X c>")->eof;
+is(join(",", map { ref($_) ? join("=", %$_) : $_ } map @$_, @a),
+   "x,a=yes,code,,<y></y>,x,b=yes", "literal_tags, report_tags, boolean_attribute_value");
+
+# characters
+@a = ();
+$p = HTML::Parser->new(api_version => 3);
+$p->parse("<p title='\x{263A}");
+$p = HTML::Parser->thaw($p->freeze, api_version => 3,
+			start_h => [\@a, "attr"]);
+$p->parse(" x'>")->eof;
+is($a[0][0]{title}, "\x{263A} x", "utf8 buffer");
+
+# a fresh parser freezes small
+is(length(HTML::Parser->new->freeze), 28, "length");
+
+eval { HTML::Parser->thaw("HPst\001\x{ff}") };
+like($@, qr/^Bad frozen parser state at byte 5/, "bad state");
+
+eval { HTML::Parser->thaw(substr($p->freeze, 0, -1)) };
+like($@, qr/^Bad frozen parser state/, "cut off");
+
+# states that don't add up
+my $fresh = HTML::Parser->new->freeze;
+for my $bad ([11, "\x31", 27, "element of the last event, no stack"],
+	     [11, "\x21", 27, "pop pending, no stack"],
+	     [24, "\x01", 25, "ignore depth, nothing ignored"])
+{
+    my($at, $byte, $err_at, $name) = @$bad;
+    my $state = $fresh;
+    substr($state, $at, 1) = $byte;
+    eval { HTML::Parser->thaw($state, api_version => 3,
+			      start_h => [sub {}, "depth, path"]) };
+    like($@, qr/^Bad frozen parser state at byte $err_at/, $name);
+}
+@h = (api_version => 3, "start:div b_h" => [\@a, "tagname"]);
+$p = HTML::Parser->new(@h);
+$p->parse("<div><b>");
+my $state = $p->freeze;
+ok(HTML::Parser->thaw($state, @h), "selector masks");
+for (["\x04\x01\x01", "part"], ["\x02\x02\x01", "match"],
+     ["\x02\x01\x02", "inside"])
+{
+    my($masks, $name) = @$_;
+    (my $bad = $state) =~ s/\x03b\x02\x01\x01\x00\z/\x03b$masks\x00/ || die;
+    eval { HTML::Parser->thaw($bad, @h) };
+    like($@, qr/^Bad frozen parser state/, "selector $name mask too wide");
+}
+
+$p = HTML::Parser->new(api_version => 3,
+		       start_h => [sub { shift->freeze }, "self"]);
+eval { $p->parse("<p>") };
+like($@, qr/^Can't freeze or thaw while parsing/, "while parsing");
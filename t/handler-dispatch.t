@@ -0,0 +1,91 @@
+use strict;
+use Test::More tests => 10;
+
+use HTML::Parser;
+
+my @a;
+{
+    package P1;
+    use vars qw(@ISA $AUTOLOAD);
+    @ISA = qw(HTML::Parser);
+    sub s { push(@a, "P1:$_[1]") }
+    sub AUTOLOAD {
+	my $name = $AUTOLOAD;
+	$name =~ s/.*:://;
+	return if $name eq "DESTROY";
+	push(@a, "auto-$name:$_[1]");
+    }
+
+    package P2;
+    use vars qw(@ISA);
+    @ISA = qw(P1);
+
+    package P3;
+    use vars qw(@ISA);
+    @ISA = qw(HTML::Parser);
+    sub s { push(@a, "P3:$_[1]") }
+}
+
+my $p = P2->new(api_version => 3, start_h => ["s", "self,tagname"]);
+$p->parse("<a>");
+is("@a", "P1:a", "inherited method");
+
+# redefining the method
+@a = ();
+{
+    no warnings 'redefine';
+    eval 'sub P1::s { push(@a, "P1new:$_[1]") }';
+}
+$p->parse("<b>");
+is("@a", "P1new:b", "redefined method");
+
+# method defined in the subclass
+@a = ();
+eval 'sub P2::s { push(@a, "P2:$_[1]") }';
+$p->parse("<c>");
+is("@a", "P2:c", "method added to subclass");
+
+# @ISA changes
+@a = ();
+{
+    no strict 'refs';
+    undef &P2::s;
+    delete $P2::{s};
+}
+@P2::ISA = qw(P3);
+$p->parse("<d>");
+is("@a", "P3:d", "\@ISA changed");
+
+# reblessed object
+@a = ();
+bless $p, "P1";
+$p->parse("<e>");
+is("@a", "P1new:e", "reblessed");
+
+# AUTOLOAD
+@a = ();
+$p->handler(start => "foo", "self,tagname");
+$p->parse("<f><g>");
+is("@a", "auto-foo:f auto-foo:g", "AUTOLOAD");
+
+# a handler that dies leaves the parser usable
+@a = ();
+$p = HTML::Parser->new(api_version => 3,
+		       start_h => [sub { die "oops\n" if $_[0] eq "b"; push(@a, $_[0]) },
+				   "tagname"]);
+eval { $p->parse("<a><b><c>") };
+is($@, "oops\n", "exception propagated");
+$p->parse("<d>")->eof;
+is("@a", "a d", "parser usable after die");
+
+# dying while pending text is reported
+@a = ();
+my $die = 1;
+$p = HTML::Parser->new(api_version => 3, unbroken_text => 1,
+		       text_h => [sub { if ($die) { $die = 0; die "text\n" }
+					 push(@a, $_[0]) }, "text"],
+		       start_h => [\@a, "tagname"]);
+eval { $p->parse("foo<a>bar")->eof };
+is($@, "text\n", "exception from flushed text");
+$p->parse("baz<b>qux")->eof;
+is(join(",", map { ref($_) ? @$_ : $_ } @a), "baz,b,qux", "pending text state restored");
@@ -0,0 +1,127 @@
+use strict;
+use Test::More tests => 18;
+
+use HTML::Parser;
+
+my @a;
+my $doc = <<'EOT';
+<div class="nav"><a href="/home">Home</a></div>
+<div class="main article" id=content>
+  <p>Intro <a href="http://example.com/">ext</a> <a name=x>anchor</a>
+  <ul><li><a href="/1">one</a><li><b><a href='/2'>two</a></b></ul>
+</div>
+<a href="/foot">foot</a>
+EOT
+
+my $p = HTML::Parser->new(api_version => 3);
+$p->handler("start:div.article a[href]" => \@a, '@{attrval(href)}');
+$p->parse($doc)->eof;
+is(join(",", @a), "http://example.com/,/1,/2", "descendant");
+@a = ();
+
+$p->handler("start:div.article a[href]" => undef);
+$p->handler("start:li > a" => \@a, '@{attrval(href)}');
+$p->parse($doc)->eof;
+is("@a", "/1", "child");
+@a = ();
+
+$p->handler("start:li > a" => undef);
+$p->handler("start:#content ul a[href^='/']" => \@a, '@{attrval(href)}');
+$p->parse($doc)->eof;
+is("@a", "/1 /2", "id and prefix");
+@a = ();
+
+$p->handler("start:#content ul a[href^='/']" => undef);
+$p->handler("text:div.article li" => \@a, '@{dtext}');
+$p->parse($doc)->eof;
+is(join("", @a), "onetwo", "text inside matches");
+@a = ();
+
+$p->handler("text:div.article li" => undef);
+$p->handler("end:.main" => \@a, '@{tagname, offset}');
+$p->handler("start:*.nav" => \@a, '@{tagname, offset}');
+$p->parse($doc)->eof;
+is("@a", "div 0 div 223", "end events and universal selector");
+@a = ();
+
+$p = HTML::Parser->new(api_version => 3,
+		       "start:meta[property^=og:]_h" => [\@a, '@{attrval(property, content)}'],
+		       start_h => [\@a, '@{"S", tagname}'],
+		      );
+$p->parse(<<'EOT')->eof;
+<head>
+<meta property="og:title" content="Title">
+<meta name=description content="Text">
+<META PROPERTY="og:image" CONTENT="x.png">
+<meta property="fb:app_id" content="1">
+</head>
+EOT
+is("@a", "S head og:title Title S meta og:image x.png S meta", "constructor, fallback to the start handler");
+@a = ();
+
+# a selector handler takes precedence over a tag handler
+$p = HTML::Parser->new(api_version => 3,
+		       "start:a_h" => [\@a, '@{"tag"}'],
+		       "start:p a_h" => [\@a, '@{"selector"}'],
+		      );
+$p->parse("<a><p><a></p><a>")->eof;
+is("@a", "tag selector tag", "precedence");
+@a = ();
+
+# attribute values are decoded and classes are words
+$p = HTML::Parser->new(api_version => 3,
+		       'start:a[title="a&b"]_h' => [\@a, '@{"title"}'],
+		       "start:.x.y_h" => [\@a, '@{"xy"}'],
+		       "start:[checked]_h" => [\@a, '@{"checked"}'],
+		      );
+$p->parse(qq(<a title="a&amp;b"><a title="a&b"><a title="a&ampb">));
+$p->parse(qq(<i class="y  x z"><i class="xy"><i class=x><input checked>))->eof;
+is("@a", "title title xy checked", "values");
+@a = ();
+
+# case sensitivity follows the parser
+$p = HTML::Parser->new(api_version => 3,
+		       "start:DIV > Span_h" => [\@a, '@{tagname}'],
+		      );
+$p->parse("<div><span>")->eof;
+is("@a", "span", "case insensitive");
+@a = ();
+$p->xml_mode(1);
+$p->parse("<div><span><DIV><Span>")->eof;
+is("@a", "Span", "xml_mode");
+@a = ();
+
+# the open element stack is followed
+$p = HTML::Parser->new(api_version => 3,
+		       "start:p > b_h" => [\@a, '@{tagname, path}'],
+		      );
+$p->parse("<p><b>1</b><br><b>2</b><p><b>3</b></p><div><b>4</b></div>")->eof;
+is("@a", "b p/b b p/b b p/b", "element stack");
+@a = ();
+
+# deep nesting must not make matching explode
+$p = HTML::Parser->new(api_version => 3,
+		       "start:section div div div div a_h" => [\@a, 'tagname'],
+		       "start:section > div > div b_h" => [\@a, 'tagname'],
+		      );
+my $t = time;
+$p->parse("<section>" . ("<div>" x 2000) . "<a><b>" . ("</div>" x 2000))->eof;
+ok(time - $t < 10, "deep nesting");
+is(scalar(@a), 2, "matched deep down");
+@a = ();
+
+eval { $p->handler("start:a[href" => \@a) };
+like($@, qr/^Bad selector \(a\[href\)/, "bad selector");
+
+eval { $p->handler("start:a >" => \@a) };
+like($@, qr/^Bad selector/, "dangling combinator");
+
+eval { $p->handler("comment:a b" => \@a) };
+like($@, qr/^No selector handlers for comment events/, "no selector handlers for comments");
+
+# one compound selector each, one more than fits
+$p = HTML::Parser->new(api_version => 3);
+eval { $p->handler("start:.c$_" => \@a) for 0 .. 32 };
+like($@, qr/^Too many compound selectors/, "too many selector handlers");
+$p->parse("<p class=c31>")->eof;
+is(scalar(@a), 1, "the others still work");
@@ -0,0 +1,69 @@
+use strict;
+use Test::More tests => 13;
+
+use HTML::Parser;
+
+my @a;
+my $p = HTML::Parser->new(api_version => 3);
+$p->handler(start => \@a, '"start", tagname');
+$p->handler("start:a" => \@a, '"a", attr');
+$p->handler("end:title" => sub { push(@a, ["title end"]) }, "");
+
+$p->parse("<a href=x><b></a><title>x</title>")->eof;
+is(join("|", map { join(",", map { ref($_) ? join("=", %$_) : $_ } @$_) } @a),
+   "a,href=x|start,b|start,title|title end", "tag handlers");
+
+# returned values
+is(ref($p->handler("start:a")), "ARRAY", "get handler");
+ok(!defined($p->handler("start:b")), "no such handler");
+ok(!defined($p->handler("end:b")), "still no such handler");
+
+# removing a tag handler falls back to the generic one
+@a = ();
+is(ref($p->handler("start:a" => undef)), "ARRAY", "old handler returned");
+ok(!defined($p->handler("start:a")), "removed");
+$p->parse("<a href=x>")->eof;
+is(join("|", map { join(",", @$_) } @a), "start,a", "generic handler again");
+
+# "" ignores the tag
+@a = ();
+$p->handler("start:b" => "");
+$p->parse("<a><b><c>")->eof;
+is(join("|", map { join(",", @$_) } @a), "start,a|start,c", "ignored tag");
+
+# falls back to the default handler too
+@a = ();
+$p = HTML::Parser->new(api_version => 3,
+		       default_h => [\@a, "event"],
+		       "start:p_h" => [\@a, '"p"'],
+		      );
+$p->parse("<p><q>")->eof;
+is(join("|", map { join(",", @$_) } @a), "start_document|p|start|end_document", "default handler");
+
+# tag names are matched like the tag filters
+@a = ();
+$p = HTML::Parser->new(api_version => 3);
+$p->handler("start:img" => \@a, "attrval(src)");
+$p->parse("<IMG SRC=a.gif><img src=b.gif>")->eof;
+is(join(",", map @$_, @a), "a.gif,b.gif", "case insensitive");
+
+@a = ();
+$p->case_sensitive(1);
+$p->parse("<IMG SRC=a.gif><img src=b.gif>")->eof;
+is(join(",", map @$_, @a), "b.gif", "case_sensitive");
+
+# method handlers
+{
+    package MyP;
+    use vars qw(@ISA);
+    @ISA = qw(HTML::Parser);
+    sub title_start { push(@a, "title") }
+}
+@a = ();
+$p = MyP->new(api_version => 3);
+$p->handler("start:title" => "title_start", "self");
+$p->parse("<title><h1>")->eof;
+is("@a", "title", "method");
+
+eval { $p->handler("comment:p" => \@a) };
+like($@, qr/^No tag specific handlers for comment events/, "only start and end");
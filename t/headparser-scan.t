@@ -0,0 +1,67 @@
+use strict;
+use Test::More tests => 9;
+
+require HTML::HeadParser;
+
+{ package H;
+  sub new { bless [], shift }
+  sub push_header { my $self = shift; push(@$self, [@_]) }
+}
+
+{ package SlowHeadParser;
+  # overriding a handler method turns the head_scan mode off
+  use vars qw(@ISA);
+  @ISA = qw(HTML::HeadParser);
+  sub text { shift->SUPER::text(@_) }
+}
+
+sub fields {
+    my($class, $chunks, $utf8) = @_;
+    my $h = H->new;
+    my $p = $class->new($h);
+    $p->utf8_mode(1) if $utf8;
+    my $more;
+    for (@$chunks) {
+	$more = $p->parse($_);
+	last unless $more;
+    }
+    $p->eof;
+    return join("|", ($more ? "more" : "done"),
+		map { join("=", map { defined($_) ? $_ : "<undef>" } @$_) } @$h);
+}
+
+ok(HTML::HeadParser->new(H->new)->head_scan, "head_scan used");
+ok(!SlowHeadParser->new(H->new)->head_scan, "not for subclasses");
+
+my @docs = (
+    <<'EOT',
+<html><head>
+<title>  Some &amp;
+    title&#33;  </title>
+<meta http-equiv="Content-Type" content="text/html; charset=utf-8">
+<meta http-equiv="" name="author" content="Me">
+<META NAME="og:title" CONTENT="x"><meta name=0 content=zero><meta name=empty>
+<meta charset=latin1><meta http-equiv=refresh>
+<meta property="og:image" content="/i.png"><meta name=n property=p content=x>
+<meta property=0 content=zero>
+<link href=" a.css " rel=stylesheet type="text/css" rel=dup />
+<link rel=icon><base href="  http://example.com/ "><isindex prompt=0>
+<noscript>text in noscript</noscript><object>x</object>
+<script>document.write("<body>")</script><style>p {}</style>
+</head><body>Body text <title>not this</title>
+EOT
+    "<title>Hi <foo></title><meta name=a content=b>",
+    "\x{FEFF}\n<title>\x{263A} smile</title>  \n<p>",
+    "<title>a</title><br><meta name=late content=x>",
+    "<title>unterminated",
+    "<!DOCTYPE html><!-- <meta name=commented> --><?pi?><meta name=b content=c> text",
+);
+
+for my $doc (@docs) {
+    my $slow = fields("SlowHeadParser", [$doc]);
+    is(fields("HTML::HeadParser", [$doc]), $slow, "same fields");
+}
+
+my $doc = $docs[0];
+is(fields("HTML::HeadParser", [split //, $doc]),
+   fields("SlowHeadParser", [$doc]), "one char at a time");
@@ -1,7 +1,7 @@
 #!perl -w
 
 use strict;
-use Test::More tests => 17;
+use Test::More tests => 18;
 
 { package H;
   sub new { bless {}, shift; }
@@ -51,6 +51,7 @@ my $HTML = <<'EOT';
 <meta http-equiv="Expires" content="Soon">
 <meta http-equiv="Foo" content="Bar">
 <meta name='twitter:card' content='photo' />
+<meta property="og:image" content="/i.png">
 <link href="mailto:gisle@aas.no" rev=made title="Gisle Aas">
 
 <script>
@@ -101,6 +102,7 @@ is($p->header('Content-Base'), 'http://www.sn.no');
 is_deeply($p->header('X-Meta-Keywords'), ['test, test, test,...', 'more']);
 is($p->header('X-Meta-Charset'), 'ISO-8859-1');
 is($p->header('X-Meta-Twitter-Card'), 'photo');
+is($p->header('X-Meta-Property-Og-Image'), '/i.png');
 like($p->header('Link'), qr/<mailto:gisle\@aas.no>/);
 
 # This header should not be present because the head ended
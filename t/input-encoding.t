@@ -0,0 +1,76 @@
+use strict;
+use Test::More tests => 23;
+
+use HTML::Parser;
+use Encode qw(encode);
+
+my @text;
+my $p = HTML::Parser->new(api_version => 3,
+			  input_encoding => "auto",
+			  text_h => [sub { push(@text, shift) }, "dtext"]);
+
+sub text {
+    my @chunks = @_;
+    @text = ();
+    $p->parse($_) for @chunks;
+    $p->eof;
+    return join("", @text);
+}
+
+my $str = "h\x{e9}llo \x{20ac} \x{1F600} w\x{f6}rld";
+for my $enc (qw(UTF-8 UTF-16LE UTF-16BE)) {
+    my $bytes = encode($enc, "\x{FEFF}<p>$str</p>");
+    my $ok = 1;
+    for my $n (1 .. 5) {
+	# every character split between chunks some way
+	$ok = 0 unless text($bytes =~ /(.{1,$n})/gs) eq $str;
+    }
+    ok($ok, "$enc with BOM");
+    is($p->document_encoding, $enc, "$enc found");
+}
+
+is(text("<meta charset=windows-1252><p>\x80 caf\xe9"), "\x{20ac} caf\x{e9}",
+   "meta charset");
+is(text("<meta http-equiv='Content-Type' content='text/html; charset=ISO-8859-1'>\x80"),
+   "\x{20ac}", "http-equiv");
+is($p->document_encoding, "windows-1252", "ISO-8859-1 labels mean windows-1252");
+is(text("<!-- <meta charset=utf-16> -->\xc3\xa9", "\xc3"), "\x{e9}\x{fffd}",
+   "meta in a comment");
+is(text("<p>" . ("x" x 1024) . "<meta charset=utf-8>\xe9"), ("x" x 1024) . "\x{e9}",
+   "only the start is looked at");
+is($p->document_encoding, "windows-1252", "the default");
+text("<p>caf\xc3", "\xa9");
+is($p->document_encoding, "UTF-8", "looks like UTF-8");
+
+# the events wait for the encoding to be known
+@text = ();
+$p->parse("<p>a");
+is(scalar(@text), 0, "waits");
+$p->parse("<meta charset=utf-8>");
+is(join("", @text), "a", "until it is known");
+$p->eof;
+
+$p->input_encoding("ISO-8859-1");
+is(text("x\x80\xe9"), "x\x{20ac}\x{e9}", "ISO-8859-1 means windows-1252");
+$p->input_encoding("us-ascii");
+is($p->input_encoding, "windows-1252", "so does US-ASCII");
+is(text("\xef\xbb\xbf\xc3\xa9"), "\x{e9}", "a BOM wins");
+
+$p->input_encoding("utf8");
+is(text("a\xff\xe2\x82b\xf0\x9f"), "a\x{fffd}\x{fffd}b\x{fffd}", "malformed UTF-8");
+is($p->input_encoding, "UTF-8", "name");
+
+$p->utf8_mode(1);
+is(text("\xfe\xff\0\xe9"), "\xc3\xa9", "utf8_mode gives bytes");
+$p->utf8_mode(0);
+
+$p->input_encoding("auto");
+$p->parse("<p>\xe9");
+$p = HTML::Parser->thaw($p->freeze, api_version => 3,
+			text_h => [sub { push(@text, shift) }, "dtext"]);
+@text = ();
+$p->parse("<meta charset=cp1252>")->eof;
+is(join("", @text), "\x{e9}", "freeze");
+
+eval { $p->input_encoding("EBCDIC") };
+like($@, qr/^Unknown input encoding 'EBCDIC'/, "unknown");
@@ -0,0 +1,87 @@
+package RandomDoc;
+
+# Random documents for the tests that parse the same document in
+# different ways and expect the same events.
+
+use strict;
+use Exporter ();
+use Test::More ();
+
+use vars qw(@ISA @EXPORT);
+@ISA = qw(Exporter);
+@EXPORT = qw(random_doc random_chunks event_string same_events);
+
+my %pieces = (
+    # bits of start tags and attributes
+    attr => ["<a", "<b ", "<img", "</a>", ">", ">", " ", " ", "=", "=",
+	     "\"", "'", "`", "/", "/>", "x", "y=1", "z='>'", "w=\"a b\"",
+	     "\n", "&amp;", "<!--", "-->", "text", "<script>", "</script>"],
+
+    # bits of tags, and the markup that might hide them
+    tags => ["<a", "<b", "<meta", "</a", "</b", "</meta", "<script>",
+	     "</script>", "<!--", "-->", "<!DOCTYPE html>", "<?pi?>", ">",
+	     ">", "/>", " ", "\n", "x", "title='<a>'", "href=\"</b>\"",
+	     "=", "\"", "'", "<![CDATA[", "]]>", "&amp;", "<", "</",
+	     "\xE6", "\x{263A}"],
+
+    # whole tags and text, and the elements and sections that change
+    # how what follows is parsed
+    elements => ["<a href='x'>", "</a>", "<p>", "text ", "more\ntext",
+		 "<script>", "if (a<b) x()", "</script>", "<!-- c -->",
+		 "<!--", "-->", "<title>", "</title>", "&amp;", "<br/>", "<",
+		 ">", "<textarea>", "</textarea>", "<![CDATA[", "]]>",
+		 "<?pi?>", "<![INCLUDE[", "<![IGNORE[", "<![RCDATA[", "\"",
+		 "'", "<xmp>", "</xmp>", "<plaintext>", "<b>", "</b>",
+		 "<div class='y'>", "</div>"],
+
+    # bits of what a sanitizer has to keep out
+    unsafe => ["<a", "<b", "<script", "</a", "</b", "</script", "<p", "</p",
+	       ">", "/>", " ", "x", "href='javascript:x'", "onclick=x",
+	       "class=\"", "\"", "'", "<!--", "-->", "&lt;", "<", "</",
+	       "<style>", "</style>", "<li>", "<br>", "=", "src=/x"],
+);
+
+sub random_doc
+{
+    my($kind, $len) = @_;
+    my $pieces = $pieces{$kind} || die "No '$kind' pieces";
+    my $doc = "";
+    $doc .= $pieces->[rand @$pieces] for 1 .. $len;
+    return $doc;
+}
+
+sub random_chunks
+{
+    # the document in chunks of 1 to $max characters
+    my($doc, $max) = @_;
+    my @chunks;
+    push(@chunks, substr($doc, 0, 1 + int(rand $max), "")) while length $doc;
+    return @chunks;
+}
+
+sub event_string
+{
+    # the events collected by an array handler, one per line
+    return join("\n", map { join("|", map { defined ? $_ : "-" } @$_) } @_);
+}
+
+sub same_events
+{
+    # Makes $count documents of $kind and $len pieces and passes each
+    # to $parse, which returns name/events pairs.  True if all the
+    # events are the same every time, or else it shows the document
+    # where they are not.
+    my($count, $kind, $len, $parse) = @_;
+    for (1 .. $count) {
+	my $doc = random_doc($kind, $len);
+	my($name0, $ev0, @rest) = $parse->($doc);
+	while (my($name, $ev) = splice(@rest, 0, 2)) {
+	    next if $ev eq $ev0;
+	    Test::More::diag("doc: $doc\n$name0:\n$ev0\n$name:\n$ev");
+	    return 0;
+	}
+    }
+    return 1;
+}
+
+1;
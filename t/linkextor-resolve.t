@@ -0,0 +1,163 @@
+use strict;
+use Test::More tests => 18;
+
+use HTML::Parser;
+require HTML::LinkExtor;
+
+# RFC 3986 section 5.4
+my $base = "http://a/b/c/d;p?q";
+my %ex = (
+    "g:h"           => "g:h",
+    "g"             => "http://a/b/c/g",
+    "./g"           => "http://a/b/c/g",
+    "g/"            => "http://a/b/c/g/",
+    "/g"            => "http://a/g",
+    "//g"           => "http://g",
+    "?y"            => "http://a/b/c/d;p?y",
+    "g?y"           => "http://a/b/c/g?y",
+    "#s"            => "http://a/b/c/d;p?q#s",
+    "g#s"           => "http://a/b/c/g#s",
+    "g?y#s"         => "http://a/b/c/g?y#s",
+    ";x"            => "http://a/b/c/;x",
+    "g;x"           => "http://a/b/c/g;x",
+    "g;x?y#s"       => "http://a/b/c/g;x?y#s",
+    ""              => "http://a/b/c/d;p?q",
+    "."             => "http://a/b/c/",
+    "./"            => "http://a/b/c/",
+    ".."            => "http://a/b/",
+    "../"           => "http://a/b/",
+    "../g"          => "http://a/b/g",
+    "../.."         => "http://a/",
+    "../../"        => "http://a/",
+    "../../g"       => "http://a/g",
+    "../../../g"    => "http://a/g",
+    "../../../../g" => "http://a/g",
+    "/./g"          => "http://a/g",
+    "/../g"         => "http://a/g",
+    "g."            => "http://a/b/c/g.",
+    ".g"            => "http://a/b/c/.g",
+    "g.."           => "http://a/b/c/g..",
+    "..g"           => "http://a/b/c/..g",
+    "./../g"        => "http://a/b/g",
+    "./g/."         => "http://a/b/c/g/",
+    "g/./h"         => "http://a/b/c/g/h",
+    "g/../h"        => "http://a/b/c/h",
+    "g;x=1/./y"     => "http://a/b/c/g;x=1/y",
+    "g;x=1/../y"    => "http://a/b/c/y",
+    "g?y/./x"       => "http://a/b/c/g?y/./x",
+    "g#s/../x"      => "http://a/b/c/g#s/../x",
+    "http:g"        => "http:g",
+);
+
+sub links {
+    # the URLs the @links argspec passes
+    my($base, $doc) = @_;
+    my @a;
+    my $p = HTML::Parser->new(api_version => 3,
+			      start_h => [sub { push(@a, @_[grep $_ % 2, 0 .. $#_]) },
+					  '@links'],
+			      link_elements => \%HTML::Tagset::linkElements,
+			     );
+    $p->link_base($base);
+    $p->parse($doc)->eof;
+    return @a;
+}
+
+my @refs = sort keys %ex;
+my $doc = join("", map { qq(<a href="$_">) } @refs);
+is_deeply([links($base, $doc)], [map $ex{$_}, @refs], "RFC 3986 examples");
+is_deeply([links($base, "<a href='a_b:c'><a href='a+b-c.d:e'><a href='1a:b'>")],
+	  ["http://a/b/c/a_b:c", "a+b-c.d:e", "http://a/b/c/1a:b"],
+	  "what a scheme can be made of");
+
+# trimming, entities and escaping
+is_deeply([links("http://www.example.com/dir/",
+		 qq(<img src=" a b.png\n" alt=x><a href="x?a=1&amp;b=\xE5">))],
+	  ["http://www.example.com/dir/a%20b.png",
+	   "http://www.example.com/dir/x?a=1&b=%C3%A5"],
+	  "trimmed and escaped");
+my $chars = qq(<a href="\xE5\x{263A}">);
+is(join(" ", links("http://h/\xE5/", $chars), links("http://h/\xE5/", "<a href='&#xE5;'>")),
+   "http://h/%C3%A5/%C3%A5%E2%98%BA http://h/%C3%A5/%C3%A5", "characters are UTF-8");
+
+# without a base nothing but trimming happens
+my $p = HTML::LinkExtor->new;
+$p->parse(qq(<IMG SRC=" a b.png " LowSrc=x.gif><a name=x><form action="">));
+$p->eof;
+is_deeply([$p->links], [[img => src => "a b.png", lowsrc => "x.gif"],
+			[form => action => ""]], "no base");
+
+# <base href> is honoured when asked for
+my $html = <<'EOT';
+<head><base href="/other/"><base href="http://ignored/"></head>
+<a href="x.html">x</a>
+EOT
+$p = HTML::LinkExtor->new;
+$p->link_base_tag(1);
+$p->parse($html)->eof;
+is(join(" ", map $_->[2], $p->links),
+   "/other/ http://ignored/ x.html", "relative base tag");
+
+# the callback is looked up for each link, and the hooks are kept
+my @cb;
+$p = HTML::LinkExtor->new;
+$p->{extractlink_cb} = sub { push(@cb, [@_]) };
+$p->parse(qq(<p><a href=x>x</a><link rel=stylesheet href=s.css>))->eof;
+is_deeply(\@cb, [[a => href => "x"], [link => href => "s.css"]],
+	  "callback set later");
+is(scalar(my @l = $p->links), 0, "no links kept with a callback");
+
+{ package MyExtor;
+  our @ISA = qw(HTML::LinkExtor);
+  sub _found_link { my $self = shift; push(@{$self->{found}}, "@_") }
+}
+$p = MyExtor->new;
+$p->parse(qq(<a href=x><img src=y>))->eof;
+is("@{$p->{found}}", "a href x img src y", "_found_link");
+
+{ package MyStartExtor;
+  our @ISA = qw(HTML::LinkExtor);
+  sub _start_tag { my($self, $tag, $attr) = @_; $self->SUPER::_start_tag($tag, {%$attr, href => "z"}) }
+}
+$p = MyStartExtor->new;
+$p->parse(qq(<a href=x><b href=y>))->eof;
+is_deeply([$p->links], [[a => href => "z"]], "_start_tag");
+
+SKIP: {
+    skip "URI not installed", 5 unless eval { require URI };
+
+    $p = HTML::LinkExtor->new(undef, $base);
+    $p->parse($doc)->eof;
+    my @links = $p->links;
+    isa_ok($links[0][2], "URI", "with a base, a link");
+    is_deeply([map "$_->[2]", @links], [map $ex{$_}, @refs], "URI objects");
+
+    $p = HTML::LinkExtor->new(undef, "http://www.sn.no/foo/foo.html");
+    $p->link_base_tag(1);
+    $p->parse($html)->eof;
+    is(join(" ", map $_->[2], $p->links),
+       "http://www.sn.no/other/ http://ignored/ http://www.sn.no/other/x.html",
+       "base tag");
+
+    # the base tag only applies to the document it is in
+    $p->parse(qq(<a href="y.html">))->eof;
+    is(join(" ", map $_->[2], $p->links), "http://www.sn.no/foo/y.html",
+       "base tag forgotten at eof");
+
+    $p = HTML::LinkExtor->new(undef, "http://www.sn.no/");
+    $p->parse($html)->eof;
+    is(join(" ", map $_->[2], $p->links),
+       "http://www.sn.no/other/ http://ignored/ http://www.sn.no/x.html",
+       "base tag ignored by default");
+}
+
+# the @links argspec
+my @a;
+$p = HTML::Parser->new(api_version => 3,
+		       start_h => [\@a, '@{tagname, @links}'],
+		       link_elements => { a => "href", img => ["src", "usemap"] },
+		      );
+$p->parse(qq(<a><a href=1><img usemap=#m src=x><b href=2>))->eof;
+is("@a", "a href 1 img src x usemap #m", "\@links argspec");
+is($p->link_base("http://x/"), undef, "no base");
+is($p->link_base, "http://x/", "link_base");
@@ -0,0 +1,64 @@
+use Test::More tests => 9;
+
+use strict;
+use HTML::Parser;
+
+my @a;
+my $p = HTML::Parser->new(api_version => 3,
+			  literal_tags => [qw(template svg)],
+			 );
+$p->handler(default => \@a, '@{event, text, is_cdata}');
+
+sub doc {
+    my $doc = join(":", map { defined($_) ? $_ : "" } @a);
+    @a = ();
+    return $doc;
+}
+
+$p->parse("<Template><b>x</b></TEMPLATE><script><i></script>")->eof;
+is(doc(), "start_document:::start:<Template>::text:<b>x</b>:1:end:</TEMPLATE>::start:<script>::start:<i>::end:</script>::end_document::", 'custom set');
+
+# unknown literal elements are made empty at eof, like <script>
+$p->parse("<svg><g>x")->eof;
+is(join(":", map $_ || "", @a[0..10]), "start_document:::start:<svg>::end:::start:<g>", 'eof inside custom element');
+@a = ();
+
+# built-in elements keep their behaviour when listed
+$p->literal_tags(qw(title svg));
+$p->handler(default => \@a, '@{event, text, is_cdata}');
+$p->parse("<title>a&amp;<b></title>")->eof;
+is(doc(), "start_document:::start:<title>::text:a&amp;<b>::end:</title>::end_document::", 'title is still RCDATA');
+
+# no arguments restores the default set
+$p->literal_tags;
+$p->parse("<svg><b></svg><xmp><b></xmp>")->eof;
+is(doc(), "start_document:::start:<svg>::start:<b>::end:</svg>::start:<xmp>::text:<b>:1:end:</xmp>::end_document::", 'default set');
+
+# an empty list disables literal mode completely
+$p->literal_tags([]);
+$p->parse("<script>a<b>c</script>")->eof;
+is(doc(), "start_document:::start:<script>::text:a::start:<b>::text:c::end:</script>::end_document::", 'no literal elements');
+
+# changing the set from inside a literal element
+$p = HTML::Parser->new(api_version => 3,
+		       start_h => [sub { push(@a, "start", $_[1]);
+					 $_[0]->literal_tags(qw(style)) },
+				   "self,text"],
+		       default_h => [\@a, '@{event, text}'],
+		      );
+$p->parse("<script><b></script><style><b></style>")->eof;
+is(doc(), "start_document::start:<script>:start:<b>:end:</script>:start:<style>:text:<b>:end:</style>:end_document:", 'changed from handler');
+
+$p = HTML::Parser->new(api_version => 3,
+		       literal_tags => ["template"],
+		       text_h => [\@a, '@{text}'],
+		      );
+$p->parse("<template><p>a</p></template><p>b</p>")->eof;
+is(doc(), "<p>a</p>:b", 'text only');
+
+$p->xml_mode(1);
+$p->parse("<template><p>a</p></template>")->eof;
+is(doc(), "a", 'xml_mode ignores literal_tags');
+
+eval { $p->literal_tags({}) };
+like($@, qr/^Tag list must be plain scalars and arrays/, 'bad list');
@@ -10,13 +10,13 @@ my $p = HTML::Parser->new(start_h => [sub { $tag = shift  }, "tagname"],
                          );
 
 
-use Test::More tests => 14;
+use Test::More tests => 17;
 
 SKIP: {
 eval {
     $p->marked_sections(1);
 };
-skip $@, 14 if $@;
+skip $@, 17 if $@;
 
 $p->parse("<![[foo]]>");
 is($text, "foo");
@@ -118,4 +118,37 @@ $p = HTML::Parser->new(
 $p->parse("<![CDATA[foo [1]]]>");
 is($text, "foo [1]", "CDATA text ending in square bracket");
 
+# "]]>" chopped up between chunks
+for (["<![INCLUDE[xx]]>yy" => "xxyy"],
+     ["<![INCLUDE[<![INCLUDE[xx]]>]]>z" => "xxz"])
+{
+    my($doc, $expect) = @$_;
+    $text = "";
+    $p = HTML::Parser->new(
+        text_h => [sub { $text .= shift }, "dtext"],
+        marked_sections => 1,
+    );
+    $p->parse($_) for $doc =~ /(.{1,6})/gs;
+    $p->eof;
+    is($text, $expect, "chunked $doc");
+}
+
+# ending a chunk with "]" or "]]" made it look past the end of the buffer
+my $doc2 = "<![INCLUDE[]]>x]]>]]><![INCLUDE[<![INCLUDE[xx]]]]>";
+my $whole = "";
+HTML::Parser->new(text_h => [sub { $whole .= shift }, "dtext"],
+                  marked_sections => 1)->parse($doc2)->eof;
+my $same = 0;
+for (1..50) {
+    $text = "";
+    $p = HTML::Parser->new(
+        text_h => [sub { $text .= shift }, "dtext"],
+        marked_sections => 1,
+    );
+    $p->parse($_) for $doc2 =~ /(.{1,7})/gs;
+    $p->eof;
+    $same++ if $text eq $whole;
+}
+is($same, 50, "chunk ending in square brackets");
+
 } # SKIP
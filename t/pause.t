@@ -0,0 +1,83 @@
+use strict;
+use Test::More tests => 15;
+
+use HTML::Parser;
+use lib "t/lib";
+use RandomDoc;
+
+# Pausing and resuming, or parsing within budgets, must not change
+# the events reported.
+
+sub events {
+    my($doc, $opt, $how) = @_;
+    my %opt = %$opt;
+    my $report = delete $opt{report_tags};
+    my @ev;
+    my $p;
+    $p = HTML::Parser->new(api_version => 3, %opt,
+			   default_h => [sub {
+			       # text is broken up where the chunks end
+			       if ($_[0] eq "text" && @ev && $ev[-1][0] eq "text" &&
+				   ($ev[-1][5] || 0) == ($_[5] || 0)) {
+				   $ev[-1][1] .= $_[1];
+			       }
+			       else {
+				   push(@ev, [@_]);
+			       }
+			       $p->pause if $how eq "pause" && rand() < 0.2;
+			   }, "event,text,offset,line,column,is_cdata"]);
+    $p->report_tags(@$report) if $report;
+    my @budget = $how eq "events" ? (max_events => 3) :
+	         $how eq "bytes"  ? (max_bytes => 10) : ();
+    for my $chunk ($doc =~ /(.{1,40})/gs) {
+	$p->parse($chunk, @budget);
+	$p->resume(@budget) while $p->paused && rand() < 0.8;
+    }
+    $p->eof;
+    return event_string(@ev);
+}
+
+srand(3);
+for my $opt ({}, {unbroken_text => 1}, {marked_sections => 1},
+	     {report_tags => [qw(a b)]})
+{
+    ok(same_events(100, elements => 40, sub {
+	my $doc = shift;
+	return (plain => events($doc, $opt, ""),
+		map { $_ => events($doc, $opt, $_) } qw(pause events bytes));
+    }), "same events with " . join(",", map { ref($_) ? "@$_" : $_ } %$opt));
+}
+
+my @ev;
+my $p = HTML::Parser->new(api_version => 3,
+			  start_h => [sub {
+			      push(@ev, $_[1]);
+			      $_[0]->pause if $_[1] eq "b";
+			  }, "self,tagname"],
+			  text_h => [\@ev, "text"]);
+is($p->parse("<a><b>x<c>"), $p, "parse returns the parser");
+is(join(",", @ev), "a,b", "stopped after <b>");
+ok($p->paused, "paused");
+@ev = ();
+$p->resume;
+is(join(",", map { ref($_) ? @$_ : $_ } @ev), "x,c", "resumed");
+ok(!$p->paused, "done");
+
+@ev = ();
+$p->parse("<d>" x 10, max_events => 4);
+is(scalar(@ev), 4, "max_events");
+$p->parse("<e>", max_bytes => 7);
+is(scalar(@ev), 7, "max_bytes stops after the token crossing it");
+$p->eof;
+is(scalar(@ev), 11, "eof parses the rest");
+
+# the chunks from a code reference are taken as they are needed
+@ev = ();
+my @chunks = ("<f><b><g>", "<h>");
+$p->parse(sub { shift @chunks });
+is(join(",", @ev), "f,b", "code reference");
+$p->resume;
+is(join(",", @ev), "f,b,g", "the rest of the chunk");
+
+eval { $p->parse("x", max_tokens => 1) };
+like($@, qr/^Bad parse option 'max_tokens'/, "bad option");
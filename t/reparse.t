@@ -0,0 +1,117 @@
+use strict;
+use Test::More tests => 12;
+
+use HTML::Parser;
+use lib "t/lib";
+use RandomDoc;
+
+# The events of an edited document are the old ones before and after
+# the range reparse() returns, with the new ones in between.
+
+my @ev;
+my $p = HTML::Parser->new(api_version => 3,
+			  default_h => [\@ev, "event,text,offset,is_cdata"]);
+
+sub full {
+    my $doc = shift;
+    @ev = ();
+    $p->parse($doc)->eof;
+    return [@ev];
+}
+
+sub splice_events {
+    my($old, $new, $from, $to, $delta) = @_;
+    my @ev = grep { ($_->[2] < $from || $_->[0] eq "start_document") &&
+		    $_->[0] ne "end_document" } @$old;
+    push(@ev, @$new);
+    # unless it went on to the end of the document
+    unless (grep $_->[0] eq "end_document", @$new) {
+	for (@$old) {
+	    next if $_->[0] eq "start_document" || $_->[2] < $to - $delta;
+	    push(@ev, [$_->[0], $_->[1], $_->[2] + $delta, $_->[3]]);
+	}
+    }
+    return \@ev;
+}
+
+sub check {
+    my($doc, $at, $old_len, $insert, $interval) = @_;
+    $p->checkpoint_interval($interval);
+    my $old = full($doc);
+    my $new_doc = $doc;
+    substr($new_doc, $at, $old_len) = $insert;
+    @ev = ();
+    my($from, $to) = $p->reparse($new_doc, $at, $old_len, length $insert);
+    my $new = [@ev];
+    my $delta = length($insert) - $old_len;
+    my $got = splice_events($old, $new, $from, $to, $delta);
+    my $expected = full($new_doc);
+    return (event_string(@$got) eq event_string(@$expected), $to - $from,
+	    $got, $expected);
+}
+
+srand(45);
+my($ok, $n, $small) = (1, 0, 0);
+for (1 .. 300) {
+    my $doc = random_doc(elements => 150);
+    my $at = int(rand length $doc);
+    my $old_len = int(rand 8);
+    $old_len = length($doc) - $at if $at + $old_len > length $doc;
+    my $insert = random_doc(elements => int(rand 3));
+    my($same, $span, $got, $expected) = check($doc, $at, $old_len, $insert, 20);
+    $n++;
+    $small++ if $span < length($doc) / 2;
+    unless ($same) {
+	$ok = 0;
+	diag "doc: $doc\nat: $at $old_len [$insert]";
+	if ($ENV{REPARSE_DEBUG}) {
+	    diag "got:\n" . event_string(@$got);
+	    diag "expected:\n" . event_string(@$expected);
+	}
+	last;
+    }
+}
+ok($ok, "random edits ($n)");
+ok($small > $n / 3, "often reparse less than half ($small of $n)");
+
+# a small edit in a big document
+my $doc = "<html><body>\n" . join("", map "<p class=x>Paragraph $_ &amp; <b>more</b></p>\n", 1 .. 5000) . "</body></html>\n";
+$p->checkpoint_interval(512);
+full($doc);
+my $at = index($doc, "Paragraph 2500");
+my $new_doc = $doc;
+substr($new_doc, $at, 9) = "Section";
+@ev = ();
+my($from, $to) = $p->reparse($new_doc, $at, 9, 7);
+ok($to - $from < 3 * 512, "reparsed " . ($to - $from) . " of " . length($new_doc));
+ok(@ev < 150, "events reported: " . @ev);
+is((grep $_->[0] eq "text" && $_->[1] =~ /Section 2500/, @ev), 1, "the edited text");
+
+# checkpoints move along, so it can be done again
+substr($new_doc, $at, 0) = "<i>";
+@ev = ();
+($from, $to) = $p->reparse($new_doc, $at, 0, 3);
+is(scalar(grep $_->[1] eq "<i>", @ev), 1, "the new tag");
+is($ev[0][2] <= $at && $to >= $at + 3, 1, "range covers it");
+
+# the edit starts a script element that is never closed
+substr($new_doc, $at, 0) = "<script>";
+@ev = ();
+($from, $to) = $p->reparse($new_doc, $at, 0, 8);
+is($to, length($new_doc), "to the end");
+is($ev[-1][0], "end_document", "end_document");
+
+# a marked section left open ends with its document
+my $ms = HTML::Parser->new(api_version => 3, marked_sections => 1);
+$ms->checkpoint_interval(8);
+$ms->parse("<![INCLUDE[ x")->eof;
+$ms->parse($doc)->eof;
+$new_doc = $doc;
+substr($new_doc, $at, 0) = "<i>";
+($from, $to) = eval { $ms->reparse($new_doc, $at, 0, 3) };
+ok(defined($to) && $to - $from < length($doc) / 2, "unterminated marked section");
+
+eval { HTML::Parser->new->reparse("x", 0, 0, 1) };
+like($@, qr/^No complete parse to reparse/, "no checkpoints");
+eval { $p->reparse("x", 5, 0, 1) };
+like($@, qr/^Edit is outside the document/, "outside");
@@ -0,0 +1,65 @@
+use strict;
+use Test::More tests => 10;
+
+use HTML::Parser;
+use lib "t/lib";
+use RandomDoc;
+
+# With report_tags and only start/end handlers the parser skips over
+# everything else without tokenizing it.  The events must be the same
+# as when something else is looked at as well.
+
+sub events {
+    my($chunks, $opt, $full) = @_;
+    my %opt = %$opt;
+    my $ignore_b = delete $opt{ignore_b};
+    my @ev;
+    my $argspec = "event,tagname,offset,line,column,skipped_text";
+    my $p = HTML::Parser->new(api_version => 3,
+			      %opt,
+			      start_h => [\@ev, $argspec],
+			      end_h   => [\@ev, $argspec],
+			      # the element stack needs to see every tag
+			      ($full ? (start_document_h => [sub {}, "depth"]) : ()),
+			     );
+    $p->report_tags(qw(a meta));
+    $p->ignore_elements(qw(b)) if $ignore_b;
+    $p->parse($_) for @$chunks;
+    $p->eof;
+    return event_string(@ev);
+}
+
+srand(7);
+for my $opt ({}, {strict_names => 1}, {empty_element_tags => 1},
+	     {xml_mode => 1}, {strict_end => 1}, {ignore_b => 1},
+	     {marked_sections => 1})
+{
+    ok(same_events(200, tags => 25, sub {
+	my @chunks = random_chunks(shift, 9);
+	return (fast => events(\@chunks, $opt),
+		full => events(\@chunks, $opt, 1));
+    }), "same events with " . join(",", %$opt));
+}
+
+my @a;
+my $p = HTML::Parser->new(api_version => 3,
+			  start_h => [\@a, "tagname, line"],
+			  report_tags => [qw(meta)],
+			 );
+$p->parse(<<'EOT')->eof;
+<html><head><title>x</title>
+<!-- <meta name=commented> -->
+<script>document.write("<meta name=scripted>")</script>
+<link title="<meta name=quoted>">
+<meta name=real>
+EOT
+is(join(",", map @$_, @a), "meta,5", "only the real tag");
+@a = ();
+
+$p->parse("<p>no candidates here</p>" x 1000)->eof;
+is(scalar(@a), 0, "nothing reported");
+
+# a text handler turns it off again
+$p->handler(text => \@a, "dtext");
+$p->parse("<p>a<meta>b")->eof;
+is(join(",", map @$_, @a), "a,meta,1,b", "text still reported");
@@ -0,0 +1,61 @@
+use strict;
+use Test::More tests => 9;
+
+use HTML::Parser;
+
+my $doc = <<'EOT';
+<a href="x" id=1>foo &amp; bar</a><br clear>
+<img src='y.png' alt="&lt;img&gt;">text
+EOT
+
+sub events {
+    my %opt = @_;
+    my @ev;
+    my $p = HTML::Parser->new(api_version => 3, %opt,
+	default_h => [sub { push(@ev, [map { ref($_) eq "HASH" ? { %$_ } :
+					          ref($_) eq "ARRAY" ? [ @$_ ] : $_ } @_]) },
+		      "event, tagname, attr, attrseq, tokens, dtext, offset, line, 'lit'"],
+    );
+    $p->parse($doc)->eof;
+    return \@ev;
+}
+
+is_deeply(events(reuse_args => 1), events(), "same arguments");
+
+my $p = HTML::Parser->new(api_version => 3);
+ok(!$p->reuse_args, "off by default");
+ok(!$p->reuse_args(1), "old value returned");
+ok($p->reuse_args, "enabled");
+
+# values kept by the handler are not overwritten
+my(@kept, @refs);
+$p->handler(start => sub { push(@kept, $_[1]); push(@refs, \$_[0]) }, "tagname, attr");
+$p->parse("<a href=1><b id=2><c>")->eof;
+is(join(",", map { join("", keys %$_) } @kept), "href,id,", "hash references kept");
+is(join(",", map $$_, @refs), "a,b,c", "scalar references kept");
+
+# values the handler does not keep are reused
+my %seen;
+$p->handler(start => sub { $seen{0+\$_[0]}++; $seen{0+$_[1]}++ }, "tagname, attr");
+$p->parse("<a><b><c><d>")->eof;
+is(scalar(keys %seen), 2, "same scalar and hash for each event");
+
+# a handler that replaces itself
+my @a;
+$p->handler(start => sub { push(@a, $_[0]);
+			   $_[1]->handler(start => sub { push(@a, uc $_[0]) }, "tagname") },
+	    "tagname, self");
+$p->parse("<a><b><c>")->eof;
+is("@a", "a B C", "handler replaced while running");
+
+# method handlers
+{
+    package MyParser;
+    use vars qw(@ISA @start);
+    @ISA = qw(HTML::Parser);
+    sub start { push(@start, "$_[1]:$_[2]{href}") }
+}
+$p = MyParser->new(api_version => 3, reuse_args => 1,
+		   start_h => ["start", "self, tagname, attr"]);
+$p->parse("<a href=1><a href=2>")->eof;
+is("@MyParser::start", "a:1 a:2", "method handler");
@@ -0,0 +1,104 @@
+use strict;
+use Test::More tests => 19;
+
+use HTML::Parser;
+use lib "t/lib";
+use RandomDoc;
+
+# Untouched input comes out as it went in, whatever the chunking
+srand(11);
+for my $opt ({}, {xml_mode => 1}, {marked_sections => 1},
+	     {unbroken_text => 1}, {report_tags => [qw(a)]})
+{
+    ok(same_events(200, tags => 25, sub {
+	my $doc = shift;
+	my $out = "";
+	my $p = HTML::Parser->new(api_version => 3, %$opt,
+				  rewrite_output => \$out);
+	$p->parse($_) for random_chunks($doc, 9);
+	$p->eof;
+	return (doc => $doc, out => $out);
+    }), "copied with " . join(",", %$opt));
+}
+
+my $doc = <<'EOT';
+<html><head><title>T</title><script>var a = "<b>";</script></head>
+<body bgcolor=red>
+<!-- note -->
+<FONT face=x>Big</font> <a href="/x" STYLE='c'>x</a>
+<img src="i.png" alt=pic><br/>
+<div class=ad><div>ad</div>more ad</div>after
+</body></html>
+EOT
+
+sub rewrite {
+    my($tags, @opt) = @_;
+    my $out = "";
+    my $p = HTML::Parser->new(api_version => 3, rewrite_output => \$out,
+			      rewrite_tags => $tags, @opt);
+    $p->parse($doc)->eof;
+    return $out;
+}
+
+my $out = rewrite({ font => { rename => "span" } });
+like($out, qr{<span face=x>Big</span> <a}, "rename");
+
+$out = rewrite({ a => { drop_attr => "style" }, body => { drop_attr => [qw(bgcolor)] } });
+like($out, qr{<body>\n}, "drop only attribute");
+like($out, qr{<a href="/x">x</a>}, "drop attribute, case insensitive");
+
+$out = rewrite({ img => { set_attr => { src => "n.png?a&b", title => "\"t\"", alt => undef } } });
+like($out, qr{<img src="n.png\?a&amp;b" alt title="&quot;t&quot;"><br/>}, "set attributes");
+
+$out = rewrite({ font => { drop => "tag" }, script => { drop => "element" },
+		 div => { drop => "element" }, img => { drop => "element" } });
+like($out, qr{<title>T</title></head>}, "drop script");
+like($out, qr{\nBig <a}, "drop tags");
+like($out, qr{<br/>\nafter}, "drop nested element and void element");
+$out = "";
+HTML::Parser->new(api_version => 3, rewrite_output => \$out,
+		  rewrite_tags => { script => { drop => "element" } })
+    ->parse("<p>a<script>document.write(1)")->eof;
+is($out, "<p>a", "drop unclosed element");
+
+$out = rewrite({ '*' => { drop_attr => [qw(style bgcolor src)] }, a => {} });
+like($out, qr{<body>.*STYLE.*<img alt=pic>}s, "default edits");
+
+# handlers get the events they are registered for and write them
+$out = rewrite(undef,
+	       "start:a_h" => [sub {
+				   my($p, $tag, $text) = @_;
+				   $p->rewrite_print(uc($text));
+			       }, "self, tagname, text"],
+	       comment_h => [""]);
+my $expect = $doc;
+$expect =~ s/<a href="\/x" STYLE='c'>/<A HREF="\/X" STYLE='C'>/;
+$expect =~ s/<!-- note -->//;
+is($out, $expect, "handlers");
+
+# with report_tags only <a> goes to the handler
+$out = rewrite(undef, report_tags => [qw(a)],
+	       start_h => [sub { $_[0]->rewrite_print("<A>") }, "self"]);
+($expect = $doc) =~ s/<a [^>]*>/<A>/;
+is($out, $expect, "report_tags");
+
+# file handles
+{
+    my $file = "rewrite$$.html";
+    open(my $fh, ">", $file) || die "Can't create $file: $!";
+    my $p = HTML::Parser->new(api_version => 3, rewrite_output => $fh,
+			      rewrite_tags => { b => { rename => "strong" } });
+    $p->parse("<p><b>x</b></p>")->eof;
+    close($fh);
+    open($fh, "<", $file) || die;
+    local $/;
+    is(<$fh>, "<p><strong>x</strong></p>", "file handle");
+    close($fh);
+    unlink($file);
+}
+
+my $p = HTML::Parser->new(api_version => 3);
+eval { $p->rewrite_tags({ a => { drop => "all" } }) };
+like($@, qr/^Bad rewrite edit 'drop' for 'a'/, "bad edit");
+eval { $p->rewrite_print("x") };
+like($@, qr/^No rewrite_output to print to/, "no output");
@@ -0,0 +1,108 @@
+use strict;
+use Test::More tests => 17;
+
+use HTML::Parser;
+use lib "t/lib";
+use RandomDoc;
+
+my %tags = (
+    a => [qw(href title)],
+    img => [qw(src alt)],
+    p => [], b => [], i => [], ul => [], li => [], br => [],
+    div => [], td => [], tr => [], table => [],
+    "*" => [qw(class)],
+);
+
+sub sanitize {
+    my($html, %opt) = @_;
+    my $out = "";
+    my $p = HTML::Parser->new(api_version => 3,
+			      rewrite_output => \$out,
+			      sanitize => { tags => \%tags, %opt },
+			     );
+    $p->parse($html)->eof;
+    return $out;
+}
+
+is(sanitize(qq(<P CLASS=x Style="color:red" onclick="evil()">Hi <B>there</B></P>)),
+   qq(<p class="x">Hi <b>there</b></p>), "attributes and case");
+
+is(sanitize(qq(<script>alert("<b>")</script><style>p {}</style>a<!-- c --><?pi?>b)),
+   qq(ab), "script, style, comments and processing instructions");
+
+# left open at the end of the document
+is(sanitize(qq(<p>a<script>alert(1))), qq(<p>a</p>), "unclosed script");
+is(sanitize(qq(<p>a<style>p { x: y }<b>c)), qq(<p>a</p>), "unclosed style");
+
+is(sanitize(qq(<font face=x><blink>kept</blink></font> <iframe src=x></iframe>)),
+   qq(kept ), "tags not allowed, content kept");
+
+is(sanitize(qq(<a href="http://x.com/?a=1&amp;b=2" title='say "hi" &lt;3'>x</a>)),
+   qq(<a href="http://x.com/?a=1&amp;b=2" title="say &quot;hi&quot; &lt;3">x</a>),
+   "values re-encoded and quoted");
+
+is(sanitize(qq(<a href="javascript:alert(1)">1</a><a href=" JaVa\tScRiPt:x">2</a>) .
+	    qq(<a href="&#106;avascript:x">3</a><img src="data:image/png;base64,x" alt=y>)),
+   qq(<a>1</a><a>2</a><a>3</a><img alt="y">), "bad schemes");
+
+is(sanitize(qq(<a href="/rel">1</a><a href="mailto:x\@y">2</a><a href="page?q=a:b">3</a>)),
+   qq(<a href="/rel">1</a><a href="mailto:x\@y">2</a><a href="page?q=a:b">3</a>),
+   "good and relative URLs");
+
+is(sanitize(qq(<a href="data:x">d</a>), url_schemes => [qw(data)]),
+   qq(<a href="data:x">d</a>), "url_schemes");
+
+is(sanitize(qq(1 < 2 &amp; 3 > 2 &lt;b&gt; &copy;)),
+   qq(1 &lt; 2 &amp; 3 &gt; 2 &lt;b&gt; \xA9), "text encoded");
+
+is(sanitize(qq(<div><b><i>x</b>y</div></i></p>z)),
+   qq(<div><b><i>x</i></b>y</div>z), "balanced end tags");
+
+is(sanitize(qq(<ul><li>a<li>b</ul><p>1<p>2<div>3)),
+   qq(<ul><li>a</li><li>b</li></ul><p>1</p><p>2</p><div>3</div>), "optional and missing end tags");
+
+is(sanitize(qq(<p>a<br>b<img src=x.png alt="" alt=second></p>)),
+   qq(<p>a<br>b<img src="x.png" alt=""></p>), "void elements and repeated attributes");
+
+is(sanitize(qq(<table><tr><td>x<td>y</table>)),
+   qq(<table><tr><td>x</td><td>y</td></tr></table>), "tables");
+
+is(sanitize(qq(<b>1<object><b>2</b></object>3</b>), drop_elements => [qw(object)]),
+   qq(<b>13</b>), "drop_elements");
+
+# whatever goes in, only allowed tags and attributes come out, balanced
+srand(5);
+my $ok = 1;
+for (1 .. 300) {
+    my $doc = random_doc(unsafe => 30);
+    my $out = sanitize($doc);
+    my @open;
+    my $bad;
+    HTML::Parser->new(api_version => 3,
+		      start_h => [sub {
+				      my($tag, $attrseq, $attr) = @_;
+				      $bad ||= "tag $tag" unless $tags{$tag};
+				      for my $name (@$attrseq) {
+					  $bad ||= "attr $name"
+					      unless grep $_ eq $name, @{$tags{$tag}}, "class";
+					  $bad ||= "javascript"
+					      if $attr->{$name} =~ /^\s*javascript/i;
+				      }
+				      push(@open, $tag) unless $tag eq "br";
+				  }, "tagname, attrseq, attr"],
+		      end_h => [sub {
+				    $bad ||= "end $_[0]" unless @open && pop(@open) eq $_[0];
+				}, "tagname"],
+		      comment_h => [sub { $bad ||= "comment" }, ""],
+		     )->parse($out)->eof;
+    $bad ||= "not closed" if @open;
+    if ($bad) {
+	diag "$bad\ndoc: $doc\nout: $out";
+	$ok = 0;
+	last;
+    }
+}
+ok($ok, "random documents");
+
+eval { sanitize("", frobnicate => 1) };
+like($@, qr/^Bad sanitize option 'frobnicate'/, "bad option");
@@ -0,0 +1,62 @@
+use strict;
+use Test::More tests => 12;
+
+use HTML::Parser;
+
+sub ser {
+    my($doc, %opt) = @_;
+    my $out = "";
+    my $p = HTML::Parser->new(api_version => 3, rewrite_output => \$out);
+    $p->serialize(\%opt);
+    $p->parse($_) for ref($doc) ? @$doc : $doc;
+    $p->eof;
+    return $out;
+}
+
+my $doc = qq(<!DOCTYPE html>\n<HTML><Body CLASS=x>\n  <P ID='a'>One  <!-- c -->\n  two</P>\n</BODY></HTML>\n);
+is(ser($doc), $doc, "no options, no change");
+
+is(ser("<DIV Class=x><BR/></DIV>", lowercase_names => 1),
+   "<div class=x><br/></div>", "lowercase_names");
+
+is(ser(qq(<a href=/x title='say "hi"' checked id="y">), quote_attributes => 1),
+   qq(<a href="/x" title="say &quot;hi&quot;" checked id="y">),
+   "quote_attributes");
+
+is(ser("<p>a  \n\t b</p>\n\n<pre> x\n  y </pre> <textarea>  </textarea>",
+       collapse_whitespace => 1),
+   "<p>a b</p> <pre> x\n  y </pre> <textarea>  </textarea>",
+   "collapse_whitespace");
+
+is(ser("<script>a  =  1</script>  x  ", collapse_whitespace => 1),
+   "<script>a  =  1</script> x ", "script kept");
+
+is(ser("a<!-- c -->b<!--[if IE]>x<![endif]-->", drop_comments => 1),
+   "ab<!--[if IE]>x<![endif]-->", "drop_comments keeps conditionals");
+
+is(ser("<ul><li>a</li><li>b</li>\n</ul><p>x</p><div></div><p>y</p>",
+       drop_optional_end_tags => 1),
+   "<ul><li>a<li>b\n</ul><p>x<div></div><p>y", "drop_optional_end_tags");
+
+is(ser("<table><tr><td>1</td><td>2</td></tr></table>",
+       drop_optional_end_tags => 1),
+   "<table><tr><td>1<td>2</table>", "table cells");
+
+is(ser("<p>x</p><span>y</span>", drop_optional_end_tags => 1),
+   "<p>x</p><span>y</span>", "kept before phrasing content");
+
+is(ser(["<UL><LI>a</L", "I>  <LI> b </LI> ", " </UL>"],
+       lowercase_names => 1, collapse_whitespace => 1,
+       drop_optional_end_tags => 1),
+   "<ul><li>a <li> b </ul>", "all together, in chunks");
+
+eval { ser("", bogus => 1) };
+like($@, qr/^Bad serialize option 'bogus'/, "bad option");
+
+# turned off again
+my $out = "";
+my $p = HTML::Parser->new(api_version => 3, rewrite_output => \$out);
+$p->serialize({ lowercase_names => 1 });
+$p->serialize;
+$p->parse("<P>x</P>")->eof;
+is($out, "<P>x</P>", "off");
@@ -0,0 +1,85 @@
+use strict;
+use Test::More tests => 12;
+
+use HTML::Parser;
+
+my $doc = <<'EOT';
+<html><head><title>A &amp; B</title>
+<style>p { color: red }</style><script>if (a < b) document.write("<p>")</script>
+</head><body><h1>Head</h1><!-- comment -->
+<p>Some <b>bold</b>
+  text<br>next <img src=x alt="An &lt;image&gt;"> <img src=y></p>
+<table><tr><td>a<td>b</table>end
+EOT
+
+my $text = "";
+my $p = HTML::Parser->new(api_version => 3, text_output => \$text);
+$p->parse($doc)->eof;
+is($text, "\n\nA & B\n\n\n\n\nHead\n\n\nSome bold\n  text\nnext An <image> [IMG]\n\n\n\n a b\nend\n", "text");
+
+$text = "";
+$p->text_collapse(1);
+$p->parse($doc)->eof;
+is($text, "A & B\nHead\nSome bold text\nnext An <image> [IMG]\na b\nend", "collapsed");
+
+# chunks don't matter
+$text = "";
+$p->parse($_) for split //, $doc;
+$p->eof;
+is($text, "A & B\nHead\nSome bold text\nnext An <image> [IMG]\na b\nend", "one char at a time");
+
+$text = "";
+$p->textify({ a => "href", img => "title" });
+$p->parse(qq(<a href="/x">x</a> <img alt=y> <A HREF=z>))->eof;
+is($text, "/xx [IMG] z", "textify");
+
+$text = "";
+$p->textify({});
+$p->parse(qq(<a href="/x">x</a> <img alt=y>))->eof;
+is($text, "x", "no textify");
+$p->textify;
+
+# handlers are not called, except for other events
+my @c;
+$p->handler(text => sub { push(@c, "text") });
+$p->handler(comment => sub { push(@c, "comment") });
+$text = "";
+$p->parse("<p>a<!-- b -->c</p>")->eof;
+is("$text @c", "ac comment", "handlers");
+
+is(${$p->text_output(undef)}, "ac", "old value");
+$p->parse("<p>a</p>")->eof;
+is("@c", "comment text", "mode off");
+
+# report_tags does not hide the text of other elements
+$text = "";
+$p = HTML::Parser->new(api_version => 3, text_output => \$text);
+$p->report_tags("p");
+$p->parse("<div>hello <b>world</b></div><p>x</p>")->eof;
+is($text, "hello world\nx\n", "report_tags");
+
+my @fields;
+for my $comment_h (0, 1) {
+    # a comment handler keeps the tags from being skipped up front
+    $p = HTML::Parser->new(api_version => 3, head_scan => 1,
+			   ($comment_h ? (comment_h => [sub {}, ""]) : ()));
+    $p->report_tags("meta");
+    $p->parse("<div>T</div><meta name=a content=b><p>x");
+    $p->eof;
+    push(@fields, join("|", $p->head_fields));
+}
+is($fields[0], $fields[1], "report_tags, head_scan");
+
+# file handles
+my $file = "text$$.txt";
+open(my $fh, ">", $file) || die "Can't create $file: $!";
+$p = HTML::Parser->new(api_version => 3, text_output => $fh, text_collapse => 1);
+$p->parse("<p>Hello <i>world</i>&#33;</p>")->eof;
+close($fh);
+open($fh, "<", $file) || die;
+is(scalar(<$fh>), "Hello world!", "file handle");
+close($fh);
+unlink($file);
+
+eval { $p->text_output("no such handle") };
+ok($@, "not a handle");
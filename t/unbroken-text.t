@@ -1,7 +1,7 @@
 use strict;
 use HTML::Parser;
 
-use Test::More tests => 3;
+use Test::More tests => 5;
 
 my $text = "";
 sub text
@@ -58,3 +58,57 @@ $p->eof;
 is($text, "[TEXT:0:1.0:foobar\nfoo][CDATA:20:2.8:xmp][TEXT:29:2.17:bar]");
 
 
+
+
+# Text split by ignored markup, fed in random chunks, must come out the
+# same as when joined by hand from the broken text events.
+sub events {
+    my($doc, $unbroken, @chunks) = @_;
+    my @ev;
+    my $p = HTML::Parser->new(api_version => 3,
+			      unbroken_text => $unbroken,
+			      ignore_tags => ["i"],
+			      handlers => [text => [\@ev, "event,text,offset"],
+					   start => [\@ev, "event,text,offset"],
+					  ],
+			     );
+    $p->parse($_) for @chunks;
+    $p->eof;
+    my @joined;
+    for (@ev) {
+	if ($_->[0] eq "text" && @joined && $joined[-1][0] eq "text") {
+	    $joined[-1][1] .= $_->[1];
+	}
+	else {
+	    push(@joined, [@$_]);
+	}
+    }
+    return join("|", map "@$_", @joined);
+}
+
+srand(7);
+my $doc = join("", map { ("foo ", "bar", "<!-- c -->", "<i>", "</i>", "\n",
+			  "<b>", "&amp;", "<script>x</script>")[rand 9] } 1..300);
+my $ok = 1;
+for (1..20) {
+    my @chunks;
+    my $d = $doc;
+    push(@chunks, substr($d, 0, 1 + int(rand 40), "")) while length $d;
+    unless (events($doc, 1, @chunks) eq events($doc, 0, $doc)) {
+	$ok = 0;
+	last;
+    }
+}
+ok($ok, "random chunks");
+
+# chunks with and without the UTF8 flag
+$text = "";
+$p = HTML::Parser->new(unbroken_text => 1,
+		       text_h => [sub { $text .= "[" . shift() . "]" }, "text"],
+		       start_h => [sub { $text .= shift }, "text"],
+		      );
+$p->parse("a\xE5");
+$p->parse("<!--x-->\x{263A}<!--y-->\xE6");
+$p->parse("b<p>");
+$p->eof;
+is($text, "[a\xE5\x{263A}\xE6b]<p>", "mixed UTF8 chunks");
@@ -309,3 +309,221 @@ probably_utf8_chunk(pTHX_ char *s, STRLEN len)
     return is_utf8_string((U8*)s, e - s);
 }
 #endif
+
+
+/*
+ * URI references (RFC 3986) for the @links argspec.
+ *
+ *   uri_escape_cat() - appends a string, escaping what isn't URI chars
+ *   uri_resolve()    - appends a reference resolved against a base
+ */
+
+struct uri_parts {
+    const char *scheme;  STRLEN scheme_len;
+    const char *auth;    STRLEN auth_len;    /* 0 if no authority */
+    const char *path;    STRLEN path_len;
+    const char *query;   STRLEN query_len;   /* 0 if no query */
+    const char *frag;    STRLEN frag_len;    /* 0 if no fragment */
+};
+
+static void
+uri_split(const char *s, STRLEN len, struct uri_parts *u)
+{
+    const char *end = s + len;
+    const char *t;
+
+    Zero(u, 1, struct uri_parts);
+
+    if (s < end && isALPHA(*s)) {
+	t = s + 1;
+	while (t < end && (isALPHA(*t) || isDIGIT(*t) ||
+			   *t == '+' || *t == '-' || *t == '.'))
+	    t++;
+	if (t < end && *t == ':') {
+	    u->scheme = s;
+	    u->scheme_len = t - s;
+	    s = t + 1;
+	}
+    }
+    if (end - s >= 2 && s[0] == '/' && s[1] == '/') {
+	s += 2;
+	t = s;
+	while (t < end && *t != '/' && *t != '?' && *t != '#')
+	    t++;
+	u->auth = s;
+	u->auth_len = t - s;
+	s = t;
+    }
+    t = s;
+    while (t < end && *t != '?' && *t != '#')
+	t++;
+    u->path = s;
+    u->path_len = t - s;
+    s = t;
+    if (s < end && *s == '?') {
+	t = ++s;
+	while (t < end && *t != '#')
+	    t++;
+	u->query = s;
+	u->query_len = t - s;
+	s = t;
+    }
+    if (s < end && *s == '#') {
+	s++;
+	u->frag = s;
+	u->frag_len = end - s;
+    }
+}
+
+static void
+uri_remove_dots(pTHX_ SV* out, STRLEN path_start, const char *s, STRLEN len)
+{
+    /* RFC 3986 section 5.2.4; appends the result to out */
+    const char *end = s + len;
+
+    while (s < end) {
+	STRLEN left = end - s;
+	if (left >= 3 && strnEQ(s, "../", 3))
+	    s += 3;
+	else if (left >= 2 && strnEQ(s, "./", 2))
+	    s += 2;
+	else if (left >= 3 && strnEQ(s, "/./", 3))
+	    s += 2;
+	else if (left == 2 && strnEQ(s, "/.", 2)) {
+	    sv_catpvn(out, "/", 1);
+	    break;
+	}
+	else if ((left >= 4 && strnEQ(s, "/../", 4)) ||
+		 (left == 3 && strnEQ(s, "/..", 3)))
+	{
+	    /* drop the last segment of the output */
+	    char *o = SvPVX(out);
+	    STRLEN cur = SvCUR(out);
+	    while (cur > path_start && o[cur - 1] != '/')
+		cur--;
+	    if (cur > path_start)
+		cur--;
+	    SvCUR_set(out, cur);
+	    if (left == 3) {
+		sv_catpvn(out, "/", 1);
+		break;
+	    }
+	    s += 3;
+	}
+	else if ((left == 1 && *s == '.') ||
+		 (left == 2 && strnEQ(s, "..", 2)))
+	{
+	    break;
+	}
+	else {
+	    const char *t = s + 1;
+	    while (t < end && *t != '/')
+		t++;
+	    sv_catpvn(out, s, t - s);
+	    s = t;
+	}
+    }
+}
+
+#define isURI_CHAR(c) \
+    ((c) && (isALNUM(c) || strchr(";/?:@&=+$,[]-_.!~*'()%#", (c))))
+
+EXTERN void
+uri_escape_cat(pTHX_ SV* out, const char *s, STRLEN len, bool utf8)
+{
+    /* like URI->new; bytes that can't be in a URI are %-escaped, and
+     * characters are UTF-8 encoded first
+     */
+    static const char hex[] = "0123456789ABCDEF";
+    const char *end = s + len;
+
+    while (s < end) {
+	const char *t = s;
+	while (t < end && isURI_CHAR(*t))
+	    t++;
+	if (t > s)
+	    sv_catpvn(out, s, t - s);
+	if (t < end) {
+	    char buf[6];
+	    STRLEN n = 0;
+	    U8 c = *t++;
+	    if (!utf8 && c >= 0x80) {
+		/* a latin-1 char is two bytes in UTF-8 */
+		buf[n++] = '%';
+		buf[n++] = hex[(0xC0 | c >> 6) >> 4];
+		buf[n++] = hex[(0xC0 | c >> 6) & 0xF];
+		c = 0x80 | (c & 0x3F);
+	    }
+	    buf[n++] = '%';
+	    buf[n++] = hex[c >> 4];
+	    buf[n++] = hex[c & 0xF];
+	    sv_catpvn(out, buf, n);
+	}
+	s = t;
+    }
+}
+
+EXTERN void
+uri_resolve(pTHX_ SV* out, const char *ref, STRLEN ref_len,
+	    const char *base, STRLEN base_len)
+{
+    /* RFC 3986 section 5.2.2.  Absolute references and references
+     * against a base without a scheme are left as they are.
+     */
+    struct uri_parts r, b;
+    const char *auth, *query;
+    STRLEN auth_len, query_len;
+    STRLEN path_start;
+
+    uri_split(ref, ref_len, &r);
+    uri_split(base, base_len, &b);
+    if (r.scheme || !b.scheme) {
+	sv_catpvn(out, ref, ref_len);
+	return;
+    }
+
+    sv_catpvn(out, b.scheme, b.scheme_len);
+    sv_catpvn(out, ":", 1);
+    auth = r.auth ? r.auth : b.auth;
+    auth_len = r.auth ? r.auth_len : b.auth_len;
+    if (auth) {
+	sv_catpvn(out, "//", 2);
+	sv_catpvn(out, auth, auth_len);
+    }
+    path_start = SvCUR(out);
+    query = r.query;
+    query_len = r.query_len;
+
+    if (r.auth || (r.path_len && *r.path == '/')) {
+	uri_remove_dots(aTHX_ out, path_start, r.path, r.path_len);
+    }
+    else if (!r.path_len) {
+	sv_catpvn(out, b.path, b.path_len);
+	if (!r.query) {
+	    query = b.query;
+	    query_len = b.query_len;
+	}
+    }
+    else {
+	/* merge with all but the last segment of the base path */
+	SV* merged = sv_2mortal(newSVpvn("", 0));
+	STRLEN dir = b.path_len;
+	while (dir && b.path[dir - 1] != '/')
+	    dir--;
+	if (b.auth && !b.path_len)
+	    sv_catpvn(merged, "/", 1);
+	else
+	    sv_catpvn(merged, b.path, dir);
+	sv_catpvn(merged, r.path, r.path_len);
+	uri_remove_dots(aTHX_ out, path_start, SvPVX(merged), SvCUR(merged));
+    }
+
+    if (query) {
+	sv_catpvn(out, "?", 1);
+	sv_catpvn(out, query, query_len);
+    }
+    if (r.frag) {
+	sv_catpvn(out, "#", 1);
+	sv_catpvn(out, r.frag, r.frag_len);
+    }
+}